@@ -0,0 +1,149 @@
+// Exercises the baseline JIT. Every function here runs often enough to be
+// compiled with "--jit threshold=1", and its output must match a run with
+// "--jit off" line for line (see test_jit.sh).
+
+Function SumTo(n As Integer) As Integer
+  Var total As Integer = 0
+  Var i As Integer = 0
+  While i < n
+    total = total + i * 2 - (i Mod 7)
+    If total > 1000000 Then
+      total = total - 1000000
+    End If
+    i = i + 1
+  Wend
+  Return total
+End Function
+
+Function Fib(n As Integer) As Integer
+  If n < 2 Then
+    Return n
+  End If
+  Return Fib(n - 1) + Fib(n - 2)
+End Function
+
+Function Harmonic(n As Integer) As Double
+  Var h As Double = 0
+  For k As Integer = 1 To n
+    h = h + 1 / k
+  Next
+  Return h
+End Function
+
+Function MixedMath(a As Integer, b As Double) As Double
+  Return (a + b) * (a - b) / 2 - a * -b
+End Function
+
+Function CountDown(n As Integer) As Integer
+  Var steps As Integer = 0
+  For k As Integer = n DownTo 1 Step -3
+    steps = steps + k
+  Next
+  Return steps
+End Function
+
+Function Compare(a As Double, b As Double) As String
+  Var s As String = ""
+  If a < b Then
+    s = s + "lt "
+  End If
+  If a <= b Then
+    s = s + "le "
+  End If
+  If a > b Then
+    s = s + "gt "
+  End If
+  If a >= b Then
+    s = s + "ge "
+  End If
+  If a = b Then
+    s = s + "eq "
+  End If
+  If a <> b Then
+    s = s + "ne"
+  End If
+  Return s
+End Function
+
+Function Truthy(n As Integer) As Integer
+  Var hits As Integer = 0
+  Var flag As Boolean = False
+  For k As Integer = 0 To n
+    flag = Not flag
+    If flag Then
+      hits = hits + 1
+    End If
+    If k Mod 4 = 0 And flag Then
+      hits = hits + 10
+    End If
+  Next
+  Return hits
+End Function
+
+Function Negatives(n As Integer) As Integer
+  Var r As Integer = 0
+  For k As Integer = -n To n
+    r = r + (k Mod 5) - -k
+  Next
+  Return r
+End Function
+
+Function Wraps(n As Integer) As Integer
+  Var x As Integer = 2147483000
+  For k As Integer = 1 To n
+    x = x + 1000
+  Next
+  Return x
+End Function
+
+// Strings inside the loop leave the native code on every iteration.
+Function Labels(n As Integer) As String
+  Var s As String = ""
+  For k As Integer = 1 To n
+    s = s + Str(k)
+    If k < n Then
+      s = s + ","
+    End If
+  Next
+  Return s
+End Function
+
+// A local that changes type between Integer and String.
+Function Retyped(n As Integer) As String
+  Var v As Variant = 0
+  For k As Integer = 1 To n
+    v = k * 3
+  Next
+  Return "done at " + Str(v)
+End Function
+
+Function EarlyExit(limit As Integer) As Integer
+  Var i As Integer = 0
+  While True
+    i = i + 1
+    If i * i > limit Then
+      Return i
+    End If
+  Wend
+  Return -1
+End Function
+
+Function Divide(a As Integer, b As Integer) As Double
+  Return a / b
+End Function
+
+For round As Integer = 1 To 3
+  Print(Str(SumTo(20000)))
+  Print(Str(Fib(18)))
+  Print(Str(Harmonic(1000)))
+  Print(Str(MixedMath(7, 2.5)))
+  Print(Str(CountDown(100)))
+  Print(Compare(1, 2) + " | " + Compare(2, 2) + " | " + Compare(3.5, 2))
+  Print(Str(Truthy(99)))
+  Print(Str(Negatives(50)))
+  Print(Str(Wraps(3)))
+  Print(Labels(12))
+  Print(Retyped(5))
+  Print(Str(EarlyExit(1000)))
+  Print(Str(Divide(1, 4)) + " " + Str(Divide(-9, 2)))
+Next
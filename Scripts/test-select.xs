@@ -0,0 +1,46 @@
+// Select Case over dense integer cases compiles to a jump table. Subjects far
+// outside its range, on either side of a negative low bound, must land in
+// Case Else (see test_jit.sh, which also runs this with the JIT on).
+
+Function Classify(v As Integer) As String
+  Select Case v
+  Case -5
+    Return "minus five"
+  Case -4
+    Return "minus four"
+  Case -3
+    Return "minus three"
+  Case -2
+    Return "minus two"
+  Case -1
+    Return "minus one"
+  Case 0
+    Return "zero"
+  Case 1
+    Return "one"
+  Case 2
+    Return "two"
+  Case Else
+    Return "else"
+  End Select
+End Function
+
+Sub Check(v As Integer, expected As String)
+  Var got As String = Classify(v)
+  If got = expected Then
+    Print(Str(v) + ": " + got)
+  Else
+    Print("FAILED: " + Str(v) + " gave " + got + ", expected " + expected)
+  End If
+End Sub
+
+For round As Integer = 1 To 3
+  Check(2147483647, "else")
+  Check(-2147483647 - 1, "else")
+  Check(2147483647 - 4, "else")
+  Check(-6, "else")
+  Check(3, "else")
+  Check(-5, "minus five")
+  Check(0, "zero")
+  Check(2, "two")
+Next
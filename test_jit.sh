@@ -0,0 +1,48 @@
+#!/bin/bash
+
+# Differential test for the JIT: every script must print exactly the same
+# output with the JIT disabled and with every function compiled on first use.
+# Usage: ./test_jit.sh [path/to/xojoscript]
+
+XOJOSCRIPT=${1:-release-64/xojoscript}
+
+if [ ! -x "$XOJOSCRIPT" ]; then
+    echo "$XOJOSCRIPT not found. Build it first with ./build_xojoscript.sh"
+    exit 1
+fi
+
+# Deterministic scripts that need neither plugins nor user input
+SCRIPTS="Scripts/test-jit.xs Scripts/test.xs Scripts/test-pair.xs Scripts/test-dictionary.xs Scripts/test-select.xs"
+
+failed=0
+for script in $SCRIPTS; do
+    for level in 0 1; do
+        "$XOJOSCRIPT" --s "$script" --O $level --jit off > jit-off.log 2>&1
+        off_status=$?
+        "$XOJOSCRIPT" --s "$script" --O $level --jit threshold=1 > jit-on.log 2>&1
+        on_status=$?
+        # A crash, or a script's own "FAILED:" check, fails even if both agree
+        if [ $off_status -ge 128 ] || [ $on_status -ge 128 ] ||
+           grep -q '^FAILED:' jit-off.log jit-on.log; then
+            echo "FAILED  $script (--O $level): exit $off_status / $on_status"
+            grep -h '^FAILED:' jit-off.log jit-on.log | head -20
+            failed=1
+        elif cmp -s jit-off.log jit-on.log; then
+            echo "ok      $script (--O $level)"
+        else
+            echo "FAILED  $script (--O $level)"
+            diff jit-off.log jit-on.log | head -20
+            failed=1
+        fi
+    done
+done
+
+rm -f jit-off.log jit-on.log
+
+if [ $failed -ne 0 ]; then
+    echo "JIT output differs from the interpreter, or a script failed."
+    exit 1
+fi
+
+echo "JIT output matches the interpreter."
+exit 0
@@ -27,6 +27,16 @@
 // SOFTWARE.
 // -----------------------------------------------------------------------------  
 // Build: g++ -static -static-libgcc -static-libstdc++ -O3 -o xcompile.exe xcompile.cpp
+//
+// xcompile <target_executable> <script> has xojoscript compile the script to a
+// program image (--xsb) and appends that to a copy of the xojoscript
+// executable, which loads it at startup instead of compiling.
+//
+// xcompile --aot <target_executable> <script> instead has xojoscript
+// translate the compiled script to C++ (--aot) and builds that with the
+// system compiler ($CXX, default g++, plus $CXXFLAGS) against xojoscript.cpp,
+// found beside xcompile or in the current directory. $CXX and $CXXFLAGS are
+// split into words at whitespace; no shell is involved.
 
 #include <iostream>
 #include <fstream>
@@ -35,9 +45,24 @@
 #include <cstdint>
 #include <cstring>
 #include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <sstream>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 const char MARKER[9] = "XOJOCODE"; // 8 characters + null terminator
 
+#ifdef _WIN32
+const char BASE_EXE[] = "xojoscript.exe";
+#else
+const char BASE_EXE[] = "xojoscript";
+#endif
+
 // Copy file from sourcePath to destPath.
 bool copyFile(const std::string& sourcePath, const std::string& destPath) {
     std::ifstream src(sourcePath, std::ios::binary);
@@ -71,8 +96,8 @@ bool hasEmbeddedData(const std::string& exePath) {
     return (std::strncmp(markerBuffer, MARKER, 8) == 0);
 }
 
-// Injects text file contents into the executable by appending:
-// [text data][MARKER (8 bytes)][4-byte text length]
+// Injects a file's contents into the executable by appending:
+// [data][MARKER (8 bytes)][4-byte data length]
 void injectData(const std::string& exePath, const std::string& textFilePath) {
     // Read text file into a vector.
     std::ifstream textFile(textFilePath, std::ios::binary);
@@ -103,14 +128,114 @@ void injectData(const std::string& exePath, const std::string& textFilePath) {
     std::cout << "Compilation complete: Wrote " << textLength << " bytes of bytecode to " << exePath << ".\n";
 }
 
+#ifdef _WIN32
+// Quotes an argument so the C runtime's command-line parsing gives it back
+// unchanged: backslashes only escape when they precede a quote.
+std::string windowsArgument(const std::string& arg) {
+    std::string out = "\"";
+    size_t backslashes = 0;
+    for (char c : arg) {
+        if (c == '\\') {
+            backslashes++;
+            continue;
+        }
+        out.append(c == '"' ? 2 * backslashes + 1 : backslashes, '\\');
+        backslashes = 0;
+        out += c;
+    }
+    out.append(2 * backslashes, '\\');
+    return out + "\"";
+}
+#endif
+
+// Runs a program with the given arguments and waits for it, without going
+// through a shell, so paths are passed on exactly as given. Returns its exit
+// status, or -1 if it could not be run.
+int runProgram(const std::vector<std::string>& args) {
+#ifdef _WIN32
+    // _spawnvp joins its arguments into a single command line.
+    std::vector<std::string> quotedArgs;
+    for (const std::string& arg : args)
+        quotedArgs.push_back(windowsArgument(arg));
+    std::vector<const char*> argv;
+    for (const std::string& arg : quotedArgs)
+        argv.push_back(arg.c_str());
+    argv.push_back(nullptr);
+    return static_cast<int>(_spawnvp(_P_WAIT, args[0].c_str(), argv.data()));
+#else
+    std::vector<char*> argv;
+    for (const std::string& arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        execvp(argv[0], argv.data());
+        std::cerr << "Error: Unable to run " << args[0] << ": " << std::strerror(errno) << "\n";
+        _exit(127);
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+}
+
+// Appends the whitespace-separated words of an environment variable to args.
+void appendWords(std::vector<std::string>& args, const char* text) {
+    std::istringstream words(text ? text : "");
+    for (std::string word; words >> word; )
+        args.push_back(word);
+}
+
+// Ahead-of-time compilation: script -> C++ (xojoscript --aot) -> native executable.
+int compileNative(const std::string& baseExe, const std::string& baseDir, const std::string& targetExe,
+                  const std::string& scriptPath) {
+    std::string runtimeDir = baseDir;
+    if (!std::ifstream(runtimeDir + "xojoscript.cpp")) {
+        runtimeDir = "";
+        if (!std::ifstream("xojoscript.cpp")) {
+            std::cerr << "Error: --aot needs xojoscript.cpp beside xcompile or in the current directory.\n";
+            return EXIT_FAILURE;
+        }
+    }
+    std::string cppPath = targetExe + ".cpp";
+    if (runProgram({ baseExe, "--s", scriptPath, "--aot", cppPath }) != 0) {
+        std::cerr << "Error: Could not translate " << scriptPath << " to C++.\n";
+        return EXIT_FAILURE;
+    }
+    std::vector<std::string> build;
+    appendWords(build, std::getenv("CXX"));
+    if (build.empty())
+        build.push_back("g++");
+    build.push_back("-std=c++17");
+    build.push_back("-O2");
+    appendWords(build, std::getenv("CXXFLAGS")); // e.g. the -L path of libffi
+    build.push_back("-I" + (runtimeDir.empty() ? std::string(".") : runtimeDir));
+    build.insert(build.end(), { "-o", targetExe, cppPath, "-lffi" });
+    for (size_t i = 0; i < build.size(); i++)
+        std::cout << (i ? " " : "") << build[i];
+    std::cout << "\n";
+    if (runProgram(build) != 0) {
+        std::cerr << "Error: Building " << cppPath << " failed.\n";
+        return EXIT_FAILURE;
+    }
+    std::cout << "Compilation complete: Built native executable " << targetExe << " from " << cppPath << ".\n";
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <target_executable> <text_file>\n";
+    bool aot = argc > 1 && std::string(argv[1]) == "--aot";
+    if (argc < 3 + aot) {
+        std::cerr << "Usage: " << argv[0] << " [--aot] <target_executable> <text_file>\n";
         return EXIT_FAILURE;
     }
     
-    std::string targetExe = argv[1];
-    std::string textFilePath = argv[2];
+    std::string targetExe = argv[1 + aot];
+    std::string textFilePath = argv[2 + aot];
     
     // Prevent the user from supplying the base executable name.
     if (targetExe == "xojoscript" || targetExe == "xojoscript.exe") {
@@ -122,8 +247,11 @@ int main(int argc, char* argv[]) {
     std::string currentPath = argv[0];
     size_t pos = currentPath.find_last_of("\\/");
     std::string baseDir = (pos != std::string::npos) ? currentPath.substr(0, pos + 1) : "";
-    std::string baseExe = baseDir + "xojoscript.exe"; // Base executable located beside this program.
+    std::string baseExe = baseDir + BASE_EXE; // Base executable located beside this program.
     
+    if (aot)
+        return compileNative(baseExe, baseDir, targetExe, textFilePath);
+
     // Copy the base executable to the user-defined target filename.
     if (!copyFile(baseExe, targetExe)) {
         std::cerr << "Error: Could not copy base executable from " << baseExe << " to " << targetExe << ".\n";
@@ -136,8 +264,15 @@ int main(int argc, char* argv[]) {
         return EXIT_FAILURE;
     }
     
-    // Inject the text file's content into the target executable.
-    injectData(targetExe, textFilePath);
+    // Compile the script to a program image and inject that into the target executable.
+    std::string imagePath = targetExe + ".xsb";
+    if (runProgram({ baseExe, "--s", textFilePath, "--xsb", imagePath }) != 0) {
+        std::cerr << "Error: Could not compile " << textFilePath << ".\n";
+        std::remove(targetExe.c_str());
+        return EXIT_FAILURE;
+    }
+    injectData(targetExe, imagePath);
+    std::remove(imagePath.c_str());
     
     return 0;
 }
@@ -34,6 +34,8 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <map>
+#include <set>
 #include <variant>
 #include <memory>
 #include <cstdlib>
@@ -48,6 +50,7 @@
 #include <cstring>
 #include <typeinfo>
 #include <cstdint>
+#include <climits>
 #include <streambuf>
 
 #ifdef _WIN32
@@ -55,6 +58,9 @@
 #else
 #include <dlfcn.h>
 #include <dirent.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 #include <ffi.h>
@@ -63,10 +69,21 @@
 // Debugging and Time globals  
 // ============================================================================
 bool DEBUG_MODE = false; // set to true for debug logging
+bool STATS_MODE = false; // report executed instructions per second (--stats)
+bool PROFILE_MODE = false; // report the most frequent opcode pairs (--profile)
+size_t MAX_CALL_DEPTH = 100000; // script call frames before StackOverflowException (--depth)
+int OPT_LEVEL = 0; // AST optimizer level; 0 compiles the tree as parsed (--O)
+bool REGISTER_VM = false; // run functions on the register-based tier (--vm register)
+bool JIT_ENABLED = false; // compile hot functions to native code (--jit)
+int JIT_THRESHOLD = 1000; // calls plus loop back edges before a function is compiled (--jit threshold=N)
+std::string AOT_OUTPUT; // write the compiled program here as C++ instead of running it (--aot)
+std::string XSB_OUTPUT; // write the compiled program here as a program image instead of running it (--xsb)
 void debugLog(const std::string& msg) {
     if (DEBUG_MODE)
         std::cout << "[DEBUG] " << msg << std::endl;
 }
+// Runtime hot paths log through DEBUG_LOG so the message is only built when debugging.
+#define DEBUG_LOG(msg) do { if (DEBUG_MODE) debugLog(msg); } while (0)
 std::chrono::steady_clock::time_point startTime;
 
 // ---------------------------------------------------------------------------  
@@ -82,11 +99,13 @@ VM* globalVM = nullptr;
 // Forward declarations for object types
 // ============================================================================
 struct ObjFunction;
+struct JitCode;
 struct ObjClass;
 struct ObjInstance;
 struct ObjArray;
 struct ObjBoundMethod;
 struct ObjModule;
+struct ObjEnum;
 
 // ============================================================================  
 // Color type  
@@ -97,13 +116,77 @@ struct Color {
 };
 
 // ============================================================================  
-// NEW: Enum object definition
+// Value tags. Everything from String on lives on the heap behind an Obj.
 // ============================================================================
-struct ObjEnum {
-    std::string name;
-    std::unordered_map<std::string, int> members;
+enum class ValueType : uint8_t {
+    Nil,
+    Int,
+    Double,
+    Bool,
+    Color,
+    Pointer,
+    String,
+    Function,
+    Class,
+    Instance,
+    Array,
+    BoundMethod,
+    Builtin,
+    Properties,
+    Overloads,
+    Module,
+    Enum
+};
+
+// ============================================================================  
+// Heap object header – intrusive reference count plus the object's type
+// ============================================================================
+struct Obj {
+    ValueType type;
+    uint32_t refCount = 0;
+    explicit Obj(ValueType t) : type(t) {}
+    virtual ~Obj() = default;
+};
+
+inline void retainObj(Obj* obj) {
+    obj->refCount++;
+}
+inline void releaseObj(Obj* obj) {
+    if (--obj->refCount == 0)
+        delete obj;
+}
+
+// ----------------------------------------------------------------------------  
+// Ref<T> – owning reference to a heap object (the shared_ptr of Obj types)
+// ----------------------------------------------------------------------------
+template <typename T>
+class Ref {
+public:
+    Ref() = default;
+    Ref(std::nullptr_t) {}
+    explicit Ref(T* p) : ptr(p) { if (ptr) retainObj(ptr); }
+    Ref(const Ref& other) : ptr(other.ptr) { if (ptr) retainObj(ptr); }
+    Ref(Ref&& other) noexcept : ptr(other.ptr) { other.ptr = nullptr; }
+    ~Ref() { if (ptr) releaseObj(ptr); }
+    Ref& operator=(Ref other) noexcept {
+        std::swap(ptr, other.ptr);
+        return *this;
+    }
+    T* get() const { return ptr; }
+    T* operator->() const { return ptr; }
+    T& operator*() const { return *ptr; }
+    explicit operator bool() const { return ptr != nullptr; }
+    bool operator==(const Ref& other) const { return ptr == other.ptr; }
+    bool operator!=(const Ref& other) const { return ptr != other.ptr; }
+private:
+    T* ptr = nullptr;
 };
 
+template <typename T, typename... Args>
+Ref<T> makeRef(Args&&... args) {
+    return Ref<T>(new T(std::forward<Args>(args)...));
+}
+
 // ============================================================================  
 // Built-in function type
 // ============================================================================
@@ -115,62 +198,175 @@ using BuiltinFn = std::function<struct Value(const std::vector<struct Value>&)>;
 using PropertiesType = std::vector<std::pair<std::string, struct Value>>;
 
 // ============================================================================  
-// Dynamic Value type – a wrapper around std::variant
-// Now includes pointer type (void*) for pointer variables.
+// Dynamic Value type – a 16-byte tagged union
+// Ints, doubles, booleans, colors and pointers (void*) are stored inline;
+// everything else is a reference-counted Obj.
 // ============================================================================
-// By Design - Not a duplication mistake: The duplicate "using" declaration 
-// inherits std::variant's constructors so Value can be directly constructed 
-// from any of its alternatives.
-struct Value : public std::variant<
-    std::monostate,
-    int,
-    double,
-    bool,
-    std::string,
-    Color,
-    std::shared_ptr<ObjFunction>,
-    std::shared_ptr<ObjClass>,
-    std::shared_ptr<ObjInstance>,
-    std::shared_ptr<ObjArray>,
-    std::shared_ptr<ObjBoundMethod>,
-    BuiltinFn,
-    PropertiesType,
-    std::vector<std::shared_ptr<ObjFunction>>,
-    std::shared_ptr<ObjModule>,
-    std::shared_ptr<ObjEnum>,
-    void* // Pointer type
-> {
-    using std::variant<
-        std::monostate,
-        int,
-        double,
-        bool,
-        std::string,
-        Color,
-        std::shared_ptr<ObjFunction>,
-        std::shared_ptr<ObjClass>,
-        std::shared_ptr<ObjInstance>,
-        std::shared_ptr<ObjArray>,
-        std::shared_ptr<ObjBoundMethod>,
-        BuiltinFn,
-        PropertiesType,
-        std::vector<std::shared_ptr<ObjFunction>>,
-        std::shared_ptr<ObjModule>,
-        std::shared_ptr<ObjEnum>,
-        void*
-    >::variant;
+struct Value {
+    ValueType type = ValueType::Nil;
+    union {
+        int i;
+        double d;
+        bool b;
+        unsigned int color;
+        void* ptr;
+        Obj* obj;
+    } as = {};
+
+    Value() = default;
+    Value(std::monostate) {}
+    Value(int v) : type(ValueType::Int) { as.i = v; }
+    Value(double v) : type(ValueType::Double) { as.d = v; }
+    Value(bool v) : type(ValueType::Bool) { as.b = v; }
+    Value(Color v) : type(ValueType::Color) { as.color = v.value; }
+    Value(void* v) : type(ValueType::Pointer) { as.ptr = v; }
+    Value(const std::string& s);
+    Value(const char* s);
+    Value(const BuiltinFn& fn);
+    Value(const PropertiesType& properties);
+    Value(const std::vector<Ref<ObjFunction>>& overloads);
+    template <typename T>
+    Value(const Ref<T>& ref) {
+        if (ref) {
+            type = T::TYPE;
+            as.obj = ref.get();
+            retainObj(as.obj);
+        }
+    }
+
+    Value(const Value& other) : type(other.type), as(other.as) {
+        if (isObject()) retainObj(as.obj);
+    }
+    Value(Value&& other) noexcept : type(other.type), as(other.as) {
+        other.type = ValueType::Nil;
+    }
+    Value& operator=(const Value& other) {
+        if (other.isObject()) retainObj(other.as.obj);
+        if (isObject()) releaseObj(as.obj);
+        type = other.type;
+        as = other.as;
+        return *this;
+    }
+    Value& operator=(Value&& other) noexcept {
+        if (this != &other) {
+            if (isObject()) releaseObj(as.obj);
+            type = other.type;
+            as = other.as;
+            other.type = ValueType::Nil;
+        }
+        return *this;
+    }
+    ~Value() {
+        if (isObject()) releaseObj(as.obj);
+    }
+
+    bool isObject() const { return type >= ValueType::String; }
+};
+static_assert(sizeof(Value) <= 16, "Value must stay within 16 bytes");
+
+// ============================================================================  
+// Heap objects stored directly in a Value
+// ============================================================================
+struct ObjString : Obj {
+    static constexpr ValueType TYPE = ValueType::String;
+    std::string chars;
+    explicit ObjString(std::string s) : Obj(TYPE), chars(std::move(s)) {}
+};
+
+struct DeclareSignature;
+
+struct ObjBuiltin : Obj {
+    static constexpr ValueType TYPE = ValueType::Builtin;
+    BuiltinFn fn;
+    std::shared_ptr<const DeclareSignature> declare; // Set when a Declare statement made it, see declaredFunction
+    explicit ObjBuiltin(BuiltinFn f) : Obj(TYPE), fn(std::move(f)) {}
+};
+
+struct ObjProperties : Obj {
+    static constexpr ValueType TYPE = ValueType::Properties;
+    PropertiesType properties;
+    explicit ObjProperties(PropertiesType p) : Obj(TYPE), properties(std::move(p)) {}
+};
+
+struct ObjOverloads : Obj {
+    static constexpr ValueType TYPE = ValueType::Overloads;
+    std::vector<Ref<ObjFunction>> functions;
+    explicit ObjOverloads(std::vector<Ref<ObjFunction>> f) : Obj(TYPE), functions(std::move(f)) {}
 };
 
+inline Value::Value(const std::string& s) : type(ValueType::String) { as.obj = new ObjString(s); retainObj(as.obj); }
+inline Value::Value(const char* s) : Value(std::string(s)) {}
+inline Value::Value(const BuiltinFn& fn) : type(ValueType::Builtin) { as.obj = new ObjBuiltin(fn); retainObj(as.obj); }
+inline Value::Value(const PropertiesType& properties) : type(ValueType::Properties) { as.obj = new ObjProperties(properties); retainObj(as.obj); }
+inline Value::Value(const std::vector<Ref<ObjFunction>>& overloads) : type(ValueType::Overloads) { as.obj = new ObjOverloads(overloads); retainObj(as.obj); }
+
 // ----------------------------------------------------------------------------  
-// Helper templates for type queries and access.
+// Helper templates for type queries and access. holds<T> is a single tag
+// compare; getVal<T> returns inline values by value and heap payloads by
+// reference (object types as a new Ref).
 // ----------------------------------------------------------------------------
+template <typename T> struct ValueTraits;
+template <> struct ValueTraits<std::monostate> {
+    static bool is(const Value& v) { return v.type == ValueType::Nil; }
+    static std::monostate get(const Value&) { return {}; }
+};
+template <> struct ValueTraits<int> {
+    static bool is(const Value& v) { return v.type == ValueType::Int; }
+    static int get(const Value& v) { return v.as.i; }
+};
+template <> struct ValueTraits<double> {
+    static bool is(const Value& v) { return v.type == ValueType::Double; }
+    static double get(const Value& v) { return v.as.d; }
+};
+template <> struct ValueTraits<bool> {
+    static bool is(const Value& v) { return v.type == ValueType::Bool; }
+    static bool get(const Value& v) { return v.as.b; }
+};
+template <> struct ValueTraits<Color> {
+    static bool is(const Value& v) { return v.type == ValueType::Color; }
+    static Color get(const Value& v) { return Color{ v.as.color }; }
+};
+template <> struct ValueTraits<void*> {
+    static bool is(const Value& v) { return v.type == ValueType::Pointer; }
+    static void* get(const Value& v) { return v.as.ptr; }
+};
+template <> struct ValueTraits<std::string> {
+    static bool is(const Value& v) { return v.type == ValueType::String; }
+    static const std::string& get(const Value& v) { return static_cast<ObjString*>(v.as.obj)->chars; }
+};
+template <> struct ValueTraits<BuiltinFn> {
+    static bool is(const Value& v) { return v.type == ValueType::Builtin; }
+    static const BuiltinFn& get(const Value& v) { return static_cast<ObjBuiltin*>(v.as.obj)->fn; }
+};
+template <> struct ValueTraits<PropertiesType> {
+    static bool is(const Value& v) { return v.type == ValueType::Properties; }
+    static const PropertiesType& get(const Value& v) { return static_cast<ObjProperties*>(v.as.obj)->properties; }
+};
+template <> struct ValueTraits<std::vector<Ref<ObjFunction>>> {
+    static bool is(const Value& v) { return v.type == ValueType::Overloads; }
+    static const std::vector<Ref<ObjFunction>>& get(const Value& v) { return static_cast<ObjOverloads*>(v.as.obj)->functions; }
+};
+template <typename T> struct ValueTraits<Ref<T>> {
+    static bool is(const Value& v) { return v.type == T::TYPE; }
+    static Ref<T> get(const Value& v) { return Ref<T>(static_cast<T*>(v.as.obj)); }
+};
+
+[[noreturn]] void runtimeError(const std::string& msg);
+
 template<typename T>
 bool holds(const Value& v) {
-    return std::holds_alternative<T>(v); 
+    return ValueTraits<T>::is(v);
+}
+template<typename T>
+decltype(auto) getVal(const Value& v) {
+    if (!ValueTraits<T>::is(v))
+        runtimeError("VM: Value has unexpected type.");
+    return ValueTraits<T>::get(v);
 }
+// Borrowed pointer to the object held by v (no reference count traffic).
 template<typename T>
-T getVal(const Value& v) {
-    return std::get<T>(v);
+T* asObj(const Value& v) {
+    return static_cast<T*>(v.as.obj);
 }
 template <typename T>
 std::string getTypeName(const T& var) {
@@ -185,30 +381,78 @@ std::string toLower(const std::string& s) {
     return ret;
 }
 
+// ============================================================================  
+// Symbol table – identifiers are case-insensitive, so every name is lowercased
+// and interned once at compile time. The VM keys environments, fields,
+// methods and module members on the resulting SymbolId.
+// ============================================================================
+using SymbolId = int;
+
+struct SymbolTable {
+    std::unordered_map<std::string, SymbolId> ids;
+    std::vector<std::string> names;
+    SymbolId intern(const std::string& name) {
+        std::string key = toLower(name);
+        auto it = ids.find(key);
+        if (it != ids.end())
+            return it->second;
+        SymbolId id = (SymbolId)names.size();
+        names.push_back(key);
+        ids.emplace(key, id);
+        return id;
+    }
+};
+
+SymbolTable& symbolTable() {
+    static SymbolTable table;
+    return table;
+}
+SymbolId intern(const std::string& name) {
+    return symbolTable().intern(name);
+}
+const std::string& symbolName(SymbolId id) {
+    return symbolTable().names[id];
+}
+
+// Names the VM itself looks for.
+const SymbolId SYM_SELF = intern("self");
+const SymbolId SYM_MAIN = intern("main");
+const SymbolId SYM_CONSTRUCTOR = intern("constructor");
+const SymbolId SYM_TOSTRING = intern("tostring");
+const SymbolId SYM_MICROSECONDS = intern("microseconds");
+const SymbolId SYM_TICKS = intern("ticks");
+const SymbolId SYM_ADD = intern("add");
+const SymbolId SYM_INDEXOF = intern("indexof");
+const SymbolId SYM_LASTINDEX = intern("lastindex");
+const SymbolId SYM_COUNT = intern("count");
+const SymbolId SYM_POP = intern("pop");
+const SymbolId SYM_REMOVEAT = intern("removeat");
+const SymbolId SYM_REMOVEALL = intern("removeall");
+
 // ----------------------------------------------------------------------------  
 // Helper: Return a string naming the underlying type of a Value.
 // ----------------------------------------------------------------------------
 std::string getTypeName(const Value& v) {
-    struct TypeVisitor {
-        std::string operator()(std::monostate) const { return "nil"; }
-        std::string operator()(int) const { return "int"; }
-        std::string operator()(double) const { return "double"; }
-        std::string operator()(bool) const { return "bool"; }
-        std::string operator()(const std::string&) const { return "string"; }
-        std::string operator()(const Color&) const { return "Color"; }
-        std::string operator()(const std::shared_ptr<ObjFunction>&) const { return "ObjFunction"; }
-        std::string operator()(const std::shared_ptr<ObjClass>&) const { return "ObjClass"; }
-        std::string operator()(const std::shared_ptr<ObjInstance>&) const { return "ObjInstance"; }
-        std::string operator()(const std::shared_ptr<ObjArray>&) const { return "ObjArray"; }
-        std::string operator()(const std::shared_ptr<ObjBoundMethod>&) const { return "ObjBoundMethod"; }
-        std::string operator()(const BuiltinFn&) const { return "BuiltinFn"; }
-        std::string operator()(const PropertiesType&) const { return "PropertiesType"; }
-        std::string operator()(const std::vector<std::shared_ptr<ObjFunction>>&) const { return "OverloadedFunctions"; }
-        std::string operator()(const std::shared_ptr<ObjModule>&) const { return "ObjModule"; }
-        std::string operator()(const std::shared_ptr<ObjEnum>&) const { return "ObjEnum"; }
-        std::string operator()(void* ptr) const { return "pointer"; }
-    } visitor;
-    return std::visit(visitor, v);
+    switch (v.type) {
+    case ValueType::Nil:         return "nil";
+    case ValueType::Int:         return "int";
+    case ValueType::Double:      return "double";
+    case ValueType::Bool:        return "bool";
+    case ValueType::String:      return "string";
+    case ValueType::Color:       return "Color";
+    case ValueType::Function:    return "ObjFunction";
+    case ValueType::Class:       return "ObjClass";
+    case ValueType::Instance:    return "ObjInstance";
+    case ValueType::Array:       return "ObjArray";
+    case ValueType::BoundMethod: return "ObjBoundMethod";
+    case ValueType::Builtin:     return "BuiltinFn";
+    case ValueType::Properties:  return "PropertiesType";
+    case ValueType::Overloads:   return "OverloadedFunctions";
+    case ValueType::Module:      return "ObjModule";
+    case ValueType::Enum:        return "ObjEnum";
+    case ValueType::Pointer:     return "pointer";
+    }
+    return "unknown";
 }
 
 // ============================================================================  
@@ -221,97 +465,260 @@ struct Param {
     Value defaultValue;
 };
 
+// What a Declare statement binds to its name, kept so that a compiled
+// program can load the API again without its source (--aot, --xsb).
+struct DeclareSignature {
+    std::vector<Param> params;
+    std::string returnType;
+    std::string apiName;
+    std::string libraryName;
+};
+
 // ============================================================================  
 // Enum for Access Modifiers (for module members)
 // ============================================================================
 enum class AccessModifier { PUBLIC, PRIVATE };
 
+// ============================================================================  
+// Inline caches – one per property or method site, indexed by the
+// instruction's cache operand. Each entry pairs a class shape with what the
+// name resolved to there: a field slot, or a method (slot == -1).
+// ============================================================================
+struct InlineCache {
+    static const int SIZE = 4; // Polymorphic sites beyond this evict round-robin
+    struct Entry {
+        uint32_t shapeId = 0; // 0 = empty
+        int slot = -1;
+        const Value* method = nullptr; // Points into the class's method table
+    } entries[SIZE];
+    int next = 0;
+
+    const Entry* find(uint32_t shapeId) const {
+        for (const Entry& entry : entries) {
+            if (entry.shapeId == shapeId)
+                return &entry;
+        }
+        return nullptr;
+    }
+    void add(uint32_t shapeId, int slot, const Value* method) {
+        entries[next] = { shapeId, slot, method };
+        next = (next + 1) % SIZE;
+    }
+};
+
+// Dispatch table for a Select Case whose cases are all constants: a dense
+// integer range indexes targets directly; sparse integers and strings hash.
+struct SwitchTable {
+    int low = 0;               // targets[key - low] for OP_JUMP_TABLE
+    std::vector<int> targets;
+    std::unordered_map<int, int> intTargets;
+    std::unordered_map<std::string, int> stringTargets;
+    int defaultTarget = 0;
+};
+
+// A chunk's encoded instructions. Compiled chunks own their bytes; a chunk
+// loaded from a program image (.xsb) points into the mapped file instead,
+// so loading it copies nothing. Quickening writes through either form.
+class Bytecode {
+public:
+    Bytecode() = default;
+    Bytecode(std::vector<uint8_t> bytes) : owned(std::move(bytes)), start(owned.data()), count(owned.size()) {}
+    Bytecode(const Bytecode& other) { *this = other; }
+    Bytecode(Bytecode&& other) noexcept = default;
+    Bytecode& operator=(const Bytecode& other) {
+        if (this != &other) {
+            owned = other.owned;
+            start = owned.empty() ? other.start : owned.data();
+            count = other.count;
+        }
+        return *this;
+    }
+    Bytecode& operator=(Bytecode&& other) noexcept = default;
+
+    static Bytecode view(uint8_t* bytes, size_t size) {
+        Bytecode bytecode;
+        bytecode.start = bytes;
+        bytecode.count = size;
+        return bytecode;
+    }
+
+    uint8_t& operator[](size_t i) { return start[i]; }
+    const uint8_t& operator[](size_t i) const { return start[i]; }
+    size_t size() const { return count; }
+
+private:
+    std::vector<uint8_t> owned;
+    uint8_t* start = nullptr;
+    size_t count = 0;
+};
+
+// Shape ids identify a class layout plus method table; a class takes a fresh
+// id whenever either changes, which invalidates every cache entry for it.
+uint32_t newShapeId() {
+    static uint32_t nextShapeId = 1;
+    return nextShapeId++;
+}
+
 // ============================================================================  
 // Object definitions
 // ============================================================================
-struct ObjFunction {
+struct ObjFunction : Obj {
+    static constexpr ValueType TYPE = ValueType::Function;
+    ObjFunction() : Obj(TYPE) {}
     std::string name;
     int arity = 0; // Parameter initialization.
     std::vector<Param> params; // Full parameter list
+    bool isMethod = false; // Class methods receive self in frame slot 0
     struct CodeChunk {
-        std::vector<int> code;
+        std::vector<int> code;         // One int per opcode and operand, while compiling
+        Bytecode bytecode;             // What the VM runs, set by encodeChunk
         std::vector<Value> constants;
+        int localCount = 0; // Frame slots: parameters first, then Dim'd locals
+        int maxStack = 0;   // Deepest operand stack above the slots, set by verifyChunk
+        mutable std::vector<InlineCache> caches; // Filled in as the code runs
+        std::vector<SwitchTable> switchTables;
     } chunk;
+    // Three-address code for the register tier (--vm register): a function
+    // whose body it can express gets both forms. Operands below zero name
+    // constants[-1 - operand] instead of a register.
+    struct RegisterChunk {
+        std::vector<int> code;
+        std::vector<Value> constants;
+        int registerCount = 0; // Self for methods, parameters, then locals, then temporaries
+        mutable std::vector<InlineCache> caches; // Property and method lookups, as on the stack tier
+    };
+    std::shared_ptr<RegisterChunk> registers;
+    // Baseline JIT (--jit): calls and loop back edges counted so far, then
+    // the native code once the function is compiled.
+    int hotness = 0;
+    std::shared_ptr<JitCode> jit;
 };
 
-struct ObjClass {
+struct ObjClass : Obj {
+    static constexpr ValueType TYPE = ValueType::Class;
+    ObjClass() : Obj(TYPE) {}
     std::string name;
-    std::unordered_map<std::string, Value> methods;
-    PropertiesType properties;
+    uint32_t shapeId = newShapeId();
+    std::unordered_map<SymbolId, Value> methods;
+    // Shape: declared property -> slot in ObjInstance::fields. Every instance
+    // of the class starts as a copy of fieldDefaults.
+    std::unordered_map<SymbolId, int> fieldSlots;
+    std::vector<Value> fieldDefaults;
     bool isPlugin = false;
     BuiltinFn pluginConstructor;
-    std::unordered_map<std::string, std::pair<BuiltinFn, BuiltinFn>> pluginProperties;
+    std::unordered_map<SymbolId, std::pair<BuiltinFn, BuiltinFn>> pluginProperties;
 };
 
-struct ObjInstance {
-    std::shared_ptr<ObjClass> klass;
-    std::unordered_map<std::string, Value> fields;
+struct ObjInstance : Obj {
+    static constexpr ValueType TYPE = ValueType::Instance;
+    ObjInstance() : Obj(TYPE) {}
+    Ref<ObjClass> klass;
+    std::vector<Value> fields; // Laid out by klass->fieldSlots
+    std::unordered_map<SymbolId, Value> extraFields; // Properties assigned but never declared
     void* pluginInstance = nullptr;
+
+    Value* findField(SymbolId name) {
+        auto slot = klass->fieldSlots.find(name);
+        if (slot != klass->fieldSlots.end())
+            return &fields[slot->second];
+        auto extra = extraFields.find(name);
+        return extra != extraFields.end() ? &extra->second : nullptr;
+    }
+    void setField(SymbolId name, const Value& value) {
+        if (Value* field = findField(name))
+            *field = value;
+        else
+            extraFields[name] = value;
+    }
 };
 
-struct ObjArray {
+struct ObjArray : Obj {
+    static constexpr ValueType TYPE = ValueType::Array;
+    ObjArray() : Obj(TYPE) {}
     std::vector<Value> elements;
 };
 
-struct ObjBoundMethod {
+struct ObjBoundMethod : Obj {
+    static constexpr ValueType TYPE = ValueType::BoundMethod;
+    ObjBoundMethod() : Obj(TYPE) {}
     Value receiver;
+    SymbolId name;
+    Value method; // The class method name resolved to, when the receiver is an instance
+};
+
+struct ObjModule : Obj {
+    static constexpr ValueType TYPE = ValueType::Module;
+    ObjModule() : Obj(TYPE) {}
     std::string name;
+    std::unordered_map<SymbolId, Value> publicMembers;
 };
 
-struct ObjModule {
+// ============================================================================  
+// NEW: Enum object definition
+// ============================================================================
+struct ObjEnum : Obj {
+    static constexpr ValueType TYPE = ValueType::Enum;
     std::string name;
-    std::unordered_map<std::string, Value> publicMembers;
+    std::unordered_map<SymbolId, int> members;
+    ObjEnum() : Obj(TYPE) {}
 };
 
+// ----------------------------------------------------------------------------  
+// Helper: truth value used by conditional jumps, And, Or and Not.
+// ----------------------------------------------------------------------------
+inline bool isTruthy(const Value& v) {
+    switch (v.type) {
+    case ValueType::Bool:   return v.as.b;
+    case ValueType::Int:    return v.as.i != 0;
+    case ValueType::String: return !getVal<std::string>(v).empty();
+    default:                return false;
+    }
+}
+
 // ============================================================================  
 // valueToString – visitor for Value conversion (with trailing zero trimming to mirror Xojo)
 // ============================================================================
 // valueToString converts a Value to a string
 std::string valueToString(const Value& val) {
-    struct Visitor {
-        std::string operator()(std::monostate) const { return "nil"; }
-        std::string operator()(int i) const { return std::to_string(i); }
-        std::string operator()(double d) const {
-            std::string s = std::to_string(d);
-            size_t pos = s.find('.');
-            if (pos != std::string::npos) {
-                while (!s.empty() && s.back() == '0')
-                    s.pop_back();
-                if (!s.empty() && s.back() == '.')
-                    s.pop_back();
-            }
-            return s;
-        }
-        std::string operator()(bool b) const { return b ? "true" : "false"; }
-        std::string operator()(const std::string& s) const { return s; }
-        std::string operator()(const Color& col) const {
-            char buf[10];
-            std::snprintf(buf, sizeof(buf), "&h%06X", col.value & 0xFFFFFF);
-            return std::string(buf);
-        }
-        std::string operator()(const std::shared_ptr<ObjFunction>& fn) const { return "<function " + fn->name + ">"; }
-        std::string operator()(const std::shared_ptr<ObjClass>& cls) const { return "<class " + cls->name + ">"; }
-        std::string operator()(const std::shared_ptr<ObjInstance>& inst) const { return "<instance of " + inst->klass->name + ">"; }
-        std::string operator()(const std::shared_ptr<ObjArray>& arr) const { return "Array(" + std::to_string(arr->elements.size()) + ")"; }
-        std::string operator()(const std::shared_ptr<ObjBoundMethod>& bm) const { return "<bound method " + bm->name + ">"; }
-        std::string operator()(const BuiltinFn&) const { return "<builtin fn>"; }
-        std::string operator()(const PropertiesType&) const { return "<properties>"; }
-        std::string operator()(const std::vector<std::shared_ptr<ObjFunction>>&) const { return "<overloaded functions>"; }
-        std::string operator()(const std::shared_ptr<ObjModule>& mod) const { return "<module " + mod->name + ">"; }
-        std::string operator()(const std::shared_ptr<ObjEnum>& e) const { return "<enum " + e->name + ">"; }
-        std::string operator()(void* ptr) const {
-            if(ptr == nullptr) return "nil";
-            char buf[20];
-            std::snprintf(buf, sizeof(buf), "ptr(%p)", ptr);
-            return std::string(buf);
-        } // Pointer type
-    } visitor;
-    return std::visit(visitor, val);
+    switch (val.type) {
+    case ValueType::Nil: return "nil";
+    case ValueType::Int: return std::to_string(val.as.i);
+    case ValueType::Double: {
+        std::string s = std::to_string(val.as.d);
+        size_t pos = s.find('.');
+        if (pos != std::string::npos) {
+            while (!s.empty() && s.back() == '0')
+                s.pop_back();
+            if (!s.empty() && s.back() == '.')
+                s.pop_back();
+        }
+        return s;
+    }
+    case ValueType::Bool: return val.as.b ? "true" : "false";
+    case ValueType::String: return asObj<ObjString>(val)->chars;
+    case ValueType::Color: {
+        char buf[10];
+        std::snprintf(buf, sizeof(buf), "&h%06X", val.as.color & 0xFFFFFF);
+        return std::string(buf);
+    }
+    case ValueType::Function: return "<function " + asObj<ObjFunction>(val)->name + ">";
+    case ValueType::Class: return "<class " + asObj<ObjClass>(val)->name + ">";
+    case ValueType::Instance: return "<instance of " + asObj<ObjInstance>(val)->klass->name + ">";
+    case ValueType::Array: return "Array(" + std::to_string(asObj<ObjArray>(val)->elements.size()) + ")";
+    case ValueType::BoundMethod: return "<bound method " + symbolName(asObj<ObjBoundMethod>(val)->name) + ">";
+    case ValueType::Builtin: return "<builtin fn>";
+    case ValueType::Properties: return "<properties>";
+    case ValueType::Overloads: return "<overloaded functions>";
+    case ValueType::Module: return "<module " + asObj<ObjModule>(val)->name + ">";
+    case ValueType::Enum: return "<enum " + asObj<ObjEnum>(val)->name + ">";
+    case ValueType::Pointer: {
+        if (val.as.ptr == nullptr) return "nil";
+        char buf[20];
+        std::snprintf(buf, sizeof(buf), "ptr(%p)", val.as.ptr);
+        return std::string(buf);
+    } // Pointer type
+    }
+    return "nil";
 }
 
 // ============================================================================  
@@ -507,53 +914,45 @@ std::string rtrim(const std::string& s) {
 // Environment (case–insensitive for variable names)
 // ============================================================================
 struct Environment {
-    std::unordered_map<std::string, Value> values;
+    std::unordered_map<SymbolId, Value> values;
     std::shared_ptr<Environment> enclosing;
     Environment(std::shared_ptr<Environment> enclosing = nullptr)
         : enclosing(enclosing) { }
-    void define(const std::string& name, const Value& value) {
-        values[toLower(name)] = value;
+    void define(SymbolId name, const Value& value) {
+        values[name] = value;
     }
-    Value get(const std::string& name) {
-        std::string key = toLower(name);
-        if (values.find(key) != values.end())
-            return values[key];
-        if (values.find("self") != values.end()) {
-            Value selfVal = values["self"];
-            if (holds<std::shared_ptr<ObjInstance>>(selfVal)) {
-                auto instance = getVal<std::shared_ptr<ObjInstance>>(selfVal);
-                if (instance->fields.find(key) != instance->fields.end())
-                    return instance->fields[key];
-            }
-        }
+    Value get(SymbolId name) {
+        auto it = values.find(name);
+        if (it != values.end())
+            return it->second;
         if (enclosing) return enclosing->get(name);
-        std::cerr << "NilObjectException for variable: " << name << std::endl;
+        std::cerr << "NilObjectException for variable: " << symbolName(name) << std::endl;
         exit(1);
         return Value(std::monostate{});
     }
-    void assign(const std::string& name, const Value& value) {
-        std::string key = toLower(name);
-        if (values.find(key) != values.end()) {
-            values[key] = value;
+    Value* lookup(SymbolId name) {
+        auto it = values.find(name);
+        if (it != values.end())
+            return &it->second;
+        return enclosing ? enclosing->lookup(name) : nullptr;
+    }
+    void assign(SymbolId name, const Value& value) {
+        auto it = values.find(name);
+        if (it != values.end()) {
+            it->second = value;
             return;
         }
-        if (values.find("self") != values.end()) {
-            Value selfVal = values["self"];
-            if (holds<std::shared_ptr<ObjInstance>>(selfVal)) {
-                auto instance = getVal<std::shared_ptr<ObjInstance>>(selfVal);
-                if (instance->fields.find(key) != instance->fields.end()) {
-                    instance->fields[key] = value;
-                    return;
-                }
-            }
-        }
         if (enclosing) {
             enclosing->assign(name, value);
             return;
         }
-        std::cerr << "NilObjectException for variable: " << name << std::endl;
+        std::cerr << "NilObjectException for variable: " << symbolName(name) << std::endl;
         exit(1);
     }
+    // Native code (built-ins, plugins, the compiler) uses names directly.
+    void define(const std::string& name, const Value& value) { define(intern(name), value); }
+    Value get(const std::string& name) { return get(intern(name)); }
+    void assign(const std::string& name, const Value& value) { assign(intern(name), value); }
 };
 
 // ============================================================================  
@@ -619,8 +1018,6 @@ enum OpCode {
     OP_GE,
     OP_NE,
     OP_EQ,
-    OP_AND,
-    OP_OR,
     OP_PRINT,
     OP_POP,
     OP_DEFINE_GLOBAL,
@@ -640,8 +1037,58 @@ enum OpCode {
     OP_SET_PROPERTY,
     OP_PROPERTIES,
     OP_DUP,
-    OP_CONSTRUCTOR_END
+    OP_CONSTRUCTOR_END,
+    OP_GET_LOCAL,
+    OP_SET_LOCAL,
+    OP_TAIL_CALL,
+    OP_INVOKE,
+    OP_TAIL_INVOKE,
+    // Quickened forms: the generic arithmetic and comparison ops rewrite
+    // themselves into these once they have seen their operand types.
+    OP_ADD_INT,
+    OP_ADD_DOUBLE,
+    OP_ADD_STRING,
+    OP_SUB_INT,
+    OP_SUB_DOUBLE,
+    OP_MUL_INT,
+    OP_MUL_DOUBLE,
+    OP_LT_INT,
+    OP_LE_INT,
+    OP_GT_INT,
+    OP_GE_INT,
+    OP_NE_INT,
+    OP_EQ_INT,
+    OP_LT_DOUBLE,
+    OP_LE_DOUBLE,
+    OP_GT_DOUBLE,
+    OP_GE_DOUBLE,
+    OP_FOR_LOOP,
+    OP_FOR_LOOP_GLOBAL,
+    OP_FOR_EACH,
+    OP_JUMP_TABLE,
+    OP_SWITCH_HASH,
+    OP_NOT,
+    OP_JUMP_IF_TRUE,
+    OP_JUMP_IF_NOT_LT,
+    OP_JUMP_IF_NOT_LE,
+    OP_JUMP_IF_NOT_GT,
+    OP_JUMP_IF_NOT_GE,
+    OP_JUMP_IF_NOT_EQ,
+    OP_JUMP_IF_NOT_NE,
+    // Superinstructions, chosen from --profile opcode pair counts.
+    OP_INC_LOCAL,
+    OP_ADD_LOCAL_CONST,
+    OP_SUB_LOCAL_CONST,
+    OP_JUMP_IF_NOT_LOCAL_CONST,
+    OP_JUMP_IF_NOT_LOCALS,
+    OP_GET_SELF_FIELD,
+    OP_SET_SELF_FIELD,
+    // Operand width prefixes, emitted only by encodeChunk.
+    OP_WIDE,  // Operands of the next instruction are two bytes
+    OP_WIDE4, // Operands of the next instruction are four bytes
+    OP_COUNT // Number of opcodes; keep last
 };
+static_assert(OP_COUNT <= 256, "opcodes are encoded in one byte");
 
 std::string opcodeToString(int opcode) {
     switch (opcode) {
@@ -659,8 +1106,6 @@ std::string opcodeToString(int opcode) {
     case OP_GE:            return "OP_GE";
     case OP_NE:            return "OP_NE";
     case OP_EQ:            return "OP_EQ";
-    case OP_AND:           return "OP_AND";
-    case OP_OR:            return "OP_OR";
     case OP_PRINT:         return "OP_PRINT";
     case OP_POP:           return "OP_POP";
     case OP_DEFINE_GLOBAL: return "OP_DEFINE_GLOBAL";
@@ -681,62 +1126,217 @@ std::string opcodeToString(int opcode) {
     case OP_PROPERTIES:    return "OP_PROPERTIES";
     case OP_DUP:           return "OP_DUP";
     case OP_CONSTRUCTOR_END: return "OP_CONSTRUCTOR_END";
+    case OP_GET_LOCAL:     return "OP_GET_LOCAL";
+    case OP_SET_LOCAL:     return "OP_SET_LOCAL";
+    case OP_TAIL_CALL:     return "OP_TAIL_CALL";
+    case OP_INVOKE:        return "OP_INVOKE";
+    case OP_TAIL_INVOKE:   return "OP_TAIL_INVOKE";
+    case OP_ADD_INT:       return "OP_ADD_INT";
+    case OP_ADD_DOUBLE:    return "OP_ADD_DOUBLE";
+    case OP_ADD_STRING:    return "OP_ADD_STRING";
+    case OP_SUB_INT:       return "OP_SUB_INT";
+    case OP_SUB_DOUBLE:    return "OP_SUB_DOUBLE";
+    case OP_MUL_INT:       return "OP_MUL_INT";
+    case OP_MUL_DOUBLE:    return "OP_MUL_DOUBLE";
+    case OP_LT_INT:        return "OP_LT_INT";
+    case OP_LE_INT:        return "OP_LE_INT";
+    case OP_GT_INT:        return "OP_GT_INT";
+    case OP_GE_INT:        return "OP_GE_INT";
+    case OP_NE_INT:        return "OP_NE_INT";
+    case OP_EQ_INT:        return "OP_EQ_INT";
+    case OP_LT_DOUBLE:     return "OP_LT_DOUBLE";
+    case OP_LE_DOUBLE:     return "OP_LE_DOUBLE";
+    case OP_GT_DOUBLE:     return "OP_GT_DOUBLE";
+    case OP_GE_DOUBLE:     return "OP_GE_DOUBLE";
+    case OP_FOR_LOOP:      return "OP_FOR_LOOP";
+    case OP_FOR_LOOP_GLOBAL: return "OP_FOR_LOOP_GLOBAL";
+    case OP_FOR_EACH:      return "OP_FOR_EACH";
+    case OP_JUMP_TABLE:    return "OP_JUMP_TABLE";
+    case OP_SWITCH_HASH:   return "OP_SWITCH_HASH";
+    case OP_NOT:           return "OP_NOT";
+    case OP_JUMP_IF_TRUE:  return "OP_JUMP_IF_TRUE";
+    case OP_JUMP_IF_NOT_LT: return "OP_JUMP_IF_NOT_LT";
+    case OP_JUMP_IF_NOT_LE: return "OP_JUMP_IF_NOT_LE";
+    case OP_JUMP_IF_NOT_GT: return "OP_JUMP_IF_NOT_GT";
+    case OP_JUMP_IF_NOT_GE: return "OP_JUMP_IF_NOT_GE";
+    case OP_JUMP_IF_NOT_EQ: return "OP_JUMP_IF_NOT_EQ";
+    case OP_JUMP_IF_NOT_NE: return "OP_JUMP_IF_NOT_NE";
+    case OP_INC_LOCAL:     return "OP_INC_LOCAL";
+    case OP_ADD_LOCAL_CONST: return "OP_ADD_LOCAL_CONST";
+    case OP_SUB_LOCAL_CONST: return "OP_SUB_LOCAL_CONST";
+    case OP_JUMP_IF_NOT_LOCAL_CONST: return "OP_JUMP_IF_NOT_LOCAL_CONST";
+    case OP_JUMP_IF_NOT_LOCALS: return "OP_JUMP_IF_NOT_LOCALS";
+    case OP_GET_SELF_FIELD: return "OP_GET_SELF_FIELD";
+    case OP_SET_SELF_FIELD: return "OP_SET_SELF_FIELD";
+    case OP_WIDE:          return "OP_WIDE";
+    case OP_WIDE4:         return "OP_WIDE4";
     default:               return "UNKNOWN";
     }
 }
 
+// Register tier instructions. Each names its destination register first and
+// reads registers or constants; calls take the callee and arguments from
+// consecutive registers starting at base. R_INVOKE puts its symbol and cache
+// ahead of the usual dst, base, argCount.
+enum RegOpCode {
+    R_MOVE,          // dst, src
+    R_GET_GLOBAL,    // dst, symbol
+    R_SET_GLOBAL,    // symbol, src
+    R_ADD, R_SUB, R_MUL, R_DIV, R_POW, R_MOD,  // dst, a, b
+    R_LT, R_LE, R_GT, R_GE, R_EQ, R_NE,        // dst, a, b
+    R_NEGATE, R_NOT, // dst, a
+    R_JUMP,          // target
+    R_JUMP_IF_FALSE, R_JUMP_IF_TRUE,           // a, target
+    R_JUMP_IF_NOT_LT, R_JUMP_IF_NOT_LE, R_JUMP_IF_NOT_GT,
+    R_JUMP_IF_NOT_GE, R_JUMP_IF_NOT_EQ, R_JUMP_IF_NOT_NE, // a, b, target
+    R_CALL,          // dst, base, argCount
+    R_TAIL_CALL,     // dst, base, argCount; then R_RETURN dst for native callees
+    R_RETURN,        // src
+    R_FOR_LOOP,      // counter, bound, step, down, bodyStart
+    R_GET_SELF_FIELD,  // dst, symbol, cache
+    R_SET_SELF_FIELD,  // symbol, src, cache
+    R_GET_PROPERTY,  // dst, object, symbol, cache
+    R_SET_PROPERTY,  // object, symbol, src, cache
+    R_INVOKE,        // symbol, cache, dst, base, argCount; base holds the receiver
+    R_COUNT          // Number of register opcodes; keep last
+};
+
 // ============================================================================  
 // Virtual Machine
 // ============================================================================
+// An interpreter activation. The callee (or receiver for methods) sits at
+// stackBase; the slots (self for methods, then parameters, then Dim'd locals)
+// start at slotBase. Top-level code runs in a frame with no function.
+struct CallFrame {
+    ObjFunction* function;
+    const ObjFunction::CodeChunk* chunk;
+    int ip; // Resume point while a callee runs
+    size_t slotBase;
+    size_t stackBase; // vm.stack is truncated here on return
+};
+
 struct VM {
     std::vector<Value> stack;
+    std::vector<CallFrame> frames;
     std::shared_ptr<Environment> globals;
     std::shared_ptr<Environment> environment;
     ObjFunction::CodeChunk mainChunk;
+    uint64_t instructionCount = 0; // Reported by --stats
+    std::vector<uint64_t> pairCounts; // [previous * OP_COUNT + next], filled by --profile
+    int previousOpcode = -1;
+    std::vector<Value> jitCells; // Operand stack of native code, see jitRun
+    VM() {
+        stack.reserve(1024);
+        frames.reserve(256);
+    }
 };
 
 // ----------------------------------------------------------------------------  
-// Helper: pop from VM stack (with logging)
+// Helper: pop from VM stack. verifyChunk has proven the depth, so underflow
+// cannot happen here.
 // ----------------------------------------------------------------------------
 Value pop(VM& vm) {
-    if (vm.stack.empty()) {
-        debugLog("OP_POP: Attempted to pop from an empty stack.");
-        runtimeError("VM: Stack underflow on POP.");
-    }
-    Value v = vm.stack.back();
+    Value v = std::move(vm.stack.back());
     vm.stack.pop_back();
     return v;
 }
 
 
+Value runVM(VM& vm);
 Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk);
+Value callRegisterFunction(VM& vm, ObjFunction* function, size_t stackBase, int argCount);
+
+// ----------------------------------------------------------------------------  
+// Helper: push an interpreter frame, enforcing the maximum call depth. The
+// stack is grown once here to the chunk's verified maximum, so the frame's
+// own pushes never reallocate it.
+// ----------------------------------------------------------------------------
+void pushFrame(VM& vm, ObjFunction* function, const ObjFunction::CodeChunk& chunk, size_t slotBase, size_t stackBase) {
+    if (vm.frames.size() >= MAX_CALL_DEPTH)
+        runtimeError("StackOverflowException: call depth exceeded " + std::to_string(MAX_CALL_DEPTH) + " frames.");
+    size_t needed = slotBase + chunk.localCount + chunk.maxStack;
+    if (needed > vm.stack.capacity())
+        vm.stack.reserve(std::max(needed, 2 * vm.stack.capacity()));
+    vm.frames.push_back({ function, &chunk, 0, slotBase, stackBase });
+}
+
+// ----------------------------------------------------------------------------  
+// Helper: enter a script function whose callee slot is at stackBase, followed
+// by argCount arguments. Missing optional arguments take their declared
+// defaults and locals start as nil. Methods find their receiver in the callee
+// slot, which becomes self (slot 0).
+// ----------------------------------------------------------------------------
+void enterFunction(VM& vm, ObjFunction* function, size_t stackBase, int argCount) {
+    size_t slotBase = function->isMethod ? stackBase : stackBase + 1;
+    size_t firstParam = stackBase + 1;
+    for (size_t i = argCount; i < function->params.size(); i++)
+        vm.stack.push_back(function->params[i].defaultValue);
+    vm.stack.resize(firstParam + function->params.size());
+    vm.stack.resize(slotBase + function->chunk.localCount);
+    pushFrame(vm, function, function->chunk, slotBase, stackBase);
+}
+
+// ----------------------------------------------------------------------------  
+// Helper: pick the overload accepting argCount arguments, or nullptr.
+// ----------------------------------------------------------------------------
+ObjFunction* selectOverload(const std::vector<Ref<ObjFunction>>& overloads, int argCount) {
+    for (auto& f : overloads) {
+        if (argCount >= f->arity && argCount <= (int)f->params.size())
+            return f.get();
+    }
+    return nullptr;
+}
+
+// ----------------------------------------------------------------------------  
+// Helper: run a script function from native code with an argument list.
+// ----------------------------------------------------------------------------
+Value callScriptFunction(VM& vm, const Ref<ObjFunction>& function, const std::vector<Value>& args, const Value* receiver = nullptr) {
+    size_t base = vm.stack.size();
+    if (function->isMethod)
+        vm.stack.push_back(receiver ? *receiver : Value(std::monostate{}));
+    else
+        vm.stack.push_back(Value(function));
+    for (auto& arg : args)
+        vm.stack.push_back(arg);
+    if (function->registers)
+        return callRegisterFunction(vm, function.get(), base, args.size());
+    enterFunction(vm, function.get(), base, args.size());
+    return runVM(vm);
+}
 
+// ----------------------------------------------------------------------------  
+// Helper: a field of the executing method's receiver, or nullptr when not in a
+// method or the receiver has no such field. Unqualified names inside methods
+// resolve here before the global environment.
+// ----------------------------------------------------------------------------
+Value* selfField(VM& vm, SymbolId name) {
+    if (vm.frames.empty() || !vm.frames.back().function || !vm.frames.back().function->isMethod)
+        return nullptr;
+    const Value& self = vm.stack[vm.frames.back().slotBase];
+    if (!holds<Ref<ObjInstance>>(self))
+        return nullptr;
+    return asObj<ObjInstance>(self)->findField(name);
+}
 
 // ============================================================================  
 // Script callback invoker (used by trampoline)
 // ============================================================================
 void invokeScriptCallback(const Value& funcVal, const char* param) {
-    debugLog("invokeScriptCallback: Called with param: " + std::string(param ? param : "null"));
+    DEBUG_LOG("invokeScriptCallback: Called with param: " + std::string(param ? param : "null"));
     std::vector<Value> args;
     args.push_back(std::string(param));
     if (holds<BuiltinFn>(funcVal)) {
-        debugLog("invokeScriptCallback: Detected BuiltinFn.");
+        DEBUG_LOG("invokeScriptCallback: Detected BuiltinFn.");
         BuiltinFn fn = getVal<BuiltinFn>(funcVal);
         fn(args);
-        debugLog("invokeScriptCallback: BuiltinFn executed.");
-    } else if (holds<std::shared_ptr<ObjFunction>>(funcVal)) {
-        debugLog("invokeScriptCallback: Detected ObjFunction.");
-        std::shared_ptr<ObjFunction> fn = getVal<std::shared_ptr<ObjFunction>>(funcVal);
+        DEBUG_LOG("invokeScriptCallback: BuiltinFn executed.");
+    } else if (holds<Ref<ObjFunction>>(funcVal)) {
+        DEBUG_LOG("invokeScriptCallback: Detected ObjFunction.");
+        Ref<ObjFunction> fn = getVal<Ref<ObjFunction>>(funcVal);
         auto previousEnv = globalVM->environment;
-        globalVM->environment = std::make_shared<Environment>(globalVM->globals);
-        for (size_t i = 0; i < fn->params.size(); i++) {
-            if (i < args.size())
-                globalVM->environment->define(fn->params[i].name, args[i]);
-            else
-                globalVM->environment->define(fn->params[i].name, fn->params[i].defaultValue);
-        }
-        Value result = runVM(*globalVM, fn->chunk);
-        debugLog("invokeScriptCallback: Function executed with result: " + valueToString(result));
+        globalVM->environment = globalVM->globals;
+        Value result = callScriptFunction(*globalVM, fn, args);
+        DEBUG_LOG("invokeScriptCallback: Function executed with result: " + valueToString(result));
         globalVM->environment = previousEnv;
     } else {
         runtimeError("invokeScriptCallback: Not a callable function.");
@@ -748,14 +1348,14 @@ void invokeScriptCallback(const Value& funcVal, const char* param) {
 // Script callback trampoline for AddressOf built-in.
 // This function is called by the ffi closure.
 void scriptCallbackTrampoline(ffi_cif* cif, void* ret, void** args, void* user_data) {
-    debugLog("scriptCallbackTrampoline: Entered.");
+    DEBUG_LOG("scriptCallbackTrampoline: Entered.");
     const char* param = *(const char**)args[0];
-    debugLog("scriptCallbackTrampoline: Parameter: " + std::string(param ? param : "null"));
+    DEBUG_LOG("scriptCallbackTrampoline: Parameter: " + std::string(param ? param : "null"));
     // user_data is a pointer to a Value that holds the script function.
     Value* funcPtr = (Value*)user_data;
-    debugLog("scriptCallbackTrampoline: Invoking script callback.");
+    DEBUG_LOG("scriptCallbackTrampoline: Invoking script callback.");
     invokeScriptCallback(*funcPtr, param);
-    debugLog("scriptCallbackTrampoline: Callback invocation complete.");
+    DEBUG_LOG("scriptCallbackTrampoline: Callback invocation complete.");
     return;
 }
 
@@ -768,7 +1368,7 @@ BuiltinFn addressOfBuiltin = [](const std::vector<Value>& args) -> Value {
     if (args.size() != 1)
         runtimeError("AddressOf expects exactly one argument.");
     debugLog("AddressOf: Argument type: " + getTypeName(args[0]));
-    if (!(holds<std::shared_ptr<ObjFunction>>(args[0]) || holds<BuiltinFn>(args[0])))
+    if (!(holds<Ref<ObjFunction>>(args[0]) || holds<BuiltinFn>(args[0])))
         runtimeError("AddressOf expects a function reference, not a function call result. Remove the parentheses.");
     // Allocate an ffi closure.
     ffi_closure* closure;
@@ -949,9 +1549,11 @@ struct FunctionStmt : Stmt {
     std::vector<Param> params;
     std::vector<std::shared_ptr<Stmt>> body;
     AccessModifier access;
+    std::string returnType; // empty for Sub
     FunctionStmt(const std::string& name, const std::vector<Param>& params,
-        const std::vector<std::shared_ptr<Stmt>>& body, AccessModifier access = AccessModifier::PUBLIC)
-        : name(name), params(params), body(body), access(access) { }
+        const std::vector<std::shared_ptr<Stmt>>& body, AccessModifier access = AccessModifier::PUBLIC,
+        const std::string& returnType = "")
+        : name(name), params(params), body(body), access(access), returnType(toLower(returnType)) { }
 };
 
 struct VarStmt : Stmt {
@@ -1019,12 +1621,41 @@ struct ForStmt : Stmt {
     std::shared_ptr<Expr> end;
     std::shared_ptr<Expr> step;
     std::vector<std::shared_ptr<Stmt>> body;
+    std::string varType;
+    bool isDown; // DownTo: loop while the counter is >= end
     ForStmt(const std::string& varName,
         std::shared_ptr<Expr> start,
         std::shared_ptr<Expr> end,
         std::shared_ptr<Expr> step,
-        const std::vector<std::shared_ptr<Stmt>>& body)
-        : varName(varName), start(start), end(end), step(step), body(body) { }
+        const std::vector<std::shared_ptr<Stmt>>& body,
+        const std::string& varType = "", bool isDown = false)
+        : varName(varName), start(start), end(end), step(step), body(body), varType(toLower(varType)), isDown(isDown) { }
+};
+
+struct SelectStmt : Stmt {
+    struct CaseItem {
+        std::shared_ptr<Expr> value;
+        std::shared_ptr<Expr> rangeEnd; // Case a To b; null for a single value
+    };
+    struct Clause {
+        bool isDefault = false;
+        std::vector<CaseItem> items;
+        std::vector<std::shared_ptr<Stmt>> statements;
+    };
+    std::shared_ptr<Expr> subject;
+    std::vector<Clause> clauses;
+    SelectStmt(std::shared_ptr<Expr> subject, const std::vector<Clause>& clauses)
+        : subject(subject), clauses(clauses) { }
+};
+
+struct ForEachStmt : Stmt {
+    std::string varName;
+    std::string varType;
+    std::shared_ptr<Expr> collection;
+    std::vector<std::shared_ptr<Stmt>> body;
+    ForEachStmt(const std::string& varName, const std::string& varType,
+        std::shared_ptr<Expr> collection, const std::vector<std::shared_ptr<Stmt>>& body)
+        : varName(varName), varType(toLower(varType)), collection(collection), body(body) { }
 };
 
 // Module AST node
@@ -1286,15 +1917,16 @@ private:
             } while (match({ XTokenType::COMMA }));
         }
         consume(XTokenType::RIGHT_PAREN, "Expect ')' after parameters.");
+        std::string returnType = "";
         if (match({ XTokenType::AS }))
-            consume(XTokenType::IDENTIFIER, "Expect return type after 'As'.");
+            returnType = consume(XTokenType::IDENTIFIER, "Expect return type after 'As'.").lexeme;
         std::vector<std::shared_ptr<Stmt>> body = block({ XTokenType::END });
         consume(XTokenType::END, "Expect 'End' after function body.");
         match({ XTokenType::FUNCTION, XTokenType::SUB });
         int req = 0;
         for (auto& p : parameters)
             if (!p.optional) req++;
-        return std::make_shared<FunctionStmt>(name.lexeme, parameters, body, access);
+        return std::make_shared<FunctionStmt>(name.lexeme, parameters, body, access, returnType);
     }
     std::shared_ptr<Stmt> classDeclaration() {
         Token name = consume(XTokenType::IDENTIFIER, "Expect class name.");
@@ -1318,7 +1950,7 @@ private:
                 else if (typeStr == "color")
                     defaultVal = Color{ 0 };
                 else if (typeStr == "array")
-                    defaultVal = Value(std::make_shared<ObjArray>());
+                    defaultVal = Value(makeRef<ObjArray>());
                 else
                     defaultVal = std::monostate{};
                 properties.push_back({ toLower(propName.lexeme), defaultVal });
@@ -1349,12 +1981,13 @@ private:
                     } while (match({ XTokenType::COMMA }));
                 }
                 consume(XTokenType::RIGHT_PAREN, "Expect ')' after parameters.");
+                std::string returnType = "";
                 if (match({ XTokenType::AS }))
-                    consume(XTokenType::IDENTIFIER, "Expect return type after 'As'.");
+                    returnType = consume(XTokenType::IDENTIFIER, "Expect return type after 'As'.").lexeme;
                 std::vector<std::shared_ptr<Stmt>> body = block({ XTokenType::END });
                 consume(XTokenType::END, "Expect 'End' after method body.");
                 match({ XTokenType::FUNCTION, XTokenType::SUB });
-                methods.push_back(std::make_shared<FunctionStmt>(methodName.lexeme, parameters, body));
+                methods.push_back(std::make_shared<FunctionStmt>(methodName.lexeme, parameters, body, AccessModifier::PUBLIC, returnType));
             }
             else {
                 advance();
@@ -1471,9 +2104,14 @@ private:
     } */
 
     std::shared_ptr<Stmt> forStatement() {
+        // "Each" and "In" are only keywords here, so they stay usable as names.
+        if (check(XTokenType::IDENTIFIER) && toLower(peek().lexeme) == "each" &&
+            static_cast<size_t>(current) + 1 < tokens.size() && tokens[current + 1].type == XTokenType::IDENTIFIER)
+            return forEachStatement();
         Token varName = consume(XTokenType::IDENTIFIER, "Expect loop variable name.");
+        std::string varType = "";
         if (match({ XTokenType::AS })) { 
-            consume(XTokenType::IDENTIFIER, "Expect type after 'As'.");
+            varType = consume(XTokenType::IDENTIFIER, "Expect type after 'As'.").lexeme;
         }
         consume(XTokenType::EQUAL, "Expect '=' after loop variable.");
         std::shared_ptr<Expr> startExpr = expression();
@@ -1498,30 +2136,23 @@ private:
         std::vector<std::shared_ptr<Stmt>> body = block({ XTokenType::NEXT });
         consume(XTokenType::NEXT, "Expect 'Next' after For loop body.");
         if (check(XTokenType::IDENTIFIER)) advance();
-    
-        // Create the initializer for the loop variable
-        std::shared_ptr<Stmt> initializer = std::make_shared<VarStmt>(varName.lexeme, startExpr);
-        std::shared_ptr<Expr> loopVar = std::make_shared<VariableExpr>(varName.lexeme);
-    
-        // Set loop condition: <= for upward, >= for downward
-        std::shared_ptr<Expr> condition;
-        if (isDown) {
-            condition = std::make_shared<BinaryExpr>(loopVar, BinaryOp::GE, endExpr);
-        } else {
-            condition = std::make_shared<BinaryExpr>(loopVar, BinaryOp::LE, endExpr);
-        }
-    
-        // Update the loop variable: always using addition (the step will be negative if downward)
-        std::shared_ptr<Expr> increment = std::make_shared<AssignmentExpr>(
-            varName.lexeme,
-            std::make_shared<BinaryExpr>(loopVar, BinaryOp::ADD, stepExpr)
-        );
-        body.push_back(std::make_shared<ExpressionStmt>(increment));
-    
-        std::vector<std::shared_ptr<Stmt>> forBlock = { initializer, std::make_shared<WhileStmt>(condition, body) };
-        return std::make_shared<BlockStmt>(forBlock);
+        return std::make_shared<ForStmt>(varName.lexeme, startExpr, endExpr, stepExpr, body, varType, isDown);
+    }
+    std::shared_ptr<Stmt> forEachStatement() {
+        advance(); // consume Each
+        Token varName = consume(XTokenType::IDENTIFIER, "Expect loop variable name after 'Each'.");
+        std::string varType = "";
+        if (match({ XTokenType::AS }))
+            varType = consume(XTokenType::IDENTIFIER, "Expect type after 'As'.").lexeme;
+        if (!check(XTokenType::IDENTIFIER) || toLower(peek().lexeme) != "in")
+            runtimeError("Expect 'In' after loop variable in For Each loop.");
+        advance();
+        std::shared_ptr<Expr> collection = expression();
+        std::vector<std::shared_ptr<Stmt>> body = block({ XTokenType::NEXT });
+        consume(XTokenType::NEXT, "Expect 'Next' after For Each loop body.");
+        if (check(XTokenType::IDENTIFIER)) advance();
+        return std::make_shared<ForEachStmt>(varName.lexeme, varType, collection, body);
     }
-    
 
     std::shared_ptr<Stmt> whileStatement() {
         std::shared_ptr<Expr> condition = expression();
@@ -1554,7 +2185,7 @@ private:
         return std::make_shared<ExpressionStmt>(expr);
     }
     std::shared_ptr<Expr> assignment() {
-        std::shared_ptr<Expr> expr = equality();
+        std::shared_ptr<Expr> expr = logicalOr();
         if (match({ XTokenType::EQUAL })) {
             Token equals = previous();
             std::shared_ptr<Expr> value = assignment();
@@ -1566,6 +2197,22 @@ private:
         return expr;
     }
     std::shared_ptr<Expr> expression() { return assignment(); }
+    std::shared_ptr<Expr> logicalOr() {
+        std::shared_ptr<Expr> expr = logicalAnd();
+        while (match({ XTokenType::OR })) {
+            std::shared_ptr<Expr> right = logicalAnd();
+            expr = std::make_shared<BinaryExpr>(expr, BinaryOp::OR, right);
+        }
+        return expr;
+    }
+    std::shared_ptr<Expr> logicalAnd() {
+        std::shared_ptr<Expr> expr = equality();
+        while (match({ XTokenType::AND })) {
+            std::shared_ptr<Expr> right = equality();
+            expr = std::make_shared<BinaryExpr>(expr, BinaryOp::AND, right);
+        }
+        return expr;
+    }
     std::shared_ptr<Expr> equality() {
         std::shared_ptr<Expr> expr = comparison();
         while (match({ XTokenType::EQUAL, XTokenType::NOT_EQUAL })) {
@@ -1711,98 +2358,473 @@ private:
     std::shared_ptr<Stmt> selectCaseStatement() {
         consume(XTokenType::CASE, "Expect 'Case' after 'Select' in Select Case statement.");
         std::shared_ptr<Expr> switchExpr = expression();
-        struct CaseClause {
-            bool isDefault = false;
-            std::shared_ptr<Expr> expr;
-            std::vector<std::shared_ptr<Stmt>> statements;
-        };
-        std::vector<CaseClause> clauses;
+        std::vector<SelectStmt::Clause> clauses;
         while (!check(XTokenType::END)) {
             consume(XTokenType::CASE, "Expect 'Case' at start of case clause.");
-            CaseClause clause;
+            SelectStmt::Clause clause;
             if (match({ XTokenType::ELSE })) {
                 clause.isDefault = true;
             }
             else {
-                clause.isDefault = false;
-                clause.expr = expression();
+                do {
+                    SelectStmt::CaseItem item;
+                    item.value = expression();
+                    if (match({ XTokenType::TO }))
+                        item.rangeEnd = expression();
+                    clause.items.push_back(item);
+                } while (match({ XTokenType::COMMA }));
             }
             clause.statements = block({ XTokenType::CASE, XTokenType::END });
             clauses.push_back(clause);
         }
         consume(XTokenType::END, "Expect 'End' after Select Case statement.");
         consume(XTokenType::SELECT, "Expect 'Select' after 'End' in Select Case statement.");
-        std::vector<std::shared_ptr<Stmt>> currentElse;
-        for (int i = clauses.size() - 1; i >= 0; i--) {
-            if (clauses[i].isDefault) {
-                currentElse = clauses[i].statements;
-            }
-            else {
-                auto condition = std::make_shared<BinaryExpr>(switchExpr, BinaryOp::EQ, clauses[i].expr);
-                auto ifStmt = std::make_shared<IfStmt>(condition, clauses[i].statements, currentElse);
-                currentElse.clear();
-                currentElse.push_back(ifStmt);
-            }
-        }
-        if (currentElse.empty()) {
-            return std::make_shared<BlockStmt>(std::vector<std::shared_ptr<Stmt>>{});
-        }
-        return currentElse[0];
+        return std::make_shared<SelectStmt>(switchExpr, clauses);
     }
     // ***** End of Select Case support *****
 };
 
 // ============================================================================  
-// Helpers for constant pool management
+// AST Optimizer (--O 1): folds constant expressions, inlines Const values,
+// prunes If/While branches with a constant condition and drops statements
+// after Return. Runs between Parser::parse and Compiler::compile.
 // ============================================================================
-int addConstant(ObjFunction::CodeChunk& chunk, const Value& v) {
-    chunk.constants.push_back(v);
-    return chunk.constants.size() - 1;
-}
-
-int addConstantString(ObjFunction::CodeChunk& chunk, const std::string& s) {
-    for (int i = 0; i < chunk.constants.size(); i++) {
-        if (holds<std::string>(chunk.constants[i])) {
-            if (getVal<std::string>(chunk.constants[i]) == s)
-                return i;
-        }
+class Optimizer {
+public:
+    std::vector<std::shared_ptr<Stmt>> optimize(const std::vector<std::shared_ptr<Stmt>>& statements) {
+        collectNames(statements);
+        scopes.emplace_back();
+        return optimizeBlock(statements);
     }
-    chunk.constants.push_back(s);
-    return chunk.constants.size() - 1;
-}
 
-// ============================================================================  
-// Built-in Array Methods
-// ============================================================================
-Value callArrayMethod(std::shared_ptr<ObjArray> array, const std::string& method, const std::vector<Value>& args) {
-    std::string m = toLower(method);
-    if (m == "add") {
-        if (args.size() != 1) runtimeError("Array.add expects 1 argument.");
-        array->elements.push_back(args[0]);
-        return Value(std::monostate{});
+private:
+    // Names declared as anything but a Const, and how often each Const name is
+    // declared. Only a Const whose name is declared exactly once and never
+    // rebound is inlined, so scoping rules never come into play.
+    std::unordered_map<std::string, bool> shadowed;
+    std::unordered_map<std::string, int> constDeclarations;
+    std::vector<std::unordered_map<std::string, Value>> scopes;
+    int moduleDepth = 0;
+
+    void shadow(const std::string& name) { shadowed[toLower(name)] = true; }
+
+    void collectNames(const std::vector<std::shared_ptr<Stmt>>& statements) {
+        for (auto& stmt : statements)
+            collectNames(stmt);
     }
-    else if (m == "indexof") {
-        if (args.size() != 1) runtimeError("Array.indexof expects 1 argument.");
-        for (size_t i = 0; i < array->elements.size(); i++) {
-            if (valueToString(array->elements[i]) == valueToString(args[0]))
-                return (int)i;
+    void collectNames(const std::shared_ptr<Stmt>& stmt) {
+        if (auto varStmt = std::dynamic_pointer_cast<VarStmt>(stmt)) {
+            if (varStmt->isConstant)
+                constDeclarations[toLower(varStmt->name)]++;
+            else
+                shadow(varStmt->name);
+            collectNames(varStmt->initializer);
+        }
+        else if (auto func = std::dynamic_pointer_cast<FunctionStmt>(stmt)) {
+            shadow(func->name);
+            for (auto& param : func->params)
+                shadow(param.name);
+            collectNames(func->body);
+        }
+        else if (auto cls = std::dynamic_pointer_cast<ClassStmt>(stmt)) {
+            shadow(cls->name);
+            for (auto& prop : cls->properties)
+                shadow(prop.first);
+            for (auto& method : cls->methods)
+                collectNames(std::static_pointer_cast<Stmt>(method));
+        }
+        else if (auto module = std::dynamic_pointer_cast<ModuleStmt>(stmt)) {
+            shadow(module->name);
+            collectNames(module->body);
+        }
+        else if (auto enumStmt = std::dynamic_pointer_cast<EnumStmt>(stmt))
+            shadow(enumStmt->name);
+        else if (auto declare = std::dynamic_pointer_cast<DeclareStmt>(stmt))
+            shadow(declare->apiName);
+        else if (auto assign = std::dynamic_pointer_cast<AssignmentStmt>(stmt)) {
+            shadow(assign->name);
+            collectNames(assign->value);
+        }
+        else if (auto exprStmt = std::dynamic_pointer_cast<ExpressionStmt>(stmt))
+            collectNames(exprStmt->expression);
+        else if (auto ret = std::dynamic_pointer_cast<ReturnStmt>(stmt))
+            collectNames(ret->value);
+        else if (auto propAssign = std::dynamic_pointer_cast<PropertyAssignmentStmt>(stmt)) {
+            collectNames(propAssign->object);
+            collectNames(propAssign->value);
+        }
+        else if (auto ifStmt = std::dynamic_pointer_cast<IfStmt>(stmt)) {
+            collectNames(ifStmt->condition);
+            collectNames(ifStmt->thenBranch);
+            collectNames(ifStmt->elseBranch);
+        }
+        else if (auto whileStmt = std::dynamic_pointer_cast<WhileStmt>(stmt)) {
+            collectNames(whileStmt->condition);
+            collectNames(whileStmt->body);
+        }
+        else if (auto block = std::dynamic_pointer_cast<BlockStmt>(stmt))
+            collectNames(block->statements);
+        else if (auto forStmt = std::dynamic_pointer_cast<ForStmt>(stmt)) {
+            shadow(forStmt->varName);
+            collectNames(forStmt->start);
+            collectNames(forStmt->end);
+            collectNames(forStmt->step);
+            collectNames(forStmt->body);
+        }
+        else if (auto forEach = std::dynamic_pointer_cast<ForEachStmt>(stmt)) {
+            shadow(forEach->varName);
+            collectNames(forEach->collection);
+            collectNames(forEach->body);
+        }
+        else if (auto select = std::dynamic_pointer_cast<SelectStmt>(stmt)) {
+            collectNames(select->subject);
+            for (auto& clause : select->clauses) {
+                for (auto& item : clause.items) {
+                    collectNames(item.value);
+                    collectNames(item.rangeEnd);
+                }
+                collectNames(clause.statements);
+            }
         }
-        return -1;
-    }
-    else if (m == "lastindex") {
-        return array->elements.empty() ? -1 : (int)(array->elements.size() - 1);
     }
-    else if (m == "count") {
-        return (int)array->elements.size();
+    // Assignment expressions can also rebind a name.
+    void collectNames(const std::shared_ptr<Expr>& expr) {
+        if (!expr)
+            return;
+        if (auto assign = std::dynamic_pointer_cast<AssignmentExpr>(expr)) {
+            shadow(assign->name);
+            collectNames(assign->value);
+        }
+        else if (auto un = std::dynamic_pointer_cast<UnaryExpr>(expr))
+            collectNames(un->right);
+        else if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr)) {
+            collectNames(bin->left);
+            collectNames(bin->right);
+        }
+        else if (auto group = std::dynamic_pointer_cast<GroupingExpr>(expr))
+            collectNames(group->expression);
+        else if (auto call = std::dynamic_pointer_cast<CallExpr>(expr)) {
+            collectNames(call->callee);
+            for (auto& arg : call->arguments)
+                collectNames(arg);
+        }
+        else if (auto arr = std::dynamic_pointer_cast<ArrayLiteralExpr>(expr)) {
+            for (auto& elem : arr->elements)
+                collectNames(elem);
+        }
+        else if (auto getProp = std::dynamic_pointer_cast<GetPropExpr>(expr))
+            collectNames(getProp->object);
+        else if (auto setProp = std::dynamic_pointer_cast<SetPropExpr>(expr)) {
+            collectNames(setProp->object);
+            collectNames(setProp->value);
+        }
+        else if (auto newExpr = std::dynamic_pointer_cast<NewExpr>(expr)) {
+            for (auto& arg : newExpr->arguments)
+                collectNames(arg);
+        }
     }
-    else if (m == "pop") {
-        if (array->elements.empty()) runtimeError("Array.pop called on empty array.");
-        Value last = array->elements.back();
-        array->elements.pop_back();
-        return last;
+
+    std::vector<std::shared_ptr<Stmt>> optimizeBlock(const std::vector<std::shared_ptr<Stmt>>& statements) {
+        std::vector<std::shared_ptr<Stmt>> out;
+        for (auto& stmt : statements) {
+            if (!optimizeStmt(stmt, out))
+                break; // the rest of the block is unreachable
+        }
+        return out;
     }
-    else if (m == "removeat") {
-        if (args.size() != 1) runtimeError("Array.removeat expects 1 argument.");
+
+    // Appends the optimized form of stmt to out (nothing, when it is pruned).
+    // Returns false once control can no longer fall through.
+    bool optimizeStmt(const std::shared_ptr<Stmt>& stmt, std::vector<std::shared_ptr<Stmt>>& out) {
+        if (auto ifStmt = std::dynamic_pointer_cast<IfStmt>(stmt)) {
+            ifStmt->condition = fold(ifStmt->condition);
+            if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(ifStmt->condition)) {
+                for (auto& s : isTruthy(lit->value) ? ifStmt->thenBranch : ifStmt->elseBranch) {
+                    if (!optimizeStmt(s, out))
+                        return false;
+                }
+                return true;
+            }
+            ifStmt->thenBranch = optimizeBlock(ifStmt->thenBranch);
+            ifStmt->elseBranch = optimizeBlock(ifStmt->elseBranch);
+        }
+        else if (auto whileStmt = std::dynamic_pointer_cast<WhileStmt>(stmt)) {
+            whileStmt->condition = fold(whileStmt->condition);
+            auto lit = std::dynamic_pointer_cast<LiteralExpr>(whileStmt->condition);
+            if (lit && !isTruthy(lit->value))
+                return true;
+            whileStmt->body = optimizeBlock(whileStmt->body);
+        }
+        else if (auto varStmt = std::dynamic_pointer_cast<VarStmt>(stmt)) {
+            if (varStmt->initializer)
+                varStmt->initializer = fold(varStmt->initializer);
+            std::string name = toLower(varStmt->name);
+            auto lit = std::dynamic_pointer_cast<LiteralExpr>(varStmt->initializer);
+            if (varStmt->isConstant && lit && moduleDepth == 0 &&
+                constDeclarations[name] == 1 && !shadowed.count(name))
+                scopes.back()[name] = lit->value;
+        }
+        else if (auto func = std::dynamic_pointer_cast<FunctionStmt>(stmt)) {
+            optimizeFunction(func);
+        }
+        else if (auto cls = std::dynamic_pointer_cast<ClassStmt>(stmt)) {
+            for (auto& method : cls->methods)
+                optimizeFunction(method);
+        }
+        else if (auto module = std::dynamic_pointer_cast<ModuleStmt>(stmt)) {
+            moduleDepth++;
+            module->body = optimizeBlock(module->body);
+            moduleDepth--;
+        }
+        else if (auto ret = std::dynamic_pointer_cast<ReturnStmt>(stmt)) {
+            if (ret->value)
+                ret->value = fold(ret->value);
+            out.push_back(stmt);
+            return false;
+        }
+        else if (auto exprStmt = std::dynamic_pointer_cast<ExpressionStmt>(stmt))
+            exprStmt->expression = fold(exprStmt->expression);
+        else if (auto assign = std::dynamic_pointer_cast<AssignmentStmt>(stmt))
+            assign->value = fold(assign->value);
+        else if (auto propAssign = std::dynamic_pointer_cast<PropertyAssignmentStmt>(stmt)) {
+            propAssign->object = fold(propAssign->object);
+            propAssign->value = fold(propAssign->value);
+        }
+        else if (auto block = std::dynamic_pointer_cast<BlockStmt>(stmt))
+            block->statements = optimizeBlock(block->statements);
+        else if (auto forStmt = std::dynamic_pointer_cast<ForStmt>(stmt)) {
+            forStmt->start = fold(forStmt->start);
+            forStmt->end = fold(forStmt->end);
+            forStmt->step = fold(forStmt->step);
+            forStmt->body = optimizeBlock(forStmt->body);
+        }
+        else if (auto forEach = std::dynamic_pointer_cast<ForEachStmt>(stmt)) {
+            forEach->collection = fold(forEach->collection);
+            forEach->body = optimizeBlock(forEach->body);
+        }
+        else if (auto select = std::dynamic_pointer_cast<SelectStmt>(stmt)) {
+            select->subject = fold(select->subject);
+            for (auto& clause : select->clauses) {
+                for (auto& item : clause.items) {
+                    item.value = fold(item.value);
+                    if (item.rangeEnd)
+                        item.rangeEnd = fold(item.rangeEnd);
+                }
+                clause.statements = optimizeBlock(clause.statements);
+            }
+        }
+        out.push_back(stmt);
+        return true;
+    }
+
+    void optimizeFunction(const std::shared_ptr<FunctionStmt>& func) {
+        scopes.emplace_back();
+        func->body = optimizeBlock(func->body);
+        scopes.pop_back();
+    }
+
+    const Value* lookupConst(const std::string& name) {
+        std::string key = toLower(name);
+        for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+            auto found = it->find(key);
+            if (found != it->end())
+                return &found->second;
+        }
+        return nullptr;
+    }
+
+    static std::shared_ptr<Expr> literal(const Value& v) { return std::make_shared<LiteralExpr>(v); }
+
+    // Evaluates op over two literals exactly as the VM would, or returns false
+    // when the VM would raise an error (which is left to happen at run time).
+    static bool evalBinary(BinaryOp op, const Value& a, const Value& b, Value& out) {
+        bool ints = a.type == ValueType::Int && b.type == ValueType::Int;
+        bool nums = (a.type == ValueType::Int || a.type == ValueType::Double) &&
+                    (b.type == ValueType::Int || b.type == ValueType::Double);
+        bool strings = a.type == ValueType::String && b.type == ValueType::String;
+        double ad = a.type == ValueType::Double ? a.as.d : a.as.i;
+        double bd = b.type == ValueType::Double ? b.as.d : b.as.i;
+        // Integer ops wrap like the VM's 32-bit arithmetic.
+        uint32_t ua = static_cast<uint32_t>(a.as.i), ub = static_cast<uint32_t>(b.as.i);
+        switch (op) {
+        case BinaryOp::ADD:
+            if (strings) { out = Value(getVal<std::string>(a) + getVal<std::string>(b)); return true; }
+            if (ints) { out = Value(static_cast<int>(ua + ub)); return true; }
+            if (nums) { out = Value(ad + bd); return true; }
+            return false;
+        case BinaryOp::SUB:
+            if (ints) { out = Value(static_cast<int>(ua - ub)); return true; }
+            if (nums) { out = Value(ad - bd); return true; }
+            return false;
+        case BinaryOp::MUL:
+            if (ints) { out = Value(static_cast<int>(ua * ub)); return true; }
+            if (nums) { out = Value(ad * bd); return true; }
+            return false;
+        case BinaryOp::DIV:
+            if (nums) { out = Value(ad / bd); return true; }
+            return false;
+        case BinaryOp::POW:
+            if (nums) { out = Value(std::pow(ad, bd)); return true; }
+            return false;
+        case BinaryOp::MOD:
+            if (ints && b.as.i != 0 && !(a.as.i == INT_MIN && b.as.i == -1)) { out = Value(a.as.i % b.as.i); return true; }
+            if (nums && !ints) { out = Value(std::fmod(ad, bd)); return true; }
+            return false;
+        case BinaryOp::LT: if (!nums) return false; out = Value(ints ? a.as.i < b.as.i : ad < bd); return true;
+        case BinaryOp::LE: if (!nums) return false; out = Value(ints ? a.as.i <= b.as.i : ad <= bd); return true;
+        case BinaryOp::GT: if (!nums) return false; out = Value(ints ? a.as.i > b.as.i : ad > bd); return true;
+        case BinaryOp::GE: if (!nums) return false; out = Value(ints ? a.as.i >= b.as.i : ad >= bd); return true;
+        case BinaryOp::EQ:
+        case BinaryOp::NE: {
+            bool equal;
+            if (nums)
+                equal = ints ? a.as.i == b.as.i : ad == bd;
+            else if (strings)
+                equal = getVal<std::string>(a) == getVal<std::string>(b);
+            else if (a.type == ValueType::Bool && b.type == ValueType::Bool)
+                equal = a.as.b == b.as.b;
+            else
+                return false;
+            out = Value(op == BinaryOp::EQ ? equal : !equal);
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    std::shared_ptr<Expr> fold(const std::shared_ptr<Expr>& expr) {
+        if (auto var = std::dynamic_pointer_cast<VariableExpr>(expr)) {
+            if (const Value* v = lookupConst(var->name))
+                return literal(*v);
+            return expr;
+        }
+        if (auto group = std::dynamic_pointer_cast<GroupingExpr>(expr)) {
+            group->expression = fold(group->expression);
+            if (std::dynamic_pointer_cast<LiteralExpr>(group->expression))
+                return group->expression;
+            return expr;
+        }
+        if (auto un = std::dynamic_pointer_cast<UnaryExpr>(expr)) {
+            un->right = fold(un->right);
+            auto lit = std::dynamic_pointer_cast<LiteralExpr>(un->right);
+            if (!lit)
+                return expr;
+            if (toLower(un->op) == "not")
+                return literal(Value(!isTruthy(lit->value)));
+            if (un->op == "-" && lit->value.type == ValueType::Int)
+                return literal(Value(static_cast<int>(0u - static_cast<uint32_t>(lit->value.as.i))));
+            if (un->op == "-" && lit->value.type == ValueType::Double)
+                return literal(Value(-lit->value.as.d));
+            return expr;
+        }
+        if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr)) {
+            bin->left = fold(bin->left);
+            bin->right = fold(bin->right);
+            auto l = std::dynamic_pointer_cast<LiteralExpr>(bin->left);
+            auto r = std::dynamic_pointer_cast<LiteralExpr>(bin->right);
+            if (bin->op == BinaryOp::AND || bin->op == BinaryOp::OR) {
+                // A deciding left operand skips the right one, as at run time.
+                if (l && isTruthy(l->value) == (bin->op == BinaryOp::OR))
+                    return literal(Value(bin->op == BinaryOp::OR));
+                if (l && r)
+                    return literal(Value(isTruthy(r->value)));
+                return expr;
+            }
+            Value result;
+            if (l && r && evalBinary(bin->op, l->value, r->value, result))
+                return literal(result);
+            return expr;
+        }
+        if (auto assign = std::dynamic_pointer_cast<AssignmentExpr>(expr)) {
+            assign->value = fold(assign->value);
+            return expr;
+        }
+        if (auto call = std::dynamic_pointer_cast<CallExpr>(expr)) {
+            if (!std::dynamic_pointer_cast<VariableExpr>(call->callee))
+                call->callee = fold(call->callee);
+            for (auto& arg : call->arguments)
+                arg = fold(arg);
+            return expr;
+        }
+        if (auto arr = std::dynamic_pointer_cast<ArrayLiteralExpr>(expr)) {
+            for (auto& elem : arr->elements)
+                elem = fold(elem);
+            return expr;
+        }
+        if (auto getProp = std::dynamic_pointer_cast<GetPropExpr>(expr)) {
+            getProp->object = fold(getProp->object);
+            return expr;
+        }
+        if (auto setProp = std::dynamic_pointer_cast<SetPropExpr>(expr)) {
+            setProp->object = fold(setProp->object);
+            setProp->value = fold(setProp->value);
+            return expr;
+        }
+        if (auto newExpr = std::dynamic_pointer_cast<NewExpr>(expr)) {
+            for (auto& arg : newExpr->arguments)
+                arg = fold(arg);
+            return expr;
+        }
+        return expr;
+    }
+};
+
+// ============================================================================  
+// Helpers for constant pool management
+// ============================================================================
+int addConstant(ObjFunction::CodeChunk& chunk, const Value& v) {
+    chunk.constants.push_back(v);
+    return chunk.constants.size() - 1;
+}
+
+int addInlineCache(ObjFunction::CodeChunk& chunk) {
+    chunk.caches.emplace_back();
+    return chunk.caches.size() - 1;
+}
+
+int addConstantString(ObjFunction::CodeChunk& chunk, const std::string& s) {
+    for (int i = 0; i < chunk.constants.size(); i++) {
+        if (holds<std::string>(chunk.constants[i])) {
+            if (getVal<std::string>(chunk.constants[i]) == s)
+                return i;
+        }
+    }
+    chunk.constants.push_back(s);
+    return chunk.constants.size() - 1;
+}
+
+// ============================================================================  
+// Built-in Array Methods
+// ============================================================================
+Value callArrayMethod(Ref<ObjArray> array, SymbolId method, const std::vector<Value>& args) {
+    if (method == SYM_ADD) {
+        if (args.size() != 1) runtimeError("Array.add expects 1 argument.");
+        array->elements.push_back(args[0]);
+        return Value(std::monostate{});
+    }
+    else if (method == SYM_INDEXOF) {
+        if (args.size() != 1) runtimeError("Array.indexof expects 1 argument.");
+        for (size_t i = 0; i < array->elements.size(); i++) {
+            if (valueToString(array->elements[i]) == valueToString(args[0]))
+                return (int)i;
+        }
+        return -1;
+    }
+    else if (method == SYM_LASTINDEX) {
+        return array->elements.empty() ? -1 : (int)(array->elements.size() - 1);
+    }
+    else if (method == SYM_COUNT) {
+        return (int)array->elements.size();
+    }
+    else if (method == SYM_POP) {
+        if (array->elements.empty()) runtimeError("Array.pop called on empty array.");
+        Value last = array->elements.back();
+        array->elements.pop_back();
+        return last;
+    }
+    else if (method == SYM_REMOVEAT) {
+        if (args.size() != 1) runtimeError("Array.removeat expects 1 argument.");
         int index = 0;
         if (holds<int>(args[0]))
             index = getVal<int>(args[0]);
@@ -1812,12 +2834,12 @@ Value callArrayMethod(std::shared_ptr<ObjArray> array, const std::string& method
         array->elements.erase(array->elements.begin() + index);
         return Value(std::monostate{});
     }
-    else if (m == "removeall") {
+    else if (method == SYM_REMOVEALL) {
         array->elements.clear();
         return Value(std::monostate{});
     }
     else {
-        runtimeError("Unknown array method: " + method);
+        runtimeError("Unknown array method: " + symbolName(method));
     }
     return Value(std::monostate{});
 }
@@ -1922,11 +2944,16 @@ BuiltinFn wrapPluginFunction(void* funcPtr, int arity, const char** paramTypes,
         std::cerr << "ffi_prep_cif failed for plugin function." << std::endl;
         exit(1);
     }
-    return [funcPtr, cif, arity, argTypes, paramTypes, retType, retTypeString](const std::vector<Value>& args) -> Value {
-        debugLog("PluginFunction: Calling plugin function with " + std::to_string(args.size()) + " arguments.");
-        for (size_t i = 0; i < args.size(); i++) {
-            debugLog("Arg[" + std::to_string(i) + "] type: " + getTypeName(args[i]) +
-                     " value: " + valueToString(args[i]));
+    std::vector<std::string> paramTypeNames;
+    for (int i = 0; i < arity; i++)
+        paramTypeNames.push_back(toLower(std::string(paramTypes[i] ? paramTypes[i] : "")));
+    return [funcPtr, cif, arity, argTypes, paramTypeNames, retType, retTypeString](const std::vector<Value>& args) -> Value {
+        if (DEBUG_MODE) {
+            debugLog("PluginFunction: Calling plugin function with " + std::to_string(args.size()) + " arguments.");
+            for (size_t i = 0; i < args.size(); i++) {
+                debugLog("Arg[" + std::to_string(i) + "] type: " + getTypeName(args[i]) +
+                         " value: " + valueToString(args[i]));
+            }
         }
         if ((int)args.size() != arity)
             runtimeError("Plugin function expects " + std::to_string(arity) + " arguments.");
@@ -1939,7 +2966,7 @@ BuiltinFn wrapPluginFunction(void* funcPtr, int arity, const char** paramTypes,
         Value* variantStorage[10] = {nullptr};
         void* pointerStorage[10] = {nullptr};
         for (int i = 0; i < arity; i++) {
-            std::string pType = toLower(std::string(paramTypes[i] ? paramTypes[i] : ""));
+            const std::string& pType = paramTypeNames[i];
             if (pType == "string") {
                 if (!holds<std::string>(args[i])) runtimeError("Plugin expects a string argument.");
                 std::string s = getVal<std::string>(args[i]);
@@ -1976,9 +3003,11 @@ BuiltinFn wrapPluginFunction(void* funcPtr, int arity, const char** paramTypes,
                 argValues[i] = &variantStorage[i];
             }
             else if (pType == "array") {
-                if (!holds<std::shared_ptr<ObjArray>>(args[i])) runtimeError("Plugin expects an array argument.");
-                auto arr = getVal<std::shared_ptr<ObjArray>>(args[i]);
-                pointerStorage[i] = static_cast<void*>(arr.get());
+                // Plugins see the element vector, never the ObjArray and its
+                // object header, so they neither depend on nor touch its refcount.
+                if (!holds<Ref<ObjArray>>(args[i])) runtimeError("Plugin expects an array argument.");
+                auto arr = getVal<Ref<ObjArray>>(args[i]);
+                pointerStorage[i] = static_cast<void*>(&arr->elements);
                 argValues[i] = &pointerStorage[i];
             }
             else if (pType == "pointer" || pType == "ptr") {
@@ -1990,7 +3019,7 @@ BuiltinFn wrapPluginFunction(void* funcPtr, int arity, const char** paramTypes,
                 runtimeError("Unsupported plugin parameter type: " + pType);
             }
         }
-        debugLog("PluginFunction: About to call ffi_call.");
+        DEBUG_LOG("PluginFunction: About to call ffi_call.");
         union {
             int i;
             double d;
@@ -2000,13 +3029,15 @@ BuiltinFn wrapPluginFunction(void* funcPtr, int arity, const char** paramTypes,
             Value* variant;
             void* p; // Pointer return storage
         } resultStorage;
-        std::ostringstream oss;
-        oss << "Result Storage Function Pointer: " << reinterpret_cast<void*>(&resultStorage);
-        debugLog(oss.str());
+        if (DEBUG_MODE) {
+            std::ostringstream oss;
+            oss << "Result Storage Function Pointer: " << reinterpret_cast<void*>(&resultStorage);
+            debugLog(oss.str());
+        }
         ffi_call(cif, FFI_FN(funcPtr), &resultStorage, argValues);
-        debugLog("PluginFunction: ffi_call returned; result type: " + retTypeString);
+        DEBUG_LOG("PluginFunction: ffi_call returned; result type: " + retTypeString);
         for (int i = 0; i < arity; i++) {
-            std::string pType = toLower(std::string(paramTypes[i] ? paramTypes[i] : ""));
+            const std::string& pType = paramTypeNames[i];
             if (pType == "string") {
                 free((void*)stringStorage[i]);
             }
@@ -2016,48 +3047,51 @@ BuiltinFn wrapPluginFunction(void* funcPtr, int arity, const char** paramTypes,
         }
         delete[] argValues;
         if (retTypeString == "string") {
-            debugLog("PluginFunction: Returning value: " + valueToString(Value(std::string(resultStorage.s ? resultStorage.s : ""))));
+            DEBUG_LOG("PluginFunction: Returning value: " + valueToString(Value(std::string(resultStorage.s ? resultStorage.s : ""))));
             return Value(std::string(resultStorage.s ? resultStorage.s : ""));
         }
         else if (retTypeString == "double") {
-            debugLog("PluginFunction: Returning value: " + valueToString(Value(resultStorage.d)));
+            DEBUG_LOG("PluginFunction: Returning value: " + valueToString(Value(resultStorage.d)));
             return Value(resultStorage.d);
         }
         else if (retTypeString == "integer") {
-            debugLog("PluginFunction: Returning value: " + valueToString(Value(resultStorage.i)));
+            DEBUG_LOG("PluginFunction: Returning value: " + valueToString(Value(resultStorage.i)));
             return Value(resultStorage.i);
         }
         else if (retTypeString == "boolean") {
-            debugLog("PluginFunction: Returning value: " + valueToString(Value(resultStorage.b)));
+            DEBUG_LOG("PluginFunction: Returning value: " + valueToString(Value(resultStorage.b)));
             return Value(resultStorage.b);
         }
         else if (retTypeString == "color") {
-            debugLog("PluginFunction: Returning value: " + valueToString(Value(Color{ resultStorage.ui })));
+            DEBUG_LOG("PluginFunction: Returning value: " + valueToString(Value(Color{ resultStorage.ui })));
             return Value(Color{ resultStorage.ui });
         }
         else if (retTypeString == "variant") {
-            debugLog("Setting Variant pointer...");
+            DEBUG_LOG("Setting Variant pointer...");
             if (resultStorage.variant) {
                 Value retVal = *(resultStorage.variant);
                 delete resultStorage.variant;
                 return retVal;
             }
             else {
-                debugLog("PluginFunction: Returning nil variant.");
+                DEBUG_LOG("PluginFunction: Returning nil variant.");
                 return Value(std::monostate{});
             }
         }
         else if (retTypeString == "array") {
-            ObjArray* arrPtr = static_cast<ObjArray*>(resultStorage.p);
-            if (arrPtr) {
-                auto sharedArr = std::shared_ptr<ObjArray>(arrPtr, [](ObjArray*){});
-                return Value(sharedArr);
+            // The plugin keeps ownership of the vector it returns; the script
+            // gets a copy of its elements in an array of its own.
+            auto elements = static_cast<const std::vector<Value>*>(resultStorage.p);
+            if (elements) {
+                auto arr = makeRef<ObjArray>();
+                arr->elements = *elements;
+                return Value(arr);
             } else {
                 return Value(std::monostate{});
             }
         }
         else if (retTypeString == "pointer" || retTypeString == "ptr") {
-            debugLog("PluginFunction: Returning pointer value: " + valueToString(Value(resultStorage.p)));
+            DEBUG_LOG("PluginFunction: Returning pointer value: " + valueToString(Value(resultStorage.p)));
             return Value(resultStorage.p);
         }
         else {
@@ -2099,6 +3133,13 @@ BuiltinFn wrapPluginFunctionForDeclare(const std::vector<Param>& params, const s
     return wrapPluginFunction(funcPtr, arity, pTypes, retType.c_str());
 }
 
+// The built-in a Declare statement binds its name to.
+Value declaredFunction(const DeclareSignature& signature) {
+    Value fn(wrapPluginFunctionForDeclare(signature.params, signature.returnType, signature.apiName, signature.libraryName));
+    static_cast<ObjBuiltin*>(fn.as.obj)->declare = std::make_shared<DeclareSignature>(signature);
+    return fn;
+}
+
 // loadPlugins: Loads plugin libraries from the "libs" folder (located beside the executable)
 // using cross-platform directory listing and libffi for function wrapping.
 void loadPlugins(VM& vm) {
@@ -2153,7 +3194,7 @@ void loadPlugins(VM& vm) {
                     GetClassDefinitionFunc getClassDef = (GetClassDefinitionFunc)GetProcAddress(hModule, "GetClassDefinition");
                     if (getClassDef) {
                         ClassDefinition* classDef = getClassDef();
-                        auto pluginClass = std::make_shared<ObjClass>();
+                        auto pluginClass = makeRef<ObjClass>();
                         pluginClass->name = toLower(classDef->className);
                         pluginClass->isPlugin = true;
                         pluginClass->pluginConstructor = wrapPluginFunction(classDef->constructor, 0, nullptr, "pointer");
@@ -2163,13 +3204,12 @@ void loadPlugins(VM& vm) {
                             BuiltinFn getterFn = wrapPluginFunction(prop.getter, 1, getterParams, prop.type);
                             const char* setterParams[2] = { "pointer", prop.type };
                             BuiltinFn setterFn = wrapPluginFunction(prop.setter, 2, setterParams, "void");
-                            pluginClass->pluginProperties[toLower(prop.name)] = std::make_pair(getterFn, setterFn);
+                            pluginClass->pluginProperties[intern(prop.name)] = std::make_pair(getterFn, setterFn);
                         }
                         for (size_t i = 0; i < classDef->methodsCount; i++) {
                             ClassEntry& entry = classDef->methods[i];
                             BuiltinFn methodFn = wrapPluginFunction(entry.funcPtr, entry.arity, entry.paramTypes, entry.retType);
-                            std::string methodName = toLower(entry.name);
-                            pluginClass->methods[methodName] = methodFn;
+                            pluginClass->methods[intern(entry.name)] = methodFn;
                         }
                         vm.environment->define(toLower(pluginClass->name), Value(pluginClass));
                         debugLog("Loaded plugin class: " + pluginClass->name + " from " + dllPath);
@@ -2224,7 +3264,7 @@ void loadPlugins(VM& vm) {
                     GetClassDefinitionFunc getClassDef = (GetClassDefinitionFunc)dlsym(libHandle, "GetClassDefinition");
                     if (getClassDef) {
                         ClassDefinition* classDef = getClassDef();
-                        auto pluginClass = std::make_shared<ObjClass>();
+                        auto pluginClass = makeRef<ObjClass>();
                         pluginClass->name = toLower(classDef->className);
                         pluginClass->isPlugin = true;
                         pluginClass->pluginConstructor = wrapPluginFunction(classDef->constructor, 0, nullptr, "pointer");
@@ -2234,13 +3274,12 @@ void loadPlugins(VM& vm) {
                             BuiltinFn getterFn = wrapPluginFunction(prop.getter, 1, getterParams, prop.type);
                             const char* setterParams[2] = { "pointer", prop.type };
                             BuiltinFn setterFn = wrapPluginFunction(prop.setter, 2, setterParams, "void");
-                            pluginClass->pluginProperties[toLower(prop.name)] = std::make_pair(getterFn, setterFn);
+                            pluginClass->pluginProperties[intern(prop.name)] = std::make_pair(getterFn, setterFn);
                         }
                         for (size_t i = 0; i < classDef->methodsCount; i++) {
                             ClassEntry& entry = classDef->methods[i];
                             BuiltinFn methodFn = wrapPluginFunction(entry.funcPtr, entry.arity, entry.paramTypes, entry.retType);
-                            std::string methodName = toLower(entry.name);
-                            pluginClass->methods[methodName] = methodFn;
+                            pluginClass->methods[intern(entry.name)] = methodFn;
                         }
                         vm.environment->define(toLower(pluginClass->name), Value(pluginClass));
                         debugLog("Loaded plugin class: " + pluginClass->name + " from " + fullPath);
@@ -2262,180 +3301,1491 @@ void loadPlugins(VM& vm) {
 // ============================================================================  
 // Compiler
 // ============================================================================
-class Compiler {
-public:
-    Compiler(VM& virtualMachine) : vm(virtualMachine), compilingModule(false) {}
-    void compile(const std::vector<std::shared_ptr<Stmt>>& stmts) {
-        for (auto stmt : stmts) {
-            compileStmt(stmt, vm.mainChunk);
-            debugLog("Compiler: Compiled a statement. Main chunk now has " +
-                std::to_string(vm.mainChunk.code.size()) + " instructions.");
-        }
+// Static types the compiler can prove from As declarations and literals.
+// Unknown covers Variant and anything unproven; those sites stay generic.
+enum class StaticType { Unknown, Integer, Double, String, Boolean };
+
+StaticType staticTypeFromName(const std::string& typeName) {
+    if (typeName == "integer") return StaticType::Integer;
+    if (typeName == "double") return StaticType::Double;
+    if (typeName == "string") return StaticType::String;
+    if (typeName == "boolean") return StaticType::Boolean;
+    return StaticType::Unknown;
+}
+
+StaticType staticTypeOf(const Value& v) {
+    switch (v.type) {
+    case ValueType::Int:    return StaticType::Integer;
+    case ValueType::Double: return StaticType::Double;
+    case ValueType::String: return StaticType::String;
+    case ValueType::Bool:   return StaticType::Boolean;
+    default:                return StaticType::Unknown;
     }
-private:
-    VM& vm;
-    bool compilingModule; // Flag indicating if compiling a module
-    std::string currentModuleName; // Current module name
-    std::unordered_map<std::string, Value> currentModulePublicMembers;  // Public members of current module
+}
 
-    void emit(ObjFunction::CodeChunk& chunk, int byte) {
-        chunk.code.push_back(byte);
+bool isNumeric(StaticType t) {
+    return t == StaticType::Integer || t == StaticType::Double;
+}
+
+// ============================================================================  
+// Peephole Optimizer: runs over each finished chunk. It threads jumps through
+// jump chains, removes unreachable code, turns stores to locals that are never
+// read into pops, deletes push/pop pairs and then compacts the code, fixing up
+// every jump target.
+// ============================================================================
+int operandCount(int opcode) {
+    switch (opcode) {
+    case OP_CONSTANT: case OP_DEFINE_GLOBAL: case OP_GET_GLOBAL: case OP_SET_GLOBAL:
+    case OP_CALL: case OP_OPTIONAL_CALL: case OP_TAIL_CALL: case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE: case OP_JUMP: case OP_CLASS: case OP_METHOD: case OP_ARRAY:
+    case OP_PROPERTIES: case OP_GET_LOCAL: case OP_SET_LOCAL: case OP_JUMP_TABLE:
+    case OP_SWITCH_HASH: case OP_JUMP_IF_NOT_LT: case OP_JUMP_IF_NOT_LE:
+    case OP_JUMP_IF_NOT_GT: case OP_JUMP_IF_NOT_GE: case OP_JUMP_IF_NOT_EQ:
+    case OP_JUMP_IF_NOT_NE:
+        return 1;
+    case OP_GET_PROPERTY: case OP_SET_PROPERTY: case OP_INC_LOCAL: case OP_ADD_LOCAL_CONST:
+    case OP_SUB_LOCAL_CONST: case OP_GET_SELF_FIELD: case OP_SET_SELF_FIELD:
+        return 2;
+    case OP_INVOKE: case OP_TAIL_INVOKE: case OP_FOR_EACH:
+        return 3;
+    case OP_JUMP_IF_NOT_LOCAL_CONST: case OP_JUMP_IF_NOT_LOCALS:
+        return 4;
+    case OP_FOR_LOOP: case OP_FOR_LOOP_GLOBAL:
+        return 5;
+    default:
+        return 0;
     }
-    void emitWithOperand(ObjFunction::CodeChunk& chunk, int opcode, int operand) {
-        emit(chunk, opcode);
-        emit(chunk, operand);
+}
+
+// Position of the operand holding a jump target, relative to the opcode, or 0.
+int jumpOperand(int opcode) {
+    switch (opcode) {
+    case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_NOT_LT: case OP_JUMP_IF_NOT_LE: case OP_JUMP_IF_NOT_GT:
+    case OP_JUMP_IF_NOT_GE: case OP_JUMP_IF_NOT_EQ: case OP_JUMP_IF_NOT_NE:
+        return 1;
+    case OP_FOR_EACH:
+        return 3; // exit target
+    case OP_JUMP_IF_NOT_LOCAL_CONST: case OP_JUMP_IF_NOT_LOCALS:
+        return 4; // after the comparison and its two operands
+    case OP_FOR_LOOP: case OP_FOR_LOOP_GLOBAL:
+        return 5; // body start
+    default:
+        return 0;
     }
-    void compileStmt(std::shared_ptr<Stmt> stmt, ObjFunction::CodeChunk& chunk) {
-        if (auto modStmt = std::dynamic_pointer_cast<ModuleStmt>(stmt)) {
-            auto previousEnv = vm.environment;
-            auto moduleEnv = std::make_shared<Environment>(previousEnv);
-            vm.environment = moduleEnv;
-            bool oldCompilingModule = compilingModule;
-            compilingModule = true;
-            currentModuleName = toLower(modStmt->name);
-            currentModulePublicMembers.clear();
-            for (auto s : modStmt->body)
-                compileStmt(s, chunk);
-            auto moduleObj = std::make_shared<ObjModule>();
-            moduleObj->name = currentModuleName;
-            moduleObj->publicMembers = currentModulePublicMembers;
-            vm.environment = previousEnv;
-            compilingModule = oldCompilingModule;
-            vm.environment->define(toLower(currentModuleName), Value(moduleObj));
-            for (auto& entry : currentModulePublicMembers) {
-                vm.environment->define(entry.first, entry.second);
+}
+
+// Every code position a switch table can send control to.
+template <typename Fn>
+void forEachSwitchTarget(SwitchTable& table, Fn fn) {
+    for (int& t : table.targets) fn(t);
+    for (auto& entry : table.intTargets) fn(entry.second);
+    for (auto& entry : table.stringTargets) fn(entry.second);
+    fn(table.defaultTarget);
+}
+
+// Follows unconditional jumps from target to the first real instruction.
+int threadTarget(const std::vector<int>& code, int target) {
+    for (int hops = 0; hops < 16 && target < (int)code.size() && code[target] == OP_JUMP; hops++) {
+        if (code[target + 1] == target)
+            break; // a jump to itself
+        target = code[target + 1];
+    }
+    return target;
+}
+
+// Superinstructions replace the hottest sequences seen with --profile:
+//   GET_LOCAL a; CONSTANT k; ADD; SET_LOCAL a  -> INC_LOCAL a k
+//   GET_LOCAL a; CONSTANT k; ADD|SUB           -> ADD|SUB_LOCAL_CONST a k
+//   GET_LOCAL a; CONSTANT k; JUMP_IF_NOT_cc t  -> JUMP_IF_NOT_LOCAL_CONST cc a k t
+//   GET_LOCAL a; GET_LOCAL b; JUMP_IF_NOT_cc t -> JUMP_IF_NOT_LOCALS cc a b t
+// Only the first instruction of a sequence may be a jump target.
+bool isAddOp(int op) { return op == OP_ADD || op == OP_ADD_INT || op == OP_ADD_DOUBLE || op == OP_ADD_STRING; }
+bool isSubOp(int op) { return op == OP_SUB || op == OP_SUB_INT || op == OP_SUB_DOUBLE; }
+bool isFusedJump(int op) { return op >= OP_JUMP_IF_NOT_LT && op <= OP_JUMP_IF_NOT_NE; }
+
+void fuseSuperinstructions(const std::vector<int>& code, const std::vector<int>& starts, const std::vector<char>& isTarget,
+                           std::vector<char>& keep, std::vector<std::vector<int>>& rewrite) {
+    auto plain = [&](size_t i) {
+        return i < starts.size() && keep[i] && rewrite[i].empty() && !isTarget[starts[i]];
+    };
+    for (size_t i = 0; i + 2 < starts.size(); i++) {
+        if (!keep[i] || !rewrite[i].empty() || code[starts[i]] != OP_GET_LOCAL || !plain(i + 1) || !plain(i + 2))
+            continue;
+        const int* first = &code[starts[i]];
+        const int* second = &code[starts[i + 1]];
+        const int* third = &code[starts[i + 2]];
+        std::vector<int> fused;
+        size_t length = 3;
+        if (second[0] == OP_CONSTANT) {
+            if (isAddOp(third[0]) && plain(i + 3) && code[starts[i + 3]] == OP_SET_LOCAL && code[starts[i + 3] + 1] == first[1]) {
+                fused = { OP_INC_LOCAL, first[1], second[1] };
+                length = 4;
             }
-            return;
+            else if (isAddOp(third[0]))
+                fused = { OP_ADD_LOCAL_CONST, first[1], second[1] };
+            else if (isSubOp(third[0]))
+                fused = { OP_SUB_LOCAL_CONST, first[1], second[1] };
+            else if (isFusedJump(third[0]))
+                fused = { OP_JUMP_IF_NOT_LOCAL_CONST, third[0], first[1], second[1], third[1] };
+        }
+        else if (second[0] == OP_GET_LOCAL && isFusedJump(third[0]))
+            fused = { OP_JUMP_IF_NOT_LOCALS, third[0], first[1], second[1], third[1] };
+        if (fused.empty())
+            continue;
+        rewrite[i] = fused;
+        for (size_t k = 1; k < length; k++)
+            keep[i + k] = 0;
+        i += length - 1;
+    }
+}
+
+// One round of the pass; returns whether anything changed.
+bool peepholeRound(ObjFunction::CodeChunk& chunk, bool isMethod) {
+    std::vector<int>& code = chunk.code;
+    const int size = code.size();
+    std::vector<int> starts;
+    for (int pc = 0; pc < size; pc += 1 + operandCount(code[pc]))
+        starts.push_back(pc);
+    bool changed = false;
+
+    // Jump threading.
+    for (int pc : starts) {
+        if (int at = jumpOperand(code[pc])) {
+            int threaded = threadTarget(code, code[pc + at]);
+            changed = changed || threaded != code[pc + at];
+            code[pc + at] = threaded;
         }
-        else if (auto declStmt = std::dynamic_pointer_cast<DeclareStmt>(stmt)) {
-            compileDeclare(declStmt, chunk);
+    }
+    for (auto& table : chunk.switchTables)
+        forEachSwitchTarget(table, [&](int& t) { t = threadTarget(code, t); });
+
+    // Reachability from the entry point.
+    std::vector<char> live(size + 1, 0), isTarget(size + 1, 0);
+    std::vector<int> work = { 0 };
+    while (!work.empty()) {
+        int pc = work.back();
+        work.pop_back();
+        if (pc >= size || live[pc])
+            continue;
+        live[pc] = 1;
+        int op = code[pc];
+        if (int at = jumpOperand(op)) {
+            isTarget[code[pc + at]] = 1;
+            work.push_back(code[pc + at]);
+        }
+        if (op == OP_JUMP_TABLE || op == OP_SWITCH_HASH) {
+            forEachSwitchTarget(chunk.switchTables[code[pc + 1]], [&](int& t) {
+                isTarget[t] = 1;
+                work.push_back(t);
+            });
+            continue;
         }
-        else if (auto enumStmt = std::dynamic_pointer_cast<EnumStmt>(stmt)) {
-            auto enumObj = std::make_shared<ObjEnum>();
-            enumObj->name = toLower(enumStmt->name);
-            enumObj->members = enumStmt->members;
-            if (!compilingModule) {
-                int nameConst = addConstantString(chunk, toLower(enumStmt->name));
-                int enumConstant = addConstant(chunk, Value(enumObj));
-                emitWithOperand(chunk, OP_CONSTANT, enumConstant);
-                emitWithOperand(chunk, OP_DEFINE_GLOBAL, nameConst);
-            }
-            else {
-                currentModulePublicMembers[toLower(enumStmt->name)] = Value(enumObj);
-                vm.environment->define(toLower(enumStmt->name), Value(enumObj));
-            }
+        if (op != OP_JUMP && op != OP_RETURN)
+            work.push_back(pc + 1 + operandCount(op));
+    }
+
+    // Slots read anywhere in the chunk. Slot 0 of a method is self, which
+    // property access reads implicitly.
+    std::vector<char> slotRead(chunk.localCount + 1, 0);
+    if (isMethod)
+        slotRead[0] = 1;
+    auto markRead = [&](int slot) {
+        if (slot >= (int)slotRead.size())
+            slotRead.resize(slot + 1, 0);
+        slotRead[slot] = 1;
+    };
+    for (int pc : starts) {
+        switch (code[pc]) {
+        case OP_GET_LOCAL: markRead(code[pc + 1]); break;
+        case OP_FOR_LOOP:
+            markRead(code[pc + 1]);
+            // fall through
+        case OP_FOR_LOOP_GLOBAL:
+            markRead(code[pc + 2]);
+            markRead(code[pc + 3]);
+            break;
+        case OP_FOR_EACH:
+            markRead(code[pc + 1]);
+            markRead(code[pc + 2]);
+            break;
+        case OP_INC_LOCAL: case OP_ADD_LOCAL_CONST: case OP_SUB_LOCAL_CONST:
+            markRead(code[pc + 1]);
+            break;
+        case OP_JUMP_IF_NOT_LOCALS:
+            markRead(code[pc + 3]);
+            // fall through
+        case OP_JUMP_IF_NOT_LOCAL_CONST:
+            markRead(code[pc + 2]);
+            break;
+        default: break;
         }
-        else if (auto exprStmt = std::dynamic_pointer_cast<ExpressionStmt>(stmt)) {
-            compileExpr(exprStmt->expression, chunk);
-            emit(chunk, OP_POP);
+    }
+
+    // Mark removals. keep[i] is false for a deleted instruction; a non-empty
+    // rewrite[i] replaces the instruction's words.
+    std::vector<char> keep(starts.size(), 1);
+    std::vector<std::vector<int>> rewrite(starts.size());
+    auto toPop = [&](size_t i) { return rewrite[i].size() == 1 && rewrite[i][0] == OP_POP; };
+    for (size_t i = 0; i < starts.size(); i++) {
+        int pc = starts[i];
+        if (!live[pc]) {
+            keep[i] = 0;
+            continue;
+        }
+        if (code[pc] == OP_SET_LOCAL && code[pc + 1] < (int)slotRead.size() && !slotRead[code[pc + 1]])
+            rewrite[i] = { OP_POP };
+    }
+    for (size_t i = 0; i + 1 < starts.size(); i++) {
+        int pc = starts[i], next = starts[i + 1];
+        int op = code[pc];
+        bool pure = op == OP_CONSTANT || op == OP_NIL || op == OP_GET_LOCAL || op == OP_DUP;
+        bool nextPops = code[next] == OP_POP || toPop(i + 1);
+        if (keep[i] && rewrite[i].empty() && pure && keep[i + 1] && nextPops && !isTarget[next]) {
+            keep[i] = keep[i + 1] = 0;
+            i++;
         }
-        else if (auto retStmt = std::dynamic_pointer_cast<ReturnStmt>(stmt)) {
-            if (retStmt->value)
-                compileExpr(retStmt->value, chunk);
+    }
+    fuseSuperinstructions(code, starts, isTarget, keep, rewrite);
+    // A jump to the instruction that follows it once dead code is gone.
+    for (size_t i = 0; i < starts.size(); i++) {
+        if (!keep[i] || code[starts[i]] != OP_JUMP)
+            continue;
+        size_t j = i + 1;
+        while (j < starts.size() && !keep[j])
+            j++;
+        int nextPc = j < starts.size() ? starts[j] : size;
+        if (code[starts[i] + 1] == nextPc)
+            keep[i] = 0;
+    }
+
+    // Compact: map every old position (and the end) to its new one.
+    std::vector<int> newPos(size + 1, 0);
+    std::vector<int> out;
+    out.reserve(size);
+    for (size_t i = 0; i < starts.size(); i++) {
+        int pc = starts[i], end = pc + 1 + operandCount(code[pc]);
+        for (int k = pc; k < end; k++)
+            newPos[k] = out.size();
+        if (!keep[i]) {
+            changed = true;
+            continue;
+        }
+        if (!rewrite[i].empty()) {
+            changed = true;
+            out.insert(out.end(), rewrite[i].begin(), rewrite[i].end());
+            continue;
+        }
+        out.insert(out.end(), code.begin() + pc, code.begin() + end);
+    }
+    newPos[size] = out.size();
+    if (!changed)
+        return false;
+    for (size_t pc = 0; pc < out.size(); pc += 1 + operandCount(out[pc])) {
+        if (int at = jumpOperand(out[pc]))
+            out[pc + at] = newPos[out[pc + at]];
+    }
+    for (auto& table : chunk.switchTables)
+        forEachSwitchTarget(table, [&](int& t) { t = newPos[t]; });
+    code.swap(out);
+    return true;
+}
+
+void peephole(ObjFunction::CodeChunk& chunk, bool isMethod = false) {
+    size_t before = chunk.code.size();
+    for (int round = 0; round < 8 && peepholeRound(chunk, isMethod); round++) { }
+    DEBUG_LOG("Peephole: " + std::to_string(before) + " -> " + std::to_string(chunk.code.size()) + " code words.");
+}
+
+// ============================================================================
+// Bytecode Verifier: runs once over each finished chunk, and over each chunk
+// loaded from a program image (verifyBytecode). It proves that every
+// path ends in a Return holding just the result, that the stack depth at an
+// instruction is the same on every path into it and never drops below what
+// the instruction pops, and that each constant, slot, cache, switch table and
+// jump operand is in range. The dispatch loop relies on this and does no
+// bounds or underflow checks of its own. The deepest point becomes maxStack.
+// ============================================================================
+// Values an instruction pops, and pushes on its fall-through path.
+void stackEffect(const std::vector<int>& code, int pc, int& pops, int& pushes) {
+    int op = code[pc];
+    pops = 0;
+    pushes = 0;
+    switch (op) {
+    case OP_CONSTANT: case OP_GET_GLOBAL: case OP_NIL: case OP_GET_LOCAL: case OP_CLASS:
+    case OP_ADD_LOCAL_CONST: case OP_SUB_LOCAL_CONST: case OP_GET_SELF_FIELD: case OP_FOR_EACH:
+        pushes = 1;
+        break;
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_POW: case OP_MOD:
+    case OP_LT: case OP_LE: case OP_GT: case OP_GE: case OP_NE: case OP_EQ:
+    case OP_ADD_INT: case OP_ADD_DOUBLE: case OP_ADD_STRING: case OP_SUB_INT: case OP_SUB_DOUBLE:
+    case OP_MUL_INT: case OP_MUL_DOUBLE: case OP_LT_INT: case OP_LE_INT: case OP_GT_INT:
+    case OP_GE_INT: case OP_NE_INT: case OP_EQ_INT: case OP_LT_DOUBLE: case OP_LE_DOUBLE:
+    case OP_GT_DOUBLE: case OP_GE_DOUBLE: case OP_METHOD: case OP_CONSTRUCTOR_END:
+        pops = 2;
+        pushes = 1;
+        break;
+    case OP_NEGATE: case OP_NOT: case OP_NEW: case OP_GET_PROPERTY: case OP_PROPERTIES:
+        pops = 1;
+        pushes = 1;
+        break;
+    case OP_PRINT: case OP_POP: case OP_DEFINE_GLOBAL: case OP_SET_GLOBAL: case OP_SET_LOCAL:
+    case OP_SET_SELF_FIELD: case OP_JUMP_IF_FALSE: case OP_JUMP_IF_TRUE: case OP_RETURN:
+    case OP_JUMP_TABLE: case OP_SWITCH_HASH:
+        pops = 1;
+        break;
+    case OP_SET_PROPERTY: case OP_JUMP_IF_NOT_LT: case OP_JUMP_IF_NOT_LE: case OP_JUMP_IF_NOT_GT:
+    case OP_JUMP_IF_NOT_GE: case OP_JUMP_IF_NOT_EQ: case OP_JUMP_IF_NOT_NE:
+        pops = 2;
+        break;
+    case OP_DUP:
+        pops = 1;
+        pushes = 2;
+        break;
+    case OP_CALL: case OP_TAIL_CALL: case OP_OPTIONAL_CALL:
+        pops = code[pc + 1] + 1;
+        pushes = 1;
+        break;
+    case OP_INVOKE: case OP_TAIL_INVOKE:
+        pops = code[pc + 2] + 1;
+        pushes = 1;
+        break;
+    case OP_ARRAY:
+        pops = code[pc + 1];
+        pushes = 1;
+        break;
+    default: // jumps, loop back edges and in-place local updates
+        break;
+    }
+}
+
+// Checks chunk.code and returns its maximum stack depth, and in slotsUsed one
+// past the highest slot it refers to. fail(pc, reason) is called for the
+// first problem found and must not return.
+template <typename Fail>
+int verifyCode(ObjFunction::CodeChunk& chunk, Fail fail, int* slotsUsed = nullptr) {
+    const std::vector<int>& code = chunk.code;
+    const int size = code.size();
+    std::vector<char> isStart(size + 1, 0);
+    for (int pc = 0; pc < size; pc += 1 + operandCount(code[pc])) {
+        if (code[pc] < 0 || code[pc] >= OP_COUNT)
+            fail(pc, "unknown opcode " + std::to_string(code[pc]) + ".");
+        if (pc + operandCount(code[pc]) >= size)
+            fail(pc, "truncated " + opcodeToString(code[pc]) + ".");
+        isStart[pc] = 1;
+    }
+    auto checkIndex = [&](int pc, int index, size_t limit, const char* what) {
+        if (index < 0 || index >= (int)limit)
+            fail(pc, std::string(what) + " " + std::to_string(index) + " out of range.");
+    };
+    auto checkTarget = [&](int pc, int target) {
+        if (target < 0 || target >= size || !isStart[target])
+            fail(pc, "jump to " + std::to_string(target) + " is not an instruction.");
+    };
+
+    // Operands, checked once for every instruction whether reachable or not.
+    const int slots = chunk.localCount;
+    int highestSlot = -1;
+    auto checkSlot = [&](int pc, int slot) {
+        checkIndex(pc, slot, slots, "slot");
+        highestSlot = std::max(highestSlot, slot);
+    };
+    const size_t symbols = symbolTable().names.size();
+    for (int pc = 0; pc < size; pc += 1 + operandCount(code[pc])) {
+        int op = code[pc];
+        switch (op) {
+        case OP_CONSTANT: case OP_CLASS: case OP_PROPERTIES:
+            checkIndex(pc, code[pc + 1], chunk.constants.size(), "constant");
+            break;
+        case OP_GET_LOCAL: case OP_SET_LOCAL:
+            checkSlot(pc, code[pc + 1]);
+            break;
+        case OP_DEFINE_GLOBAL: case OP_GET_GLOBAL: case OP_SET_GLOBAL: case OP_METHOD:
+            checkIndex(pc, code[pc + 1], symbols, "symbol");
+            break;
+        case OP_INC_LOCAL: case OP_ADD_LOCAL_CONST: case OP_SUB_LOCAL_CONST:
+            checkSlot(pc, code[pc + 1]);
+            checkIndex(pc, code[pc + 2], chunk.constants.size(), "constant");
+            break;
+        case OP_GET_PROPERTY: case OP_SET_PROPERTY: case OP_GET_SELF_FIELD: case OP_SET_SELF_FIELD:
+            checkIndex(pc, code[pc + 1], symbols, "symbol");
+            checkIndex(pc, code[pc + 2], chunk.caches.size(), "cache");
+            break;
+        case OP_INVOKE: case OP_TAIL_INVOKE:
+            checkIndex(pc, code[pc + 1], symbols, "symbol");
+            if (code[pc + 2] < 0)
+                fail(pc, "negative count.");
+            checkIndex(pc, code[pc + 3], chunk.caches.size(), "cache");
+            break;
+        case OP_JUMP_IF_NOT_LOCAL_CONST: case OP_JUMP_IF_NOT_LOCALS:
+            if (code[pc + 1] < OP_JUMP_IF_NOT_LT || code[pc + 1] > OP_JUMP_IF_NOT_NE)
+                fail(pc, "bad comparison " + std::to_string(code[pc + 1]) + ".");
+            checkSlot(pc, code[pc + 2]);
+            if (op == OP_JUMP_IF_NOT_LOCALS)
+                checkSlot(pc, code[pc + 3]);
             else
-                emit(chunk, OP_NIL);
-            emit(chunk, OP_RETURN);
+                checkIndex(pc, code[pc + 3], chunk.constants.size(), "constant");
+            break;
+        case OP_FOR_LOOP: case OP_FOR_LOOP_GLOBAL:
+            if (op == OP_FOR_LOOP)
+                checkSlot(pc, code[pc + 1]);
+            else
+                checkIndex(pc, code[pc + 1], symbols, "symbol");
+            checkSlot(pc, code[pc + 2]);
+            checkSlot(pc, code[pc + 3]);
+            break;
+        case OP_FOR_EACH:
+            checkSlot(pc, code[pc + 1]);
+            checkSlot(pc, code[pc + 2]);
+            break;
+        case OP_JUMP_TABLE: case OP_SWITCH_HASH:
+            checkIndex(pc, code[pc + 1], chunk.switchTables.size(), "switch table");
+            forEachSwitchTarget(chunk.switchTables[code[pc + 1]], [&](int& t) { checkTarget(pc, t); });
+            break;
+        case OP_CALL: case OP_TAIL_CALL: case OP_OPTIONAL_CALL: case OP_ARRAY:
+            if (code[pc + 1] < 0)
+                fail(pc, "negative count.");
+            break;
+        default: break;
         }
-        else if (auto funcStmt = std::dynamic_pointer_cast<FunctionStmt>(stmt)) {
-            std::shared_ptr<ObjFunction> placeholder = std::make_shared<ObjFunction>();
-            placeholder->name = funcStmt->name;
-            int req = 0;
-            for (auto& p : funcStmt->params)
-                if (!p.optional) req++;
-            placeholder->arity = req;
-            placeholder->params = funcStmt->params;
-            vm.environment->define(toLower(funcStmt->name), Value(placeholder));
-            compileFunction(funcStmt);
-            vm.environment->assign(toLower(funcStmt->name), Value(lastFunction));
-            if (!compilingModule) {
-                int fnConst = addConstant(chunk, vm.environment->get(toLower(funcStmt->name)));
-                emitWithOperand(chunk, OP_CONSTANT, fnConst);
-                int nameConst = addConstantString(chunk, toLower(funcStmt->name));
-                emitWithOperand(chunk, OP_DEFINE_GLOBAL, nameConst);
-            }
-            else {
-                if (funcStmt->access == AccessModifier::PUBLIC) {
-                    currentModulePublicMembers[toLower(funcStmt->name)] = vm.environment->get(toLower(funcStmt->name));
-                }
+        if (int at = jumpOperand(op))
+            checkTarget(pc, code[pc + at]);
+    }
+
+    // Stack depths, propagated along every path from the entry point.
+    std::vector<int> depth(size, -1);
+    std::vector<int> work;
+    int maxDepth = 0;
+    auto flowTo = [&](int from, int pc, int d) {
+        if (pc >= size)
+            fail(from, "control falls off the end of the chunk.");
+        if (depth[pc] < 0) {
+            depth[pc] = d;
+            work.push_back(pc);
+        }
+        else if (depth[pc] != d)
+            fail(pc, "stack depth " + std::to_string(d) + " here does not match " + std::to_string(depth[pc]) + ".");
+    };
+    flowTo(0, 0, 0);
+    while (!work.empty()) {
+        int pc = work.back();
+        work.pop_back();
+        int op = code[pc], d = depth[pc], pops, pushes;
+        stackEffect(code, pc, pops, pushes);
+        if (d < pops)
+            fail(pc, opcodeToString(op) + " needs " + std::to_string(pops) + " values but the stack holds " + std::to_string(d) + ".");
+        int after = d - pops + pushes;
+        maxDepth = std::max(maxDepth, after);
+        if (op == OP_RETURN) {
+            if (d != 1)
+                fail(pc, "return leaves " + std::to_string(d - 1) + " values behind.");
+            continue;
+        }
+        if (op == OP_JUMP_TABLE || op == OP_SWITCH_HASH) {
+            forEachSwitchTarget(chunk.switchTables[code[pc + 1]], [&](int& t) { flowTo(pc, t, after); });
+            continue;
+        }
+        if (int at = jumpOperand(op))
+            flowTo(pc, code[pc + at], op == OP_FOR_EACH ? d : after);
+        if (op != OP_JUMP)
+            flowTo(pc, pc + 1 + operandCount(op), after);
+    }
+    if (slotsUsed)
+        *slotsUsed = highestSlot + 1;
+    return maxDepth;
+}
+
+void verifyChunk(ObjFunction::CodeChunk& chunk, const std::string& name) {
+    chunk.maxStack = verifyCode(chunk, [&](int pc, const std::string& msg) {
+        runtimeError("Verifier: " + name + " at " + std::to_string(pc) + ": " + msg);
+    });
+    DEBUG_LOG("Verifier: " + name + " is balanced, max stack " + std::to_string(chunk.maxStack) + ".");
+}
+
+// ============================================================================
+// Bytecode Encoding: lowers a verified chunk to the byte stream the VM runs.
+// Opcodes take one byte and so does each operand, unless the instruction is
+// prefixed by OP_WIDE (two-byte operands) or OP_WIDE4 (four-byte operands).
+// Jump operands become signed offsets from the end of their instruction, so
+// most branches fit a byte however long the chunk is; an instruction whose
+// offset does not fit is widened and the layout redone until nothing changes.
+// Switch tables keep absolute targets, remapped to byte offsets.
+// ============================================================================
+const int BYTECODE_PADDING = 3; // Zero bytes after the last instruction, see operandWord
+
+int operandWidth(int value, bool isSigned) {
+    if (isSigned)
+        return value >= INT8_MIN && value <= INT8_MAX ? 1 : value >= INT16_MIN && value <= INT16_MAX ? 2 : 4;
+    return value >= 0 && value <= UINT8_MAX ? 1 : value >= 0 && value <= UINT16_MAX ? 2 : 4;
+}
+
+void encodeChunk(ObjFunction::CodeChunk& chunk) {
+    const std::vector<int>& code = chunk.code;
+    std::vector<int> starts;
+    std::vector<int> index(code.size(), -1); // code position -> instruction number
+    for (int pc = 0; pc < (int)code.size(); pc += 1 + operandCount(code[pc])) {
+        index[pc] = starts.size();
+        starts.push_back(pc);
+    }
+    const size_t count = starts.size();
+
+    // Plain operands fix a minimum width up front; jump offsets may raise it.
+    std::vector<int> width(count, 1);
+    for (size_t i = 0; i < count; i++) {
+        int pc = starts[i], at = jumpOperand(code[pc]);
+        for (int k = 1; k <= operandCount(code[pc]); k++)
+            if (k != at)
+                width[i] = std::max(width[i], operandWidth(code[pc + k], false));
+    }
+    std::vector<int> pos(count + 1, 0);
+    auto offset = [&](size_t i) {
+        int pc = starts[i];
+        return pos[index[code[pc + jumpOperand(code[pc])]]] - pos[i + 1];
+    };
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (size_t i = 0; i < count; i++)
+            pos[i + 1] = pos[i] + (width[i] > 1) + 1 + operandCount(code[starts[i]]) * width[i];
+        for (size_t i = 0; i < count; i++) {
+            if (!jumpOperand(code[starts[i]]))
+                continue;
+            int needed = operandWidth(offset(i), true);
+            if (needed > width[i]) {
+                width[i] = needed;
+                changed = true;
             }
         }
-        else if (auto varStmt = std::dynamic_pointer_cast<VarStmt>(stmt)) {
-            if (varStmt->initializer)
-                compileExpr(varStmt->initializer, chunk);
-            else {
-                if (varStmt->varType == "integer" || varStmt->varType == "double")
-                    compileExpr(std::make_shared<LiteralExpr>(0), chunk);
-                else if (varStmt->varType == "boolean")
+    }
+
+    std::vector<uint8_t> bytes;
+    bytes.reserve(pos[count]);
+    for (size_t i = 0; i < count; i++) {
+        int pc = starts[i], op = code[pc], at = jumpOperand(op);
+        if (width[i] > 1)
+            bytes.push_back(width[i] == 2 ? OP_WIDE : OP_WIDE4);
+        bytes.push_back(op);
+        for (int k = 1; k <= operandCount(op); k++) {
+            uint32_t value = k == at ? offset(i) : code[pc + k];
+            for (int b = 0; b < width[i]; b++)
+                bytes.push_back((value >> (8 * b)) & 0xFF);
+        }
+    }
+    for (SwitchTable& table : chunk.switchTables)
+        forEachSwitchTarget(table, [&](int& t) { t = pos[index[t]]; });
+    DEBUG_LOG("Encoder: " + std::to_string(code.size() * sizeof(int)) + " bytes of code encoded in " +
+              std::to_string(bytes.size()) + ".");
+    bytes.resize(bytes.size() + BYTECODE_PADDING);
+    chunk.bytecode = std::move(bytes);
+    chunk.code.clear();
+    chunk.code.shrink_to_fit();
+}
+
+// One instruction of an encoded chunk, for passes that walk the byte stream
+// after encoding. `pos` includes any width prefix; jump operands are turned
+// back into absolute byte positions.
+struct DecodedInstruction {
+    int pos = 0;
+    int op = 0;
+    int operands[5] = {};
+    int next = 0; // Position of the following instruction
+};
+
+DecodedInstruction decodeInstruction(const Bytecode& code, int pos) {
+    DecodedInstruction ins;
+    ins.pos = pos;
+    int width = 1;
+    if (code[pos] == OP_WIDE || code[pos] == OP_WIDE4)
+        width = code[pos++] == OP_WIDE ? 2 : 4;
+    ins.op = code[pos++];
+    int count = operandCount(ins.op), at = jumpOperand(ins.op);
+    for (int k = 0; k < count; k++, pos += width) {
+        uint32_t value = 0;
+        for (int b = 0; b < width; b++)
+            value |= (uint32_t)code[pos + b] << (8 * b);
+        int unusedBits = 32 - 8 * width;
+        ins.operands[k] = k + 1 == at ? (int32_t)(value << unusedBits) >> unusedBits : (int)value;
+    }
+    ins.next = pos;
+    if (at)
+        ins.operands[at - 1] += pos;
+    return ins;
+}
+
+// Verifies an encoded chunk that did not come from this compiler (a program
+// image) and returns its maximum stack depth. The bytes are decoded back into
+// the one-int-per-word form, with jump and switch targets turned from byte
+// positions into code positions, and checked by verifyCode. fail(pos, reason)
+// gets a byte position and must not return.
+template <typename Fail>
+int verifyBytecode(const ObjFunction::CodeChunk& chunk, Fail fail, int& slotsUsed) {
+    const Bytecode& bytecode = chunk.bytecode;
+    const int size = (int)bytecode.size() - BYTECODE_PADDING;
+    if (size <= 0)
+        fail(0, "the chunk has no code.");
+    ObjFunction::CodeChunk check;
+    std::vector<int> codeAt(size, -1); // byte position -> code position
+    std::vector<int> posOf;            // code position -> byte position
+    for (int pos = 0; pos < size; ) {
+        int at = pos, width = 1;
+        if (bytecode[at] == OP_WIDE || bytecode[at] == OP_WIDE4)
+            width = bytecode[at++] == OP_WIDE ? 2 : 4;
+        if (at >= size || bytecode[at] >= OP_COUNT || bytecode[at] == OP_WIDE || bytecode[at] == OP_WIDE4)
+            fail(pos, "unknown opcode " + std::to_string(at < size ? bytecode[at] : 0) + ".");
+        if (at + 1 + operandCount(bytecode[at]) * width > size)
+            fail(pos, "truncated " + opcodeToString(bytecode[at]) + ".");
+        DecodedInstruction ins = decodeInstruction(bytecode, pos);
+        codeAt[pos] = check.code.size();
+        check.code.push_back(ins.op);
+        check.code.insert(check.code.end(), ins.operands, ins.operands + operandCount(ins.op));
+        posOf.resize(check.code.size(), pos);
+        pos = ins.next;
+    }
+    // A target that is not the start of an instruction becomes -1, which
+    // verifyCode reports.
+    auto remap = [&](int& target) { target = target >= 0 && target < size ? codeAt[target] : -1; };
+    for (int pc = 0; pc < (int)check.code.size(); pc += 1 + operandCount(check.code[pc])) {
+        if (int at = jumpOperand(check.code[pc]))
+            remap(check.code[pc + at]);
+    }
+    check.switchTables = chunk.switchTables;
+    for (SwitchTable& table : check.switchTables)
+        forEachSwitchTarget(table, remap);
+    check.constants = chunk.constants;
+    check.localCount = chunk.localCount;
+    check.caches.resize(chunk.caches.size());
+    return verifyCode(check, [&](int pc, const std::string& msg) { fail(posOf[pc], msg); }, &slotsUsed);
+}
+
+// ============================================================================
+// Register Compiler: code generator for the register tier (--vm register).
+// It compiles a function body straight from the AST into three-address code
+// over the frame's virtual registers. Self (in methods), parameters and
+// locals keep one register for the whole function; temporaries are taken
+// above them while a statement is compiled and released after it. It covers
+// functions and methods built from Dim, assignment, If, While, For, Return,
+// calls, arithmetic and comparisons, property and self-field access, and
+// method invocation. A body using anything else (New, array literals,
+// Select, For Each, nested declarations) keeps only its stack code, and
+// unsupported() names what stopped it. Top-level code always stays on the
+// stack tier.
+// ============================================================================
+class RegisterCompiler {
+public:
+    // Resolves Module.Member and Enum.Value at compile time, as the stack
+    // compiler does, so both tiers see the same member.
+    using StaticMemberFn = std::function<bool(const std::shared_ptr<GetPropExpr>&, Value&)>;
+    explicit RegisterCompiler(StaticMemberFn staticMember) : resolveStatic(std::move(staticMember)) {}
+
+    bool compile(const std::shared_ptr<FunctionStmt>& funcStmt, ObjFunction& function) {
+        out = std::make_shared<ObjFunction::RegisterChunk>();
+        isMethod = function.isMethod;
+        if (isMethod)
+            declareLocal("self");
+        for (auto& p : funcStmt->params)
+            declareLocal(p.name);
+        for (auto& stmt : funcStmt->body) {
+            if (!compileStmt(stmt))
+                return false;
+        }
+        emit({ R_RETURN, constant(Value(std::monostate{})) });
+        out->registerCount = maxRegisters;
+        function.registers = out;
+        return true;
+    }
+
+    // The construct that kept the last function on the stack tier.
+    const std::string& unsupported() const { return unsupportedConstruct; }
+
+private:
+    StaticMemberFn resolveStatic;
+    std::shared_ptr<ObjFunction::RegisterChunk> out;
+    std::unordered_map<std::string, int> locals;
+    bool isMethod = false;
+    int nextRegister = 0; // Locals sit below it between statements
+    int maxRegisters = 0;
+    std::string unsupportedConstruct;
+
+    bool reject(const std::string& construct) {
+        if (unsupportedConstruct.empty())
+            unsupportedConstruct = construct;
+        return false;
+    }
+    int cache() {
+        out->caches.emplace_back();
+        return out->caches.size() - 1;
+    }
+    // Inside a method a name that is not a local is looked up on self first.
+    bool selfFieldAccess(const std::string& name) {
+        SymbolId sym = intern(name);
+        return isMethod && sym != SYM_MICROSECONDS && sym != SYM_TICKS;
+    }
+    bool staticMember(const std::shared_ptr<GetPropExpr>& getProp, Value& member) {
+        std::shared_ptr<Expr> root = getProp->object;
+        while (auto inner = std::dynamic_pointer_cast<GetPropExpr>(root))
+            root = inner->object;
+        auto var = std::dynamic_pointer_cast<VariableExpr>(root);
+        return var && resolveLocal(var->name) < 0 && resolveStatic(getProp, member);
+    }
+
+    void emit(std::initializer_list<int> words) {
+        out->code.insert(out->code.end(), words);
+    }
+    int temp() {
+        maxRegisters = std::max(maxRegisters, nextRegister + 1);
+        return nextRegister++;
+    }
+    int declareLocal(const std::string& name) {
+        auto it = locals.find(toLower(name));
+        if (it != locals.end())
+            return it->second;
+        return locals[toLower(name)] = temp();
+    }
+    int resolveLocal(const std::string& name) {
+        auto it = locals.find(toLower(name));
+        return it != locals.end() ? it->second : -1;
+    }
+    // Constants are operands below zero.
+    int constant(const Value& v) {
+        auto& pool = out->constants;
+        for (size_t i = 0; i < pool.size(); i++) {
+            const Value& c = pool[i];
+            bool same = c.type == v.type && (
+                (v.type == ValueType::Nil) ||
+                (v.type == ValueType::Int && c.as.i == v.as.i) ||
+                (v.type == ValueType::Bool && c.as.b == v.as.b));
+            if (same)
+                return -1 - (int)i;
+        }
+        pool.push_back(v);
+        return -(int)pool.size();
+    }
+    void patch(const std::vector<int>& jumps) {
+        for (int at : jumps)
+            out->code[at] = out->code.size();
+    }
+
+    bool compileBlock(const std::vector<std::shared_ptr<Stmt>>& stmts) {
+        for (auto& stmt : stmts) {
+            if (!compileStmt(stmt))
+                return false;
+        }
+        return true;
+    }
+
+    bool compileStmt(const std::shared_ptr<Stmt>& stmt) {
+        int mark = nextRegister;
+        if (auto exprStmt = std::dynamic_pointer_cast<ExpressionStmt>(stmt)) {
+            bool ok = compileExpr(exprStmt->expression, temp());
+            nextRegister = mark;
+            return ok;
+        }
+        if (auto varStmt = std::dynamic_pointer_cast<VarStmt>(stmt)) {
+            int reg = resolveLocal(varStmt->name);
+            if (reg < 0)
+                reg = temp();
+            bool ok = true;
+            if (varStmt->initializer)
+                ok = compileExpr(varStmt->initializer, reg);
+            else
+                emit({ R_MOVE, reg, constant(defaultValue(varStmt->varType)) });
+            nextRegister = std::max(mark, reg + 1);
+            locals[toLower(varStmt->name)] = reg;
+            return ok;
+        }
+        if (auto assign = std::dynamic_pointer_cast<AssignmentStmt>(stmt)) {
+            int reg = resolveLocal(assign->name);
+            if (reg >= 0)
+                return compileExpr(assign->value, reg);
+            int value;
+            bool ok = operand(assign->value, value);
+            if (selfFieldAccess(assign->name))
+                emit({ R_SET_SELF_FIELD, (int)intern(assign->name), value, cache() });
+            else
+                emit({ R_SET_GLOBAL, (int)intern(assign->name), value });
+            nextRegister = mark;
+            return ok;
+        }
+        if (auto propAssign = std::dynamic_pointer_cast<PropertyAssignmentStmt>(stmt)) {
+            int object, value;
+            bool ok = operand(propAssign->object, object) && operand(propAssign->value, value);
+            emit({ R_SET_PROPERTY, object, (int)intern(propAssign->property), value, cache() });
+            nextRegister = mark;
+            return ok;
+        }
+        if (auto ret = std::dynamic_pointer_cast<ReturnStmt>(stmt)) {
+            int value = constant(Value(std::monostate{}));
+            bool ok = true;
+            if (auto call = std::dynamic_pointer_cast<CallExpr>(ret->value)) {
+                // Return f(...) reuses the frame for register-tier callees.
+                value = temp();
+                ok = compileCall(call, value, R_TAIL_CALL);
+            }
+            else if (ret->value)
+                ok = operand(ret->value, value);
+            emit({ R_RETURN, value });
+            nextRegister = mark;
+            return ok;
+        }
+        if (auto ifStmt = std::dynamic_pointer_cast<IfStmt>(stmt)) {
+            std::vector<int> toElse;
+            if (!compileJump(ifStmt->condition, false, toElse) || !compileBlock(ifStmt->thenBranch))
+                return false;
+            emit({ R_JUMP, 0 });
+            std::vector<int> toEnd = { (int)out->code.size() - 1 };
+            patch(toElse);
+            if (!compileBlock(ifStmt->elseBranch))
+                return false;
+            patch(toEnd);
+            return true;
+        }
+        if (auto whileStmt = std::dynamic_pointer_cast<WhileStmt>(stmt)) {
+            int loopStart = out->code.size();
+            std::vector<int> exits;
+            if (!compileJump(whileStmt->condition, false, exits) || !compileBlock(whileStmt->body))
+                return false;
+            emit({ R_JUMP, loopStart });
+            patch(exits);
+            return true;
+        }
+        if (auto block = std::dynamic_pointer_cast<BlockStmt>(stmt))
+            return compileBlock(block->statements);
+        if (auto forStmt = std::dynamic_pointer_cast<ForStmt>(stmt)) {
+            // As on the stack tier: the bound and step are evaluated once, the
+            // test runs on entry and then on each R_FOR_LOOP back edge.
+            if (!compileStmt(std::make_shared<VarStmt>(forStmt->varName, forStmt->start, forStmt->varType)))
+                return false;
+            int counter = resolveLocal(forStmt->varName);
+            int bound = temp(), step = temp();
+            if (!compileExpr(forStmt->end, bound) || !compileExpr(forStmt->step, step))
+                return false;
+            nextRegister = step + 1;
+            emit({ forStmt->isDown ? R_JUMP_IF_NOT_GE : R_JUMP_IF_NOT_LE, counter, bound, 0 });
+            std::vector<int> exits = { (int)out->code.size() - 1 };
+            int bodyStart = out->code.size();
+            if (!compileBlock(forStmt->body))
+                return false;
+            emit({ R_FOR_LOOP, counter, bound, step, forStmt->isDown, bodyStart });
+            patch(exits);
+            return true;
+        }
+        if (std::dynamic_pointer_cast<SelectStmt>(stmt))
+            return reject("Select Case");
+        if (std::dynamic_pointer_cast<ForEachStmt>(stmt))
+            return reject("For Each");
+        return reject("a nested declaration");
+    }
+
+    static Value defaultValue(const std::string& varType) {
+        if (varType == "integer" || varType == "double")
+            return Value(0);
+        if (varType == "boolean")
+            return Value(false);
+        if (varType == "string")
+            return Value(std::string(""));
+        if (varType == "color")
+            return Value(Color{ 0 });
+        if (varType == "array")
+            return Value(makeRef<ObjArray>());
+        if (varType == "pointer" || varType == "ptr")
+            return Value(static_cast<void*>(nullptr));
+        return Value(std::monostate{});
+    }
+
+    // An instruction operand for expr: a local's register, a constant, or a
+    // new temporary holding its value.
+    bool operand(const std::shared_ptr<Expr>& expr, int& result) {
+        if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(expr)) {
+            result = constant(lit->value);
+            return true;
+        }
+        if (auto var = std::dynamic_pointer_cast<VariableExpr>(expr); var && resolveLocal(var->name) >= 0) {
+            result = resolveLocal(var->name);
+            return true;
+        }
+        if (auto group = std::dynamic_pointer_cast<GroupingExpr>(expr))
+            return operand(group->expression, result);
+        result = temp();
+        return compileExpr(expr, result);
+    }
+
+    static int binaryOp(BinaryOp op) {
+        switch (op) {
+        case BinaryOp::ADD: return R_ADD;
+        case BinaryOp::SUB: return R_SUB;
+        case BinaryOp::MUL: return R_MUL;
+        case BinaryOp::DIV: return R_DIV;
+        case BinaryOp::POW: return R_POW;
+        case BinaryOp::MOD: return R_MOD;
+        case BinaryOp::LT:  return R_LT;
+        case BinaryOp::LE:  return R_LE;
+        case BinaryOp::GT:  return R_GT;
+        case BinaryOp::GE:  return R_GE;
+        case BinaryOp::EQ:  return R_EQ;
+        case BinaryOp::NE:  return R_NE;
+        default:            return -1;
+        }
+    }
+
+    // Evaluates expr into register dst.
+    bool compileExpr(const std::shared_ptr<Expr>& expr, int dst) {
+        int mark = nextRegister;
+        bool ok = true;
+        if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(expr)) {
+            emit({ R_MOVE, dst, constant(lit->value) });
+        }
+        else if (auto var = std::dynamic_pointer_cast<VariableExpr>(expr)) {
+            int reg = resolveLocal(var->name);
+            if (reg < 0 && selfFieldAccess(var->name))
+                emit({ R_GET_SELF_FIELD, dst, (int)intern(var->name), cache() });
+            else if (reg < 0)
+                emit({ R_GET_GLOBAL, dst, (int)intern(var->name) });
+            else if (reg != dst)
+                emit({ R_MOVE, dst, reg });
+        }
+        else if (auto group = std::dynamic_pointer_cast<GroupingExpr>(expr)) {
+            ok = compileExpr(group->expression, dst);
+        }
+        else if (auto un = std::dynamic_pointer_cast<UnaryExpr>(expr)) {
+            int a;
+            ok = operand(un->right, a);
+            if (un->op == "-")
+                emit({ R_NEGATE, dst, a });
+            else if (toLower(un->op) == "not")
+                emit({ R_NOT, dst, a });
+            else
+                ok = reject("the unary " + un->op + " operator");
+        }
+        else if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr);
+                 bin && (bin->op == BinaryOp::AND || bin->op == BinaryOp::OR)) {
+            std::vector<int> toFalse;
+            ok = compileJump(bin, false, toFalse);
+            emit({ R_MOVE, dst, constant(Value(true)), R_JUMP, 0 });
+            std::vector<int> toEnd = { (int)out->code.size() - 1 };
+            patch(toFalse);
+            emit({ R_MOVE, dst, constant(Value(false)) });
+            patch(toEnd);
+        }
+        else if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr)) {
+            int a, b;
+            ok = operand(bin->left, a) && operand(bin->right, b) && binaryOp(bin->op) >= 0;
+            if (ok)
+                emit({ binaryOp(bin->op), dst, a, b });
+        }
+        else if (auto call = std::dynamic_pointer_cast<CallExpr>(expr)) {
+            ok = compileCall(call, dst, R_CALL);
+        }
+        else if (auto getProp = std::dynamic_pointer_cast<GetPropExpr>(expr)) {
+            Value member;
+            int object;
+            if (staticMember(getProp, member))
+                emit({ R_MOVE, dst, constant(member) });
+            else if ((ok = operand(getProp->object, object)))
+                emit({ R_GET_PROPERTY, dst, object, (int)intern(getProp->name), cache() });
+        }
+        else if (auto setProp = std::dynamic_pointer_cast<SetPropExpr>(expr)) {
+            // The expression's value is the object, as on the stack tier.
+            int value;
+            ok = compileExpr(setProp->object, dst) && operand(setProp->value, value);
+            if (ok)
+                emit({ R_SET_PROPERTY, dst, (int)intern(setProp->name), value, cache() });
+        }
+        else if (std::dynamic_pointer_cast<NewExpr>(expr))
+            ok = reject("New");
+        else if (std::dynamic_pointer_cast<ArrayLiteralExpr>(expr))
+            ok = reject("an array literal");
+        else
+            ok = reject("an assignment expression");
+        nextRegister = mark;
+        return ok;
+    }
+
+    // The callee and arguments go in consecutive registers above everything
+    // live. obj.Method(args) puts the receiver where the callee would be and
+    // invokes the method on it directly.
+    bool compileCall(const std::shared_ptr<CallExpr>& call, int dst, int op) {
+        auto getProp = std::dynamic_pointer_cast<GetPropExpr>(call->callee);
+        Value member;
+        if (getProp && staticMember(getProp, member))
+            getProp = nullptr;
+        int mark = nextRegister;
+        int argCount = call->arguments.size();
+        int base = temp();
+        for (int i = 0; i < argCount; i++)
+            temp();
+        bool ok = compileExpr(getProp ? getProp->object : call->callee, base);
+        for (int i = 0; ok && i < argCount; i++)
+            ok = compileExpr(call->arguments[i], base + 1 + i);
+        if (getProp)
+            emit({ R_INVOKE, (int)intern(getProp->name), cache(), dst, base, argCount });
+        else
+            emit({ op, dst, base, argCount });
+        nextRegister = mark;
+        return ok;
+    }
+
+    // Jumps to a target patched later when the condition is jumpIfTrue.
+    bool compileJump(const std::shared_ptr<Expr>& expr, bool jumpIfTrue, std::vector<int>& jumps) {
+        if (auto group = std::dynamic_pointer_cast<GroupingExpr>(expr))
+            return compileJump(group->expression, jumpIfTrue, jumps);
+        if (auto un = std::dynamic_pointer_cast<UnaryExpr>(expr); un && toLower(un->op) == "not")
+            return compileJump(un->right, !jumpIfTrue, jumps);
+        int mark = nextRegister;
+        bool ok = true;
+        if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr)) {
+            if (bin->op == BinaryOp::AND || bin->op == BinaryOp::OR) {
+                bool isAnd = bin->op == BinaryOp::AND;
+                if (isAnd != jumpIfTrue)
+                    return compileJump(bin->left, jumpIfTrue, jumps) && compileJump(bin->right, jumpIfTrue, jumps);
+                std::vector<int> skip;
+                ok = compileJump(bin->left, !jumpIfTrue, skip) && compileJump(bin->right, jumpIfTrue, jumps);
+                patch(skip);
+                return ok;
+            }
+            int fused = -1;
+            switch (bin->op) {
+            case BinaryOp::LT: fused = R_JUMP_IF_NOT_LT; break;
+            case BinaryOp::LE: fused = R_JUMP_IF_NOT_LE; break;
+            case BinaryOp::GT: fused = R_JUMP_IF_NOT_GT; break;
+            case BinaryOp::GE: fused = R_JUMP_IF_NOT_GE; break;
+            case BinaryOp::EQ: fused = R_JUMP_IF_NOT_EQ; break;
+            case BinaryOp::NE: fused = R_JUMP_IF_NOT_NE; break;
+            default: break;
+            }
+            if (fused >= 0 && !jumpIfTrue) {
+                int a, b;
+                ok = operand(bin->left, a) && operand(bin->right, b);
+                emit({ fused, a, b, 0 });
+                jumps.push_back(out->code.size() - 1);
+                nextRegister = mark;
+                return ok;
+            }
+        }
+        int value;
+        ok = operand(expr, value);
+        emit({ jumpIfTrue ? R_JUMP_IF_TRUE : R_JUMP_IF_FALSE, value, 0 });
+        jumps.push_back(out->code.size() - 1);
+        nextRegister = mark;
+        return ok;
+    }
+};
+
+class Compiler {
+public:
+    Compiler(VM& virtualMachine) : vm(virtualMachine), compilingModule(false) {}
+    void compile(const std::vector<std::shared_ptr<Stmt>>& stmts) {
+        // Return types first, so calls to functions defined further down are typed too.
+        for (auto stmt : stmts) {
+            if (auto funcStmt = std::dynamic_pointer_cast<FunctionStmt>(stmt))
+                declareReturnType(funcStmt->name, staticTypeFromName(funcStmt->returnType));
+        }
+        for (auto stmt : stmts) {
+            compileStmt(stmt, vm.mainChunk);
+            debugLog("Compiler: Compiled a statement. Main chunk now has " +
+                std::to_string(vm.mainChunk.code.size()) + " instructions.");
+        }
+        emit(vm.mainChunk, OP_NIL);
+        emit(vm.mainChunk, OP_RETURN);
+        peephole(vm.mainChunk);
+        verifyChunk(vm.mainChunk, "main");
+        encodeChunk(vm.mainChunk);
+    }
+private:
+    VM& vm;
+    bool compilingModule; // Flag indicating if compiling a module
+    std::string currentModuleName; // Current module name
+    std::unordered_map<SymbolId, Value> currentModulePublicMembers;  // Public members of current module
+
+    // Slot table for the function being compiled. Parameters and Dim'd locals
+    // resolve to frame slots; any other name falls back to a global lookup.
+    struct FunctionScope {
+        std::unordered_map<std::string, int> locals;
+        std::unordered_map<std::string, StaticType> types; // Declared types of typed locals
+        int localCount = 0;
+        bool isMethod = false;
+    };
+    FunctionScope* currentScope = nullptr;
+
+    int resolveLocal(const std::string& name) {
+        if (!currentScope) return -1;
+        auto it = currentScope->locals.find(toLower(name));
+        return (it != currentScope->locals.end()) ? it->second : -1;
+    }
+    // A slot for compiler-held loop state, in the function's frame or, at top
+    // level, in the slots reserved below the main chunk's stack.
+    int hiddenSlot(ObjFunction::CodeChunk& chunk) {
+        return currentScope ? currentScope->localCount++ : chunk.localCount++;
+    }
+    int declareLocal(const std::string& name) {
+        std::string key = toLower(name);
+        auto it = currentScope->locals.find(key);
+        if (it != currentScope->locals.end()) return it->second;
+        currentScope->locals[key] = currentScope->localCount;
+        return currentScope->localCount++;
+    }
+    // ------------------------------------------------------------------
+    // Static types. A declared type is a promise the VM does not enforce on
+    // assignment, so the typed ops it selects keep their type guards.
+    // ------------------------------------------------------------------
+    std::unordered_map<std::string, StaticType> globalTypes;
+    std::unordered_map<std::string, StaticType> returnTypes;
+
+    void declareType(const std::string& name, StaticType type) {
+        if (currentScope)
+            currentScope->types[toLower(name)] = type;
+        else if (!compilingModule)
+            globalTypes[toLower(name)] = type;
+    }
+    void declareReturnType(const std::string& name, StaticType type) {
+        // Overloads only keep a type they all agree on.
+        auto it = returnTypes.find(toLower(name));
+        if (it == returnTypes.end())
+            returnTypes[toLower(name)] = type;
+        else if (it->second != type)
+            it->second = StaticType::Unknown;
+    }
+    StaticType variableType(const std::string& name) {
+        std::string key = toLower(name);
+        if (currentScope) {
+            if (currentScope->locals.count(key)) {
+                auto it = currentScope->types.find(key);
+                return it != currentScope->types.end() ? it->second : StaticType::Unknown;
+            }
+            // Inside a method an unqualified name may be one of self's fields.
+            if (currentScope->isMethod)
+                return StaticType::Unknown;
+        }
+        auto it = globalTypes.find(key);
+        return it != globalTypes.end() ? it->second : StaticType::Unknown;
+    }
+    StaticType inferType(std::shared_ptr<Expr> expr) {
+        if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(expr))
+            return staticTypeOf(lit->value);
+        if (auto var = std::dynamic_pointer_cast<VariableExpr>(expr))
+            return variableType(var->name);
+        if (auto getProp = std::dynamic_pointer_cast<GetPropExpr>(expr)) {
+            Value member;
+            return staticMember(getProp, member) ? staticTypeOf(member) : StaticType::Unknown;
+        }
+        if (auto group = std::dynamic_pointer_cast<GroupingExpr>(expr))
+            return inferType(group->expression);
+        if (auto un = std::dynamic_pointer_cast<UnaryExpr>(expr)) {
+            StaticType t = inferType(un->right);
+            if (toLower(un->op) == "not")
+                return StaticType::Boolean;
+            return (un->op == "-" && isNumeric(t)) ? t : StaticType::Unknown;
+        }
+        if (auto call = std::dynamic_pointer_cast<CallExpr>(expr)) {
+            auto callee = std::dynamic_pointer_cast<VariableExpr>(call->callee);
+            if (!callee || resolveLocal(callee->name) >= 0 || globalTypes.count(toLower(callee->name)))
+                return StaticType::Unknown;
+            auto it = returnTypes.find(toLower(callee->name));
+            return it != returnTypes.end() ? it->second : StaticType::Unknown;
+        }
+        if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr)) {
+            StaticType l = inferType(bin->left), r = inferType(bin->right);
+            switch (bin->op) {
+            case BinaryOp::ADD:
+                if (l == StaticType::String && r == StaticType::String)
+                    return StaticType::String;
+                // fall through
+            case BinaryOp::SUB:
+            case BinaryOp::MUL:
+            case BinaryOp::MOD:
+                if (l == StaticType::Integer && r == StaticType::Integer)
+                    return StaticType::Integer;
+                if (isNumeric(l) && isNumeric(r))
+                    return StaticType::Double;
+                return StaticType::Unknown;
+            case BinaryOp::DIV:
+            case BinaryOp::POW:
+                return (isNumeric(l) && isNumeric(r)) ? StaticType::Double : StaticType::Unknown;
+            case BinaryOp::LT: case BinaryOp::LE: case BinaryOp::GT:
+            case BinaryOp::GE: case BinaryOp::NE: case BinaryOp::EQ:
+            case BinaryOp::AND: case BinaryOp::OR:
+                return StaticType::Boolean;
+            default:
+                return StaticType::Unknown;
+            }
+        }
+        return StaticType::Unknown;
+    }
+    // The typed form of a binary op when both operand types are proven, else
+    // the generic op (which still quickens itself at run time).
+    int binaryOpcode(BinaryOp op, StaticType l, StaticType r) {
+        bool ints = l == StaticType::Integer && r == StaticType::Integer;
+        bool doubles = isNumeric(l) && isNumeric(r) && !ints;
+        switch (op) {
+        case BinaryOp::ADD:
+            if (l == StaticType::String && r == StaticType::String) return OP_ADD_STRING;
+            return ints ? OP_ADD_INT : doubles ? OP_ADD_DOUBLE : OP_ADD;
+        case BinaryOp::SUB: return ints ? OP_SUB_INT : doubles ? OP_SUB_DOUBLE : OP_SUB;
+        case BinaryOp::MUL: return ints ? OP_MUL_INT : doubles ? OP_MUL_DOUBLE : OP_MUL;
+        case BinaryOp::DIV: return OP_DIV;
+        case BinaryOp::LT:  return ints ? OP_LT_INT : doubles ? OP_LT_DOUBLE : OP_LT;
+        case BinaryOp::LE:  return ints ? OP_LE_INT : doubles ? OP_LE_DOUBLE : OP_LE;
+        case BinaryOp::GT:  return ints ? OP_GT_INT : doubles ? OP_GT_DOUBLE : OP_GT;
+        case BinaryOp::GE:  return ints ? OP_GE_INT : doubles ? OP_GE_DOUBLE : OP_GE;
+        case BinaryOp::NE:  return ints ? OP_NE_INT : OP_NE;
+        case BinaryOp::EQ:  return ints ? OP_EQ_INT : OP_EQ;
+        case BinaryOp::POW: return OP_POW;
+        case BinaryOp::MOD: return OP_MOD;
+        default:            return OP_ADD;
+        }
+    }
+
+    // Compiles a condition for its branch alone: control reaches the code after
+    // it when the condition is !jumpIfTrue, and each jump recorded in `jumps`
+    // is taken otherwise. And/Or short-circuit, Not swaps the sense, and a
+    // comparison feeds a fused compare-and-jump without pushing a Boolean.
+    void compileJump(std::shared_ptr<Expr> expr, bool jumpIfTrue, std::vector<int>& jumps, ObjFunction::CodeChunk& chunk) {
+        if (auto group = std::dynamic_pointer_cast<GroupingExpr>(expr)) {
+            compileJump(group->expression, jumpIfTrue, jumps, chunk);
+            return;
+        }
+        if (auto un = std::dynamic_pointer_cast<UnaryExpr>(expr); un && toLower(un->op) == "not") {
+            compileJump(un->right, !jumpIfTrue, jumps, chunk);
+            return;
+        }
+        if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr)) {
+            // For And jumping on false (or Or jumping on true) both operands
+            // share the target; otherwise the left one decides early by
+            // skipping past the right one.
+            if (bin->op == BinaryOp::AND || bin->op == BinaryOp::OR) {
+                bool isAnd = bin->op == BinaryOp::AND;
+                if (isAnd != jumpIfTrue) {
+                    compileJump(bin->left, jumpIfTrue, jumps, chunk);
+                    compileJump(bin->right, jumpIfTrue, jumps, chunk);
+                }
+                else {
+                    std::vector<int> skip;
+                    compileJump(bin->left, !jumpIfTrue, skip, chunk);
+                    compileJump(bin->right, jumpIfTrue, jumps, chunk);
+                    patchJumps(skip, chunk);
+                }
+                return;
+            }
+            int fused = -1;
+            switch (bin->op) {
+            case BinaryOp::LT: fused = OP_JUMP_IF_NOT_LT; break;
+            case BinaryOp::LE: fused = OP_JUMP_IF_NOT_LE; break;
+            case BinaryOp::GT: fused = OP_JUMP_IF_NOT_GT; break;
+            case BinaryOp::GE: fused = OP_JUMP_IF_NOT_GE; break;
+            case BinaryOp::EQ: fused = OP_JUMP_IF_NOT_EQ; break;
+            case BinaryOp::NE: fused = OP_JUMP_IF_NOT_NE; break;
+            default: break;
+            }
+            if (fused >= 0 && !jumpIfTrue) {
+                compileExpr(bin->left, chunk);
+                compileExpr(bin->right, chunk);
+                jumps.push_back(chunk.code.size());
+                emitWithOperand(chunk, fused, 0);
+                return;
+            }
+        }
+        compileExpr(expr, chunk);
+        jumps.push_back(chunk.code.size());
+        emitWithOperand(chunk, jumpIfTrue ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE, 0);
+    }
+    void patchJumps(const std::vector<int>& jumps, ObjFunction::CodeChunk& chunk) {
+        for (int jump : jumps)
+            chunk.code[jump + 1] = chunk.code.size();
+    }
+
+    // Inside a method a name that is not a local is looked up on self first.
+    bool selfFieldAccess(const std::string& name) {
+        SymbolId sym = intern(name);
+        return currentScope && currentScope->isMethod && sym != SYM_MICROSECONDS && sym != SYM_TICKS;
+    }
+    void emitGetVariable(const std::string& name, ObjFunction::CodeChunk& chunk) {
+        int slot = resolveLocal(name);
+        if (slot >= 0) {
+            emitWithOperand(chunk, OP_GET_LOCAL, slot);
+        }
+        else if (selfFieldAccess(name)) {
+            emitWithCache(chunk, OP_GET_SELF_FIELD, name);
+        }
+        else {
+            emitWithOperand(chunk, OP_GET_GLOBAL, intern(name));
+        }
+    }
+    void emitSetVariable(const std::string& name, ObjFunction::CodeChunk& chunk) {
+        int slot = resolveLocal(name);
+        if (slot >= 0) {
+            emitWithOperand(chunk, OP_SET_LOCAL, slot);
+        }
+        else if (selfFieldAccess(name)) {
+            emitWithCache(chunk, OP_SET_SELF_FIELD, name);
+        }
+        else {
+            emitWithOperand(chunk, OP_SET_GLOBAL, intern(name));
+        }
+    }
+
+    void emit(ObjFunction::CodeChunk& chunk, int byte) {
+        chunk.code.push_back(byte);
+    }
+    void emitWithOperand(ObjFunction::CodeChunk& chunk, int opcode, int operand) {
+        emit(chunk, opcode);
+        emit(chunk, operand);
+    }
+    // Property and method sites: the name, then the site's inline cache.
+    void emitWithCache(ObjFunction::CodeChunk& chunk, int opcode, const std::string& name) {
+        emitWithOperand(chunk, opcode, intern(name));
+        emit(chunk, addInlineCache(chunk));
+    }
+    void compileStmt(std::shared_ptr<Stmt> stmt, ObjFunction::CodeChunk& chunk) {
+        if (auto modStmt = std::dynamic_pointer_cast<ModuleStmt>(stmt)) {
+            auto previousEnv = vm.environment;
+            auto moduleEnv = std::make_shared<Environment>(previousEnv);
+            vm.environment = moduleEnv;
+            bool oldCompilingModule = compilingModule;
+            compilingModule = true;
+            currentModuleName = toLower(modStmt->name);
+            currentModulePublicMembers.clear();
+            for (auto s : modStmt->body)
+                compileStmt(s, chunk);
+            auto moduleObj = makeRef<ObjModule>();
+            moduleObj->name = currentModuleName;
+            moduleObj->publicMembers = currentModulePublicMembers;
+            vm.environment = previousEnv;
+            compilingModule = oldCompilingModule;
+            compiledModules[currentModuleName] = moduleObj;
+            vm.environment->define(toLower(currentModuleName), Value(moduleObj));
+            for (auto& entry : currentModulePublicMembers) {
+                vm.environment->define(entry.first, entry.second);
+            }
+            return;
+        }
+        else if (auto declStmt = std::dynamic_pointer_cast<DeclareStmt>(stmt)) {
+            compileDeclare(declStmt, chunk);
+        }
+        else if (auto enumStmt = std::dynamic_pointer_cast<EnumStmt>(stmt)) {
+            auto enumObj = makeRef<ObjEnum>();
+            enumObj->name = toLower(enumStmt->name);
+            for (auto& member : enumStmt->members)
+                enumObj->members[intern(member.first)] = member.second;
+            compiledEnums[toLower(enumStmt->name)] = enumObj;
+            if (!compilingModule) {
+                int enumConstant = addConstant(chunk, Value(enumObj));
+                emitWithOperand(chunk, OP_CONSTANT, enumConstant);
+                emitWithOperand(chunk, OP_DEFINE_GLOBAL, intern(enumStmt->name));
+            }
+            else {
+                currentModulePublicMembers[intern(enumStmt->name)] = Value(enumObj);
+                vm.environment->define(toLower(enumStmt->name), Value(enumObj));
+            }
+        }
+        else if (auto exprStmt = std::dynamic_pointer_cast<ExpressionStmt>(stmt)) {
+            compileExpr(exprStmt->expression, chunk);
+            emit(chunk, OP_POP);
+        }
+        else if (auto retStmt = std::dynamic_pointer_cast<ReturnStmt>(stmt)) {
+            if (auto call = std::dynamic_pointer_cast<CallExpr>(retStmt->value)) {
+                // Return f(...) reuses the current frame for script callees.
+                compileCall(call, chunk, true);
+            }
+            else if (retStmt->value)
+                compileExpr(retStmt->value, chunk);
+            else
+                emit(chunk, OP_NIL);
+            emit(chunk, OP_RETURN);
+        }
+        else if (auto funcStmt = std::dynamic_pointer_cast<FunctionStmt>(stmt)) {
+            Ref<ObjFunction> placeholder = makeRef<ObjFunction>();
+            placeholder->name = funcStmt->name;
+            int req = 0;
+            for (auto& p : funcStmt->params)
+                if (!p.optional) req++;
+            placeholder->arity = req;
+            placeholder->params = funcStmt->params;
+            vm.environment->define(toLower(funcStmt->name), Value(placeholder));
+            compileFunction(funcStmt);
+            vm.environment->assign(toLower(funcStmt->name), Value(lastFunction));
+            if (!compilingModule) {
+                int fnConst = addConstant(chunk, vm.environment->get(toLower(funcStmt->name)));
+                emitWithOperand(chunk, OP_CONSTANT, fnConst);
+                emitWithOperand(chunk, OP_DEFINE_GLOBAL, intern(funcStmt->name));
+            }
+            else {
+                if (funcStmt->access == AccessModifier::PUBLIC) {
+                    currentModulePublicMembers[intern(funcStmt->name)] = vm.environment->get(toLower(funcStmt->name));
+                }
+            }
+        }
+        else if (auto varStmt = std::dynamic_pointer_cast<VarStmt>(stmt)) {
+            if (varStmt->initializer)
+                compileExpr(varStmt->initializer, chunk);
+            else {
+                if (varStmt->varType == "integer" || varStmt->varType == "double")
+                    compileExpr(std::make_shared<LiteralExpr>(0), chunk);
+                else if (varStmt->varType == "boolean")
                     compileExpr(std::make_shared<LiteralExpr>(false), chunk);
                 else if (varStmt->varType == "string")
                     compileExpr(std::make_shared<LiteralExpr>(std::string("")), chunk);
                 else if (varStmt->varType == "color")
                     compileExpr(std::make_shared<LiteralExpr>(Color{ 0 }), chunk);
                 else if (varStmt->varType == "array")
-                    compileExpr(std::make_shared<LiteralExpr>(Value(std::make_shared<ObjArray>())), chunk);
+                    compileExpr(std::make_shared<LiteralExpr>(Value(makeRef<ObjArray>())), chunk);
                 else if (varStmt->varType == "pointer" || varStmt->varType == "ptr")
                     compileExpr(std::make_shared<LiteralExpr>(static_cast<void*>(nullptr)), chunk);
                 else
                     compileExpr(std::make_shared<LiteralExpr>(std::monostate{}), chunk);
             }
-            if (!compilingModule) {
-                int nameConst = addConstantString(chunk, toLower(varStmt->name));
-                emitWithOperand(chunk, OP_DEFINE_GLOBAL, nameConst);
+            if (currentScope) {
+                emitWithOperand(chunk, OP_SET_LOCAL, declareLocal(varStmt->name));
+            }
+            else if (!compilingModule) {
+                emitWithOperand(chunk, OP_DEFINE_GLOBAL, intern(varStmt->name));
             }
             else {
+                // Module variables are bound at compile time; drop the value.
+                emit(chunk, OP_POP);
                 if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(varStmt->initializer)) {
                     if (varStmt->access == AccessModifier::PUBLIC) {
-                        currentModulePublicMembers[toLower(varStmt->name)] = lit->value;
+                        currentModulePublicMembers[intern(varStmt->name)] = lit->value;
                     }
                     vm.environment->define(toLower(varStmt->name), lit->value);
                 }
             }
+            declareType(varStmt->name, staticTypeFromName(varStmt->varType));
         }
         else if (auto classStmt = std::dynamic_pointer_cast<ClassStmt>(stmt)) {
             int nameConst = addConstantString(chunk, toLower(classStmt->name));
             emitWithOperand(chunk, OP_CLASS, nameConst);
             for (auto method : classStmt->methods) {
-                compileFunction(method);
+                compileFunction(method, true);
                 int fnConst = addConstant(chunk, Value(lastFunction));
                 emitWithOperand(chunk, OP_CONSTANT, fnConst);
-                int methodNameConst = addConstantString(chunk, toLower(method->name));
-                emitWithOperand(chunk, OP_METHOD, methodNameConst);
+                emitWithOperand(chunk, OP_METHOD, intern(method->name));
             }
             if (!classStmt->properties.empty()) {
                 int propConst = addConstant(chunk, Value(classStmt->properties));
                 emitWithOperand(chunk, OP_PROPERTIES, propConst);
             }
-            int classNameConst = addConstantString(chunk, toLower(classStmt->name));
-            emitWithOperand(chunk, OP_DEFINE_GLOBAL, classNameConst);
+            emitWithOperand(chunk, OP_DEFINE_GLOBAL, intern(classStmt->name));
         }
         else if (auto propAssign = std::dynamic_pointer_cast<PropertyAssignmentStmt>(stmt)) {
             compileExpr(propAssign->object, chunk);
             compileExpr(propAssign->value, chunk);
-            int propConst = addConstantString(chunk, toLower(propAssign->property));
-            emitWithOperand(chunk, OP_SET_PROPERTY, propConst);
+            emitWithCache(chunk, OP_SET_PROPERTY, propAssign->property);
         }
         else if (auto assignStmt = std::dynamic_pointer_cast<AssignmentStmt>(stmt)) {
-            compileExpr(std::make_shared<VariableExpr>(assignStmt->name), chunk);
             compileExpr(assignStmt->value, chunk);
-            int nameConst = addConstantString(chunk, toLower(assignStmt->name));
-            emitWithOperand(chunk, OP_SET_GLOBAL, nameConst);
+            emitSetVariable(assignStmt->name, chunk);
         }
         else if (auto setProp = std::dynamic_pointer_cast<SetPropExpr>(stmt)) {
             compileExpr(setProp->object, chunk);
             compileExpr(setProp->value, chunk);
-            int propConst = addConstantString(chunk, toLower(setProp->name));
-            emitWithOperand(chunk, OP_SET_PROPERTY, propConst);
+            emitWithCache(chunk, OP_SET_PROPERTY, setProp->name);
         }
         else if (auto ifStmt = std::dynamic_pointer_cast<IfStmt>(stmt)) {
-            compileExpr(ifStmt->condition, chunk);
-            int jumpIfFalsePos = chunk.code.size();
-            emitWithOperand(chunk, OP_JUMP_IF_FALSE, 0);
+            std::vector<int> toElse;
+            compileJump(ifStmt->condition, false, toElse, chunk);
             for (auto thenStmt : ifStmt->thenBranch)
                 compileStmt(thenStmt, chunk);
             int jumpPos = chunk.code.size();
             emitWithOperand(chunk, OP_JUMP, 0);
-            int elseStart = chunk.code.size();
-            chunk.code[jumpIfFalsePos + 1] = elseStart;
+            patchJumps(toElse, chunk);
             for (auto elseStmt : ifStmt->elseBranch)
                 compileStmt(elseStmt, chunk);
             int endIf = chunk.code.size();
@@ -2443,215 +4793,2521 @@ private:
         }
         else if (auto whileStmt = std::dynamic_pointer_cast<WhileStmt>(stmt)) {
             int loopStart = chunk.code.size();
-            compileExpr(whileStmt->condition, chunk);
-            int exitJumpPos = chunk.code.size();
-            emitWithOperand(chunk, OP_JUMP_IF_FALSE, 0);
+            std::vector<int> exits;
+            compileJump(whileStmt->condition, false, exits, chunk);
             for (auto bodyStmt : whileStmt->body)
                 compileStmt(bodyStmt, chunk);
             emitWithOperand(chunk, OP_JUMP, loopStart);
-            int loopEnd = chunk.code.size();
-            chunk.code[exitJumpPos + 1] = loopEnd;
+            patchJumps(exits, chunk);
+        }
+        else if (auto blockStmt = std::dynamic_pointer_cast<BlockStmt>(stmt)) {
+            for (auto s : blockStmt->statements)
+                compileStmt(s, chunk);
+        }
+        else if (auto forStmt = std::dynamic_pointer_cast<ForStmt>(stmt)) {
+            // The bound and step are evaluated once into hidden slots; the
+            // loop test runs once on entry, then on each OP_FOR_LOOP back edge.
+            compileStmt(std::make_shared<VarStmt>(forStmt->varName, forStmt->start, forStmt->varType), chunk);
+            int boundSlot = hiddenSlot(chunk);
+            compileExpr(forStmt->end, chunk);
+            emitWithOperand(chunk, OP_SET_LOCAL, boundSlot);
+            int stepSlot = hiddenSlot(chunk);
+            compileExpr(forStmt->step, chunk);
+            emitWithOperand(chunk, OP_SET_LOCAL, stepSlot);
+            emitGetVariable(forStmt->varName, chunk);
+            emitWithOperand(chunk, OP_GET_LOCAL, boundSlot);
+            int exitJumpPos = chunk.code.size();
+            emitWithOperand(chunk, forStmt->isDown ? OP_JUMP_IF_NOT_GE : OP_JUMP_IF_NOT_LE, 0);
+            int bodyStart = chunk.code.size();
+            for (auto bodyStmt : forStmt->body)
+                compileStmt(bodyStmt, chunk);
+            int counterSlot = resolveLocal(forStmt->varName);
+            if (counterSlot >= 0)
+                emitWithOperand(chunk, OP_FOR_LOOP, counterSlot);
+            else
+                emitWithOperand(chunk, OP_FOR_LOOP_GLOBAL, intern(forStmt->varName));
+            emit(chunk, boundSlot);
+            emit(chunk, stepSlot);
+            emit(chunk, forStmt->isDown);
+            emit(chunk, bodyStart);
+            chunk.code[exitJumpPos + 1] = chunk.code.size();
+        }
+        else if (auto select = std::dynamic_pointer_cast<SelectStmt>(stmt)) {
+            compileSelect(select, chunk);
+        }
+        else if (auto forEach = std::dynamic_pointer_cast<ForEachStmt>(stmt)) {
+            int arraySlot = hiddenSlot(chunk);
+            compileExpr(forEach->collection, chunk);
+            emitWithOperand(chunk, OP_SET_LOCAL, arraySlot);
+            int indexSlot = hiddenSlot(chunk);
+            emitWithOperand(chunk, OP_CONSTANT, addConstant(chunk, Value(0)));
+            emitWithOperand(chunk, OP_SET_LOCAL, indexSlot);
+            int loopStart = chunk.code.size();
+            emitWithOperand(chunk, OP_FOR_EACH, arraySlot);
+            emit(chunk, indexSlot);
+            int exitPos = chunk.code.size();
+            emit(chunk, 0);
+            if (currentScope)
+                emitWithOperand(chunk, OP_SET_LOCAL, declareLocal(forEach->varName));
+            else
+                emitWithOperand(chunk, OP_DEFINE_GLOBAL, intern(forEach->varName));
+            declareType(forEach->varName, staticTypeFromName(forEach->varType));
+            for (auto bodyStmt : forEach->body)
+                compileStmt(bodyStmt, chunk);
+            emitWithOperand(chunk, OP_JUMP, loopStart);
+            chunk.code[exitPos] = chunk.code.size();
+        }
+    }
+    // compileDeclare for API declarations using libffi
+    void compileDeclare(std::shared_ptr<DeclareStmt> declStmt, ObjFunction::CodeChunk& chunk) {
+        Value apiFunc = declaredFunction({
+            declStmt->params,
+            declStmt->returnType,
+            declStmt->apiName,
+            declStmt->libraryName
+        });
+        vm.environment->define(toLower(declStmt->apiName), apiFunc);
+        if (!compilingModule) {
+            int fnConst = addConstant(chunk, vm.environment->get(toLower(declStmt->apiName)));
+            emitWithOperand(chunk, OP_CONSTANT, fnConst);
+            emitWithOperand(chunk, OP_DEFINE_GLOBAL, intern(declStmt->apiName));
+        }
+        else {
+            currentModulePublicMembers[intern(declStmt->apiName)] = vm.environment->get(toLower(declStmt->apiName));
+        }
+    }
+    void compileExpr(std::shared_ptr<Expr> expr, ObjFunction::CodeChunk& chunk) {
+        if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(expr)) {
+            int constIndex = addConstant(chunk, lit->value);
+            emitWithOperand(chunk, OP_CONSTANT, constIndex);
+        }
+        else if (auto var = std::dynamic_pointer_cast<VariableExpr>(expr)) {
+            emitGetVariable(var->name, chunk);
+        }
+        else if (auto un = std::dynamic_pointer_cast<UnaryExpr>(expr)) {
+            compileExpr(un->right, chunk);
+            if (un->op == "-")
+                emit(chunk, OP_NEGATE);
+            else if (toLower(un->op) == "not")
+                emit(chunk, OP_NOT);
+        }
+        else if (auto assignExpr = std::dynamic_pointer_cast<AssignmentExpr>(expr)) {
+            compileExpr(std::make_shared<VariableExpr>(assignExpr->name), chunk);
+            compileExpr(assignExpr->value, chunk);
+            emitSetVariable(assignExpr->name, chunk);
+        }
+        else if (auto setProp = std::dynamic_pointer_cast<SetPropExpr>(expr)) {
+            // OP_SET_PROPERTY consumes the object; the expression's value is the object.
+            compileExpr(setProp->object, chunk);
+            emit(chunk, OP_DUP);
+            compileExpr(setProp->value, chunk);
+            emitWithCache(chunk, OP_SET_PROPERTY, setProp->name);
+        }
+        else if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr);
+                 bin && (bin->op == BinaryOp::AND || bin->op == BinaryOp::OR)) {
+            std::vector<int> toFalse;
+            compileJump(bin, false, toFalse, chunk);
+            emitWithOperand(chunk, OP_CONSTANT, addConstant(chunk, Value(true)));
+            int jumpPos = chunk.code.size();
+            emitWithOperand(chunk, OP_JUMP, 0);
+            patchJumps(toFalse, chunk);
+            emitWithOperand(chunk, OP_CONSTANT, addConstant(chunk, Value(false)));
+            chunk.code[jumpPos + 1] = chunk.code.size();
+        }
+        else if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr)) {
+            compileExpr(bin->left, chunk);
+            compileExpr(bin->right, chunk);
+            emit(chunk, binaryOpcode(bin->op, inferType(bin->left), inferType(bin->right)));
+        }
+        else if (auto group = std::dynamic_pointer_cast<GroupingExpr>(expr)) {
+            compileExpr(group->expression, chunk);
+        }
+        else if (auto call = std::dynamic_pointer_cast<CallExpr>(expr)) {
+            compileCall(call, chunk, false);
+        }
+        else if (auto arrLit = std::dynamic_pointer_cast<ArrayLiteralExpr>(expr)) {
+            for (auto& elem : arrLit->elements)
+                compileExpr(elem, chunk);
+            emitWithOperand(chunk, OP_ARRAY, arrLit->elements.size());
+        }
+        else if (auto getProp = std::dynamic_pointer_cast<GetPropExpr>(expr)) {
+            Value member;
+            if (staticMember(getProp, member))
+                emitWithOperand(chunk, OP_CONSTANT, addConstant(chunk, member));
+            else {
+                compileExpr(getProp->object, chunk);
+                emitWithCache(chunk, OP_GET_PROPERTY, getProp->name);
+            }
+        }
+        else if (auto newExpr = std::dynamic_pointer_cast<NewExpr>(expr)) {
+            emitWithOperand(chunk, OP_GET_GLOBAL, intern(newExpr->className));
+            emit(chunk, OP_NEW);
+            if (!newExpr->arguments.empty()) {
+                emit(chunk, OP_DUP);
+                emitWithCache(chunk, OP_GET_PROPERTY, "constructor");
+                for (auto& arg : newExpr->arguments)
+                    compileExpr(arg, chunk);
+                emitWithOperand(chunk, OP_OPTIONAL_CALL, newExpr->arguments.size());
+                emit(chunk, OP_CONSTRUCTOR_END);
+            }
+        }
+    }
+    // ------------------------------------------------------------------
+    // Select Case. The subject is evaluated once. When every case is an
+    // integer (or enum member) constant the clauses dispatch through a jump
+    // table, or a hash when the values are sparse; all-string cases hash.
+    // Ranges and computed cases test clause by clause in source order.
+    // ------------------------------------------------------------------
+    std::unordered_map<std::string, Ref<ObjEnum>> compiledEnums;
+    std::unordered_map<std::string, Ref<ObjModule>> compiledModules;
+
+    // Module members and enum values are fixed once compiled, so
+    // Module.Member and Enum.Value (also Module.Enum.Value) resolve to the
+    // member itself instead of a hash lookup on every access. Anything not
+    // yet compiled, or a name a variable could shadow, stays dynamic.
+    bool staticOwner(std::shared_ptr<Expr> expr, Value& out) {
+        if (auto var = std::dynamic_pointer_cast<VariableExpr>(expr)) {
+            std::string name = toLower(var->name);
+            if (resolveLocal(var->name) >= 0 || globalTypes.count(name))
+                return false;
+            if (auto mod = compiledModules.find(name); mod != compiledModules.end())
+                out = Value(mod->second);
+            else if (auto en = compiledEnums.find(name); en != compiledEnums.end())
+                out = Value(en->second);
+            else
+                return false;
+            return true;
+        }
+        auto getProp = std::dynamic_pointer_cast<GetPropExpr>(expr);
+        return getProp && staticMember(getProp, out) && out.type == ValueType::Enum;
+    }
+    bool staticMember(std::shared_ptr<GetPropExpr> getProp, Value& out) {
+        Value owner;
+        if (!staticOwner(getProp->object, owner))
+            return false;
+        SymbolId key = intern(getProp->name);
+        if (owner.type == ValueType::Module) {
+            auto& members = asObj<ObjModule>(owner)->publicMembers;
+            auto member = members.find(key);
+            if (member == members.end())
+                return false;
+            out = member->second;
+            return true;
+        }
+        auto& members = asObj<ObjEnum>(owner)->members;
+        auto member = members.find(key);
+        if (member == members.end())
+            return false;
+        out = Value(member->second);
+        return true;
+    }
+
+    bool caseConstant(std::shared_ptr<Expr> expr, Value& out) {
+        if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(expr)) {
+            if (lit->value.type != ValueType::Int && lit->value.type != ValueType::String)
+                return false;
+            out = lit->value;
+            return true;
+        }
+        if (auto un = std::dynamic_pointer_cast<UnaryExpr>(expr)) {
+            auto lit = std::dynamic_pointer_cast<LiteralExpr>(un->right);
+            if (un->op != "-" || !lit || lit->value.type != ValueType::Int)
+                return false;
+            out = Value(-lit->value.as.i);
+            return true;
+        }
+        if (auto getProp = std::dynamic_pointer_cast<GetPropExpr>(expr))
+            return staticMember(getProp, out) && out.type == ValueType::Int;
+        return false;
+    }
+    void compileSelect(std::shared_ptr<SelectStmt> select, ObjFunction::CodeChunk& chunk) {
+        std::vector<std::pair<Value, size_t>> keys; // Constant case value, clause index
+        bool allInts = true, allStrings = true;
+        for (size_t i = 0; i < select->clauses.size(); i++) {
+            for (auto& item : select->clauses[i].items) {
+                Value key;
+                if (item.rangeEnd || !caseConstant(item.value, key)) {
+                    allInts = allStrings = false;
+                    break;
+                }
+                allInts = allInts && key.type == ValueType::Int;
+                allStrings = allStrings && key.type == ValueType::String;
+                keys.push_back({ key, i });
+            }
+        }
+        compileExpr(select->subject, chunk);
+        std::vector<int> clauseStart(select->clauses.size(), 0);
+        std::vector<int> endJumps;
+        int defaultClause = -1;
+        for (size_t i = 0; i < select->clauses.size(); i++) {
+            if (select->clauses[i].isDefault)
+                defaultClause = i;
+        }
+        if (!keys.empty() && (allInts || allStrings)) {
+            int low = 0, high = 0;
+            if (allInts) {
+                low = high = keys[0].first.as.i;
+                for (auto& key : keys) {
+                    low = std::min(low, key.first.as.i);
+                    high = std::max(high, key.first.as.i);
+                }
+            }
+            long long span = (long long)high - low + 1;
+            bool dense = allInts && span <= 1024 && span <= 4 * (long long)keys.size();
+            int tableIndex = chunk.switchTables.size();
+            chunk.switchTables.emplace_back();
+            emitWithOperand(chunk, dense ? OP_JUMP_TABLE : OP_SWITCH_HASH, tableIndex);
+            for (size_t i = 0; i < select->clauses.size(); i++) {
+                if ((int)i == defaultClause)
+                    continue;
+                clauseStart[i] = chunk.code.size();
+                for (auto bodyStmt : select->clauses[i].statements)
+                    compileStmt(bodyStmt, chunk);
+                endJumps.push_back(chunk.code.size());
+                emitWithOperand(chunk, OP_JUMP, 0);
+            }
+            int defaultStart = chunk.code.size();
+            if (defaultClause >= 0) {
+                for (auto bodyStmt : select->clauses[defaultClause].statements)
+                    compileStmt(bodyStmt, chunk);
+            }
+            SwitchTable& table = chunk.switchTables[tableIndex];
+            table.defaultTarget = defaultStart;
+            if (dense) {
+                table.low = low;
+                table.targets.assign(span, defaultStart);
+            }
+            // Walk keys backwards so the first clause listing a value wins.
+            for (auto it = keys.rbegin(); it != keys.rend(); ++it) {
+                int target = clauseStart[it->second];
+                if (dense)
+                    table.targets[it->first.as.i - low] = target;
+                else if (allInts)
+                    table.intTargets[it->first.as.i] = target;
+                else
+                    table.stringTargets[getVal<std::string>(it->first)] = target;
+            }
+        }
+        else {
+            int subjectSlot = hiddenSlot(chunk);
+            emitWithOperand(chunk, OP_SET_LOCAL, subjectSlot);
+            for (size_t i = 0; i < select->clauses.size(); i++) {
+                const SelectStmt::Clause& clause = select->clauses[i];
+                if (clause.isDefault)
+                    continue;
+                // Each item jumps to the body on a match; the last one falls
+                // into it, or on to the next clause.
+                std::vector<int> toBody, toNextClause;
+                for (size_t k = 0; k < clause.items.size(); k++) {
+                    const SelectStmt::CaseItem& item = clause.items[k];
+                    std::vector<int> misses;
+                    emitWithOperand(chunk, OP_GET_LOCAL, subjectSlot);
+                    compileExpr(item.value, chunk);
+                    misses.push_back(chunk.code.size());
+                    emitWithOperand(chunk, item.rangeEnd ? OP_JUMP_IF_NOT_GE : OP_JUMP_IF_NOT_EQ, 0);
+                    if (item.rangeEnd) {
+                        emitWithOperand(chunk, OP_GET_LOCAL, subjectSlot);
+                        compileExpr(item.rangeEnd, chunk);
+                        misses.push_back(chunk.code.size());
+                        emitWithOperand(chunk, OP_JUMP_IF_NOT_LE, 0);
+                    }
+                    if (k + 1 < clause.items.size()) {
+                        toBody.push_back(chunk.code.size());
+                        emitWithOperand(chunk, OP_JUMP, 0);
+                        for (int miss : misses)
+                            chunk.code[miss + 1] = chunk.code.size();
+                    }
+                    else
+                        toNextClause = misses;
+                }
+                for (int jump : toBody)
+                    chunk.code[jump + 1] = chunk.code.size();
+                for (auto bodyStmt : clause.statements)
+                    compileStmt(bodyStmt, chunk);
+                endJumps.push_back(chunk.code.size());
+                emitWithOperand(chunk, OP_JUMP, 0);
+                for (int miss : toNextClause)
+                    chunk.code[miss + 1] = chunk.code.size();
+            }
+            if (defaultClause >= 0) {
+                for (auto bodyStmt : select->clauses[defaultClause].statements)
+                    compileStmt(bodyStmt, chunk);
+            }
+        }
+        for (int jump : endJumps)
+            chunk.code[jump + 1] = chunk.code.size();
+    }
+
+    // obj.Method(args) invokes the method on the receiver directly; anything
+    // else evaluates the callee and calls it.
+    void compileCall(std::shared_ptr<CallExpr> call, ObjFunction::CodeChunk& chunk, bool tail) {
+        auto getProp = std::dynamic_pointer_cast<GetPropExpr>(call->callee);
+        Value member;
+        if (getProp && staticMember(getProp, member)) {
+            // Module.Function(...): the callee is known, so call it directly.
+            emitWithOperand(chunk, OP_CONSTANT, addConstant(chunk, member));
+            getProp = nullptr;
+        }
+        else
+            compileExpr(getProp ? getProp->object : call->callee, chunk);
+        for (auto arg : call->arguments)
+            compileExpr(arg, chunk);
+        if (getProp) {
+            emitWithOperand(chunk, tail ? OP_TAIL_INVOKE : OP_INVOKE, intern(getProp->name));
+            emit(chunk, call->arguments.size());
+            emit(chunk, addInlineCache(chunk));
+        }
+        else
+            emitWithOperand(chunk, tail ? OP_TAIL_CALL : OP_CALL, call->arguments.size());
+    }
+    Ref<ObjFunction> lastFunction;
+    void compileFunction(std::shared_ptr<FunctionStmt> funcStmt, bool isMethod = false) {
+        auto function = makeRef<ObjFunction>();
+        function->name = funcStmt->name;
+        function->isMethod = isMethod;
+        int req = 0;
+        for (auto& p : funcStmt->params)
+            if (!p.optional) req++;
+        function->arity = req;
+        function->params = funcStmt->params;
+        ObjFunction::CodeChunk fnChunk;
+        FunctionScope scope;
+        FunctionScope* enclosingScope = currentScope;
+        currentScope = &scope;
+        scope.isMethod = isMethod;
+        if (isMethod)
+            declareLocal("self");
+        for (auto& p : funcStmt->params) {
+            declareLocal(p.name);
+            declareType(p.name, staticTypeFromName(p.type));
+        }
+        for (auto stmt : funcStmt->body)
+            compileStmt(stmt, fnChunk);
+        emit(fnChunk, OP_NIL);
+        emit(fnChunk, OP_RETURN);
+        currentScope = enclosingScope;
+        fnChunk.localCount = scope.localCount;
+        peephole(fnChunk, isMethod);
+        verifyChunk(fnChunk, function->name);
+        encodeChunk(fnChunk);
+        function->chunk = fnChunk;
+        if (REGISTER_VM) {
+            RegisterCompiler registerCompiler([this](const std::shared_ptr<GetPropExpr>& getProp, Value& member) {
+                return staticMember(getProp, member);
+            });
+            if (registerCompiler.compile(funcStmt, *function))
+                debugLog("Compiler: " + function->name + " also compiled for the register tier.");
+            else
+                std::cerr << "Notice: --vm register: " << function->name << " runs on the stack VM because it uses "
+                          << registerCompiler.unsupported() << "." << std::endl;
+        }
+        lastFunction = function;
+        debugLog("Compiler: Compiled function: " + function->name + " with required arity " + std::to_string(function->arity));
+    }
+};
+
+// ============================================================================  
+// Virtual Machine Execution
+// ============================================================================
+// ----------------------------------------------------------------------------  
+// Debug trace for one instruction: the stack it sees, then the instruction.
+// ----------------------------------------------------------------------------
+void traceInstruction(VM& vm, int ip, int instruction) {
+    std::string s = "[";
+    for (auto& v : vm.stack)
+        s += valueToString(v) + ", ";
+    s += "]";
+    debugLog("VM: Stack: " + s);
+    debugLog("VM: IP " + std::to_string(ip) + ": Executing " + opcodeToString(instruction));
+}
+
+// ----------------------------------------------------------------------------  
+// Opcode pair profile (--profile): how often each opcode directly follows
+// another, across calls and returns. Frequent pairs are the candidates for
+// superinstructions.
+// ----------------------------------------------------------------------------
+inline void countOpcodePair(VM& vm, int instruction) {
+    if (vm.pairCounts.empty())
+        vm.pairCounts.assign(OP_COUNT * OP_COUNT, 0);
+    if (vm.previousOpcode >= 0)
+        vm.pairCounts[vm.previousOpcode * OP_COUNT + instruction]++;
+    vm.previousOpcode = instruction;
+}
+
+void reportOpcodePairs(const VM& vm, size_t top = 20) {
+    std::vector<std::pair<uint64_t, int>> pairs;
+    uint64_t total = 0;
+    for (size_t i = 0; i < vm.pairCounts.size(); i++) {
+        total += vm.pairCounts[i];
+        if (vm.pairCounts[i])
+            pairs.push_back({ vm.pairCounts[i], (int)i });
+    }
+    std::sort(pairs.begin(), pairs.end(), std::greater<>());
+    std::cerr << "[PROFILE] " << total << " opcode pairs, most frequent first:" << std::endl;
+    for (size_t i = 0; i < pairs.size() && i < top; i++) {
+        std::cerr << "[PROFILE] " << std::setw(12) << pairs[i].first << "  " << std::fixed << std::setprecision(1)
+                  << std::setw(5) << 100.0 * pairs[i].first / total << "%  "
+                  << opcodeToString(pairs[i].second / OP_COUNT) << " -> " << opcodeToString(pairs[i].second % OP_COUNT) << std::endl;
+    }
+}
+
+// ----------------------------------------------------------------------------  
+// Call helpers shared by OP_CALL and OP_INVOKE.
+// ----------------------------------------------------------------------------
+// Returns the script function a call to `target` runs in a new frame, or
+// nullptr when the callee is handled natively. A bound instance method's
+// receiver replaces the callee slot so that it becomes the method's self.
+ObjFunction* resolveFrameCallee(Value& target, int argCount) {
+    ObjFunction* frameFn = nullptr;
+    if (holds<Ref<ObjFunction>>(target)) {
+        frameFn = asObj<ObjFunction>(target);
+        int total = frameFn->params.size();
+        int required = frameFn->arity;
+        if (argCount < required || argCount > total)
+            runtimeError("VM: Expected between " + std::to_string(required) + " and " + std::to_string(total) + " arguments for function " + frameFn->name);
+    }
+    else if (holds<std::vector<Ref<ObjFunction>>>(target)) {
+        frameFn = selectOverload(getVal<std::vector<Ref<ObjFunction>>>(target), argCount);
+        if (!frameFn)
+            runtimeError("VM: No matching overload found for function call with " + std::to_string(argCount) + " arguments.");
+    }
+    else if (holds<Ref<ObjBoundMethod>>(target)) {
+        auto bound = getVal<Ref<ObjBoundMethod>>(target);
+        if (holds<Ref<ObjInstance>>(bound->receiver)) {
+            const Value& methodVal = bound->method;
+            if (holds<Ref<ObjFunction>>(methodVal))
+                frameFn = asObj<ObjFunction>(methodVal);
+            else if (holds<std::vector<Ref<ObjFunction>>>(methodVal)) {
+                frameFn = selectOverload(getVal<std::vector<Ref<ObjFunction>>>(methodVal), argCount);
+                if (!frameFn)
+                    runtimeError("VM: No matching method found for " + symbolName(bound->name));
+            }
+            else if (!holds<BuiltinFn>(methodVal))
+                runtimeError("VM: No matching method found for " + symbolName(bound->name));
+            if (frameFn)
+                target = bound->receiver;
+        }
+    }
+    return frameFn;
+}
+
+// Starts a frame for fn over the callee slot at calleeIndex. A tail call
+// slides the callee and its arguments down over the finished frame instead.
+void enterCallee(VM& vm, ObjFunction* fn, size_t calleeIndex, int argCount, bool tail, int ip) {
+    if (tail) {
+        size_t stackBase = vm.frames.back().stackBase;
+        std::move(vm.stack.begin() + calleeIndex, vm.stack.end(), vm.stack.begin() + stackBase);
+        vm.stack.resize(stackBase + argCount + 1);
+        vm.frames.pop_back();
+        calleeIndex = stackBase;
+    }
+    else
+        vm.frames.back().ip = ip;
+    enterFunction(vm, fn, calleeIndex, argCount);
+}
+
+// Pops the arguments and callee and pushes the result of a native call:
+// builtins, plugin functions, array indexing and built-in array methods.
+void callNative(VM& vm, int argCount) {
+    std::vector<Value> args;
+    for (int i = 0; i < argCount; i++) {
+        args.push_back(pop(vm));
+    }
+    std::reverse(args.begin(), args.end());
+    Value callee = pop(vm);
+    DEBUG_LOG("VM: Calling function with " + std::to_string(argCount) + " arguments.");
+    if (holds<BuiltinFn>(callee)) {
+        BuiltinFn fn = getVal<BuiltinFn>(callee);
+        Value result = fn(args);
+        vm.stack.push_back(result);
+    }
+    else if (holds<Ref<ObjBoundMethod>>(callee)) {
+        auto bound = getVal<Ref<ObjBoundMethod>>(callee);
+        if (holds<Ref<ObjInstance>>(bound->receiver)) {
+            BuiltinFn fn = getVal<BuiltinFn>(bound->method);
+            Value result = fn(args);
+            vm.stack.push_back(result);
+        }
+        else if (holds<Ref<ObjArray>>(bound->receiver)) {
+            auto array = getVal<Ref<ObjArray>>(bound->receiver);
+            Value result = callArrayMethod(array, bound->name, args);
+            vm.stack.push_back(result);
+        }
+        else {
+            runtimeError("VM: Bound method receiver is of unsupported type.");
+        }
+    }
+    else if (holds<Ref<ObjArray>>(callee)) {
+        auto array = getVal<Ref<ObjArray>>(callee);
+        if (argCount != 1)
+            runtimeError("VM: Array call expects exactly 1 argument for indexing.");
+        Value indexVal = args[0];
+        int index;
+        if (holds<int>(indexVal))
+            index = getVal<int>(indexVal);
+        else
+            runtimeError("VM: Array index must be an integer.");
+        if (index < 0 || index >= (int)array->elements.size())
+            runtimeError("VM: Array index out of bounds.");
+        vm.stack.push_back(array->elements[index]);
+    }
+    else if (holds<std::string>(callee)) {
+        std::string funcName = toLower(getVal<std::string>(callee));
+        if (funcName == "print") {
+            if (args.size() < 1) runtimeError("VM: print expects an argument.");
+            std::cout << valueToString(args[0]) << std::endl;
+            vm.stack.push_back(args[0]);
+        }
+        else if (funcName == "str") {
+            if (args.size() < 1) runtimeError("VM: str expects an argument.");
+            vm.stack.push_back(Value(valueToString(args[0])));
+        }
+        else if (funcName == "ticks") {
+            auto now = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(now - startTime).count();
+            int ticks = static_cast<int>(seconds * 60);
+            vm.stack.push_back(ticks);
+        }
+        else if (funcName == "microseconds") {
+            auto now = std::chrono::steady_clock::now();
+            double us = std::chrono::duration<double, std::micro>(now - startTime).count();
+            vm.stack.push_back(us);
+        }
+        else if (funcName == "val") {
+            if (args.size() != 1)
+                runtimeError("VM: val expects exactly one argument.");
+            if (!holds<std::string>(args[0]))
+                runtimeError("VM: val expects a string argument.");
+            double d = std::stod(getVal<std::string>(args[0]));
+            vm.stack.push_back(d);
+        }
+        else {
+            runtimeError("VM: Unknown built-in function: " + funcName);
+        }
+    }
+    else {
+        runtimeError("VM: Can only call functions, methods, arrays, or built-in functions.");
+    }
+}
+
+// Property lookup after the inline cache missed; records what the name
+// resolved to for the object's class.
+Value getProperty(const Value& object, SymbolId key, InlineCache& cache) {
+    if (holds<Ref<ObjInstance>>(object)) {
+        auto instance = getVal<Ref<ObjInstance>>(object);
+        if (instance->klass->isPlugin) {
+            auto it = instance->klass->pluginProperties.find(key);
+            if (it != instance->klass->pluginProperties.end()) {
+                BuiltinFn getter = it->second.first;
+                DEBUG_LOG("OP_GET_PROPERTY: Calling plugin getter for property '" + symbolName(key) + "'");
+                Value result = getter({ Value(instance->pluginInstance) });
+                DEBUG_LOG("OP_GET_PROPERTY: Plugin getter returned type: " + getTypeName(result) +
+                          " value: " + valueToString(result));
+                return result;
+            }
+            else {
+                // If no explicit getter, return a target identifier string for events.
+                int handle = *(int*)&(instance->pluginInstance);
+                std::string target = "plugin:" + std::to_string(handle) + ":" + symbolName(key);
+                return Value(target);
+            }
+        }
+        else {
+            ObjClass* klass = instance->klass.get();
+            auto slot = klass->fieldSlots.find(key);
+            auto method = klass->methods.end();
+            if (slot != klass->fieldSlots.end()) {
+                cache.add(klass->shapeId, slot->second, nullptr);
+                return instance->fields[slot->second];
+            }
+            else if (Value* field = instance->findField(key)) {
+                return *field;
+            }
+            else if ((method = klass->methods.find(key)) != klass->methods.end()) {
+                const InlineCache::Entry* hit = cache.find(klass->shapeId);
+                if (!hit)
+                    cache.add(klass->shapeId, -1, &method->second);
+                auto bound = makeRef<ObjBoundMethod>();
+                bound->receiver = object;
+                bound->name = key;
+                bound->method = hit ? *hit->method : method->second;
+                return Value(bound);
+            }
+            else if (key == SYM_TOSTRING) {
+                return valueToString(object);
+            }
+            else {
+                if (key == SYM_CONSTRUCTOR) {
+                    return Value(std::monostate{});
+                }
+                else {
+                    runtimeError("VM: NilObjectException for property: " + symbolName(key));
+                }
+            }
+        }
+    }
+    else if (holds<Ref<ObjArray>>(object)) {
+        auto bound = makeRef<ObjBoundMethod>();
+        bound->receiver = object;
+        bound->name = key;
+        return Value(bound);
+    }
+    else if (holds<int>(object)) {
+        if (key == SYM_TOSTRING) {
+            return valueToString(object);
+        }
+        else {
+            runtimeError("VM: Unknown property for integer: " + symbolName(key));
+        }
+    }
+    else if (holds<double>(object)) {
+        if (key == SYM_TOSTRING) {
+            return valueToString(object);
+        }
+        else {
+            runtimeError("VM: Unknown property for double: " + symbolName(key));
+        }
+    }
+    else if (holds<std::string>(object)) {
+        if (key == SYM_TOSTRING) {
+            return object;
+        }
+        else {
+            runtimeError("VM: Unknown property for string: " + symbolName(key));
+        }
+    }
+    else if (holds<Ref<ObjModule>>(object)) {
+        auto module = getVal<Ref<ObjModule>>(object);
+        auto member = module->publicMembers.find(key);
+        if (member != module->publicMembers.end())
+            return member->second;
+        else
+            runtimeError("VM: NilObjectException module property: " + symbolName(key));
+    }
+    else if (holds<Ref<ObjEnum>>(object)) {
+        auto en = getVal<Ref<ObjEnum>>(object);
+        auto member = en->members.find(key);
+        if (member != en->members.end()) {
+            return member->second;
+        }
+        else {
+            runtimeError("VM: NilObjectException enum member: " + symbolName(key));
+        }
+    }
+    else {
+        runtimeError("VM: Property access on unsupported type.");
+    }
+}
+
+// Property store after the inline cache missed; records the slot a declared
+// property was found in.
+void setProperty(const Value& object, SymbolId key, const Value& value, InlineCache& cache) {
+    if (holds<Ref<ObjInstance>>(object)) {
+        auto instance = getVal<Ref<ObjInstance>>(object);
+        if (instance->klass->isPlugin) {
+            auto it = instance->klass->pluginProperties.find(key);
+            if (it != instance->klass->pluginProperties.end()) {
+                BuiltinFn setter = it->second.second;
+                setter({ Value(instance->pluginInstance), value });
+            }
+            else {
+                instance->setField(key, value);
+            }
+        }
+        else {
+            auto slot = instance->klass->fieldSlots.find(key);
+            if (slot != instance->klass->fieldSlots.end())
+                cache.add(instance->klass->shapeId, slot->second, nullptr);
+            instance->setField(key, value);
+        }
+    }
+    else {
+        runtimeError("VM: Can only set properties on instances. Instead got type: " + getTypeName(object));
+    }
+}
+
+// receiver.key(args) for OP_INVOKE, with the receiver at receiverIndex and
+// the arguments above it. Returns the script function to run in a new frame
+// over receiverIndex. Otherwise the call has been made, its result replaces
+// the receiver and arguments, and nullptr is returned.
+inline ObjFunction* invokeTarget(VM& vm, SymbolId key, int argCount, InlineCache& cache, size_t receiverIndex) {
+    Value& receiver = vm.stack[receiverIndex];
+    ObjFunction* frameFn = nullptr;
+    if (receiver.type == ValueType::Instance) {
+        ObjInstance* instance = asObj<ObjInstance>(receiver);
+        ObjClass* klass = instance->klass.get();
+        const InlineCache::Entry* hit = nullptr;
+        // Extra fields can shadow methods, so only plain instances use the cache.
+        if (!klass->isPlugin && instance->extraFields.empty()) {
+            hit = cache.find(klass->shapeId);
+            if (!hit) {
+                auto slot = klass->fieldSlots.find(key);
+                auto method = klass->methods.find(key);
+                if (slot != klass->fieldSlots.end())
+                    cache.add(klass->shapeId, slot->second, nullptr);
+                else if (method != klass->methods.end())
+                    cache.add(klass->shapeId, -1, &method->second);
+                hit = cache.find(klass->shapeId);
+            }
+        }
+        if (hit && hit->slot >= 0) {
+            // A field holding a function or array is itself the callee.
+            Value field = instance->fields[hit->slot];
+            receiver = std::move(field);
+        }
+        else if (hit && holds<Ref<ObjFunction>>(*hit->method)) {
+            frameFn = asObj<ObjFunction>(*hit->method);
+        }
+        else if (hit && holds<std::vector<Ref<ObjFunction>>>(*hit->method)) {
+            frameFn = selectOverload(getVal<std::vector<Ref<ObjFunction>>>(*hit->method), argCount);
+            if (!frameFn)
+                runtimeError("VM: No matching method found for " + symbolName(key));
+        }
+        else if (klass->isPlugin && klass->methods.count(key)) {
+            // Plugin methods take the native instance handle first.
+            BuiltinFn fn = getVal<BuiltinFn>(klass->methods[key]);
+            std::vector<Value> args;
+            args.reserve(argCount + 1);
+            args.push_back(Value(instance->pluginInstance));
+            args.insert(args.end(), vm.stack.begin() + receiverIndex + 1, vm.stack.end());
+            Value result = fn(args);
+            vm.stack.resize(receiverIndex);
+            vm.stack.push_back(result);
+            return nullptr;
+        }
+        else {
+            Value callee = getProperty(receiver, key, cache);
+            vm.stack[receiverIndex] = std::move(callee);
+        }
+    }
+    else if (receiver.type == ValueType::Array) {
+        auto array = getVal<Ref<ObjArray>>(receiver);
+        std::vector<Value> args(vm.stack.begin() + receiverIndex + 1, vm.stack.end());
+        Value result = callArrayMethod(array, key, args);
+        vm.stack.resize(receiverIndex);
+        vm.stack.push_back(result);
+        return nullptr;
+    }
+    else {
+        Value callee = getProperty(receiver, key, cache);
+        vm.stack[receiverIndex] = std::move(callee);
+    }
+    if (!frameFn)
+        frameFn = resolveFrameCallee(vm.stack[receiverIndex], argCount);
+    if (!frameFn)
+        callNative(vm, argCount);
+    return frameFn;
+}
+
+// ----------------------------------------------------------------------------  
+// Quickening: rewrite the instruction at `at` in place. Only the opcode byte
+// changes, so operands and jump offsets stay valid.
+// ----------------------------------------------------------------------------
+inline void quicken(const ObjFunction::CodeChunk* chunk, int at, int op) {
+    const_cast<ObjFunction::CodeChunk*>(chunk)->bytecode[at] = op;
+}
+
+// The four bytes at `at` as a little-endian word. Operands of every width
+// are read this way and the bytes past them shifted out, so decoding does
+// not branch on the width; encodeChunk pads each chunk so this stays in bounds.
+inline uint32_t operandWord(const uint8_t* at) {
+    uint32_t word;
+    std::memcpy(&word, at, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap32(word);
+#endif
+    return word;
+}
+
+inline bool numericAsDouble(const Value& v, double& d) {
+    if (v.type == ValueType::Double)
+        d = v.as.d;
+    else if (v.type == ValueType::Int)
+        d = v.as.i;
+    else
+        return false;
+    return true;
+}
+
+// Guard for the quickened double ops: both numeric, at least one a Double.
+inline bool doubleOperands(const Value& a, const Value& b, double& ad, double& bd) {
+    return (a.type == ValueType::Double || b.type == ValueType::Double) &&
+           numericAsDouble(a, ad) && numericAsDouble(b, bd);
+}
+
+// Advances a For loop counter by step and reports whether it is still within
+// the bound. Integer loops stay on the first branch.
+inline bool forLoopStep(Value& counter, const Value& bound, const Value& step, bool down) {
+    if (counter.type == ValueType::Int && bound.type == ValueType::Int && step.type == ValueType::Int) {
+        counter.as.i += step.as.i;
+        return down ? counter.as.i >= bound.as.i : counter.as.i <= bound.as.i;
+    }
+    double c, b, s;
+    if (!numericAsDouble(counter, c) || !numericAsDouble(bound, b) || !numericAsDouble(step, s))
+        runtimeError("VM: For loop counter, bound and step must be numbers.");
+    if (counter.type == ValueType::Int && step.type == ValueType::Int)
+        counter.as.i += step.as.i;
+    else
+        counter = Value(c + s);
+    numericAsDouble(counter, c);
+    return down ? c >= b : c <= b;
+}
+
+// The generic comparison ops as a predicate, for the fused compare-and-jump
+// handlers once their integer fast path misses.
+inline bool compareValues(int op, const Value& a, const Value& b) {
+    if (a.type == ValueType::Int && b.type == ValueType::Int) {
+        switch (op) {
+        case OP_JUMP_IF_NOT_LT: return a.as.i < b.as.i;
+        case OP_JUMP_IF_NOT_LE: return a.as.i <= b.as.i;
+        case OP_JUMP_IF_NOT_GT: return a.as.i > b.as.i;
+        case OP_JUMP_IF_NOT_GE: return a.as.i >= b.as.i;
+        case OP_JUMP_IF_NOT_EQ: return a.as.i == b.as.i;
+        default:                return a.as.i != b.as.i;
+        }
+    }
+    if (op == OP_JUMP_IF_NOT_EQ || op == OP_JUMP_IF_NOT_NE) {
+        bool equal;
+        double ad, bd;
+        if (numericAsDouble(a, ad) && numericAsDouble(b, bd))
+            equal = ad == bd;
+        else if (a.type == ValueType::Bool && b.type == ValueType::Bool)
+            equal = a.as.b == b.as.b;
+        else if (a.type == ValueType::String && b.type == ValueType::String)
+            equal = getVal<std::string>(a) == getVal<std::string>(b);
+        else if (op == OP_JUMP_IF_NOT_NE)
+            runtimeError("VM: Operands are not comparable for '<>'.");
+        else
+            equal = false;
+        return op == OP_JUMP_IF_NOT_EQ ? equal : !equal;
+    }
+    double ad, bd;
+    if (!numericAsDouble(a, ad) || !numericAsDouble(b, bd))
+        runtimeError("VM: Value has unexpected type.");
+    switch (op) {
+    case OP_JUMP_IF_NOT_LT: return ad < bd;
+    case OP_JUMP_IF_NOT_LE: return ad <= bd;
+    case OP_JUMP_IF_NOT_GT: return ad > bd;
+    default:                return ad >= bd;
+    }
+}
+
+// The generic OP_ADD and OP_SUB, for the superinstructions' slow paths.
+inline Value addValues(const Value& a, const Value& b) {
+    if (holds<int>(a) && holds<int>(b))
+        return Value(getVal<int>(a) + getVal<int>(b));
+    if (holds<double>(a) || holds<double>(b)) {
+        double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
+        double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
+        return Value(ad + bd);
+    }
+    if (holds<std::string>(a) && holds<std::string>(b))
+        return Value(getVal<std::string>(a) + getVal<std::string>(b));
+    runtimeError("VM: Operands must be numbers or strings for addition.");
+}
+
+inline Value subValues(const Value& a, const Value& b) {
+    if (holds<int>(a) && holds<int>(b))
+        return Value(getVal<int>(a) - getVal<int>(b));
+    double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
+    double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
+    return Value(ad - bd);
+}
+
+// Caches the slot of a declared property of self found by selfField.
+inline void cacheSelfField(VM& vm, const Value* field, InlineCache& cache) {
+    const Value& self = vm.stack[vm.frames.back().slotBase];
+    if (!field || self.type != ValueType::Instance)
+        return;
+    ObjInstance* instance = asObj<ObjInstance>(self);
+    if (field >= instance->fields.data() && field < instance->fields.data() + instance->fields.size())
+        cache.add(instance->klass->shapeId, static_cast<int>(field - instance->fields.data()), nullptr);
+}
+
+// Integer key for a Select Case subject. Doubles with an integral value match
+// integer cases, as they would with '='.
+inline bool switchIntKey(const Value& subject, int& key) {
+    if (subject.type == ValueType::Int) {
+        key = subject.as.i;
+        return true;
+    }
+    if (subject.type == ValueType::Double && subject.as.d == std::floor(subject.as.d) &&
+        subject.as.d >= INT_MIN && subject.as.d <= INT_MAX) {
+        key = static_cast<int>(subject.as.d);
+        return true;
+    }
+    return false;
+}
+
+// ============================================================================
+// Baseline JIT (--jit): translates a hot function's bytecode into x86-64
+// machine code, one template per opcode. Calls and loop back edges count
+// toward JIT_THRESHOLD; when a function crosses it the whole chunk is
+// compiled into mmap'd memory, and later calls and back edges enter the
+// native code instead of the dispatch loop.
+//
+// verifyChunk proved the operand stack depth at every instruction, so the
+// templates address stack cells at fixed offsets and never track a stack
+// pointer. Native code only ever holds Nil, Int, Double, Bool, Color and
+// Pointer values, which need no reference counting. Anything else - an
+// opcode without a template, an object operand, a type the fast path does
+// not cover - leaves the native code at the start of that instruction: the
+// cells are pushed back onto vm.stack and the interpreter carries on from
+// there, so the JIT never changes what a script does.
+// ============================================================================
+#if defined(__x86_64__) && !defined(_WIN32)
+#define XOJO_JIT
+#endif
+
+// Code compiled ahead of time (--aot) is plain C++ called as
+// fn(slots, cells, &depth, entry), with the same exits as the JIT's.
+using NativeFn = int (*)(Value* slots, Value* cells, int* depth, int entry);
+
+struct JitCode {
+    uint8_t* code = nullptr; // Executable mapping, or null if the chunk could not be compiled
+    size_t size = 0;
+    NativeFn native = nullptr; // Set instead of code for an AOT-compiled function
+    std::vector<int> entries; // Bytecode position -> offset into code (>= 0 for native), or -1
+    ~JitCode() {
+#ifdef XOJO_JIT
+        if (code)
+            munmap(code, size);
+#endif
+    }
+};
+
+// A chunk's instructions in order; indexAt maps the byte position each one
+// starts at to its index, and is -1 elsewhere.
+std::vector<DecodedInstruction> decodeChunk(const ObjFunction::CodeChunk& chunk, std::vector<int>& indexAt) {
+    std::vector<DecodedInstruction> program;
+    const int size = chunk.bytecode.size() - BYTECODE_PADDING;
+    indexAt.assign(size, -1);
+    for (int pos = 0; pos < size; ) {
+        indexAt[pos] = program.size();
+        program.push_back(decodeInstruction(chunk.bytecode, pos));
+        pos = program.back().next;
+    }
+    return program;
+}
+
+// Operand stack depth before each instruction, or -1 where unreachable: the
+// same propagation as verifyChunk, over the encoded instructions.
+std::vector<int> stackDepths(const ObjFunction::CodeChunk& chunk, const std::vector<DecodedInstruction>& program,
+                             const std::vector<int>& indexAt) {
+    std::vector<int> depth(program.size(), -1);
+    std::vector<int> work;
+    auto flowTo = [&](int pos, int d) {
+        int i = indexAt[pos];
+        if (depth[i] < 0) {
+            depth[i] = d;
+            work.push_back(i);
+        }
+    };
+    flowTo(0, 0);
+    while (!work.empty()) {
+        const DecodedInstruction& ins = program[work.back()];
+        int d = depth[work.back()];
+        work.pop_back();
+        std::vector<int> code = { ins.op };
+        code.insert(code.end(), ins.operands, ins.operands + operandCount(ins.op));
+        int pops, pushes;
+        stackEffect(code, 0, pops, pushes);
+        int after = d - pops + pushes;
+        if (ins.op == OP_RETURN)
+            continue;
+        if (ins.op == OP_JUMP_TABLE || ins.op == OP_SWITCH_HASH) {
+            SwitchTable table = chunk.switchTables[ins.operands[0]];
+            forEachSwitchTarget(table, [&](int& t) { flowTo(t, after); });
+            continue;
+        }
+        if (int at = jumpOperand(ins.op))
+            flowTo(ins.operands[at - 1], ins.op == OP_FOR_EACH ? d : after);
+        if (ins.op != OP_JUMP)
+            flowTo(ins.next, after);
+    }
+    return depth;
+}
+
+// Where native code is entered: the function's start, and the header of
+// every loop whose whole body has native code. Entering a loop that would
+// exit again on every iteration only adds the cost of the switch.
+std::vector<char> nativeEntries(const std::vector<DecodedInstruction>& program, const std::vector<int>& indexAt,
+                                const std::vector<int>& depth, const std::vector<char>& hasTemplate) {
+    std::vector<char> isEntry(program.size(), 0);
+    isEntry[0] = hasTemplate[0];
+    std::vector<char> mixedLoop(program.size(), 0);
+    for (size_t j = 0; j < program.size(); j++) {
+        const DecodedInstruction& ins = program[j];
+        if (!(ins.op == OP_JUMP && ins.operands[0] < ins.pos) && ins.op != OP_FOR_LOOP)
+            continue;
+        int header = indexAt[ins.operands[jumpOperand(ins.op) - 1]];
+        isEntry[header] = 1;
+        for (size_t i = header; i <= j; i++) {
+            if (depth[i] >= 0 && !hasTemplate[i] && program[i].op != OP_RETURN)
+                mixedLoop[header] = 1;
+        }
+    }
+    for (size_t i = 0; i < program.size(); i++)
+        isEntry[i] = isEntry[i] && !mixedLoop[i] && depth[i] == 0;
+    return isEntry;
+}
+
+#ifdef XOJO_JIT
+static_assert(sizeof(Value) == 16, "JIT templates address a Value's tag at +0 and payload at +8");
+
+// Just enough of an x86-64 assembler for the templates. Every memory operand
+// is [base + disp32], with bases that need no SIB byte.
+class X64Emitter {
+public:
+    enum Reg { RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7, R8 = 8, R9 = 9, R10 = 10 };
+    enum Cond { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_P = 0xA,
+                CC_NP = 0xB, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF };
+    struct Mem {
+        int base;
+        int32_t disp;
+    };
+    std::vector<uint8_t> code;
+
+    void byte(uint8_t b) { code.push_back(b); }
+    void bytes(std::initializer_list<uint8_t> bs) { code.insert(code.end(), bs); }
+    void dword(int32_t v) {
+        for (int i = 0; i < 4; i++)
+            byte(static_cast<uint32_t>(v) >> (8 * i));
+    }
+    // [prefix] [REX] opcode ModRM(reg, [base + disp32]) disp32
+    void memOp(std::initializer_list<uint8_t> opcode, int reg, Mem m, bool wide = false, uint8_t prefix = 0) {
+        if (prefix)
+            byte(prefix);
+        uint8_t rex = 0x40 | (wide ? 8 : 0) | (reg >= 8 ? 4 : 0) | (m.base >= 8 ? 1 : 0);
+        if (rex != 0x40)
+            byte(rex);
+        bytes(opcode);
+        byte(0x80 | (reg & 7) << 3 | (m.base & 7));
+        dword(m.disp);
+    }
+
+    int newLabel() {
+        labels.push_back(-1);
+        return labels.size() - 1;
+    }
+    void bind(int label) { labels[label] = code.size(); }
+    int offsetOf(int label) const { return labels[label]; }
+    void jmp(int label) {
+        byte(0xE9);
+        fixup(label);
+    }
+    void jcc(int cond, int label) {
+        bytes({ 0x0F, static_cast<uint8_t>(0x80 | cond) });
+        fixup(label);
+    }
+    // Patches every jump once all labels are bound.
+    void finish() {
+        for (auto& f : fixups) {
+            int32_t rel = labels[f.second] - (f.first + 4);
+            std::memcpy(&code[f.first], &rel, sizeof(rel));
+        }
+    }
+private:
+    std::vector<int> labels;
+    std::vector<std::pair<int, int>> fixups; // rel32 position, label
+    void fixup(int label) {
+        fixups.push_back({ (int)code.size(), label });
+        dword(0);
+    }
+};
+
+// Native code is called as fn(slots, cells, constants, &depth, entry): rdi
+// holds the frame slots, rsi the operand cells, r9 the constants and r10 the
+// exit depth. It only uses caller-saved registers and calls nothing.
+using JitFn = int (*)(Value* slots, Value* cells, const Value* constants, int* depth, const uint8_t* entry);
+
+class JitCompiler {
+public:
+    explicit JitCompiler(const ObjFunction::CodeChunk& chunk) : chunk(chunk) {}
+
+    std::shared_ptr<JitCode> compile() {
+        auto jit = std::make_shared<JitCode>();
+        std::vector<int> indexAt;
+        program = decodeChunk(chunk, indexAt);
+        depth = stackDepths(chunk, program, indexAt);
+
+        // Prologue: mov r9, rdx; mov r10, rcx; jmp r8
+        a.bytes({ 0x49, 0x89, 0xD1, 0x49, 0x89, 0xCA, 0x41, 0xFF, 0xE0 });
+        std::vector<char> hasTemplate(program.size(), 0);
+        for (size_t i = 0; i < program.size(); i++)
+            labels.push_back(a.newLabel());
+        for (size_t i = 0; i < program.size(); i++) {
+            a.bind(labels[i]);
+            if (depth[i] >= 0)
+                hasTemplate[i] = emitInstruction(program[i], depth[i], indexAt);
+        }
+
+        std::vector<char> isEntry = nativeEntries(program, indexAt, depth, hasTemplate);
+        // Exits: record the depth, return the bytecode position to resume at.
+        for (auto& stub : exitStubs) {
+            a.bind(stub.label);
+            a.memOp({ 0xC7 }, 0, { X64Emitter::R10, 0 });
+            a.dword(stub.depth);
+            a.byte(0xB8);
+            a.dword(stub.pos);
+            a.byte(0xC3);
+        }
+        a.finish();
+
+        void* memory = mmap(nullptr, a.code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return jit;
+        std::memcpy(memory, a.code.data(), a.code.size());
+        if (mprotect(memory, a.code.size(), PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, a.code.size());
+            return jit;
+        }
+        jit->code = static_cast<uint8_t*>(memory);
+        jit->size = a.code.size();
+        jit->entries.assign(indexAt.size(), -1);
+        for (size_t i = 0; i < program.size(); i++) {
+            if (isEntry[i])
+                jit->entries[program[i].pos] = a.offsetOf(labels[i]);
+        }
+        return jit;
+    }
+
+private:
+    using Mem = X64Emitter::Mem;
+    struct ExitStub {
+        int label, pos, depth;
+    };
+    const ObjFunction::CodeChunk& chunk;
+    std::vector<DecodedInstruction> program;
+    std::vector<int> depth;
+    std::vector<int> labels; // Per instruction
+    std::vector<ExitStub> exitStubs;
+    std::unordered_map<int, int> exitAt; // Bytecode position -> exit label
+    X64Emitter a;
+
+    static Mem slot(int k) { return { X64Emitter::RDI, 16 * k }; }
+    static Mem cell(int k) { return { X64Emitter::RSI, 16 * k }; }
+    static Mem constant(int k) { return { X64Emitter::R9, 16 * k }; }
+    static Mem payload(Mem m) { return { m.base, m.disp + 8 }; }
+
+    int exitLabel(const DecodedInstruction& ins, int d) {
+        auto it = exitAt.find(ins.pos);
+        if (it != exitAt.end())
+            return it->second;
+        int label = a.newLabel();
+        exitAt[ins.pos] = label;
+        exitStubs.push_back({ label, ins.pos, d });
+        return label;
+    }
+
+    void cmpType(Mem m, ValueType type) {
+        a.memOp({ 0x80 }, 7, m);
+        a.byte(static_cast<uint8_t>(type));
+    }
+    void setType(Mem m, ValueType type) {
+        a.memOp({ 0xC6 }, 0, m);
+        a.byte(static_cast<uint8_t>(type));
+    }
+    void copyValue(Mem to, Mem from) {
+        a.memOp({ 0x0F, 0x10 }, 0, from); // movups xmm0, from
+        a.memOp({ 0x0F, 0x11 }, 0, to);   // movups to, xmm0
+    }
+    void loadInt(Mem m) { a.memOp({ 0x8B }, X64Emitter::RAX, payload(m)); }
+    // Writes eax, zero-extended, as the payload of an Int or Bool.
+    void storeRax(Mem m) { a.memOp({ 0x89 }, X64Emitter::RAX, payload(m), true); }
+    void storeDouble(Mem m) {
+        a.memOp({ 0x0F, 0x11 }, 0, payload(m), false, 0xF2); // movsd [m], xmm0
+        setType(m, ValueType::Double);
+    }
+    // xmm<x> = m as a double, for Int and Double operands.
+    void loadDouble(int x, Mem m, int exit) {
+        int isInt = a.newLabel(), done = a.newLabel();
+        cmpType(m, ValueType::Int);
+        a.jcc(X64Emitter::CC_E, isInt);
+        cmpType(m, ValueType::Double);
+        a.jcc(X64Emitter::CC_NE, exit);
+        a.memOp({ 0x0F, 0x10 }, x, payload(m), false, 0xF2); // movsd
+        a.jmp(done);
+        a.bind(isInt);
+        a.memOp({ 0x0F, 0x2A }, x, payload(m), false, 0xF2); // cvtsi2sd
+        a.bind(done);
+    }
+    // Jumps to `notInts` unless both operands are Int.
+    void requireInts(Mem x, Mem y, int notInts) {
+        cmpType(x, ValueType::Int);
+        a.jcc(X64Emitter::CC_NE, notInts);
+        cmpType(y, ValueType::Int);
+        a.jcc(X64Emitter::CC_NE, notInts);
+    }
+
+    // ADD, SUB and MUL: Int with Int stays Int, otherwise numbers meet as doubles.
+    void arithmetic(Mem x, Mem y, std::initializer_list<uint8_t> intOp, uint8_t sseOp, int exit) {
+        int doubles = a.newLabel(), done = a.newLabel();
+        requireInts(x, y, doubles);
+        loadInt(x);
+        a.memOp(intOp, X64Emitter::RAX, payload(y));
+        storeRax(x);
+        a.jmp(done);
+        a.bind(doubles);
+        loadDouble(0, x, exit);
+        loadDouble(1, y, exit);
+        a.bytes({ 0xF2, 0x0F, sseOp, 0xC1 });
+        storeDouble(x);
+        a.bind(done);
+    }
+
+    // al = x <cmp> y, where cmp is an OP_JUMP_IF_NOT_* code as in compareValues.
+    void compare(int cmp, Mem x, Mem y, int exit) {
+        int doubles = a.newLabel(), done = a.newLabel();
+        requireInts(x, y, doubles);
+        loadInt(x);
+        a.memOp({ 0x3B }, X64Emitter::RAX, payload(y)); // cmp eax, y
+        int cc = cmp == OP_JUMP_IF_NOT_LT ? X64Emitter::CC_L : cmp == OP_JUMP_IF_NOT_LE ? X64Emitter::CC_LE
+               : cmp == OP_JUMP_IF_NOT_GT ? X64Emitter::CC_G : cmp == OP_JUMP_IF_NOT_GE ? X64Emitter::CC_GE
+               : cmp == OP_JUMP_IF_NOT_EQ ? X64Emitter::CC_E : X64Emitter::CC_NE;
+        a.bytes({ 0x0F, static_cast<uint8_t>(0x90 | cc), 0xC0 }); // setcc al
+        a.jmp(done);
+        a.bind(doubles);
+        loadDouble(0, x, exit);
+        loadDouble(1, y, exit);
+        // ucomisd leaves CF and ZF set when unordered, so a NaN compares false.
+        switch (cmp) {
+        case OP_JUMP_IF_NOT_LT: a.bytes({ 0x66, 0x0F, 0x2E, 0xC8, 0x0F, 0x97, 0xC0 }); break; // ucomisd xmm1, xmm0; seta al
+        case OP_JUMP_IF_NOT_LE: a.bytes({ 0x66, 0x0F, 0x2E, 0xC8, 0x0F, 0x93, 0xC0 }); break; // ucomisd xmm1, xmm0; setae al
+        case OP_JUMP_IF_NOT_GT: a.bytes({ 0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x97, 0xC0 }); break; // ucomisd xmm0, xmm1; seta al
+        case OP_JUMP_IF_NOT_GE: a.bytes({ 0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x93, 0xC0 }); break; // ucomisd xmm0, xmm1; setae al
+        case OP_JUMP_IF_NOT_EQ: // sete al; setnp cl; and al, cl
+            a.bytes({ 0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x94, 0xC0, 0x0F, 0x9B, 0xC1, 0x20, 0xC8 });
+            break;
+        default: // setne al; setp cl; or al, cl
+            a.bytes({ 0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x95, 0xC0, 0x0F, 0x9A, 0xC1, 0x08, 0xC8 });
+            break;
+        }
+        a.bind(done);
+    }
+
+    static int comparisonOf(int op) {
+        switch (op) {
+        case OP_LT: case OP_LT_INT: case OP_LT_DOUBLE: return OP_JUMP_IF_NOT_LT;
+        case OP_LE: case OP_LE_INT: case OP_LE_DOUBLE: return OP_JUMP_IF_NOT_LE;
+        case OP_GT: case OP_GT_INT: case OP_GT_DOUBLE: return OP_JUMP_IF_NOT_GT;
+        case OP_GE: case OP_GE_INT: case OP_GE_DOUBLE: return OP_JUMP_IF_NOT_GE;
+        case OP_EQ: case OP_EQ_INT: return OP_JUMP_IF_NOT_EQ;
+        case OP_NE: case OP_NE_INT: return OP_JUMP_IF_NOT_NE;
+        default: return op; // Already a fused jump's comparison
+        }
+    }
+
+    // Branches to `target` when the condition's truth (as isTruthy sees a
+    // Bool or Int) equals `when`.
+    void branchOnTruth(Mem c, bool when, int target, int exit) {
+        int isInt = a.newLabel(), done = a.newLabel();
+        int cc = when ? X64Emitter::CC_NE : X64Emitter::CC_E;
+        cmpType(c, ValueType::Bool);
+        a.jcc(X64Emitter::CC_NE, isInt);
+        a.memOp({ 0x80 }, 7, payload(c)); // cmp byte [c], 0
+        a.byte(0);
+        a.jcc(cc, target);
+        a.jmp(done);
+        a.bind(isInt);
+        cmpType(c, ValueType::Int);
+        a.jcc(X64Emitter::CC_NE, exit);
+        a.memOp({ 0x83 }, 7, payload(c)); // cmp dword [c], 0
+        a.byte(0);
+        a.jcc(cc, target);
+        a.bind(done);
+    }
+
+    bool isIntConstant(int k) const { return chunk.constants[k].type == ValueType::Int; }
+
+    // Emits the instruction's template and reports whether it has one;
+    // without one it is only a jump to its exit.
+    bool emitInstruction(const DecodedInstruction& ins, int d, const std::vector<int>& indexAt) {
+        const int* operand = ins.operands;
+        int exit = exitLabel(ins, d);
+        auto target = [&](int pos) { return labels[indexAt[pos]]; };
+        switch (ins.op) {
+        case OP_CONSTANT:
+            if (chunk.constants[operand[0]].isObject()) {
+                a.jmp(exit);
+                return false;
+            }
+            copyValue(cell(d), constant(operand[0]));
+            return true;
+        case OP_NIL:
+            setType(cell(d), ValueType::Nil);
+            a.memOp({ 0xC7 }, 0, payload(cell(d)), true); // mov qword [cell], 0
+            a.dword(0);
+            break;
+        case OP_GET_LOCAL:
+            cmpType(slot(operand[0]), ValueType::String);
+            a.jcc(X64Emitter::CC_AE, exit); // objects need reference counting
+            copyValue(cell(d), slot(operand[0]));
+            break;
+        case OP_SET_LOCAL:
+            cmpType(slot(operand[0]), ValueType::String);
+            a.jcc(X64Emitter::CC_AE, exit); // the old value needs releasing
+            copyValue(slot(operand[0]), cell(d - 1));
+            break;
+        case OP_POP:
+            break;
+        case OP_DUP:
+            copyValue(cell(d), cell(d - 1));
+            break;
+        case OP_ADD: case OP_ADD_INT: case OP_ADD_DOUBLE:
+            arithmetic(cell(d - 2), cell(d - 1), { 0x03 }, 0x58, exit);
+            break;
+        case OP_SUB: case OP_SUB_INT: case OP_SUB_DOUBLE:
+            arithmetic(cell(d - 2), cell(d - 1), { 0x2B }, 0x5C, exit);
+            break;
+        case OP_MUL: case OP_MUL_INT: case OP_MUL_DOUBLE:
+            arithmetic(cell(d - 2), cell(d - 1), { 0x0F, 0xAF }, 0x59, exit);
+            break;
+        case OP_DIV:
+            loadDouble(0, cell(d - 2), exit);
+            loadDouble(1, cell(d - 1), exit);
+            a.bytes({ 0xF2, 0x0F, 0x5E, 0xC1 }); // divsd xmm0, xmm1
+            storeDouble(cell(d - 2));
+            break;
+        case OP_MOD: {
+            // Integers only; a zero or -1 divisor is left to the interpreter.
+            Mem x = cell(d - 2), y = cell(d - 1);
+            requireInts(x, y, exit);
+            a.memOp({ 0x83 }, 7, payload(y)); // cmp dword [y], 0
+            a.byte(0);
+            a.jcc(X64Emitter::CC_E, exit);
+            a.memOp({ 0x83 }, 7, payload(y)); // cmp dword [y], -1
+            a.byte(0xFF);
+            a.jcc(X64Emitter::CC_E, exit);
+            loadInt(x);
+            a.byte(0x99);                     // cdq
+            a.memOp({ 0xF7 }, 7, payload(y)); // idiv dword [y]
+            a.bytes({ 0x89, 0xD0 });          // mov eax, edx
+            storeRax(x);
+            break;
+        }
+        case OP_NEGATE: {
+            Mem x = cell(d - 1);
+            int isDouble = a.newLabel(), done = a.newLabel();
+            cmpType(x, ValueType::Int);
+            a.jcc(X64Emitter::CC_NE, isDouble);
+            loadInt(x);
+            a.bytes({ 0xF7, 0xD8 }); // neg eax
+            storeRax(x);
+            a.jmp(done);
+            a.bind(isDouble);
+            cmpType(x, ValueType::Double);
+            a.jcc(X64Emitter::CC_NE, exit);
+            a.memOp({ 0x80 }, 6, { x.base, x.disp + 15 }); // flip the sign bit
+            a.byte(0x80);
+            a.bind(done);
+            break;
+        }
+        case OP_NOT:
+            cmpType(cell(d - 1), ValueType::Bool);
+            a.jcc(X64Emitter::CC_NE, exit);
+            a.memOp({ 0x80 }, 6, payload(cell(d - 1))); // xor byte [cell], 1
+            a.byte(1);
+            break;
+        case OP_LT: case OP_LE: case OP_GT: case OP_GE: case OP_EQ: case OP_NE:
+        case OP_LT_INT: case OP_LE_INT: case OP_GT_INT: case OP_GE_INT: case OP_EQ_INT: case OP_NE_INT:
+        case OP_LT_DOUBLE: case OP_LE_DOUBLE: case OP_GT_DOUBLE: case OP_GE_DOUBLE:
+            compare(comparisonOf(ins.op), cell(d - 2), cell(d - 1), exit);
+            a.bytes({ 0x0F, 0xB6, 0xC0 }); // movzx eax, al
+            storeRax(cell(d - 2));
+            setType(cell(d - 2), ValueType::Bool);
+            break;
+        case OP_JUMP_IF_NOT_LT: case OP_JUMP_IF_NOT_LE: case OP_JUMP_IF_NOT_GT:
+        case OP_JUMP_IF_NOT_GE: case OP_JUMP_IF_NOT_EQ: case OP_JUMP_IF_NOT_NE:
+            compare(ins.op, cell(d - 2), cell(d - 1), exit);
+            a.bytes({ 0x84, 0xC0 }); // test al, al
+            a.jcc(X64Emitter::CC_E, target(operand[0]));
+            break;
+        case OP_JUMP_IF_NOT_LOCAL_CONST:
+            compare(operand[0], slot(operand[1]), constant(operand[2]), exit);
+            a.bytes({ 0x84, 0xC0 });
+            a.jcc(X64Emitter::CC_E, target(operand[3]));
+            break;
+        case OP_JUMP_IF_NOT_LOCALS:
+            compare(operand[0], slot(operand[1]), slot(operand[2]), exit);
+            a.bytes({ 0x84, 0xC0 });
+            a.jcc(X64Emitter::CC_E, target(operand[3]));
+            break;
+        case OP_JUMP:
+            a.jmp(target(operand[0]));
+            break;
+        case OP_JUMP_IF_FALSE:
+            branchOnTruth(cell(d - 1), false, target(operand[0]), exit);
+            break;
+        case OP_JUMP_IF_TRUE:
+            branchOnTruth(cell(d - 1), true, target(operand[0]), exit);
+            break;
+        case OP_INC_LOCAL:
+        case OP_ADD_LOCAL_CONST:
+        case OP_SUB_LOCAL_CONST: {
+            if (!isIntConstant(operand[1])) {
+                a.jmp(exit);
+                return false;
+            }
+            cmpType(slot(operand[0]), ValueType::Int);
+            a.jcc(X64Emitter::CC_NE, exit);
+            loadInt(slot(operand[0]));
+            a.byte(ins.op == OP_SUB_LOCAL_CONST ? 0x2D : 0x05); // sub/add eax, imm32
+            a.dword(chunk.constants[operand[1]].as.i);
+            if (ins.op == OP_INC_LOCAL)
+                storeRax(slot(operand[0]));
+            else {
+                storeRax(cell(d));
+                setType(cell(d), ValueType::Int);
+            }
+            break;
+        }
+        case OP_FOR_LOOP: {
+            // Integer counters only: step, then loop while within the bound.
+            Mem counter = slot(operand[0]), bound = slot(operand[1]), step = slot(operand[2]);
+            requireInts(counter, step, exit);
+            cmpType(bound, ValueType::Int);
+            a.jcc(X64Emitter::CC_NE, exit);
+            loadInt(counter);
+            a.memOp({ 0x03 }, X64Emitter::RAX, payload(step)); // add eax, step
+            storeRax(counter);
+            a.memOp({ 0x3B }, X64Emitter::RAX, payload(bound)); // cmp eax, bound
+            a.jcc(operand[3] ? X64Emitter::CC_GE : X64Emitter::CC_LE, target(operand[4]));
+            break;
+        }
+        default:
+            a.jmp(exit);
+            return false;
+        }
+        return true;
+    }
+};
+
+std::shared_ptr<JitCode> compileJit(const ObjFunction& function) {
+    auto jit = JitCompiler(function.chunk).compile();
+    DEBUG_LOG("JIT: Compiled " + function.name + " to " + std::to_string(jit->size) + " bytes of native code.");
+    return jit;
+}
+#else
+std::shared_ptr<JitCode> compileJit(const ObjFunction&) {
+    return std::make_shared<JitCode>();
+}
+#endif
+
+// Counts a call or back edge of `function` and reports whether native code
+// can be entered at `ip`, compiling the function once it is hot.
+inline bool jitReady(ObjFunction* function, int ip) {
+    if (!function)
+        return false;
+    if (!function->jit) {
+        if (++function->hotness < JIT_THRESHOLD)
+            return false;
+        function->jit = compileJit(*function);
+    }
+    return (function->jit->code || function->jit->native) && function->jit->entries[ip] >= 0;
+}
+
+// Runs `function`'s native code from `ip` and returns the position the
+// interpreter resumes at, with the operand stack as the native code left it.
+int jitRun(VM& vm, ObjFunction* function, size_t slotBase, int ip) {
+    const JitCode& jit = *function->jit;
+    if (vm.jitCells.size() < (size_t)function->chunk.maxStack)
+        vm.jitCells.resize(function->chunk.maxStack);
+    int depth = 0;
+    int resume = ip;
+    if (jit.native)
+        resume = jit.native(vm.stack.data() + slotBase, vm.jitCells.data(), &depth, ip);
+#ifdef XOJO_JIT
+    else
+        resume = reinterpret_cast<JitFn>(jit.code)(vm.stack.data() + slotBase, vm.jitCells.data(),
+            function->chunk.constants.data(), &depth, jit.code + jit.entries[ip]);
+#endif
+    for (int i = 0; i < depth; i++)
+        vm.stack.push_back(vm.jitCells[i]);
+    return resume;
+}
+
+// ============================================================================
+// Ahead-of-time compilation (--aot): writes a compiled program out as a C++
+// translation unit that includes this file. The executable built from it
+// starts from the program image - symbol table, chunks, constants,
+// functions, enums, modules and declares - without lexing, parsing or
+// compiling anything. Each function also becomes a C++ function for the
+// instructions the JIT has templates for. Constants are inlined and operand
+// stack cells become locals, so on a statically typed path the C++ compiler
+// folds the type guards away and what is left is plain arithmetic. Anything
+// else runs on the interpreter, entered and left exactly as with the JIT.
+// ============================================================================
+
+// An operand stack cell of AOT-compiled code. Like the JIT's cells it only
+// ever holds values that need no reference counting.
+struct NativeCell {
+    ValueType type = ValueType::Nil;
+    decltype(Value::as) as = {};
+
+    static NativeCell ofInt(int i) { NativeCell c; c.type = ValueType::Int; c.as.i = i; return c; }
+    static NativeCell ofDouble(double d) { NativeCell c; c.type = ValueType::Double; c.as.d = d; return c; }
+    static NativeCell ofBool(bool b) { NativeCell c; c.type = ValueType::Bool; c.as.b = b; return c; }
+    static NativeCell ofColor(unsigned int color) { NativeCell c; c.type = ValueType::Color; c.as.color = color; return c; }
+};
+
+inline void loadCell(NativeCell& cell, const Value& v) { cell.type = v.type; cell.as = v.as; }
+// Only for a Value that holds no object, as the generated guards ensure.
+inline void storeCell(Value& v, const NativeCell& cell) { v.type = cell.type; v.as = cell.as; }
+
+// Integers wrap on overflow, as they do in the interpreter and the JIT.
+inline int wrapAdd(int a, int b) { return (int)((unsigned)a + (unsigned)b); }
+inline int wrapSub(int a, int b) { return (int)((unsigned)a - (unsigned)b); }
+inline int wrapMul(int a, int b) { return (int)((unsigned)a * (unsigned)b); }
+
+template <typename T>
+inline bool nativeNumber(const T& v, double& d) {
+    if (v.type == ValueType::Int)
+        d = v.as.i;
+    else if (v.type == ValueType::Double)
+        d = v.as.d;
+    else
+        return false;
+    return true;
+}
+
+// ADD, SUB and MUL: Int with Int stays Int, otherwise numbers meet as doubles.
+template <int Op>
+inline bool nativeArithmetic(NativeCell& x, const NativeCell& y) {
+    if (x.type == ValueType::Int && y.type == ValueType::Int) {
+        x.as.i = Op == OP_ADD ? wrapAdd(x.as.i, y.as.i) : Op == OP_SUB ? wrapSub(x.as.i, y.as.i) : wrapMul(x.as.i, y.as.i);
+        return true;
+    }
+    double a, b;
+    if (!nativeNumber(x, a) || !nativeNumber(y, b))
+        return false;
+    x = NativeCell::ofDouble(Op == OP_ADD ? a + b : Op == OP_SUB ? a - b : a * b);
+    return true;
+}
+
+inline bool nativeDivide(NativeCell& x, const NativeCell& y) {
+    double a, b;
+    if (!nativeNumber(x, a) || !nativeNumber(y, b))
+        return false;
+    x = NativeCell::ofDouble(a / b);
+    return true;
+}
+
+// Integers only; a zero or -1 divisor is left to the interpreter.
+inline bool nativeModulo(NativeCell& x, const NativeCell& y) {
+    if (x.type != ValueType::Int || y.type != ValueType::Int || y.as.i == 0 || y.as.i == -1)
+        return false;
+    x.as.i %= y.as.i;
+    return true;
+}
+
+inline bool nativeNegate(NativeCell& x) {
+    if (x.type == ValueType::Int)
+        x.as.i = wrapSub(0, x.as.i);
+    else if (x.type == ValueType::Double)
+        x.as.d = -x.as.d;
+    else
+        return false;
+    return true;
+}
+
+// result = x <cmp> y, where Cmp is an OP_JUMP_IF_NOT_* code as in compareValues.
+template <int Cmp, typename X, typename Y>
+inline bool nativeCompare(const X& x, const Y& y, bool& result) {
+    if (x.type == ValueType::Int && y.type == ValueType::Int) {
+        int a = x.as.i, b = y.as.i;
+        result = Cmp == OP_JUMP_IF_NOT_LT ? a < b : Cmp == OP_JUMP_IF_NOT_LE ? a <= b
+               : Cmp == OP_JUMP_IF_NOT_GT ? a > b : Cmp == OP_JUMP_IF_NOT_GE ? a >= b
+               : Cmp == OP_JUMP_IF_NOT_EQ ? a == b : a != b;
+        return true;
+    }
+    double a, b;
+    if (!nativeNumber(x, a) || !nativeNumber(y, b))
+        return false;
+    result = Cmp == OP_JUMP_IF_NOT_LT ? a < b : Cmp == OP_JUMP_IF_NOT_LE ? a <= b
+           : Cmp == OP_JUMP_IF_NOT_GT ? a > b : Cmp == OP_JUMP_IF_NOT_GE ? a >= b
+           : Cmp == OP_JUMP_IF_NOT_EQ ? a == b : a != b;
+    return true;
+}
+
+// isTruthy for the Bool and Int conditions native code decides itself.
+inline bool nativeTruth(const NativeCell& c, bool& truth) {
+    if (c.type == ValueType::Bool)
+        truth = c.as.b;
+    else if (c.type == ValueType::Int)
+        truth = c.as.i != 0;
+    else
+        return false;
+    return true;
+}
+
+// Fills a chunk from the program image of an AOT-compiled executable.
+void loadNativeChunk(ObjFunction::CodeChunk& chunk, const uint8_t* bytecode, size_t size, int localCount,
+                     int maxStack, int cacheCount) {
+    chunk.bytecode = std::vector<uint8_t>(bytecode, bytecode + size);
+    chunk.localCount = localCount;
+    chunk.maxStack = maxStack;
+    chunk.caches.resize(cacheCount);
+}
+
+// Attaches a function's AOT-compiled code, entered at the given bytecode
+// positions. A function without any still gets its (empty) JitCode, so the
+// JIT does not compile it at run time either.
+void attachNativeCode(ObjFunction& function, NativeFn native, std::initializer_list<int> entries) {
+    function.jit = std::make_shared<JitCode>();
+    function.jit->native = native;
+    function.jit->entries.assign(function.chunk.bytecode.size(), -1);
+    for (int pos : entries)
+        function.jit->entries[pos] = 0;
+}
+
+// ----------------------------------------------------------------------------
+// C++ source for one function's native code, as
+//   static int <name>(Value* s, Value* cells, int* depth, int entry)
+// with the JIT's calling convention. Every instruction is a labelled block;
+// one without a C++ form, or whose guard fails, returns its own position.
+// ----------------------------------------------------------------------------
+class AotTranslator {
+public:
+    explicit AotTranslator(const ObjFunction::CodeChunk& chunk) : chunk(chunk) {}
+
+    // Writes the function and returns its entry positions, or writes nothing
+    // and returns none when no instruction has a C++ form.
+    std::vector<int> write(std::ostream& out, const std::string& name, const std::string& comment) {
+        std::vector<int> indexAt;
+        program = decodeChunk(chunk, indexAt);
+        depth = stackDepths(chunk, program, indexAt);
+        std::vector<char> hasTemplate(program.size(), 0);
+        std::vector<std::string> text(program.size());
+        for (size_t i = 0; i < program.size(); i++) {
+            if (depth[i] >= 0)
+                hasTemplate[i] = translate(program[i], depth[i], text[i]);
+        }
+        std::vector<char> isEntry = nativeEntries(program, indexAt, depth, hasTemplate);
+        std::vector<int> entries;
+        for (size_t i = 0; i < program.size(); i++) {
+            if (isEntry[i]) {
+                entries.push_back(program[i].pos);
+                targets.insert(program[i].pos);
+            }
+        }
+        if (entries.empty())
+            return entries;
+
+        out << "// " << comment << "\n";
+        out << "static int " << name << "(Value* s, Value* cells, int* depth, int entry) {\n";
+        if (cellCount > 0) {
+            out << "    NativeCell";
+            for (int k = 0; k < cellCount; k++)
+                out << (k ? ", c" : " c") << k;
+            out << ";\n";
+        }
+        out << "    (void)s;\n";
+        if (usesResult)
+            out << "    bool r = false;\n";
+        out << "    switch (entry) {\n";
+        for (int pos : entries)
+            out << "    case " << pos << ": goto L" << pos << ";\n";
+        out << "    }\n";
+        out << "    *depth = 0;\n";
+        out << "    return entry;\n";
+        for (size_t i = 0; i < program.size(); i++) {
+            if (depth[i] < 0)
+                continue;
+            const DecodedInstruction& ins = program[i];
+            if (targets.count(ins.pos))
+                out << "L" << ins.pos << ":\n";
+            out << "    // " << opcodeToString(ins.op) << "\n";
+            out << (hasTemplate[i] ? text[i] : exitCode(ins.pos, depth[i]));
+        }
+        for (auto& exit : exits)
+            out << "X" << exit.first << ":\n" << exitCode(exit.first, exit.second);
+        out << "}\n\n";
+        return entries;
+    }
+
+    // A non-object constant as a NativeCell expression.
+    static bool cellLiteral(const Value& v, std::string& out) {
+        switch (v.type) {
+        case ValueType::Nil:    out = "NativeCell()"; return true;
+        case ValueType::Int:    out = "NativeCell::ofInt(" + intLiteral(v.as.i) + ")"; return true;
+        case ValueType::Double: out = "NativeCell::ofDouble(" + doubleLiteral(v.as.d) + ")"; return true;
+        case ValueType::Bool:   out = v.as.b ? "NativeCell::ofBool(true)" : "NativeCell::ofBool(false)"; return true;
+        case ValueType::Color:  out = "NativeCell::ofColor(" + std::to_string(v.as.color) + "u)"; return true;
+        default:                return false;
+        }
+    }
+    static std::string intLiteral(int i) {
+        return i == INT_MIN ? "(-2147483647 - 1)" : std::to_string(i);
+    }
+    // Exact: hexadecimal floating literals round-trip every finite double.
+    static std::string doubleLiteral(double d) {
+        if (std::isnan(d))
+            return "NAN";
+        if (std::isinf(d))
+            return d < 0 ? "-HUGE_VAL" : "HUGE_VAL";
+        std::ostringstream out;
+        out << std::hexfloat << d;
+        return out.str();
+    }
+
+private:
+    const ObjFunction::CodeChunk& chunk;
+    std::vector<DecodedInstruction> program;
+    std::vector<int> depth;
+    std::set<int> targets;        // Positions control jumps to, which need a label
+    std::map<int, int> exits;     // Position -> stack depth, for guards that fail
+    int cellCount = 0;
+    bool usesResult = false;      // Whether a comparison or branch needs the bool r
+
+    static std::string cell(int k) { return "c" + std::to_string(k); }
+    static std::string slot(int k) { return "s[" + std::to_string(k) + "]"; }
+
+    std::string exitCode(int pos, int d) {
+        std::string code;
+        for (int k = 0; k < d; k++)
+            code += "    storeCell(cells[" + std::to_string(k) + "], " + cell(k) + ");\n";
+        return code + "    *depth = " + std::to_string(d) + ";\n    return " + std::to_string(pos) + ";\n";
+    }
+    std::string guard(const std::string& failed, const DecodedInstruction& ins, int d) {
+        exits[ins.pos] = d;
+        return "    if (" + failed + ") goto X" + std::to_string(ins.pos) + ";\n";
+    }
+    std::string jumpTo(int pos) {
+        targets.insert(pos);
+        return "goto L" + std::to_string(pos) + ";";
+    }
+    static std::string comparison(int op) {
+        switch (op) {
+        case OP_LT: case OP_LT_INT: case OP_LT_DOUBLE: case OP_JUMP_IF_NOT_LT: return "OP_JUMP_IF_NOT_LT";
+        case OP_LE: case OP_LE_INT: case OP_LE_DOUBLE: case OP_JUMP_IF_NOT_LE: return "OP_JUMP_IF_NOT_LE";
+        case OP_GT: case OP_GT_INT: case OP_GT_DOUBLE: case OP_JUMP_IF_NOT_GT: return "OP_JUMP_IF_NOT_GT";
+        case OP_GE: case OP_GE_INT: case OP_GE_DOUBLE: case OP_JUMP_IF_NOT_GE: return "OP_JUMP_IF_NOT_GE";
+        case OP_EQ: case OP_EQ_INT: case OP_JUMP_IF_NOT_EQ: return "OP_JUMP_IF_NOT_EQ";
+        default: return "OP_JUMP_IF_NOT_NE";
+        }
+    }
+    bool isIntConstant(int k) const { return chunk.constants[k].type == ValueType::Int; }
+
+    // The same coverage as the JIT's templates.
+    bool translate(const DecodedInstruction& ins, int d, std::string& code) {
+        const int* operand = ins.operands;
+        cellCount = std::max(cellCount, d + 1);
+        std::string literal;
+        switch (ins.op) {
+        case OP_CONSTANT:
+            if (!cellLiteral(chunk.constants[operand[0]], literal))
+                return false;
+            code = "    " + cell(d) + " = " + literal + ";\n";
+            return true;
+        case OP_NIL:
+            code = "    " + cell(d) + " = NativeCell();\n";
+            return true;
+        case OP_GET_LOCAL:
+            code = guard(slot(operand[0]) + ".type >= ValueType::String", ins, d) +
+                   "    loadCell(" + cell(d) + ", " + slot(operand[0]) + ");\n";
+            return true;
+        case OP_SET_LOCAL:
+            code = guard(slot(operand[0]) + ".type >= ValueType::String", ins, d) +
+                   "    storeCell(" + slot(operand[0]) + ", " + cell(d - 1) + ");\n";
+            return true;
+        case OP_POP:
+            return true;
+        case OP_DUP:
+            code = "    " + cell(d) + " = " + cell(d - 1) + ";\n";
+            return true;
+        case OP_ADD: case OP_ADD_INT: case OP_ADD_DOUBLE:
+        case OP_SUB: case OP_SUB_INT: case OP_SUB_DOUBLE:
+        case OP_MUL: case OP_MUL_INT: case OP_MUL_DOUBLE: {
+            const char* op = isAddOp(ins.op) ? "OP_ADD" : isSubOp(ins.op) ? "OP_SUB" : "OP_MUL";
+            code = guard("!nativeArithmetic<" + std::string(op) + ">(" + cell(d - 2) + ", " + cell(d - 1) + ")", ins, d);
+            return true;
+        }
+        case OP_DIV:
+            code = guard("!nativeDivide(" + cell(d - 2) + ", " + cell(d - 1) + ")", ins, d);
+            return true;
+        case OP_MOD:
+            code = guard("!nativeModulo(" + cell(d - 2) + ", " + cell(d - 1) + ")", ins, d);
+            return true;
+        case OP_NEGATE:
+            code = guard("!nativeNegate(" + cell(d - 1) + ")", ins, d);
+            return true;
+        case OP_NOT:
+            code = guard(cell(d - 1) + ".type != ValueType::Bool", ins, d) +
+                   "    " + cell(d - 1) + ".as.b = !" + cell(d - 1) + ".as.b;\n";
+            return true;
+        case OP_LT: case OP_LE: case OP_GT: case OP_GE: case OP_EQ: case OP_NE:
+        case OP_LT_INT: case OP_LE_INT: case OP_GT_INT: case OP_GE_INT: case OP_EQ_INT: case OP_NE_INT:
+        case OP_LT_DOUBLE: case OP_LE_DOUBLE: case OP_GT_DOUBLE: case OP_GE_DOUBLE:
+            usesResult = true;
+            code = guard("!nativeCompare<" + comparison(ins.op) + ">(" + cell(d - 2) + ", " + cell(d - 1) + ", r)", ins, d) +
+                   "    " + cell(d - 2) + " = NativeCell::ofBool(r);\n";
+            return true;
+        case OP_JUMP_IF_NOT_LT: case OP_JUMP_IF_NOT_LE: case OP_JUMP_IF_NOT_GT:
+        case OP_JUMP_IF_NOT_GE: case OP_JUMP_IF_NOT_EQ: case OP_JUMP_IF_NOT_NE:
+            usesResult = true;
+            code = guard("!nativeCompare<" + comparison(ins.op) + ">(" + cell(d - 2) + ", " + cell(d - 1) + ", r)", ins, d) +
+                   "    if (!r) " + jumpTo(operand[0]) + "\n";
+            return true;
+        case OP_JUMP_IF_NOT_LOCAL_CONST:
+            if (!cellLiteral(chunk.constants[operand[2]], literal))
+                return false;
+            usesResult = true;
+            code = guard("!nativeCompare<" + comparison(operand[0]) + ">(" + slot(operand[1]) + ", " + literal + ", r)", ins, d) +
+                   "    if (!r) " + jumpTo(operand[3]) + "\n";
+            return true;
+        case OP_JUMP_IF_NOT_LOCALS:
+            usesResult = true;
+            code = guard("!nativeCompare<" + comparison(operand[0]) + ">(" + slot(operand[1]) + ", " + slot(operand[2]) + ", r)", ins, d) +
+                   "    if (!r) " + jumpTo(operand[3]) + "\n";
+            return true;
+        case OP_JUMP:
+            code = "    " + jumpTo(operand[0]) + "\n";
+            return true;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            usesResult = true;
+            code = guard("!nativeTruth(" + cell(d - 1) + ", r)", ins, d) +
+                   (ins.op == OP_JUMP_IF_FALSE ? "    if (!r) " : "    if (r) ") + jumpTo(operand[0]) + "\n";
+            return true;
+        case OP_INC_LOCAL:
+        case OP_ADD_LOCAL_CONST:
+        case OP_SUB_LOCAL_CONST: {
+            if (!isIntConstant(operand[1]))
+                return false;
+            std::string local = slot(operand[0]);
+            std::string value = std::string(ins.op == OP_SUB_LOCAL_CONST ? "wrapSub(" : "wrapAdd(") + local + ".as.i, " +
+                                intLiteral(chunk.constants[operand[1]].as.i) + ")";
+            code = guard(local + ".type != ValueType::Int", ins, d);
+            if (ins.op == OP_INC_LOCAL)
+                code += "    " + local + ".as.i = " + value + ";\n";
+            else
+                code += "    " + cell(d) + " = NativeCell::ofInt(" + value + ");\n";
+            return true;
+        }
+        case OP_FOR_LOOP: {
+            // Integer counters only: step, then loop while within the bound.
+            std::string counter = slot(operand[0]), bound = slot(operand[1]), step = slot(operand[2]);
+            code = guard(counter + ".type != ValueType::Int || " + bound + ".type != ValueType::Int || " +
+                         step + ".type != ValueType::Int", ins, d) +
+                   "    " + counter + ".as.i = wrapAdd(" + counter + ".as.i, " + step + ".as.i);\n" +
+                   "    if (" + counter + ".as.i " + (operand[3] ? ">=" : "<=") + " " + bound + ".as.i) " + jumpTo(operand[4]) + "\n";
+            return true;
         }
-        else if (auto blockStmt = std::dynamic_pointer_cast<BlockStmt>(stmt)) {
-            for (auto s : blockStmt->statements)
-                compileStmt(s, chunk);
+        default:
+            return false;
         }
     }
-    // compileDeclare for API declarations using libffi
-    void compileDeclare(std::shared_ptr<DeclareStmt> declStmt, ObjFunction::CodeChunk& chunk) {
-        BuiltinFn apiFunc = wrapPluginFunctionForDeclare(
-            declStmt->params,
-            declStmt->returnType,
-            declStmt->apiName,
-            declStmt->libraryName
-        );
-        vm.environment->define(toLower(declStmt->apiName), Value(apiFunc));
-        if (!compilingModule) {
-            int fnConst = addConstant(chunk, vm.environment->get(toLower(declStmt->apiName)));
-            emitWithOperand(chunk, OP_CONSTANT, fnConst);
-            int nameConst = addConstantString(chunk, toLower(declStmt->apiName));
-            emitWithOperand(chunk, OP_DEFINE_GLOBAL, nameConst);
+};
+
+// ----------------------------------------------------------------------------
+// The compiled program as an object graph, for writing it out (--aot, --xsb):
+// the globals compilation defined or replaced, and every object reachable from
+// them and from the main chunk. Functions, enums, modules and arrays keep their
+// identity and are numbered in `objects`; everything else is saved by value.
+// ----------------------------------------------------------------------------
+struct ProgramGraph {
+    std::vector<std::pair<SymbolId, Value>> globals; // In symbol order
+    std::vector<const Obj*> objects;
+    std::unordered_map<const Obj*, int> ids; // Object -> index in objects
+    std::string error; // Set if something in the program cannot be saved
+
+    // globalsBefore holds the global environment as it was before compiling.
+    ProgramGraph(VM& vm, const std::unordered_map<SymbolId, Value>& globalsBefore) {
+        for (auto& entry : vm.globals->values) {
+            auto before = globalsBefore.find(entry.first);
+            if (before == globalsBefore.end() || !sameValue(before->second, entry.second))
+                globals.push_back(entry);
+        }
+        std::sort(globals.begin(), globals.end(), [](auto& a, auto& b) { return a.first < b.first; });
+        for (auto& value : vm.mainChunk.constants)
+            collect(value);
+        for (auto& entry : globals)
+            collect(entry.second);
+    }
+
+private:
+    static bool sameValue(const Value& a, const Value& b) {
+        return a.type == b.type && (a.isObject() ? a.as.obj == b.as.obj : std::memcmp(&a.as, &b.as, sizeof(a.as)) == 0);
+    }
+    // Registers every object reachable from v.
+    void collect(const Value& v) {
+        switch (v.type) {
+        case ValueType::Function: case ValueType::Enum: case ValueType::Module: case ValueType::Array: {
+            if (ids.count(v.as.obj))
+                return;
+            ids[v.as.obj] = objects.size();
+            objects.push_back(v.as.obj);
+            if (v.type == ValueType::Function) {
+                auto function = static_cast<const ObjFunction*>(v.as.obj);
+                for (auto& param : function->params)
+                    collect(param.defaultValue);
+                for (auto& constant : function->chunk.constants)
+                    collect(constant);
+            }
+            else if (v.type == ValueType::Module) {
+                for (auto& member : static_cast<const ObjModule*>(v.as.obj)->publicMembers)
+                    collect(member.second);
+            }
+            else if (v.type == ValueType::Array) {
+                for (auto& element : static_cast<const ObjArray*>(v.as.obj)->elements)
+                    collect(element);
+            }
+            return;
         }
-        else {
-            currentModulePublicMembers[toLower(declStmt->apiName)] = vm.environment->get(toLower(declStmt->apiName));
+        case ValueType::Properties:
+            for (auto& property : static_cast<const ObjProperties*>(v.as.obj)->properties)
+                collect(property.second);
+            return;
+        case ValueType::Overloads:
+            for (auto& function : static_cast<const ObjOverloads*>(v.as.obj)->functions)
+                collect(Value(function));
+            return;
+        case ValueType::Builtin: {
+            auto declare = static_cast<const ObjBuiltin*>(v.as.obj)->declare;
+            if (!declare)
+                error = "a built-in function is bound at compile time";
+            else for (auto& param : declare->params)
+                collect(param.defaultValue);
+            return;
         }
-    }
-    void compileExpr(std::shared_ptr<Expr> expr, ObjFunction::CodeChunk& chunk) {
-        if (auto lit = std::dynamic_pointer_cast<LiteralExpr>(expr)) {
-            int constIndex = addConstant(chunk, lit->value);
-            emitWithOperand(chunk, OP_CONSTANT, constIndex);
+        case ValueType::Pointer:
+            if (v.as.ptr)
+                error = "a pointer constant is not null";
+            return;
+        case ValueType::Class: case ValueType::Instance: case ValueType::BoundMethod:
+            error = getTypeName(v) + " value exists at compile time";
+            return;
+        default:
+            return;
         }
-        else if (auto var = std::dynamic_pointer_cast<VariableExpr>(expr)) {
-            int nameConst = addConstantString(chunk, toLower(var->name));
-            emitWithOperand(chunk, OP_GET_GLOBAL, nameConst);
+    }
+};
+
+// ----------------------------------------------------------------------------
+// The program image: every object in the graph becomes a local of
+// aotLoadProgram(), created first and filled in afterwards, so references
+// between them (recursion, module members) need no ordering.
+// ----------------------------------------------------------------------------
+class AotWriter {
+public:
+    AotWriter(std::ostream& out, const ProgramGraph& graph) : out(out), graph(graph) {}
+
+    void write(VM& vm, const std::string& sourceName) {
+        out << "// Generated by \"xojoscript --aot\" from " << sourceName << ". Do not edit; compile the\n"
+            << "// script again instead. Build it next to xojoscript.cpp, for example:\n"
+            << "//   g++ -std=c++17 -O2 -o program program.cpp -lffi\n"
+            << "#define XOJO_AOT\n"
+            << "#include \"xojoscript.cpp\"\n\n";
+
+        const std::vector<std::string>& names = symbolTable().names;
+        out << "static const char* const aotSymbols[] = {\n";
+        for (const std::string& name : names)
+            out << "    " << quote(name) << ",\n";
+        out << "};\n\n";
+
+        writeBytecode("aotCodeMain", vm.mainChunk);
+        for (size_t i = 0; i < graph.objects.size(); i++) {
+            if (graph.objects[i]->type == ValueType::Function)
+                writeBytecode("aotCode" + std::to_string(i), static_cast<const ObjFunction*>(graph.objects[i])->chunk);
+        }
+        out << "\n";
+        std::vector<std::vector<int>> entries(graph.objects.size());
+        for (size_t i = 0; i < graph.objects.size(); i++) {
+            if (graph.objects[i]->type != ValueType::Function)
+                continue;
+            auto function = static_cast<const ObjFunction*>(graph.objects[i]);
+            entries[i] = AotTranslator(function->chunk).write(out, "aotNative" + std::to_string(i), function->name);
+        }
+
+        out << "// Symbol ids are baked into the bytecode, so they are interned in the\n"
+            << "// order the compiler saw them before anything else runs.\n"
+            << "void aotInternSymbols() {\n"
+            << "    for (size_t i = 0; i < sizeof(aotSymbols) / sizeof(aotSymbols[0]); i++) {\n"
+            << "        if (intern(aotSymbols[i]) != (SymbolId)i) {\n"
+            << "            std::cerr << \"Error: symbol table mismatch at \" << aotSymbols[i] << std::endl;\n"
+            << "            exit(1);\n"
+            << "        }\n"
+            << "    }\n"
+            << "}\n\n";
+
+        out << "void aotLoadProgram(VM& vm) {\n";
+        for (size_t i = 0; i < graph.objects.size(); i++)
+            out << "    auto " << object(i) << " = makeRef<" << className(graph.objects[i]->type) << ">();\n";
+        for (size_t i = 0; i < graph.objects.size(); i++)
+            writeObject(i, entries[i]);
+        writeChunk("vm.mainChunk", "aotCodeMain", vm.mainChunk);
+        for (auto& entry : graph.globals)
+            out << "    vm.environment->define(" << entry.first << ", " << valueExpr(entry.second) << "); // "
+                << symbolName(entry.first) << "\n";
+        out << "}\n";
+    }
+
+private:
+    std::ostream& out;
+    const ProgramGraph& graph;
+
+    static std::string object(size_t i) { return "o" + std::to_string(i); }
+    static const char* className(ValueType type) {
+        switch (type) {
+        case ValueType::Function: return "ObjFunction";
+        case ValueType::Enum:     return "ObjEnum";
+        case ValueType::Module:   return "ObjModule";
+        default:                  return "ObjArray";
         }
-        else if (auto un = std::dynamic_pointer_cast<UnaryExpr>(expr)) {
-            compileExpr(un->right, chunk);
-            if (un->op == "-")
-                emit(chunk, OP_NEGATE);
+    }
+
+    static std::string quote(const std::string& s) {
+        std::string q = "\"";
+        for (unsigned char c : s) {
+            if (c == '"' || c == '\\')
+                q += std::string("\\") + (char)c;
+            else if (c >= 0x20 && c < 0x7F)
+                q += (char)c;
+            else {
+                char escape[5];
+                std::snprintf(escape, sizeof(escape), "\\%03o", c);
+                q += escape;
+            }
         }
-        else if (auto assignExpr = std::dynamic_pointer_cast<AssignmentExpr>(expr)) {
-            compileExpr(std::make_shared<VariableExpr>(assignExpr->name), chunk);
-            compileExpr(assignExpr->value, chunk);
-            int nameConst = addConstantString(chunk, toLower(assignExpr->name));
-            emitWithOperand(chunk, OP_SET_GLOBAL, nameConst);
+        return q + "\"";
+    }
+    std::string paramsExpr(const std::vector<Param>& params) {
+        std::string expr = "{";
+        for (auto& p : params)
+            expr += " Param{ " + quote(p.name) + ", " + quote(p.type) + ", " + (p.optional ? "true" : "false") + ", " +
+                    valueExpr(p.defaultValue) + " },";
+        return expr + " }";
+    }
+    std::string valueExpr(const Value& v) {
+        switch (v.type) {
+        case ValueType::Nil:    return "Value()";
+        case ValueType::Int:    return "Value(" + AotTranslator::intLiteral(v.as.i) + ")";
+        case ValueType::Double: return "Value(" + AotTranslator::doubleLiteral(v.as.d) + ")";
+        case ValueType::Bool:   return v.as.b ? "Value(true)" : "Value(false)";
+        case ValueType::Color:  return "Value(Color{ " + std::to_string(v.as.color) + "u })";
+        case ValueType::Pointer: return "Value(static_cast<void*>(nullptr))";
+        case ValueType::String: {
+            const std::string& chars = static_cast<const ObjString*>(v.as.obj)->chars;
+            return "Value(std::string(" + quote(chars) + ", " + std::to_string(chars.size()) + "))";
+        }
+        case ValueType::Properties: {
+            std::string expr = "Value(PropertiesType{";
+            for (auto& property : static_cast<const ObjProperties*>(v.as.obj)->properties)
+                expr += " { " + quote(property.first) + ", " + valueExpr(property.second) + " },";
+            return expr + " })";
+        }
+        case ValueType::Overloads: {
+            std::string expr = "Value(std::vector<Ref<ObjFunction>>{";
+            for (auto& function : static_cast<const ObjOverloads*>(v.as.obj)->functions)
+                expr += " " + object(graph.ids.at(function.get())) + ",";
+            return expr + " })";
+        }
+        case ValueType::Builtin: {
+            const DeclareSignature& declare = *static_cast<const ObjBuiltin*>(v.as.obj)->declare;
+            return "declaredFunction({ " + paramsExpr(declare.params) + ", " + quote(declare.returnType) + ", " +
+                   quote(declare.apiName) + ", " + quote(declare.libraryName) + " })";
         }
-        else if (auto setProp = std::dynamic_pointer_cast<SetPropExpr>(expr)) {
-            compileExpr(setProp->object, chunk);
-            compileExpr(setProp->value, chunk);
-            int propConst = addConstantString(chunk, toLower(setProp->name));
-            emitWithOperand(chunk, OP_SET_PROPERTY, propConst);
+        default:
+            return "Value(" + object(graph.ids.at(v.as.obj)) + ")";
         }
-        else if (auto bin = std::dynamic_pointer_cast<BinaryExpr>(expr)) {
-            compileExpr(bin->left, chunk);
-            compileExpr(bin->right, chunk);
-            switch (bin->op) {
-            case BinaryOp::ADD: emit(chunk, OP_ADD); break;
-            case BinaryOp::SUB: emit(chunk, OP_SUB); break;
-            case BinaryOp::MUL: emit(chunk, OP_MUL); break;
-            case BinaryOp::DIV: emit(chunk, OP_DIV); break;
-            case BinaryOp::LT:  emit(chunk, OP_LT); break;
-            case BinaryOp::LE:  emit(chunk, OP_LE); break;
-            case BinaryOp::GT:  emit(chunk, OP_GT); break;
-            case BinaryOp::GE:  emit(chunk, OP_GE); break;
-            case BinaryOp::NE:  emit(chunk, OP_NE); break;
-            case BinaryOp::EQ:  emit(chunk, OP_EQ); break;
-            case BinaryOp::AND: emit(chunk, OP_AND); break;
-            case BinaryOp::OR:  emit(chunk, OP_OR); break;
-            case BinaryOp::POW: emit(chunk, OP_POW); break;
-            case BinaryOp::MOD: emit(chunk, OP_MOD); break;
-            default: break;
-            }
+    }
+
+    void writeBytecode(const std::string& name, const ObjFunction::CodeChunk& chunk) {
+        out << "static const uint8_t " << name << "[] = {";
+        for (size_t i = 0; i < chunk.bytecode.size(); i++)
+            out << (i % 24 ? " " : "\n    ") << (int)chunk.bytecode[i] << ",";
+        out << "\n};\n";
+    }
+    void writeChunk(const std::string& chunk, const std::string& bytecode, const ObjFunction::CodeChunk& source) {
+        out << "    loadNativeChunk(" << chunk << ", " << bytecode << ", sizeof(" << bytecode << "), " << source.localCount
+            << ", " << source.maxStack << ", " << source.caches.size() << ");\n";
+        if (!source.constants.empty()) {
+            out << "    " << chunk << ".constants = {\n";
+            for (auto& constant : source.constants)
+                out << "        " << valueExpr(constant) << ",\n";
+            out << "    };\n";
+        }
+        if (!source.switchTables.empty())
+            out << "    " << chunk << ".switchTables.resize(" << source.switchTables.size() << ");\n";
+        for (size_t t = 0; t < source.switchTables.size(); t++) {
+            const SwitchTable& table = source.switchTables[t];
+            std::string name = chunk + ".switchTables[" + std::to_string(t) + "]";
+            out << "    " << name << ".low = " << AotTranslator::intLiteral(table.low) << ";\n";
+            out << "    " << name << ".targets = {";
+            for (int target : table.targets)
+                out << " " << target << ",";
+            out << " };\n";
+            out << "    " << name << ".intTargets = {";
+            for (auto& entry : table.intTargets)
+                out << " { " << AotTranslator::intLiteral(entry.first) << ", " << entry.second << " },";
+            out << " };\n";
+            out << "    " << name << ".stringTargets = {";
+            for (auto& entry : table.stringTargets)
+                out << " { " << quote(entry.first) << ", " << entry.second << " },";
+            out << " };\n";
+            out << "    " << name << ".defaultTarget = " << table.defaultTarget << ";\n";
         }
-        else if (auto group = std::dynamic_pointer_cast<GroupingExpr>(expr)) {
-            compileExpr(group->expression, chunk);
+    }
+    void writeObject(size_t i, const std::vector<int>& entries) {
+        std::string o = object(i);
+        switch (graph.objects[i]->type) {
+        case ValueType::Function: {
+            auto function = static_cast<const ObjFunction*>(graph.objects[i]);
+            out << "    " << o << "->name = " << quote(function->name) << ";\n";
+            out << "    " << o << "->arity = " << function->arity << ";\n";
+            if (!function->params.empty())
+                out << "    " << o << "->params = " << paramsExpr(function->params) << ";\n";
+            if (function->isMethod)
+                out << "    " << o << "->isMethod = true;\n";
+            writeChunk(o + "->chunk", "aotCode" + std::to_string(i), function->chunk);
+            out << "    attachNativeCode(*" << o << ", " << (entries.empty() ? "nullptr" : "aotNative" + std::to_string(i)) << ", {";
+            for (int pos : entries)
+                out << " " << pos << ",";
+            out << " });\n";
+            break;
         }
-        else if (auto call = std::dynamic_pointer_cast<CallExpr>(expr)) {
-            compileExpr(call->callee, chunk);
-            for (auto arg : call->arguments)
-                compileExpr(arg, chunk);
-            emitWithOperand(chunk, OP_CALL, call->arguments.size());
+        case ValueType::Enum: {
+            auto enumObj = static_cast<const ObjEnum*>(graph.objects[i]);
+            out << "    " << o << "->name = " << quote(enumObj->name) << ";\n";
+            out << "    " << o << "->members = {";
+            for (auto& member : enumObj->members)
+                out << " { " << member.first << ", " << AotTranslator::intLiteral(member.second) << " },";
+            out << " };\n";
+            break;
         }
-        else if (auto arrLit = std::dynamic_pointer_cast<ArrayLiteralExpr>(expr)) {
-            for (auto& elem : arrLit->elements)
-                compileExpr(elem, chunk);
-            emitWithOperand(chunk, OP_ARRAY, arrLit->elements.size());
+        case ValueType::Module: {
+            auto module = static_cast<const ObjModule*>(graph.objects[i]);
+            out << "    " << o << "->name = " << quote(module->name) << ";\n";
+            for (auto& member : module->publicMembers)
+                out << "    " << o << "->publicMembers[" << member.first << "] = " << valueExpr(member.second) << "; // "
+                    << symbolName(member.first) << "\n";
+            break;
         }
-        else if (auto getProp = std::dynamic_pointer_cast<GetPropExpr>(expr)) {
-            compileExpr(getProp->object, chunk);
-            int propConst = addConstantString(chunk, toLower(getProp->name));
-            emitWithOperand(chunk, OP_GET_PROPERTY, propConst);
+        default: {
+            auto array = static_cast<const ObjArray*>(graph.objects[i]);
+            for (auto& element : array->elements)
+                out << "    " << o << "->elements.push_back(" << valueExpr(element) << ");\n";
+            break;
         }
-        else if (auto newExpr = std::dynamic_pointer_cast<NewExpr>(expr)) {
-            int classConst = addConstantString(chunk, toLower(newExpr->className));
-            emitWithOperand(chunk, OP_GET_GLOBAL, classConst);
-            emit(chunk, OP_NEW);
-            if (!newExpr->arguments.empty()) {
-                emit(chunk, OP_DUP);
-                int consName = addConstantString(chunk, "constructor");
-                emitWithOperand(chunk, OP_GET_PROPERTY, consName);
-                emitWithOperand(chunk, OP_OPTIONAL_CALL, newExpr->arguments.size());
-                emit(chunk, OP_CONSTRUCTOR_END);
-            }
         }
     }
-    std::shared_ptr<ObjFunction> lastFunction;
-    void compileFunction(std::shared_ptr<FunctionStmt> funcStmt) {
-        auto function = std::make_shared<ObjFunction>();
-        function->name = funcStmt->name;
-        int req = 0;
-        for (auto& p : funcStmt->params)
-            if (!p.optional) req++;
-        function->arity = req;
-        function->params = funcStmt->params;
-        ObjFunction::CodeChunk fnChunk;
-        for (auto stmt : funcStmt->body)
-            compileStmt(stmt, fnChunk);
-        emit(fnChunk, OP_NIL);
-        emit(fnChunk, OP_RETURN);
-        function->chunk = fnChunk;
-        lastFunction = function;
-        debugLog("Compiler: Compiled function: " + function->name + " with required arity " + std::to_string(function->arity));
-    }
 };
 
-// ============================================================================  
-// Virtual Machine Execution
-// ============================================================================
+// Writes the compiled program in vm as C++ to path. globalsBefore holds the
+// global environment as it was before compiling.
+bool writeAotProgram(VM& vm, const std::unordered_map<SymbolId, Value>& globalsBefore, const std::string& path,
+                     const std::string& sourceName) {
+    ProgramGraph graph(vm, globalsBefore);
+    if (!graph.error.empty()) {
+        std::cerr << "Error: --aot cannot compile this program: " << graph.error << std::endl;
+        return false;
+    }
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Error: Unable to write " << path << std::endl;
+        return false;
+    }
+    AotWriter(file, graph).write(vm, sourceName);
+    return true;
+}
+
+#ifdef XOJO_AOT
+// Defined by the generated translation unit that includes this file.
+void aotInternSymbols();
+void aotLoadProgram(VM& vm);
+#endif
+
+// ----------------------------------------------------------------------------  
+// Dispatch. GCC and Clang thread the interpreter with labels-as-values: every
+// handler ends by fetching and jumping straight to the next handler. Other
+// compilers (or -DXOJO_SWITCH_DISPATCH) use the portable switch.
+// ----------------------------------------------------------------------------
+#if defined(__GNUC__) && !defined(XOJO_SWITCH_DISPATCH)
+#define XOJO_COMPUTED_GOTO
+#endif
+
+// Fetch the next instruction. Every verified chunk ends in OP_RETURN.
+#define VM_FETCH()                                                      \
+    do {                                                                \
+        instruction = chunk->bytecode[ip++];                            \
+        width = 1;                                                      \
+        unusedBits = 24;                                                \
+        vm.instructionCount++;                                          \
+        if constexpr (Profile)                                          \
+            countOpcodePair(vm, instruction);                           \
+        if constexpr (Trace)                                            \
+            traceInstruction(vm, ip - 1, instruction);                  \
+    } while (0)
+
+#define VM_TRACE(msg) do { if constexpr (Trace) debugLog(msg); } while (0)
+
+// Function entries and loop back edges: run the current function's native
+// code from ip once it is hot (--jit). Traced and profiled runs stay in the
+// interpreter so they see every instruction.
+#define JIT_ENTER()                                                     \
+    do {                                                                \
+        if constexpr (!Trace && !Profile) {                             \
+            ObjFunction* current = vm.frames.back().function;           \
+            if (JIT_ENABLED && jitReady(current, ip))                   \
+                ip = jitRun(vm, current, slotBase, ip);                 \
+        }                                                               \
+    } while (0)
+
+// Operands are one byte unless the instruction had a width prefix. Jump
+// operands are signed offsets from the end of the instruction.
+#define OPERAND() (ip += width, \
+    (int)(operandWord(&chunk->bytecode[ip - width]) << unusedBits >> unusedBits))
+#define JUMP_OPERAND() (ip += width, \
+    (int32_t)(operandWord(&chunk->bytecode[ip - width]) << unusedBits) >> unusedBits)
+
+#ifdef XOJO_COMPUTED_GOTO
+#define CASE(op) case op: L_##op
+#define NEXT do { VM_FETCH(); goto *dispatchTable[instruction]; } while (0)
+#define DEOPT(op) do { quicken(chunk, ip - 1, op); goto L_##op; } while (0)
+#else
+#define CASE(op) case op
+#define NEXT break
+#define DEOPT(op) do { quicken(chunk, ip - 1, op); instruction = op; goto redispatch; } while (0)
+#endif
+
+// Quickened handlers compute over the left operand in place. When the type
+// guard fails, the site reverts to its generic op, which runs instead and
+// may quicken it again for the new types.
+#define QUICK_INT_OP(op, generic, expr)                                 \
+    CASE(op): {                                                         \
+        Value& a = vm.stack[vm.stack.size() - 2];                       \
+        const Value& b = vm.stack.back();                               \
+        if (a.type != ValueType::Int || b.type != ValueType::Int)       \
+            DEOPT(generic);                                             \
+        a = Value(expr);                                                \
+        vm.stack.pop_back();                                            \
+        NEXT;                                                           \
+    }
+
+#define QUICK_DOUBLE_OP(op, generic, expr)                              \
+    CASE(op): {                                                         \
+        Value& a = vm.stack[vm.stack.size() - 2];                       \
+        double ad, bd;                                                  \
+        if (!doubleOperands(a, vm.stack.back(), ad, bd))                \
+            DEOPT(generic);                                             \
+        a = Value(expr);                                                \
+        vm.stack.pop_back();                                            \
+        NEXT;                                                           \
+    }
+
+// Fused compare-and-jump: pops both operands and branches when the comparison
+// is false, never materialising the Boolean.
+#define FUSED_JUMP(op, cmp)                                             \
+    CASE(op): {                                                         \
+        int offset = JUMP_OPERAND();                                    \
+        const Value& a = vm.stack[vm.stack.size() - 2];                 \
+        const Value& b = vm.stack.back();                               \
+        bool result = (a.type == ValueType::Int && b.type == ValueType::Int) \
+            ? a.as.i cmp b.as.i : compareValues(op, a, b);              \
+        vm.stack.resize(vm.stack.size() - 2);                           \
+        if (!result)                                                    \
+            ip += offset;                                               \
+        NEXT;                                                           \
+    }
+
+// ----------------------------------------------------------------------------  
+// Run top-level code in a fresh frame.
+// ----------------------------------------------------------------------------
 Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
-    int ip = 0;
-    while (ip < chunk.code.size()) {
-        int currentIp = ip;
-        int instruction = chunk.code[ip++];
-        debugLog("VM: IP " + std::to_string(currentIp) + ": Executing " + opcodeToString(instruction));
+    // Top-level code has no Dim'd locals, only the compiler's hidden slots.
+    size_t base = vm.stack.size();
+    vm.stack.resize(base + chunk.localCount);
+    pushFrame(vm, nullptr, chunk, base, base);
+    return runVM(vm);
+}
+
+// ----------------------------------------------------------------------------  
+// Dispatch loop, instantiated with and without tracing. Script-to-script
+// calls push frames instead of recursing, so this returns only when the frame
+// on top at entry returns. Native code that calls back into scripts
+// (callbacks, constructors) re-enters here.
+// ----------------------------------------------------------------------------
+template <bool Trace, bool Profile>
+Value runVMImpl(VM& vm) {
+    size_t entryDepth = vm.frames.size();
+    const ObjFunction::CodeChunk* chunk = vm.frames.back().chunk;
+    int ip = vm.frames.back().ip;
+    size_t slotBase = vm.frames.back().slotBase;
+    int instruction;
+    int width = 1;       // Operand bytes of the current instruction, set by OP_WIDE/OP_WIDE4
+    int unusedBits = 24; // 32 - 8 * width
+#ifdef XOJO_COMPUTED_GOTO
+    static void* const dispatchTable[] = {
+        &&L_OP_CONSTANT,
+        &&L_OP_ADD,
+        &&L_OP_SUB,
+        &&L_OP_MUL,
+        &&L_OP_DIV,
+        &&L_OP_NEGATE,
+        &&L_OP_POW,
+        &&L_OP_MOD,
+        &&L_OP_LT,
+        &&L_OP_LE,
+        &&L_OP_GT,
+        &&L_OP_GE,
+        &&L_OP_NE,
+        &&L_OP_EQ,
+        &&L_OP_PRINT,
+        &&L_OP_POP,
+        &&L_OP_DEFINE_GLOBAL,
+        &&L_OP_GET_GLOBAL,
+        &&L_OP_SET_GLOBAL,
+        &&L_OP_NEW,
+        &&L_OP_CALL,
+        &&L_OP_OPTIONAL_CALL,
+        &&L_OP_RETURN,
+        &&L_OP_NIL,
+        &&L_OP_JUMP_IF_FALSE,
+        &&L_OP_JUMP,
+        &&L_OP_CLASS,
+        &&L_OP_METHOD,
+        &&L_OP_ARRAY,
+        &&L_OP_GET_PROPERTY,
+        &&L_OP_SET_PROPERTY,
+        &&L_OP_PROPERTIES,
+        &&L_OP_DUP,
+        &&L_OP_CONSTRUCTOR_END,
+        &&L_OP_GET_LOCAL,
+        &&L_OP_SET_LOCAL,
+        &&L_OP_TAIL_CALL,
+        &&L_OP_INVOKE,
+        &&L_OP_TAIL_INVOKE,
+        &&L_OP_ADD_INT,
+        &&L_OP_ADD_DOUBLE,
+        &&L_OP_ADD_STRING,
+        &&L_OP_SUB_INT,
+        &&L_OP_SUB_DOUBLE,
+        &&L_OP_MUL_INT,
+        &&L_OP_MUL_DOUBLE,
+        &&L_OP_LT_INT,
+        &&L_OP_LE_INT,
+        &&L_OP_GT_INT,
+        &&L_OP_GE_INT,
+        &&L_OP_NE_INT,
+        &&L_OP_EQ_INT,
+        &&L_OP_LT_DOUBLE,
+        &&L_OP_LE_DOUBLE,
+        &&L_OP_GT_DOUBLE,
+        &&L_OP_GE_DOUBLE,
+        &&L_OP_FOR_LOOP,
+        &&L_OP_FOR_LOOP_GLOBAL,
+        &&L_OP_FOR_EACH,
+        &&L_OP_JUMP_TABLE,
+        &&L_OP_SWITCH_HASH,
+        &&L_OP_NOT,
+        &&L_OP_JUMP_IF_TRUE,
+        &&L_OP_JUMP_IF_NOT_LT,
+        &&L_OP_JUMP_IF_NOT_LE,
+        &&L_OP_JUMP_IF_NOT_GT,
+        &&L_OP_JUMP_IF_NOT_GE,
+        &&L_OP_JUMP_IF_NOT_EQ,
+        &&L_OP_JUMP_IF_NOT_NE,
+        &&L_OP_INC_LOCAL,
+        &&L_OP_ADD_LOCAL_CONST,
+        &&L_OP_SUB_LOCAL_CONST,
+        &&L_OP_JUMP_IF_NOT_LOCAL_CONST,
+        &&L_OP_JUMP_IF_NOT_LOCALS,
+        &&L_OP_GET_SELF_FIELD,
+        &&L_OP_SET_SELF_FIELD,
+        &&L_OP_WIDE,
+        &&L_OP_WIDE4,
+    };
+    static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == OP_COUNT, "dispatchTable must list every opcode in enum order");
+#endif
+    while (true) {
+        VM_FETCH();
+#ifdef XOJO_COMPUTED_GOTO
+        goto *dispatchTable[instruction];
+#else
+    redispatch:
+#endif
         switch (instruction) {
-        case OP_CONSTANT: {
-            int index = chunk.code[ip++];
-            Value constant = chunk.constants[index];
+        CASE(OP_CONSTANT): {
+            int index = OPERAND();
+            Value constant = chunk->constants[index];
             vm.stack.push_back(constant);
-            debugLog("VM: Loaded constant: " + valueToString(constant));
-            break;
+            VM_TRACE("VM: Loaded constant: " + valueToString(constant));
+            NEXT;
         }
-        case OP_ADD: {
+        CASE(OP_ADD): {
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
+            if (holds<int>(a) && holds<int>(b)) {
+                quicken(chunk, ip - 1, OP_ADD_INT);
                 vm.stack.push_back(getVal<int>(a) + getVal<int>(b));
+            }
             else if (holds<double>(a) || holds<double>(b)) {
+                quicken(chunk, ip - 1, OP_ADD_DOUBLE);
                 double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
                 double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
                 vm.stack.push_back(ad + bd);
             }
-            else if (holds<std::string>(a) && holds<std::string>(b))
+            else if (holds<std::string>(a) && holds<std::string>(b)) {
+                quicken(chunk, ip - 1, OP_ADD_STRING);
                 vm.stack.push_back(getVal<std::string>(a) + getVal<std::string>(b));
+            }
             else runtimeError("VM: Operands must be numbers or strings for addition.");
-            break;
+            NEXT;
         }
-        case OP_SUB: {
+        CASE(OP_SUB): {
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
+            if (holds<int>(a) && holds<int>(b)) {
+                quicken(chunk, ip - 1, OP_SUB_INT);
                 vm.stack.push_back(getVal<int>(a) - getVal<int>(b));
+            }
             else {
+                if (holds<double>(a) || holds<double>(b))
+                    quicken(chunk, ip - 1, OP_SUB_DOUBLE);
                 double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
                 double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
                 vm.stack.push_back(ad - bd);
             }
-            break;
+            NEXT;
         }
-        case OP_MUL: {
+        CASE(OP_MUL): {
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
+            if (holds<int>(a) && holds<int>(b)) {
+                quicken(chunk, ip - 1, OP_MUL_INT);
                 vm.stack.push_back(getVal<int>(a) * getVal<int>(b));
+            }
             else {
+                if (holds<double>(a) || holds<double>(b))
+                    quicken(chunk, ip - 1, OP_MUL_DOUBLE);
                 double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
                 double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
                 vm.stack.push_back(ad * bd);
             }
-            break;
+            NEXT;
         }
-        case OP_DIV: {
+        CASE(OP_DIV): {
             Value b = pop(vm), a = pop(vm);
             double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
             double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
             vm.stack.push_back(ad / bd);
-            break;
+            NEXT;
         }
-        case OP_NEGATE: {
+        CASE(OP_NEGATE): {
             Value v = pop(vm);
             if (holds<int>(v))
                 vm.stack.push_back(-getVal<int>(v));
             else if (holds<double>(v))
                 vm.stack.push_back(-getVal<double>(v));
             else runtimeError("VM: Operand must be a number for negation.");
-            break;
+            NEXT;
         }
-        case OP_POW: {
+        CASE(OP_POW): {
             Value b = pop(vm), a = pop(vm);
             double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
             double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
             vm.stack.push_back(std::pow(ad, bd));
-            break;
+            NEXT;
         }
-        case OP_MOD: {
+        CASE(OP_MOD): {
             Value b = pop(vm), a = pop(vm);
             if (holds<int>(a) && holds<int>(b))
                 vm.stack.push_back(getVal<int>(a) % getVal<int>(b));
@@ -2660,56 +7316,74 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
                 double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
                 vm.stack.push_back(std::fmod(ad, bd));
             }
-            break;
+            NEXT;
         }
-        case OP_LT: {
+        CASE(OP_LT): {
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
+            if (holds<int>(a) && holds<int>(b)) {
+                quicken(chunk, ip - 1, OP_LT_INT);
                 vm.stack.push_back(getVal<int>(a) < getVal<int>(b));
+            }
             else {
+                if (holds<double>(a) || holds<double>(b))
+                    quicken(chunk, ip - 1, OP_LT_DOUBLE);
                 double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
                 double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
                 vm.stack.push_back(ad < bd);
             }
-            break;
+            NEXT;
         }
-        case OP_LE: {
+        CASE(OP_LE): {
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
+            if (holds<int>(a) && holds<int>(b)) {
+                quicken(chunk, ip - 1, OP_LE_INT);
                 vm.stack.push_back(getVal<int>(a) <= getVal<int>(b));
+            }
             else {
+                if (holds<double>(a) || holds<double>(b))
+                    quicken(chunk, ip - 1, OP_LE_DOUBLE);
                 double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
                 double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
                 vm.stack.push_back(ad <= bd);
             }
-            break;
+            NEXT;
         }
-        case OP_GT: {
+        CASE(OP_GT): {
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
+            if (holds<int>(a) && holds<int>(b)) {
+                quicken(chunk, ip - 1, OP_GT_INT);
                 vm.stack.push_back(getVal<int>(a) > getVal<int>(b));
+            }
             else {
+                if (holds<double>(a) || holds<double>(b))
+                    quicken(chunk, ip - 1, OP_GT_DOUBLE);
                 double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
                 double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
                 vm.stack.push_back(ad > bd);
             }
-            break;
+            NEXT;
         }
-        case OP_GE: {
+        CASE(OP_GE): {
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
+            if (holds<int>(a) && holds<int>(b)) {
+                quicken(chunk, ip - 1, OP_GE_INT);
                 vm.stack.push_back(getVal<int>(a) >= getVal<int>(b));
+            }
             else {
+                if (holds<double>(a) || holds<double>(b))
+                    quicken(chunk, ip - 1, OP_GE_DOUBLE);
                 double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
                 double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
                 vm.stack.push_back(ad >= bd);
             }
-            break;
+            NEXT;
         }
-        case OP_NE: {
+        CASE(OP_NE): {
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
+            if (holds<int>(a) && holds<int>(b)) {
+                quicken(chunk, ip - 1, OP_NE_INT);
                 vm.stack.push_back(getVal<int>(a) != getVal<int>(b));
+            }
             else if (holds<double>(a) || holds<double>(b)) {
                 double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
                 double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
@@ -2720,12 +7394,14 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
             else if (holds<std::string>(a) && holds<std::string>(b))
                 vm.stack.push_back(getVal<std::string>(a) != getVal<std::string>(b));
             else runtimeError("VM: Operands are not comparable for '<>'.");
-            break;
+            NEXT;
         }
-        case OP_EQ: {
+        CASE(OP_EQ): {
             Value b = pop(vm), a = pop(vm);
-            if (holds<int>(a) && holds<int>(b))
+            if (holds<int>(a) && holds<int>(b)) {
+                quicken(chunk, ip - 1, OP_EQ_INT);
                 vm.stack.push_back(getVal<int>(a) == getVal<int>(b));
+            }
             else if (holds<double>(a) || holds<double>(b)) {
                 double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
                 double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
@@ -2737,575 +7413,1445 @@ Value runVM(VM& vm, const ObjFunction::CodeChunk& chunk) {
                 vm.stack.push_back(getVal<std::string>(a) == getVal<std::string>(b));
             else
                 vm.stack.push_back(false);
-            break;
-        }
-        case OP_AND: {
-            Value b = pop(vm), a = pop(vm);
-            bool ab = (holds<bool>(a)) ? getVal<bool>(a) : (holds<int>(a) ? (getVal<int>(a) != 0) : false);
-            bool bb = (holds<bool>(b)) ? getVal<bool>(b) : (holds<int>(b) ? (getVal<int>(b) != 0) : false);
-            vm.stack.push_back(ab && bb);
-            break;
-        }
-        case OP_OR: {
-            Value b = pop(vm), a = pop(vm);
-            bool ab = (holds<bool>(a)) ? getVal<bool>(a) : (holds<int>(a) ? (getVal<int>(a) != 0) : false);
-            bool bb = (holds<bool>(b)) ? getVal<bool>(b) : (holds<int>(b) ? (getVal<int>(b) != 0) : false);
-            vm.stack.push_back(ab || bb);
-            break;
+            NEXT;
         }
-        case OP_PRINT: {
+        CASE(OP_PRINT): {
             Value v = pop(vm);
             std::cout << valueToString(v) << std::endl;
-            break;
+            NEXT;
         }
-        case OP_POP: {
-            debugLog("OP_POP: Attempting to pop a value.");
-            if (vm.stack.empty())
-                runtimeError("VM: Stack underflow on POP.");
+        CASE(OP_POP): {
+            VM_TRACE("OP_POP: Attempting to pop a value.");
             vm.stack.pop_back();
-            break;
+            NEXT;
         }
-        case OP_DEFINE_GLOBAL: {
-            int nameIndex = chunk.code[ip++];
-            if (nameIndex < 0 || nameIndex >= (int)chunk.constants.size())
-                runtimeError("VM: Invalid constant index for global name.");
-            Value nameVal = chunk.constants[nameIndex];
-            if (!holds<std::string>(nameVal))
-                runtimeError("VM: Global name must be a string.");
-            std::string name = getVal<std::string>(nameVal);
-            if (vm.stack.empty())
-                runtimeError("VM: Stack underflow on global definition for " + name);
+        CASE(OP_DEFINE_GLOBAL): {
+            SymbolId name = OPERAND();
             Value val = pop(vm);
             vm.environment->define(name, val);
-            debugLog("VM: Defined global variable: " + name + " = " + valueToString(val));
-            break;
+            VM_TRACE("VM: Defined global variable: " + symbolName(name) + " = " + valueToString(val));
+            NEXT;
         }
-        case OP_GET_GLOBAL: {
-            int nameIndex = chunk.code[ip++];
-            if (nameIndex < 0 || nameIndex >= (int)chunk.constants.size())
-                runtimeError("VM: Invalid constant index for global name.");
-            Value nameVal = chunk.constants[nameIndex];
-            if (!holds<std::string>(nameVal))
-                runtimeError("VM: Global name must be a string.");
-            std::string name = getVal<std::string>(nameVal);
-            if (toLower(name) == "microseconds") {
+        CASE(OP_GET_GLOBAL): {
+            SymbolId name = OPERAND();
+            if (name == SYM_MICROSECONDS) {
                 auto now = std::chrono::steady_clock::now();
                 double us = std::chrono::duration<double, std::micro>(now - startTime).count();
                 vm.stack.push_back(us);
-                debugLog("VM: Loaded built-in microseconds: " + std::to_string(us));
+                VM_TRACE("VM: Loaded built-in microseconds: " + std::to_string(us));
             }
-            else if (toLower(name) == "ticks") {
+            else if (name == SYM_TICKS) {
                 auto now = std::chrono::steady_clock::now();
                 double seconds = std::chrono::duration<double>(now - startTime).count();
                 int ticks = static_cast<int>(seconds * 60);
                 vm.stack.push_back(ticks);
-                debugLog("VM: Loaded built-in ticks: " + std::to_string(ticks));
+                VM_TRACE("VM: Loaded built-in ticks: " + std::to_string(ticks));
             }
             else {
-                Value val = vm.environment->get(name);
+                Value* field = selfField(vm, name);
+                Value val = field ? *field : vm.environment->get(name);
                 vm.stack.push_back(val);
-                debugLog("VM: Loaded global variable: " + name + " = " + valueToString(val));
+                VM_TRACE("VM: Loaded global variable: " + symbolName(name) + " = " + valueToString(val));
             }
-            break;
+            NEXT;
         }
-        case OP_SET_GLOBAL: {
-            int nameIndex = chunk.code[ip++];
-            if (nameIndex < 0 || nameIndex >= (int)chunk.constants.size())
-                runtimeError("VM: Invalid constant index for global name.");
-            Value nameVal = chunk.constants[nameIndex];
-            if (!holds<std::string>(nameVal))
-                runtimeError("VM: Global name must be a string.");
-            std::string name = getVal<std::string>(nameVal);
+        CASE(OP_SET_GLOBAL): {
+            SymbolId name = OPERAND();
             Value newVal = pop(vm);
-            vm.environment->assign(name, newVal);
-            debugLog("VM: Set global variable: " + name + " = " + valueToString(newVal));
-            break;
+            Value* field = selfField(vm, name);
+            if (field)
+                *field = newVal;
+            else
+                vm.environment->assign(name, newVal);
+            VM_TRACE("VM: Set global variable: " + symbolName(name) + " = " + valueToString(newVal));
+            NEXT;
         }
-        case OP_NEW: {
+        CASE(OP_NEW): {
             Value classVal = pop(vm);
-            if (!holds<std::shared_ptr<ObjClass>>(classVal))
+            if (!holds<Ref<ObjClass>>(classVal))
                 runtimeError("VM: 'new' applied to non-class.");
-            auto cls = getVal<std::shared_ptr<ObjClass>>(classVal);
+            auto cls = getVal<Ref<ObjClass>>(classVal);
             if (cls->isPlugin) {
                 Value result = cls->pluginConstructor({});
-                auto instance = std::make_shared<ObjInstance>();
+                auto instance = makeRef<ObjInstance>();
                 instance->klass = cls;
                 instance->pluginInstance = getVal<void*>(result);
                 vm.stack.push_back(Value(instance));
             }
             else {
-                auto instance = std::make_shared<ObjInstance>();
+                auto instance = makeRef<ObjInstance>();
                 instance->klass = cls;
-                for (auto& p : cls->properties) {
-                    instance->fields[p.first] = p.second;
-                }
+                instance->fields = cls->fieldDefaults;
                 vm.stack.push_back(Value(instance));
             }
-            break;
-        }
-        case OP_DUP: {
-            if (vm.stack.empty())
-                runtimeError("VM: Stack underflow on DUP.");
-            vm.stack.push_back(vm.stack.back());
-            break;
-        }
-        case OP_CALL: {
-            int argCount = chunk.code[ip++];
-            std::vector<Value> args;
-            for (int i = 0; i < argCount; i++) {
-                args.push_back(pop(vm));
-            }
-            std::reverse(args.begin(), args.end());
-            Value callee = pop(vm);
-            debugLog("VM: Calling function with " + std::to_string(argCount) + " arguments.");
-            if (holds<BuiltinFn>(callee)) {
-                BuiltinFn fn = getVal<BuiltinFn>(callee);
-                Value result = fn(args);
-                vm.stack.push_back(result);
-            }
-            else if (holds<std::shared_ptr<ObjFunction>>(callee)) {
-                std::shared_ptr<ObjFunction> function = getVal<std::shared_ptr<ObjFunction>>(callee);
-                int total = function->params.size();
-                int required = function->arity;
-                if ((int)args.size() < required || (int)args.size() > total)
-                    runtimeError("VM: Expected between " + std::to_string(required) + " and " + std::to_string(total) + " arguments for function " + function->name);
-                for (int i = args.size(); i < total; i++) {
-                    args.push_back(function->params[i].defaultValue);
+            NEXT;
+        }
+        CASE(OP_DUP): {
+            Value top = vm.stack.back();
+            vm.stack.push_back(std::move(top));
+            NEXT;
+        }
+        CASE(OP_CALL):
+        CASE(OP_TAIL_CALL): {
+            int argCount = OPERAND();
+            size_t calleeIndex = vm.stack.size() - argCount - 1;
+            // Script functions and methods run in a new frame: the arguments
+            // already on the stack become the callee's slots.
+            if (ObjFunction* frameFn = resolveFrameCallee(vm.stack[calleeIndex], argCount)) {
+                VM_TRACE("VM: Calling function " + frameFn->name + " with " + std::to_string(argCount) + " arguments.");
+                if (frameFn->registers) {
+                    Value result = callRegisterFunction(vm, frameFn, calleeIndex, argCount);
+                    vm.stack.push_back(std::move(result));
+                    NEXT;
                 }
-                auto previousEnv = vm.environment;
-                vm.environment = std::make_shared<Environment>(previousEnv);
-                for (size_t i = 0; i < function->params.size(); i++) {
-                    vm.environment->define(function->params[i].name, args[i]);
-                }
-                Value result = runVM(vm, function->chunk);
-                vm.environment = previousEnv;
-                vm.stack.push_back(result);
-                debugLog("VM: Function " + function->name + " returned " + valueToString(result));
+                enterCallee(vm, frameFn, calleeIndex, argCount, instruction == OP_TAIL_CALL, ip);
+                chunk = vm.frames.back().chunk;
+                ip = 0;
+                slotBase = vm.frames.back().slotBase;
+                JIT_ENTER();
+                NEXT;
             }
-            else if (holds<std::vector<std::shared_ptr<ObjFunction>>>(callee)) {
-                auto overloads = getVal<std::vector<std::shared_ptr<ObjFunction>>>(callee);
-                std::shared_ptr<ObjFunction> chosen = nullptr;
-                for (auto f : overloads) {
-                    int total = f->params.size();
-                    int required = f->arity;
-                    if ((int)args.size() >= required && (int)args.size() <= total) {
-                        chosen = f;
-                        break;
-                    }
-                }
-                if (!chosen)
-                    runtimeError("VM: No matching overload found for function call with " + std::to_string(args.size()) + " arguments.");
-                for (int i = args.size(); i < chosen->params.size(); i++) {
-                    args.push_back(chosen->params[i].defaultValue);
-                }
-                auto previousEnv = vm.environment;
-                vm.environment = std::make_shared<Environment>(previousEnv);
-                for (size_t i = 0; i < chosen->params.size(); i++) {
-                    vm.environment->define(chosen->params[i].name, args[i]);
-                }
-                Value result = runVM(vm, chosen->chunk);
-                vm.environment = previousEnv;
-                vm.stack.push_back(result);
-                debugLog("VM: Function " + chosen->name + " returned " + valueToString(result));
-            }
-            else if (holds<std::shared_ptr<ObjBoundMethod>>(callee)) {
-                auto bound = getVal<std::shared_ptr<ObjBoundMethod>>(callee);
-                if (holds<std::shared_ptr<ObjInstance>>(bound->receiver)) {
-                    auto instance = getVal<std::shared_ptr<ObjInstance>>(bound->receiver);
-                    std::string key = toLower(bound->name);
-                    Value methodVal = instance->klass->methods[key];
-                    if (holds<BuiltinFn>(methodVal)) {
-                        BuiltinFn fn = getVal<BuiltinFn>(methodVal);
-                        Value result = fn(args);
-                        vm.stack.push_back(result);
-                    }
-                    else {
-                        std::shared_ptr<ObjFunction> methodFn = nullptr;
-                        if (holds<std::shared_ptr<ObjFunction>>(methodVal)) {
-                            methodFn = getVal<std::shared_ptr<ObjFunction>>(methodVal);
-                        }
-                        else if (holds<std::vector<std::shared_ptr<ObjFunction>>>(methodVal)) {
-                            auto overloads = getVal<std::vector<std::shared_ptr<ObjFunction>>>(methodVal);
-                            for (auto f : overloads) {
-                                int total = f->params.size();
-                                int required = f->arity;
-                                if ((int)args.size() >= required && (int)args.size() <= total) {
-                                    methodFn = f;
-                                    break;
-                                }
-                            }
-                        }
-                        if (!methodFn)
-                            runtimeError("VM: No matching method found for " + bound->name);
-                        auto previousEnv = vm.environment;
-                        vm.environment = std::make_shared<Environment>(previousEnv);
-                        vm.environment->define("self", bound->receiver);
-                        for (size_t i = 0; i < methodFn->params.size(); i++) {
-                            if (i < args.size())
-                                vm.environment->define(methodFn->params[i].name, args[i]);
-                            else
-                                vm.environment->define(methodFn->params[i].name, methodFn->params[i].defaultValue);
-                        }
-                        Value result = runVM(vm, methodFn->chunk);
-                        vm.environment = previousEnv;
-                        vm.stack.push_back(result);
-                        debugLog("VM: Function " + methodFn->name + " returned " + valueToString(result));
-                    }
-                }
-                else if (holds<std::shared_ptr<ObjArray>>(bound->receiver)) {
-                    auto array = getVal<std::shared_ptr<ObjArray>>(bound->receiver);
-                    Value result = callArrayMethod(array, bound->name, args);
-                    vm.stack.push_back(result);
-                }
-                else {
-                    runtimeError("VM: Bound method receiver is of unsupported type.");
+            callNative(vm, argCount);
+            NEXT;
+        }
+        CASE(OP_INVOKE):
+        CASE(OP_TAIL_INVOKE): {
+            SymbolId key = OPERAND();
+            int argCount = OPERAND();
+            InlineCache& cache = chunk->caches[OPERAND()];
+            size_t receiverIndex = vm.stack.size() - argCount - 1;
+            VM_TRACE("VM: Invoking " + symbolName(key) + " with " + std::to_string(argCount) + " arguments.");
+            if (ObjFunction* frameFn = invokeTarget(vm, key, argCount, cache, receiverIndex)) {
+                if (frameFn->registers) {
+                    Value result = callRegisterFunction(vm, frameFn, receiverIndex, argCount);
+                    vm.stack.push_back(std::move(result));
+                    NEXT;
                 }
+                enterCallee(vm, frameFn, receiverIndex, argCount, instruction == OP_TAIL_INVOKE, ip);
+                chunk = vm.frames.back().chunk;
+                ip = 0;
+                slotBase = vm.frames.back().slotBase;
+                JIT_ENTER();
             }
-            else if (holds<std::shared_ptr<ObjArray>>(callee)) {
-                auto array = getVal<std::shared_ptr<ObjArray>>(callee);
-                if (argCount != 1)
-                    runtimeError("VM: Array call expects exactly 1 argument for indexing.");
-                Value indexVal = args[0];
-                int index;
-                if (holds<int>(indexVal))
-                    index = getVal<int>(indexVal);
-                else
-                    runtimeError("VM: Array index must be an integer.");
-                if (index < 0 || index >= (int)array->elements.size())
-                    runtimeError("VM: Array index out of bounds.");
+            NEXT;
+        }
+        QUICK_INT_OP(OP_ADD_INT, OP_ADD, a.as.i + b.as.i)
+        QUICK_DOUBLE_OP(OP_ADD_DOUBLE, OP_ADD, ad + bd)
+        CASE(OP_ADD_STRING): {
+            Value& a = vm.stack[vm.stack.size() - 2];
+            const Value& b = vm.stack.back();
+            if (a.type != ValueType::String || b.type != ValueType::String)
+                DEOPT(OP_ADD);
+            a = Value(getVal<std::string>(a) + getVal<std::string>(b));
+            vm.stack.pop_back();
+            NEXT;
+        }
+        QUICK_INT_OP(OP_SUB_INT, OP_SUB, a.as.i - b.as.i)
+        QUICK_DOUBLE_OP(OP_SUB_DOUBLE, OP_SUB, ad - bd)
+        QUICK_INT_OP(OP_MUL_INT, OP_MUL, a.as.i * b.as.i)
+        QUICK_DOUBLE_OP(OP_MUL_DOUBLE, OP_MUL, ad * bd)
+        QUICK_INT_OP(OP_LT_INT, OP_LT, a.as.i < b.as.i)
+        QUICK_INT_OP(OP_LE_INT, OP_LE, a.as.i <= b.as.i)
+        QUICK_INT_OP(OP_GT_INT, OP_GT, a.as.i > b.as.i)
+        QUICK_INT_OP(OP_GE_INT, OP_GE, a.as.i >= b.as.i)
+        QUICK_INT_OP(OP_NE_INT, OP_NE, a.as.i != b.as.i)
+        QUICK_INT_OP(OP_EQ_INT, OP_EQ, a.as.i == b.as.i)
+        QUICK_DOUBLE_OP(OP_LT_DOUBLE, OP_LT, ad < bd)
+        QUICK_DOUBLE_OP(OP_LE_DOUBLE, OP_LE, ad <= bd)
+        QUICK_DOUBLE_OP(OP_GT_DOUBLE, OP_GT, ad > bd)
+        QUICK_DOUBLE_OP(OP_GE_DOUBLE, OP_GE, ad >= bd)
+        CASE(OP_FOR_LOOP): {
+            // Back edge of a For loop: step the counter slot and branch to
+            // the body while it is within the bound.
+            int counterSlot = OPERAND();
+            int boundSlot = OPERAND();
+            int stepSlot = OPERAND();
+            bool down = OPERAND();
+            int bodyOffset = JUMP_OPERAND();
+            if (forLoopStep(vm.stack[slotBase + counterSlot], vm.stack[slotBase + boundSlot], vm.stack[slotBase + stepSlot], down)) {
+                ip += bodyOffset;
+                JIT_ENTER();
+            }
+            NEXT;
+        }
+        CASE(OP_FOR_LOOP_GLOBAL): {
+            SymbolId name = OPERAND();
+            int boundSlot = OPERAND();
+            int stepSlot = OPERAND();
+            bool down = OPERAND();
+            int bodyOffset = JUMP_OPERAND();
+            Value* counter = vm.environment->lookup(name);
+            if (!counter)
+                runtimeError("VM: NilObjectException for variable: " + symbolName(name));
+            if (forLoopStep(*counter, vm.stack[slotBase + boundSlot], vm.stack[slotBase + stepSlot], down))
+                ip += bodyOffset;
+            NEXT;
+        }
+        CASE(OP_FOR_EACH): {
+            // Push the next element, or leave the loop once the array is done.
+            int arraySlot = OPERAND();
+            int indexSlot = OPERAND();
+            int exitOffset = JUMP_OPERAND();
+            const Value& collection = vm.stack[slotBase + arraySlot];
+            if (collection.type != ValueType::Array)
+                runtimeError("VM: For Each expects an array. Instead got type: " + getTypeName(collection));
+            ObjArray* array = asObj<ObjArray>(collection);
+            int index = vm.stack[slotBase + indexSlot].as.i++;
+            if (index >= (int)array->elements.size())
+                ip += exitOffset;
+            else
                 vm.stack.push_back(array->elements[index]);
+            NEXT;
+        }
+        CASE(OP_JUMP_TABLE): {
+            const SwitchTable& table = chunk->switchTables[OPERAND()];
+            Value subject = pop(vm);
+            int key;
+            ip = table.defaultTarget;
+            if (switchIntKey(subject, key)) {
+                // In 64 bits, so a key far from a negative low bound cannot
+                // wrap back into the table; keys below it wrap far above.
+                uint64_t index = (uint64_t)((int64_t)key - table.low);
+                if (index < table.targets.size())
+                    ip = table.targets[index];
             }
-            else if (holds<std::string>(callee)) {
-                std::string funcName = toLower(getVal<std::string>(callee));
-                if (funcName == "print") {
-                    if (args.size() < 1) runtimeError("VM: print expects an argument.");
-                    std::cout << valueToString(args[0]) << std::endl;
-                    vm.stack.push_back(args[0]);
-                }
-                else if (funcName == "str") {
-                    if (args.size() < 1) runtimeError("VM: str expects an argument.");
-                    vm.stack.push_back(Value(valueToString(args[0])));
-                }
-                else if (funcName == "ticks") {
-                    auto now = std::chrono::steady_clock::now();
-                    double seconds = std::chrono::duration<double>(now - startTime).count();
-                    int ticks = static_cast<int>(seconds * 60);
-                    vm.stack.push_back(ticks);
-                }
-                else if (funcName == "microseconds") {
-                    auto now = std::chrono::steady_clock::now();
-                    double us = std::chrono::duration<double, std::micro>(now - startTime).count();
-                    vm.stack.push_back(us);
-                }
-                else if (funcName == "val") {
-                    if (args.size() != 1)
-                        runtimeError("VM: val expects exactly one argument.");
-                    if (!holds<std::string>(args[0]))
-                        runtimeError("VM: val expects a string argument.");
-                    double d = std::stod(getVal<std::string>(args[0]));
-                    vm.stack.push_back(d);
-                }
-                else {
-                    runtimeError("VM: Unknown built-in function: " + funcName);
-                }
+            NEXT;
+        }
+        CASE(OP_SWITCH_HASH): {
+            const SwitchTable& table = chunk->switchTables[OPERAND()];
+            Value subject = pop(vm);
+            int key;
+            ip = table.defaultTarget;
+            if (subject.type == ValueType::String) {
+                auto it = table.stringTargets.find(getVal<std::string>(subject));
+                if (it != table.stringTargets.end())
+                    ip = it->second;
             }
-            else {
-                runtimeError("VM: Can only call functions, methods, arrays, or built-in functions.");
+            else if (switchIntKey(subject, key)) {
+                auto it = table.intTargets.find(key);
+                if (it != table.intTargets.end())
+                    ip = it->second;
             }
-            break;
+            NEXT;
         }
-        case OP_OPTIONAL_CALL: {
-            int argCount = chunk.code[ip++];
+        CASE(OP_OPTIONAL_CALL): {
+            int argCount = OPERAND();
             std::vector<Value> args;
             for (int i = 0; i < argCount; i++) {
                 args.push_back(pop(vm));
             }
             std::reverse(args.begin(), args.end());
             Value callee = pop(vm);
-            debugLog("OP_OPTIONAL_CALL: callee type: " + getTypeName(callee));
+            VM_TRACE("OP_OPTIONAL_CALL: callee type: " + getTypeName(callee));
+            // Always leaves one value, nil when there was nothing to call, so
+            // the stack depth after it is fixed.
+            Value receiver;
+            bool bound = holds<Ref<ObjBoundMethod>>(callee) && holds<Ref<ObjFunction>>(asObj<ObjBoundMethod>(callee)->method);
+            if (bound) {
+                receiver = asObj<ObjBoundMethod>(callee)->receiver;
+                Value method = asObj<ObjBoundMethod>(callee)->method;
+                callee = std::move(method);
+            }
             if (holds<std::monostate>(callee)) {
-                debugLog("OP_OPTIONAL_CALL: No constructor found; skipping call.");
+                VM_TRACE("OP_OPTIONAL_CALL: No constructor found; skipping call.");
+                vm.stack.push_back(callee);
             }
-            else if (holds<std::shared_ptr<ObjFunction>>(callee)) {
-                auto function = getVal<std::shared_ptr<ObjFunction>>(callee);
+            else if (holds<Ref<ObjFunction>>(callee)) {
+                auto function = getVal<Ref<ObjFunction>>(callee);
                 int total = function->params.size();
                 int required = function->arity;
                 if ((int)args.size() < required || (int)args.size() > total)
                     runtimeError("VM: Expected between " + std::to_string(required) + " and " + std::to_string(total) + " arguments for constructor " + function->name);
-                for (int i = args.size(); i < total; i++) {
-                    args.push_back(function->params[i].defaultValue);
-                }
-                auto previousEnv = vm.environment;
-                vm.environment = std::make_shared<Environment>(previousEnv);
-                for (size_t i = 0; i < function->params.size(); i++) {
-                    vm.environment->define(function->params[i].name, args[i]);
-                }
-                Value result = runVM(vm, function->chunk);
-                vm.environment = previousEnv;
-                debugLog("OP_OPTIONAL_CALL: Constructor function " + function->name + " returned " + valueToString(result));
-                if (!holds<std::monostate>(result))
-                    vm.stack.push_back(result);
+                Value result = callScriptFunction(vm, function, args, bound ? &receiver : nullptr);
+                VM_TRACE("OP_OPTIONAL_CALL: Constructor function " + function->name + " returned " + valueToString(result));
+                vm.stack.push_back(result);
             }
             else {
                 runtimeError("OP_OPTIONAL_CALL: Can only call functions or nil.");
             }
-            break;
-        }
-        case OP_RETURN: {
-            Value ret = vm.stack.empty() ? Value(std::monostate{}) : pop(vm);
-            return ret;
-        }
-        case OP_NIL: {
+            NEXT;
+        }
+        CASE(OP_RETURN): {
+            Value result = pop(vm);
+            vm.stack.resize(vm.frames.back().stackBase);
+            vm.frames.pop_back();
+            if (vm.frames.size() < entryDepth)
+                return result;
+            vm.stack.push_back(result);
+            chunk = vm.frames.back().chunk;
+            ip = vm.frames.back().ip;
+            slotBase = vm.frames.back().slotBase;
+            NEXT;
+        }
+        CASE(OP_NIL): {
             vm.stack.push_back(Value(std::monostate{}));
-            break;
-        }
-        case OP_JUMP_IF_FALSE: {
-            int offset = chunk.code[ip++];
-            Value condition = pop(vm);
-            bool condTruth = false;
-            if (holds<bool>(condition))
-                condTruth = getVal<bool>(condition);
-            else if (holds<int>(condition))
-                condTruth = (getVal<int>(condition) != 0);
-            else if (holds<std::string>(condition))
-                condTruth = !getVal<std::string>(condition).empty();
-            else if (std::holds_alternative<std::monostate>(condition))
-                condTruth = false;
-            if (!condTruth) {
-                ip = offset;
+            NEXT;
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            int offset = JUMP_OPERAND();
+            if (!isTruthy(pop(vm)))
+                ip += offset;
+            NEXT;
+        }
+        CASE(OP_JUMP_IF_TRUE): {
+            int offset = JUMP_OPERAND();
+            if (isTruthy(pop(vm)))
+                ip += offset;
+            NEXT;
+        }
+        CASE(OP_NOT): {
+            Value& v = vm.stack.back();
+            v = Value(!isTruthy(v));
+            NEXT;
+        }
+        FUSED_JUMP(OP_JUMP_IF_NOT_LT, <)
+        FUSED_JUMP(OP_JUMP_IF_NOT_LE, <=)
+        FUSED_JUMP(OP_JUMP_IF_NOT_GT, >)
+        FUSED_JUMP(OP_JUMP_IF_NOT_GE, >=)
+        FUSED_JUMP(OP_JUMP_IF_NOT_EQ, ==)
+        FUSED_JUMP(OP_JUMP_IF_NOT_NE, !=)
+        CASE(OP_INC_LOCAL): {
+            Value& local = vm.stack[slotBase + OPERAND()];
+            const Value& k = chunk->constants[OPERAND()];
+            if (local.type == ValueType::Int && k.type == ValueType::Int)
+                local.as.i += k.as.i;
+            else
+                local = addValues(local, k);
+            NEXT;
+        }
+        CASE(OP_ADD_LOCAL_CONST): {
+            const Value& local = vm.stack[slotBase + OPERAND()];
+            const Value& k = chunk->constants[OPERAND()];
+            Value result = (local.type == ValueType::Int && k.type == ValueType::Int)
+                ? Value(local.as.i + k.as.i) : addValues(local, k);
+            vm.stack.push_back(std::move(result));
+            NEXT;
+        }
+        CASE(OP_SUB_LOCAL_CONST): {
+            const Value& local = vm.stack[slotBase + OPERAND()];
+            const Value& k = chunk->constants[OPERAND()];
+            Value result = (local.type == ValueType::Int && k.type == ValueType::Int)
+                ? Value(local.as.i - k.as.i) : subValues(local, k);
+            vm.stack.push_back(std::move(result));
+            NEXT;
+        }
+        CASE(OP_JUMP_IF_NOT_LOCAL_CONST): {
+            int cmp = OPERAND();
+            const Value& a = vm.stack[slotBase + OPERAND()];
+            const Value& b = chunk->constants[OPERAND()];
+            int offset = JUMP_OPERAND();
+            if (!compareValues(cmp, a, b))
+                ip += offset;
+            NEXT;
+        }
+        CASE(OP_JUMP_IF_NOT_LOCALS): {
+            int cmp = OPERAND();
+            const Value& a = vm.stack[slotBase + OPERAND()];
+            const Value& b = vm.stack[slotBase + OPERAND()];
+            int offset = JUMP_OPERAND();
+            if (!compareValues(cmp, a, b))
+                ip += offset;
+            NEXT;
+        }
+        CASE(OP_GET_SELF_FIELD): {
+            SymbolId name = OPERAND();
+            InlineCache& cache = chunk->caches[OPERAND()];
+            const Value& self = vm.stack[slotBase];
+            if (self.type == ValueType::Instance) {
+                ObjInstance* instance = asObj<ObjInstance>(self);
+                const InlineCache::Entry* hit = cache.find(instance->klass->shapeId);
+                if (hit && hit->slot >= 0) {
+                    Value field = instance->fields[hit->slot];
+                    vm.stack.push_back(std::move(field));
+                    NEXT;
+                }
             }
-            break;
-        }
-        case OP_JUMP: {
-            int offset = chunk.code[ip++];
-            ip = offset;
-            break;
-        }
-        case OP_CLASS: {
-            int nameIndex = chunk.code[ip++];
-            Value nameVal = chunk.constants[nameIndex];
+            Value* field = selfField(vm, name);
+            cacheSelfField(vm, field, cache);
+            Value val = field ? *field : vm.environment->get(name);
+            vm.stack.push_back(val);
+            NEXT;
+        }
+        CASE(OP_SET_SELF_FIELD): {
+            SymbolId name = OPERAND();
+            InlineCache& cache = chunk->caches[OPERAND()];
+            Value newVal = pop(vm);
+            const Value& self = vm.stack[slotBase];
+            if (self.type == ValueType::Instance) {
+                ObjInstance* instance = asObj<ObjInstance>(self);
+                const InlineCache::Entry* hit = cache.find(instance->klass->shapeId);
+                if (hit && hit->slot >= 0) {
+                    instance->fields[hit->slot] = std::move(newVal);
+                    NEXT;
+                }
+            }
+            Value* field = selfField(vm, name);
+            cacheSelfField(vm, field, cache);
+            if (field)
+                *field = newVal;
+            else
+                vm.environment->assign(name, newVal);
+            NEXT;
+        }
+        CASE(OP_JUMP): {
+            int offset = JUMP_OPERAND();
+            ip += offset;
+            if (offset < 0)
+                JIT_ENTER();
+            NEXT;
+        }
+        CASE(OP_CLASS): {
+            int nameIndex = OPERAND();
+            Value nameVal = chunk->constants[nameIndex];
             if (!holds<std::string>(nameVal))
                 runtimeError("VM: Class name must be a string.");
-            auto klass = std::make_shared<ObjClass>();
+            auto klass = makeRef<ObjClass>();
             klass->name = getVal<std::string>(nameVal);
             vm.stack.push_back(Value(klass));
-            break;
+            NEXT;
         }
-        case OP_METHOD: {
-            int methodNameIndex = chunk.code[ip++];
-            Value methodNameVal = chunk.constants[methodNameIndex];
-            if (!holds<std::string>(methodNameVal))
-                runtimeError("VM: Method name must be a string.");
+        CASE(OP_METHOD): {
+            SymbolId methodName = OPERAND();
             Value methodVal = pop(vm);
-            if (!holds<std::shared_ptr<ObjFunction>>(methodVal))
+            if (!holds<Ref<ObjFunction>>(methodVal))
                 runtimeError("VM: Method must be a function.");
             Value classVal = pop(vm);
-            if (!holds<std::shared_ptr<ObjClass>>(classVal))
+            if (!holds<Ref<ObjClass>>(classVal))
                 runtimeError("VM: No class found for method.");
-            auto klass = getVal<std::shared_ptr<ObjClass>>(classVal);
-            std::string methodName = toLower(getVal<std::string>(methodNameVal));
+            auto klass = getVal<Ref<ObjClass>>(classVal);
             if (klass->methods.find(methodName) != klass->methods.end()) {
                 // Overload handling omitted.
             }
             else {
                 klass->methods[methodName] = methodVal;
+                klass->shapeId = newShapeId();
             }
             vm.stack.push_back(Value(klass));
-            break;
+            NEXT;
         }
-        case OP_PROPERTIES: {
-            int propIndex = chunk.code[ip++];
-            Value propVal = chunk.constants[propIndex];
+        CASE(OP_PROPERTIES): {
+            int propIndex = OPERAND();
+            Value propVal = chunk->constants[propIndex];
             if (!holds<PropertiesType>(propVal))
                 runtimeError("VM: Properties must be a property map.");
-            auto props = getVal<PropertiesType>(propVal);
+            const PropertiesType& props = getVal<PropertiesType>(propVal);
             Value classVal = pop(vm);
-            if (!holds<std::shared_ptr<ObjClass>>(classVal))
+            if (!holds<Ref<ObjClass>>(classVal))
                 runtimeError("VM: Properties can only be set on a class object.");
-            auto klass = getVal<std::shared_ptr<ObjClass>>(classVal);
-            klass->properties = props;
+            auto klass = getVal<Ref<ObjClass>>(classVal);
+            klass->fieldSlots.clear();
+            klass->fieldDefaults.clear();
+            for (auto& p : props) {
+                SymbolId name = intern(p.first);
+                auto slot = klass->fieldSlots.find(name);
+                if (slot != klass->fieldSlots.end()) {
+                    klass->fieldDefaults[slot->second] = p.second;
+                    continue;
+                }
+                klass->fieldSlots[name] = (int)klass->fieldDefaults.size();
+                klass->fieldDefaults.push_back(p.second);
+            }
+            klass->shapeId = newShapeId();
             vm.stack.push_back(Value(klass));
-            break;
+            NEXT;
         }
-        case OP_ARRAY: {
-            int count = chunk.code[ip++];
+        CASE(OP_ARRAY): {
+            int count = OPERAND();
             std::vector<Value> elems;
             for (int i = 0; i < count; i++) {
                 elems.push_back(pop(vm));
             }
             std::reverse(elems.begin(), elems.end());
-            auto array = std::make_shared<ObjArray>();
+            auto array = makeRef<ObjArray>();
             array->elements = elems;
             vm.stack.push_back(Value(array));
-            debugLog("VM: Created array with " + std::to_string(count) + " elements.");
-            break;
+            VM_TRACE("VM: Created array with " + std::to_string(count) + " elements.");
+            NEXT;
+        }
+        CASE(OP_GET_PROPERTY): {
+            SymbolId key = OPERAND();
+            InlineCache& cache = chunk->caches[OPERAND()];
+            if (vm.stack.back().type == ValueType::Instance) {
+                ObjInstance* instance = asObj<ObjInstance>(vm.stack.back());
+                const InlineCache::Entry* hit = cache.find(instance->klass->shapeId);
+                if (hit && hit->slot >= 0) {
+                    Value field = instance->fields[hit->slot];
+                    vm.stack.back() = std::move(field);
+                    NEXT;
+                }
+            }
+            Value object = pop(vm);
+            vm.stack.push_back(getProperty(object, key, cache));
+            NEXT;
         }
-        case OP_GET_PROPERTY: {
-            int nameIndex = chunk.code[ip++];
-            Value propNameVal = chunk.constants[nameIndex];
-            if (!holds<std::string>(propNameVal))
-                runtimeError("VM: Property name must be a string.");
-            std::string propName = toLower(getVal<std::string>(propNameVal));
+        CASE(OP_SET_PROPERTY): {
+            SymbolId propName = OPERAND();
+            InlineCache& cache = chunk->caches[OPERAND()];
+            Value value = pop(vm);
+            if (vm.stack.back().type == ValueType::Instance) {
+                ObjInstance* instance = asObj<ObjInstance>(vm.stack.back());
+                const InlineCache::Entry* hit = cache.find(instance->klass->shapeId);
+                if (hit && hit->slot >= 0) {
+                    instance->fields[hit->slot] = std::move(value);
+                    vm.stack.pop_back();
+                    NEXT;
+                }
+            }
             Value object = pop(vm);
-            if (holds<std::shared_ptr<ObjInstance>>(object)) {
-                auto instance = getVal<std::shared_ptr<ObjInstance>>(object);
-                std::string key = toLower(propName);
-                if (instance->klass->isPlugin) {
-                    auto it = instance->klass->pluginProperties.find(key);
-                    if (it != instance->klass->pluginProperties.end()) {
-                        BuiltinFn getter = it->second.first;
-                        debugLog("OP_GET_PROPERTY: Calling plugin getter for property '" + key + "'");
-                        Value result = getter({ Value(instance->pluginInstance) });
-                        debugLog("OP_GET_PROPERTY: Plugin getter returned type: " + getTypeName(result) +
-                                 " value: " + valueToString(result));
-                        vm.stack.push_back(result);
-                    }
-                    else {
-                        // If no explicit getter, return a target identifier string for events.
-                        int handle = *(int*)&(instance->pluginInstance);
-                        std::string target = "plugin:" + std::to_string(handle) + ":" + key;
-                        vm.stack.push_back(Value(target));
-                    }
+            VM_TRACE("OP_SET_PROPERTY: About to set property '" + symbolName(propName) + "'.");
+            VM_TRACE("OP_SET_PROPERTY: Value = " + valueToString(value));
+            VM_TRACE("OP_SET_PROPERTY: Object type = " + getTypeName(object) + " (" + valueToString(object) + ")");
+            setProperty(object, propName, value, cache);
+            NEXT;
+        }
+        CASE(OP_GET_LOCAL): {
+            int slot = OPERAND();
+            vm.stack.push_back(vm.stack[slotBase + slot]);
+            VM_TRACE("VM: Loaded local slot " + std::to_string(slot) + " = " + valueToString(vm.stack[slotBase + slot]));
+            NEXT;
+        }
+        CASE(OP_SET_LOCAL): {
+            int slot = OPERAND();
+            Value val = pop(vm);
+            vm.stack[slotBase + slot] = val;
+            VM_TRACE("VM: Set local slot " + std::to_string(slot) + " = " + valueToString(val));
+            NEXT;
+        }
+        CASE(OP_CONSTRUCTOR_END): {
+            Value constructorResult = pop(vm);
+            Value instance = pop(vm);
+            if (holds<std::monostate>(constructorResult))
+                vm.stack.push_back(instance);
+            else
+                vm.stack.push_back(constructorResult);
+            NEXT;
+        }
+        CASE(OP_WIDE):
+        CASE(OP_WIDE4): {
+            // Width prefix: run the instruction that follows with wide operands.
+            width = instruction == OP_WIDE ? 2 : 4;
+            unusedBits = 32 - 8 * width;
+            instruction = chunk->bytecode[ip++];
+#ifdef XOJO_COMPUTED_GOTO
+            goto *dispatchTable[instruction];
+#else
+            goto redispatch;
+#endif
+        }
+        default:
+            NEXT;
+        }
+    }
+}
+
+// The trace interpreter is a separate instantiation, chosen once per entry;
+// the production loop contains no logging code.
+Value runVM(VM& vm) {
+    if (DEBUG_MODE)
+        return runVMImpl<true, false>(vm);
+    return PROFILE_MODE ? runVMImpl<false, true>(vm) : runVMImpl<false, false>(vm);
+}
+
+#undef QUICK_INT_OP
+#undef QUICK_DOUBLE_OP
+#undef FUSED_JUMP
+#undef DEOPT
+#undef CASE
+#undef NEXT
+#undef VM_FETCH
+#undef VM_TRACE
+#undef JIT_ENTER
+#undef OPERAND
+#undef JUMP_OPERAND
+
+// ============================================================================
+// Register VM Execution (--vm register)
+// ============================================================================
+// A register frame is laid out like a stack frame: the callee at stackBase,
+// then the registers from slotBase, parameters first. A method's receiver
+// sits at stackBase and is register 0, self. Frames go on vm.frames
+// so call depth limits and native re-entry work across both tiers.
+// ----------------------------------------------------------------------------
+void enterRegisterFrame(VM& vm, ObjFunction* function, size_t stackBase, int argCount) {
+    size_t slotBase = function->isMethod ? stackBase : stackBase + 1;
+    for (size_t i = argCount; i < function->params.size(); i++)
+        vm.stack.push_back(function->params[i].defaultValue);
+    vm.stack.resize(slotBase + function->registers->registerCount);
+    pushFrame(vm, function, function->chunk, slotBase, stackBase);
+}
+
+// The generic arithmetic ops, computed as the stack VM does.
+Value registerArithmetic(int op, const Value& a, const Value& b) {
+    if (op == R_ADD)
+        return addValues(a, b);
+    if (op == R_SUB)
+        return subValues(a, b);
+    if ((op == R_MUL || op == R_MOD) && holds<int>(a) && holds<int>(b))
+        return Value(op == R_MUL ? getVal<int>(a) * getVal<int>(b) : getVal<int>(a) % getVal<int>(b));
+    double ad = holds<double>(a) ? getVal<double>(a) : static_cast<double>(getVal<int>(a));
+    double bd = holds<double>(b) ? getVal<double>(b) : static_cast<double>(getVal<int>(b));
+    switch (op) {
+    case R_MUL: return Value(ad * bd);
+    case R_DIV: return Value(ad / bd);
+    case R_POW: return Value(std::pow(ad, bd));
+    default:    return Value(std::fmod(ad, bd));
+    }
+}
+
+Value loadGlobal(VM& vm, SymbolId name) {
+    if (name == SYM_MICROSECONDS)
+        return Value(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - startTime).count());
+    if (name == SYM_TICKS)
+        return Value(static_cast<int>(std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count() * 60));
+    return vm.environment->get(name);
+}
+
+Value runRegisterVM(VM& vm);
+
+Value callRegisterFunction(VM& vm, ObjFunction* function, size_t stackBase, int argCount) {
+    enterRegisterFrame(vm, function, stackBase, argCount);
+    return runRegisterVM(vm);
+}
+
+#ifdef XOJO_COMPUTED_GOTO
+#define REG_CASE(op) case op: L_##op
+#define REG_NEXT do { vm.instructionCount++; instruction = code[ip++]; goto *dispatchTable[instruction]; } while (0)
+#else
+#define REG_CASE(op) case op
+#define REG_NEXT break
+#endif
+
+// An operand: a register, or the constant it names when below zero.
+#define RK(operand) ((operand) >= 0 ? R[operand] : K[-1 - (operand)])
+
+// Reload the frame state after a call or return changes the top frame.
+#define LOAD_FRAME()                                                    \
+    do {                                                                \
+        chunk = vm.frames.back().function->registers.get();             \
+        code = chunk->code.data();                                      \
+        K = chunk->constants.data();                                    \
+        ip = vm.frames.back().ip;                                       \
+        slotBase = vm.frames.back().slotBase;                           \
+        R = vm.stack.data() + slotBase;                                 \
+    } while (0)
+
+#define REG_ARITH(op, intExpr)                                          \
+    REG_CASE(op): {                                                     \
+        const Value& a = RK(code[ip + 1]);                              \
+        const Value& b = RK(code[ip + 2]);                              \
+        if (a.type == ValueType::Int && b.type == ValueType::Int)       \
+            R[code[ip]] = Value(intExpr);                               \
+        else                                                            \
+            R[code[ip]] = registerArithmetic(op, a, b);                 \
+        ip += 3;                                                        \
+        REG_NEXT;                                                       \
+    }
+
+#define REG_COMPARE(op, cmp, stackOp)                                   \
+    REG_CASE(op): {                                                     \
+        const Value& a = RK(code[ip + 1]);                              \
+        const Value& b = RK(code[ip + 2]);                              \
+        R[code[ip]] = Value((a.type == ValueType::Int && b.type == ValueType::Int) \
+            ? a.as.i cmp b.as.i : compareValues(stackOp, a, b));        \
+        ip += 3;                                                        \
+        REG_NEXT;                                                       \
+    }
+
+#define REG_JUMP_IF_NOT(op, cmp, stackOp)                               \
+    REG_CASE(op): {                                                     \
+        const Value& a = RK(code[ip]);                                  \
+        const Value& b = RK(code[ip + 1]);                              \
+        bool taken = (a.type == ValueType::Int && b.type == ValueType::Int) \
+            ? a.as.i cmp b.as.i : compareValues(stackOp, a, b);         \
+        ip = taken ? ip + 3 : code[ip + 2];                             \
+        REG_NEXT;                                                       \
+    }
+
+// ----------------------------------------------------------------------------
+// Dispatch loop for register code. Calls between register functions push
+// frames here; stack-tier and native callees run through runVM and
+// callNative. Returns when the frame on top at entry returns.
+// ----------------------------------------------------------------------------
+Value runRegisterVM(VM& vm) {
+    size_t entryDepth = vm.frames.size();
+    const ObjFunction::RegisterChunk* chunk;
+    const int* code;
+    const Value* K;
+    int ip;
+    size_t slotBase;
+    Value* R;
+    LOAD_FRAME();
+    int instruction;
+#ifdef XOJO_COMPUTED_GOTO
+    static void* const dispatchTable[] = {
+        &&L_R_MOVE, &&L_R_GET_GLOBAL, &&L_R_SET_GLOBAL,
+        &&L_R_ADD, &&L_R_SUB, &&L_R_MUL, &&L_R_DIV, &&L_R_POW, &&L_R_MOD,
+        &&L_R_LT, &&L_R_LE, &&L_R_GT, &&L_R_GE, &&L_R_EQ, &&L_R_NE,
+        &&L_R_NEGATE, &&L_R_NOT, &&L_R_JUMP, &&L_R_JUMP_IF_FALSE, &&L_R_JUMP_IF_TRUE,
+        &&L_R_JUMP_IF_NOT_LT, &&L_R_JUMP_IF_NOT_LE, &&L_R_JUMP_IF_NOT_GT,
+        &&L_R_JUMP_IF_NOT_GE, &&L_R_JUMP_IF_NOT_EQ, &&L_R_JUMP_IF_NOT_NE,
+        &&L_R_CALL, &&L_R_TAIL_CALL, &&L_R_RETURN, &&L_R_FOR_LOOP,
+        &&L_R_GET_SELF_FIELD, &&L_R_SET_SELF_FIELD, &&L_R_GET_PROPERTY, &&L_R_SET_PROPERTY, &&L_R_INVOKE,
+    };
+    static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == R_COUNT, "dispatchTable must list every register opcode in enum order");
+#endif
+    while (true) {
+        vm.instructionCount++;
+        instruction = code[ip++];
+#ifdef XOJO_COMPUTED_GOTO
+        goto *dispatchTable[instruction];
+#endif
+        switch (instruction) {
+        REG_CASE(R_MOVE): {
+            R[code[ip]] = RK(code[ip + 1]);
+            ip += 2;
+            REG_NEXT;
+        }
+        REG_CASE(R_GET_GLOBAL): {
+            R[code[ip]] = loadGlobal(vm, code[ip + 1]);
+            ip += 2;
+            REG_NEXT;
+        }
+        REG_CASE(R_SET_GLOBAL): {
+            vm.environment->assign(code[ip], RK(code[ip + 1]));
+            ip += 2;
+            REG_NEXT;
+        }
+        REG_ARITH(R_ADD, a.as.i + b.as.i)
+        REG_ARITH(R_SUB, a.as.i - b.as.i)
+        REG_ARITH(R_MUL, a.as.i * b.as.i)
+        REG_CASE(R_DIV):
+        REG_CASE(R_POW): {
+            R[code[ip]] = registerArithmetic(instruction, RK(code[ip + 1]), RK(code[ip + 2]));
+            ip += 3;
+            REG_NEXT;
+        }
+        REG_ARITH(R_MOD, a.as.i % b.as.i)
+        REG_COMPARE(R_LT, <, OP_JUMP_IF_NOT_LT)
+        REG_COMPARE(R_LE, <=, OP_JUMP_IF_NOT_LE)
+        REG_COMPARE(R_GT, >, OP_JUMP_IF_NOT_GT)
+        REG_COMPARE(R_GE, >=, OP_JUMP_IF_NOT_GE)
+        REG_COMPARE(R_EQ, ==, OP_JUMP_IF_NOT_EQ)
+        REG_COMPARE(R_NE, !=, OP_JUMP_IF_NOT_NE)
+        REG_CASE(R_NEGATE): {
+            const Value& v = RK(code[ip + 1]);
+            if (v.type == ValueType::Int)
+                R[code[ip]] = Value(-v.as.i);
+            else if (v.type == ValueType::Double)
+                R[code[ip]] = Value(-v.as.d);
+            else
+                runtimeError("VM: Operand must be a number for negation.");
+            ip += 2;
+            REG_NEXT;
+        }
+        REG_CASE(R_NOT): {
+            R[code[ip]] = Value(!isTruthy(RK(code[ip + 1])));
+            ip += 2;
+            REG_NEXT;
+        }
+        REG_CASE(R_JUMP): {
+            ip = code[ip];
+            REG_NEXT;
+        }
+        REG_CASE(R_JUMP_IF_FALSE): {
+            ip = isTruthy(RK(code[ip])) ? ip + 2 : code[ip + 1];
+            REG_NEXT;
+        }
+        REG_CASE(R_JUMP_IF_TRUE): {
+            ip = isTruthy(RK(code[ip])) ? code[ip + 1] : ip + 2;
+            REG_NEXT;
+        }
+        REG_JUMP_IF_NOT(R_JUMP_IF_NOT_LT, <, OP_JUMP_IF_NOT_LT)
+        REG_JUMP_IF_NOT(R_JUMP_IF_NOT_LE, <=, OP_JUMP_IF_NOT_LE)
+        REG_JUMP_IF_NOT(R_JUMP_IF_NOT_GT, >, OP_JUMP_IF_NOT_GT)
+        REG_JUMP_IF_NOT(R_JUMP_IF_NOT_GE, >=, OP_JUMP_IF_NOT_GE)
+        REG_JUMP_IF_NOT(R_JUMP_IF_NOT_EQ, ==, OP_JUMP_IF_NOT_EQ)
+        REG_JUMP_IF_NOT(R_JUMP_IF_NOT_NE, !=, OP_JUMP_IF_NOT_NE)
+        REG_CASE(R_CALL):
+        REG_CASE(R_TAIL_CALL):
+        REG_CASE(R_INVOKE): {
+            // R_INVOKE's symbol and cache come first, so every call ends in
+            // dst, base, argCount and R_RETURN finds dst at the same place.
+            int at = instruction == R_INVOKE ? ip + 2 : ip;
+            int dst = code[at], base = code[at + 1], argCount = code[at + 2];
+            ip = at + 3;
+            // The callee and arguments are copied above the frame, where a
+            // stack frame would have them.
+            size_t calleeIndex = vm.stack.size();
+            for (int i = 0; i <= argCount; i++)
+                vm.stack.push_back(vm.stack[slotBase + base + i]);
+            ObjFunction* frameFn;
+            if (instruction == R_INVOKE) {
+                frameFn = invokeTarget(vm, code[at - 2], argCount, chunk->caches[code[at - 1]], calleeIndex);
+                if (!frameFn) {
+                    Value result = pop(vm);
+                    R = vm.stack.data() + slotBase;
+                    R[dst] = std::move(result);
+                    REG_NEXT;
                 }
-                else {
-                    if (instance->fields.find(key) != instance->fields.end()) {
-                        vm.stack.push_back(instance->fields[key]);
-                    }
-                    else if (instance->klass && instance->klass->methods.find(key) != instance->klass->methods.end()) {
-                        auto bound = std::make_shared<ObjBoundMethod>();
-                        bound->receiver = object;
-                        bound->name = key;
-                        vm.stack.push_back(Value(bound));
-                    }
-                    else if (key == "tostring") {
-                        vm.stack.push_back(valueToString(object));
-                    }
-                    else {
-                        if (key == "constructor") {
-                            vm.stack.push_back(Value(std::monostate{}));
-                        }
-                        else {
-                            runtimeError("VM: NilObjectException for property: " + propName);
-                        }
-                    }
+            }
+            else
+                frameFn = resolveFrameCallee(vm.stack[calleeIndex], argCount);
+            if (frameFn && frameFn->registers) {
+                if (instruction == R_TAIL_CALL) {
+                    size_t stackBase = vm.frames.back().stackBase;
+                    std::move(vm.stack.begin() + calleeIndex, vm.stack.end(), vm.stack.begin() + stackBase);
+                    vm.stack.resize(stackBase + argCount + 1);
+                    vm.frames.pop_back();
+                    calleeIndex = stackBase;
                 }
+                else
+                    vm.frames.back().ip = ip;
+                enterRegisterFrame(vm, frameFn, calleeIndex, argCount);
+                LOAD_FRAME();
+                REG_NEXT;
             }
-            else if (holds<std::shared_ptr<ObjArray>>(object)) {
-                auto array = getVal<std::shared_ptr<ObjArray>>(object);
-                auto bound = std::make_shared<ObjBoundMethod>();
-                bound->receiver = object;
-                bound->name = propName;
-                vm.stack.push_back(Value(bound));
+            Value result;
+            if (frameFn) {
+                enterFunction(vm, frameFn, calleeIndex, argCount);
+                result = runVM(vm);
             }
-            else if (holds<int>(object)) {
-                if (propName == "tostring") {
-                    vm.stack.push_back(valueToString(object));
-                }
-                else {
-                    runtimeError("VM: Unknown property for integer: " + propName);
-                }
+            else {
+                callNative(vm, argCount);
+                result = pop(vm);
             }
-            else if (holds<double>(object)) {
-                if (propName == "tostring") {
-                    vm.stack.push_back(valueToString(object));
+            R = vm.stack.data() + slotBase;
+            R[dst] = std::move(result);
+            REG_NEXT;
+        }
+        REG_CASE(R_RETURN): {
+            Value result = RK(code[ip]);
+            vm.stack.resize(vm.frames.back().stackBase);
+            vm.frames.pop_back();
+            if (vm.frames.size() < entryDepth)
+                return result;
+            LOAD_FRAME();
+            R[code[ip - 3]] = std::move(result); // the caller's R_CALL destination
+            REG_NEXT;
+        }
+        REG_CASE(R_FOR_LOOP): {
+            if (forLoopStep(R[code[ip]], R[code[ip + 1]], R[code[ip + 2]], code[ip + 3]))
+                ip = code[ip + 4];
+            else
+                ip += 5;
+            REG_NEXT;
+        }
+        REG_CASE(R_GET_SELF_FIELD): {
+            InlineCache& cache = chunk->caches[code[ip + 2]];
+            if (R[0].type == ValueType::Instance) {
+                ObjInstance* instance = asObj<ObjInstance>(R[0]);
+                const InlineCache::Entry* hit = cache.find(instance->klass->shapeId);
+                if (hit && hit->slot >= 0) {
+                    R[code[ip]] = instance->fields[hit->slot];
+                    ip += 3;
+                    REG_NEXT;
                 }
-                else {
-                    runtimeError("VM: Unknown property for double: " + propName);
+            }
+            Value* field = selfField(vm, code[ip + 1]);
+            cacheSelfField(vm, field, cache);
+            R[code[ip]] = field ? *field : vm.environment->get(code[ip + 1]);
+            ip += 3;
+            REG_NEXT;
+        }
+        REG_CASE(R_SET_SELF_FIELD): {
+            InlineCache& cache = chunk->caches[code[ip + 2]];
+            const Value& value = RK(code[ip + 1]);
+            if (R[0].type == ValueType::Instance) {
+                ObjInstance* instance = asObj<ObjInstance>(R[0]);
+                const InlineCache::Entry* hit = cache.find(instance->klass->shapeId);
+                if (hit && hit->slot >= 0) {
+                    instance->fields[hit->slot] = value;
+                    ip += 3;
+                    REG_NEXT;
                 }
             }
-            else if (holds<std::string>(object)) {
-                std::string s = getVal<std::string>(object);
-                if (propName == "tostring") {
-                    vm.stack.push_back(s);
+            Value* field = selfField(vm, code[ip]);
+            cacheSelfField(vm, field, cache);
+            if (field)
+                *field = value;
+            else
+                vm.environment->assign(code[ip], value);
+            ip += 3;
+            REG_NEXT;
+        }
+        REG_CASE(R_GET_PROPERTY): {
+            InlineCache& cache = chunk->caches[code[ip + 3]];
+            const Value& object = RK(code[ip + 1]);
+            if (object.type == ValueType::Instance) {
+                ObjInstance* instance = asObj<ObjInstance>(object);
+                const InlineCache::Entry* hit = cache.find(instance->klass->shapeId);
+                if (hit && hit->slot >= 0) {
+                    R[code[ip]] = instance->fields[hit->slot];
+                    ip += 4;
+                    REG_NEXT;
                 }
-                else {
-                    runtimeError("VM: Unknown property for string: " + propName);
+            }
+            // Copied, since a plugin getter can run script code and move the stack.
+            Value result = getProperty(Value(object), code[ip + 2], cache);
+            R = vm.stack.data() + slotBase;
+            R[code[ip]] = std::move(result);
+            ip += 4;
+            REG_NEXT;
+        }
+        REG_CASE(R_SET_PROPERTY): {
+            InlineCache& cache = chunk->caches[code[ip + 3]];
+            const Value& object = RK(code[ip]);
+            const Value& value = RK(code[ip + 2]);
+            if (object.type == ValueType::Instance) {
+                ObjInstance* instance = asObj<ObjInstance>(object);
+                const InlineCache::Entry* hit = cache.find(instance->klass->shapeId);
+                if (hit && hit->slot >= 0) {
+                    instance->fields[hit->slot] = value;
+                    ip += 4;
+                    REG_NEXT;
                 }
             }
-            else if (holds<std::shared_ptr<ObjModule>>(object)) {
-                auto module = getVal<std::shared_ptr<ObjModule>>(object);
-                std::string key = toLower(propName);
-                if (module->publicMembers.find(key) != module->publicMembers.end())
-                    vm.stack.push_back(module->publicMembers[key]);
-                else
-                    runtimeError("VM: NilObjectException module property: " + propName);
+            setProperty(Value(object), code[ip + 1], Value(value), cache);
+            R = vm.stack.data() + slotBase;
+            ip += 4;
+            REG_NEXT;
+        }
+        default:
+            REG_NEXT;
+        }
+    }
+}
+
+#undef REG_CASE
+#undef REG_NEXT
+#undef RK
+#undef LOAD_FRAME
+#undef REG_ARITH
+#undef REG_COMPARE
+#undef REG_JUMP_IF_NOT
+
+const char MARKER[9] = "XOJOCODE"; // 8 characters + null terminator = 9
+
+// ============================================================================
+// Program images (.xsb): the compiled program in a versioned binary form, so
+// an executable built by xcompile starts without lexing, parsing or
+// compiling. "--xsb file" writes one instead of running the script. Loading
+// maps the file copy-on-write and points every chunk's bytecode straight into
+// the mapping; only constants, parameters and switch tables become objects.
+// Every chunk is run through the verifier before anything executes, so a
+// damaged or hand-edited image is rejected instead of trusted.
+// Classes need nothing of their own: the main chunk builds them when it runs.
+//
+// All integers are little-endian. Layout, version 1:
+//   header    "XOJOXSB\0", u32 version, u32 OP_COUNT, u32 symbols,
+//             u32 objects, u32 globals
+//   symbols   string per symbol, in id order (ids are baked into bytecode)
+//   objects   u8 ValueType per object, then each one's contents:
+//             Function  string name, i32 arity, params, u8 isMethod, chunk
+//             Enum      string name, u32 count, { u32 symbol, i32 value }...
+//             Module    string name, u32 count, { u32 symbol, value }...
+//             Array     u32 count, value...
+//   main      chunk
+//   globals   { u32 symbol, value }... - what compilation defined or replaced
+// where
+//   string    u32 length, bytes
+//   params    u32 count, { string name, string type, u8 optional, value }...
+//   chunk     i32 localCount, i32 maxStack, u32 caches, u32 size, size bytes
+//             of bytecode (padding included), u32 count, value...,
+//             u32 count, switch table...
+//   table     i32 low, u32 count, i32 target..., u32 count, { i32, i32 }...,
+//             u32 count, { string, i32 }..., i32 default
+//   value     u8 ValueType, then Int i32 | Double 8 bytes | Bool u8 |
+//             Color u32 | String string | Properties u32 count,
+//             { string, value }... | Overloads u32 count, u32 object... |
+//             Builtin (a Declare) params, string returnType, apiName,
+//             libraryName | Function, Enum, Module, Array u32 object.
+//             Nil and Pointer (always null) have no payload.
+// Bump XSB_VERSION whenever the layout, the opcodes or their encoding change.
+// ============================================================================
+const char XSB_MAGIC[8] = "XOJOXSB"; // 7 characters + null terminator = 8
+const uint32_t XSB_VERSION = 2;
+
+class XsbWriter {
+public:
+    explicit XsbWriter(const ProgramGraph& graph) : graph(graph) {}
+
+    std::string write(VM& vm) {
+        const std::vector<std::string>& names = symbolTable().names;
+        out.append(XSB_MAGIC, sizeof(XSB_MAGIC));
+        writeU32(XSB_VERSION);
+        writeU32(OP_COUNT);
+        writeU32(names.size());
+        writeU32(graph.objects.size());
+        writeU32(graph.globals.size());
+        for (const std::string& name : names)
+            writeString(name);
+        for (const Obj* object : graph.objects)
+            out.push_back((char)object->type);
+        for (const Obj* object : graph.objects)
+            writeObject(object);
+        writeChunk(vm.mainChunk);
+        for (auto& entry : graph.globals) {
+            writeU32(entry.first);
+            writeValue(entry.second);
+        }
+        return out;
+    }
+
+private:
+    const ProgramGraph& graph;
+    std::string out;
+
+    void writeU32(uint32_t v) {
+        for (int b = 0; b < 4; b++)
+            out.push_back((char)(v >> (8 * b)));
+    }
+    void writeString(const std::string& s) {
+        writeU32(s.size());
+        out += s;
+    }
+    void writeParams(const std::vector<Param>& params) {
+        writeU32(params.size());
+        for (auto& p : params) {
+            writeString(p.name);
+            writeString(p.type);
+            out.push_back(p.optional);
+            writeValue(p.defaultValue);
+        }
+    }
+    void writeValue(const Value& v) {
+        out.push_back((char)v.type);
+        switch (v.type) {
+        case ValueType::Int:   writeU32(v.as.i); break;
+        case ValueType::Bool:  out.push_back(v.as.b); break;
+        case ValueType::Color: writeU32(v.as.color); break;
+        case ValueType::Double: {
+            uint64_t bits;
+            std::memcpy(&bits, &v.as.d, sizeof(bits));
+            writeU32((uint32_t)bits);
+            writeU32((uint32_t)(bits >> 32));
+            break;
+        }
+        case ValueType::String:
+            writeString(static_cast<const ObjString*>(v.as.obj)->chars);
+            break;
+        case ValueType::Properties: {
+            auto& properties = static_cast<const ObjProperties*>(v.as.obj)->properties;
+            writeU32(properties.size());
+            for (auto& property : properties) {
+                writeString(property.first);
+                writeValue(property.second);
             }
-            else if (holds<std::shared_ptr<ObjEnum>>(object)) {
-                auto en = getVal<std::shared_ptr<ObjEnum>>(object);
-                std::string key = toLower(propName);
-                if (en->members.find(key) != en->members.end()) {
-                    vm.stack.push_back(en->members[key]);
-                }
-                else {
-                    runtimeError("VM: NilObjectException enum member: " + propName);
-                }
+            break;
+        }
+        case ValueType::Overloads: {
+            auto& functions = static_cast<const ObjOverloads*>(v.as.obj)->functions;
+            writeU32(functions.size());
+            for (auto& function : functions)
+                writeU32(graph.ids.at(function.get()));
+            break;
+        }
+        case ValueType::Builtin: {
+            const DeclareSignature& declare = *static_cast<const ObjBuiltin*>(v.as.obj)->declare;
+            writeParams(declare.params);
+            writeString(declare.returnType);
+            writeString(declare.apiName);
+            writeString(declare.libraryName);
+            break;
+        }
+        case ValueType::Function: case ValueType::Enum: case ValueType::Module: case ValueType::Array:
+            writeU32(graph.ids.at(v.as.obj));
+            break;
+        default: // Nil, and Pointer, which ProgramGraph only allows when null
+            break;
+        }
+    }
+    void writeChunk(const ObjFunction::CodeChunk& chunk) {
+        writeU32(chunk.localCount);
+        writeU32(chunk.maxStack);
+        writeU32(chunk.caches.size());
+        writeU32(chunk.bytecode.size());
+        out.append(reinterpret_cast<const char*>(&chunk.bytecode[0]), chunk.bytecode.size());
+        writeU32(chunk.constants.size());
+        for (auto& constant : chunk.constants)
+            writeValue(constant);
+        writeU32(chunk.switchTables.size());
+        for (const SwitchTable& table : chunk.switchTables) {
+            writeU32(table.low);
+            writeU32(table.targets.size());
+            for (int target : table.targets)
+                writeU32(target);
+            writeU32(table.intTargets.size());
+            for (auto& entry : table.intTargets) {
+                writeU32(entry.first);
+                writeU32(entry.second);
             }
-            else {
-                runtimeError("VM: Property access on unsupported type.");
+            writeU32(table.stringTargets.size());
+            for (auto& entry : table.stringTargets) {
+                writeString(entry.first);
+                writeU32(entry.second);
             }
+            writeU32(table.defaultTarget);
+        }
+    }
+    void writeObject(const Obj* object) {
+        switch (object->type) {
+        case ValueType::Function: {
+            auto function = static_cast<const ObjFunction*>(object);
+            writeString(function->name);
+            writeU32(function->arity);
+            writeParams(function->params);
+            out.push_back(function->isMethod);
+            writeChunk(function->chunk);
             break;
         }
-        case OP_SET_PROPERTY: {
-            int propNameIndex = chunk.code[ip++];
-            Value propNameVal = chunk.constants[propNameIndex];
-            if (!holds<std::string>(propNameVal))
-                runtimeError("VM: Property name must be a string.");
-            std::string propName = toLower(getVal<std::string>(propNameVal));
-            Value value = pop(vm);
-            Value object = pop(vm);
-            debugLog("OP_SET_PROPERTY: About to set property '" + propName + "'.");
-            debugLog("OP_SET_PROPERTY: Value = " + valueToString(value));
-            debugLog("OP_SET_PROPERTY: Object type = " + getTypeName(object) + " (" + valueToString(object) + ")");
-            if (holds<std::shared_ptr<ObjInstance>>(object)) {
-                auto instance = getVal<std::shared_ptr<ObjInstance>>(object);
-                if (instance->klass->isPlugin) {
-                    auto it = instance->klass->pluginProperties.find(propName);
-                    if (it != instance->klass->pluginProperties.end()) {
-                        BuiltinFn setter = it->second.second;
-                        setter({ Value(instance->pluginInstance), value });
-                        vm.stack.push_back(object);
-                    }
-                    else {
-                        instance->fields[propName] = value;
-                        vm.stack.push_back(object);
-                    }
-                }
-                else {
-                    instance->fields[propName] = value;
-                    vm.stack.push_back(object);
-                }
+        case ValueType::Enum: {
+            auto enumObj = static_cast<const ObjEnum*>(object);
+            writeString(enumObj->name);
+            writeU32(enumObj->members.size());
+            for (auto& member : enumObj->members) {
+                writeU32(member.first);
+                writeU32(member.second);
             }
-            else {
-                runtimeError("VM: Can only set properties on instances. Instead got type: " + getTypeName(object));
+            break;
+        }
+        case ValueType::Module: {
+            auto module = static_cast<const ObjModule*>(object);
+            writeString(module->name);
+            writeU32(module->publicMembers.size());
+            for (auto& member : module->publicMembers) {
+                writeU32(member.first);
+                writeValue(member.second);
             }
             break;
         }
-        case OP_CONSTRUCTOR_END: {
-            if (vm.stack.size() < 2)
-                runtimeError("VM: Not enough values for constructor end.");
-            Value constructorResult = pop(vm);
-            Value instance = pop(vm);
-            if (holds<std::monostate>(constructorResult))
-                vm.stack.push_back(instance);
-            else
-                vm.stack.push_back(constructorResult);
+        default: {
+            auto& elements = static_cast<const ObjArray*>(object)->elements;
+            writeU32(elements.size());
+            for (auto& element : elements)
+                writeValue(element);
             break;
         }
+        }
+    }
+};
+
+// Writes the compiled program in vm as a program image to path. globalsBefore
+// holds the global environment as it was before compiling.
+bool writeProgramImage(VM& vm, const std::unordered_map<SymbolId, Value>& globalsBefore, const std::string& path) {
+    ProgramGraph graph(vm, globalsBefore);
+    if (!graph.error.empty()) {
+        std::cerr << "Error: --xsb cannot save this program: " << graph.error << std::endl;
+        return false;
+    }
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Error: Unable to write " << path << std::endl;
+        return false;
+    }
+    file << XsbWriter(graph).write(vm);
+    return true;
+}
+
+// A program image mapped into memory. The mapping is private and writable,
+// so quickening only copies the pages it touches, and it stays mapped for
+// the life of the process since loaded chunks point into it.
+struct ProgramImage {
+    std::string path;
+    uint8_t* data = nullptr;
+    size_t size = 0;
+};
+
+// Maps the program image in path: the whole file, or with embedded set the
+// payload xcompile appended to an executable ([payload][MARKER][u32 length]).
+// Returns false if there is no image there, e.g. for a script's source.
+bool mapProgramImage(const std::string& path, bool embedded, ProgramImage& image) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+    file.seekg(0, std::ios::end);
+    uint64_t fileSize = file.tellg(), offset = 0, length = fileSize;
+    if (embedded) {
+        if (fileSize < 12)
+            return false;
+        char marker[8];
+        uint32_t payloadLength;
+        file.seekg(-12, std::ios::end);
+        file.read(marker, 8);
+        file.read(reinterpret_cast<char*>(&payloadLength), sizeof(payloadLength));
+        if (std::strncmp(marker, MARKER, 8) != 0 || payloadLength > fileSize - 12)
+            return false;
+        length = payloadLength;
+        offset = fileSize - 12 - length;
+    }
+    char magic[sizeof(XSB_MAGIC)] = {};
+    file.seekg(offset);
+    if (length < sizeof(magic) || !file.read(magic, sizeof(magic)) || std::memcmp(magic, XSB_MAGIC, sizeof(magic)) != 0)
+        return false;
+    file.close();
+
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    uint64_t start = offset - offset % info.dwAllocationGranularity;
+    void* view = nullptr;
+    HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle != INVALID_HANDLE_VALUE) {
+        if (HANDLE mapping = CreateFileMappingA(handle, nullptr, PAGE_WRITECOPY, 0, 0, nullptr)) {
+            view = MapViewOfFile(mapping, FILE_MAP_COPY, (DWORD)(start >> 32), (DWORD)start, (SIZE_T)(offset - start + length));
+            CloseHandle(mapping);
+        }
+        CloseHandle(handle);
+    }
+#else
+    uint64_t start = offset - offset % sysconf(_SC_PAGESIZE);
+    void* view = nullptr;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        view = mmap(nullptr, offset - start + length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, start);
+        if (view == MAP_FAILED)
+            view = nullptr;
+        close(fd);
+    }
+#endif
+    if (!view) {
+        std::cerr << "Error: Unable to map the program image " << path << std::endl;
+        exit(1);
+    }
+    image.path = path;
+    image.data = static_cast<uint8_t*>(view) + (offset - start);
+    image.size = length;
+    return true;
+}
+
+// Reads a mapped program image. Anything malformed ends the program, as a
+// parse error would.
+class XsbReader {
+public:
+    explicit XsbReader(const ProgramImage& image) : image(image) {
+        pos = sizeof(XSB_MAGIC);
+        uint32_t version = readU32();
+        if (version != XSB_VERSION || readU32() != OP_COUNT)
+            fail("it was written by a different version of xojoscript; compile the script again");
+        symbolCount = readU32();
+        objectCount = readU32();
+        globalCount = readU32();
+    }
+
+    // Symbol ids are baked into the bytecode, so the image's symbols are
+    // interned in order before anything else is.
+    void internSymbols() {
+        for (uint32_t i = 0; i < symbolCount; i++) {
+            if (intern(readString()) != (SymbolId)i)
+                fail("its symbol table does not match this xojoscript; compile the script again");
+        }
+    }
+
+    void load(VM& vm) {
+        for (uint32_t i = 0; i < symbolCount; i++)
+            readString();
+        // Objects are created first and filled in afterwards, so references
+        // between them (recursion, module members) need no ordering.
+        objects.reserve(readCount(objectCount));
+        for (uint32_t i = 0; i < objectCount; i++) {
+            switch ((ValueType)readU8()) {
+            case ValueType::Function: objects.push_back(makeRef<ObjFunction>()); break;
+            case ValueType::Enum:     objects.push_back(makeRef<ObjEnum>()); break;
+            case ValueType::Module:   objects.push_back(makeRef<ObjModule>()); break;
+            case ValueType::Array:    objects.push_back(makeRef<ObjArray>()); break;
+            default: fail("unknown object type");
+            }
+        }
+        for (Value& object : objects)
+            readObject(object);
+        readChunk(vm.mainChunk, "main", 0);
+        for (uint32_t i = 0; i < globalCount; i++) {
+            SymbolId name = readSymbol();
+            vm.environment->define(name, readValue());
+        }
+        if (pos != image.size)
+            fail("unexpected data at the end");
+    }
+
+private:
+    const ProgramImage& image;
+    size_t pos = 0;
+    uint32_t symbolCount = 0, objectCount = 0, globalCount = 0;
+    std::vector<Value> objects;
+
+    [[noreturn]] void fail(const std::string& why) {
+        std::cerr << "Error: Cannot load the program image " << image.path << ": " << why << "." << std::endl;
+        exit(1);
+    }
+    uint8_t* take(size_t n) {
+        if (n > image.size - pos)
+            fail("it is truncated");
+        pos += n;
+        return image.data + pos - n;
+    }
+    uint8_t readU8() { return *take(1); }
+    uint32_t readU32() {
+        const uint8_t* at = take(4);
+        return at[0] | at[1] << 8 | at[2] << 16 | (uint32_t)at[3] << 24;
+    }
+    int readI32() { return (int32_t)readU32(); }
+    // An element count; every element takes at least a byte, which bounds it.
+    uint32_t readCount() { return readCount(readU32()); }
+    uint32_t readCount(uint32_t count) {
+        if (count > image.size - pos)
+            fail("it is truncated");
+        return count;
+    }
+    std::string readString() {
+        uint32_t length = readU32();
+        return std::string(reinterpret_cast<const char*>(take(length)), length);
+    }
+    SymbolId readSymbol() {
+        uint32_t id = readU32();
+        if (id >= symbolCount)
+            fail("a symbol id is out of range");
+        return id;
+    }
+    const Value& readObjectRef(ValueType type) {
+        uint32_t index = readU32();
+        if (index >= objects.size() || objects[index].type != type)
+            fail("an object reference is invalid");
+        return objects[index];
+    }
+    std::vector<Param> readParams() {
+        std::vector<Param> params(readCount());
+        for (Param& p : params) {
+            p.name = readString();
+            p.type = readString();
+            p.optional = readU8();
+            p.defaultValue = readValue();
+        }
+        return params;
+    }
+    Value readValue() {
+        ValueType type = (ValueType)readU8();
+        switch (type) {
+        case ValueType::Nil:     return Value();
+        case ValueType::Int:     return Value(readI32());
+        case ValueType::Bool:    return Value(readU8() != 0);
+        case ValueType::Color:   return Value(Color{ readU32() });
+        case ValueType::Pointer: return Value(static_cast<void*>(nullptr));
+        case ValueType::Double: {
+            uint64_t bits = readU32();
+            bits |= (uint64_t)readU32() << 32;
+            double d;
+            std::memcpy(&d, &bits, sizeof(d));
+            return Value(d);
+        }
+        case ValueType::String:
+            return Value(readString());
+        case ValueType::Properties: {
+            PropertiesType properties(readCount());
+            for (auto& property : properties) {
+                property.first = readString();
+                property.second = readValue();
+            }
+            return Value(properties);
+        }
+        case ValueType::Overloads: {
+            std::vector<Ref<ObjFunction>> functions(readCount());
+            for (auto& function : functions)
+                function = getVal<Ref<ObjFunction>>(readObjectRef(ValueType::Function));
+            return Value(functions);
+        }
+        case ValueType::Builtin: {
+            DeclareSignature signature;
+            signature.params = readParams();
+            signature.returnType = readString();
+            signature.apiName = readString();
+            signature.libraryName = readString();
+            return declaredFunction(signature);
+        }
+        case ValueType::Function: case ValueType::Enum: case ValueType::Module: case ValueType::Array:
+            return readObjectRef(type);
         default:
+            fail("unknown value type");
+        }
+    }
+    // The chunk is verified as a freshly compiled one would be, since the
+    // dispatch loop trusts its stack depths and operands.
+    void readChunk(ObjFunction::CodeChunk& chunk, const std::string& name, int minSlots) {
+        chunk.localCount = readI32();
+        chunk.maxStack = readI32();
+        if (chunk.localCount < minSlots)
+            fail("chunk " + name + " has fewer slots than parameters");
+        chunk.caches.resize(readCount());
+        uint32_t size = readU32();
+        if (size <= (uint32_t)BYTECODE_PADDING)
+            fail("a chunk has no code");
+        chunk.bytecode = Bytecode::view(take(size), size);
+        chunk.constants.resize(readCount());
+        for (Value& constant : chunk.constants)
+            constant = readValue();
+        chunk.switchTables.resize(readCount());
+        for (SwitchTable& table : chunk.switchTables) {
+            table.low = readI32();
+            table.targets.resize(readCount());
+            for (int& target : table.targets)
+                target = readI32();
+            for (uint32_t n = readCount(); n > 0; n--) {
+                int key = readI32();
+                table.intTargets[key] = readI32();
+            }
+            for (uint32_t n = readCount(); n > 0; n--) {
+                std::string key = readString();
+                table.stringTargets[key] = readI32();
+            }
+            table.defaultTarget = readI32();
+        }
+        int slotsUsed = 0;
+        int maxStack = verifyBytecode(chunk, [&](int pos, const std::string& msg) {
+            fail("chunk " + name + " does not verify at " + std::to_string(pos) + ": " + msg.substr(0, msg.size() - 1));
+        }, slotsUsed);
+        if (maxStack != chunk.maxStack)
+            fail("chunk " + name + " claims a max stack of " + std::to_string(chunk.maxStack) + " but needs " +
+                 std::to_string(maxStack));
+        // Frames are sized by localCount, so slots no instruction refers to
+        // are dropped rather than allocated on every call.
+        chunk.localCount = std::max(minSlots, slotsUsed);
+    }
+    void readObject(Value& object) {
+        switch (object.type) {
+        case ValueType::Function: {
+            auto function = static_cast<ObjFunction*>(object.as.obj);
+            function->name = readString();
+            function->arity = readI32();
+            function->params = readParams();
+            function->isMethod = readU8();
+            if (function->arity < 0 || function->arity > (int)function->params.size())
+                fail("function " + function->name + " has a bad arity");
+            readChunk(function->chunk, function->name, function->params.size() + function->isMethod);
+            break;
+        }
+        case ValueType::Enum: {
+            auto enumObj = static_cast<ObjEnum*>(object.as.obj);
+            enumObj->name = readString();
+            for (uint32_t n = readCount(); n > 0; n--) {
+                SymbolId member = readSymbol();
+                enumObj->members[member] = readI32();
+            }
+            break;
+        }
+        case ValueType::Module: {
+            auto module = static_cast<ObjModule*>(object.as.obj);
+            module->name = readString();
+            for (uint32_t n = readCount(); n > 0; n--) {
+                SymbolId member = readSymbol();
+                module->publicMembers[member] = readValue();
+            }
+            break;
+        }
+        default: {
+            auto& elements = static_cast<ObjArray*>(object.as.obj)->elements;
+            elements.resize(readCount());
+            for (Value& element : elements)
+                element = readValue();
             break;
         }
-        {
-            std::string s = "[";
-            for (auto& v : vm.stack)
-                s += valueToString(v) + ", ";
-            s += "]";
-            debugLog("VM: Stack after execution: " + s);
         }
     }
-    return Value(std::monostate{});
-}
+};
 
-const char MARKER[9] = "XOJOCODE"; // 8 characters + null terminator = 9
 
 std::string retrieveData(const std::string& exePath) {
     std::ifstream exeFile(exePath, std::ios::binary);
@@ -3355,6 +8901,10 @@ std::string retrieveData(const std::string& exePath) {
             SetDllDirectory("libs");
         #endif
         startTime = std::chrono::steady_clock::now();
+    #ifdef XOJO_AOT
+        aotInternSymbols();
+        JIT_ENABLED = true; // Enters the functions' compiled code; --jit off runs them interpreted
+    #endif
         std::string filename = "default.xs";
         // Iterate through arguments, skipping argv[0] (program name)
         for (int i = 1; i < argc - 1; i++) {
@@ -3376,9 +8926,82 @@ std::string retrieveData(const std::string& exePath) {
                     return 1;
                 }
             }
+            else if (arg == "--stats" && (i + 1 < argc)) {
+                std::string statsArg = argv[i + 1];
+                std::transform(statsArg.begin(), statsArg.end(), statsArg.begin(), ::tolower);
+                STATS_MODE = (statsArg == "true");
+            }
+            else if (arg == "--depth" && (i + 1 < argc)) {
+                int depth = std::atoi(argv[i + 1]);
+                if (depth <= 0) {
+                    std::cerr << "Error: Argument for --depth must be a positive integer." << std::endl;
+                    return 1;
+                }
+                MAX_CALL_DEPTH = depth;
+            }
+            else if (arg == "--profile" && (i + 1 < argc)) {
+                std::string profileArg = argv[i + 1];
+                std::transform(profileArg.begin(), profileArg.end(), profileArg.begin(), ::tolower);
+                PROFILE_MODE = (profileArg == "true");
+            }
+            else if (arg == "--vm" && (i + 1 < argc)) {
+                std::string vmArg = argv[i + 1];
+                std::transform(vmArg.begin(), vmArg.end(), vmArg.begin(), ::tolower);
+                if (vmArg != "stack" && vmArg != "register") {
+                    std::cerr << "Error: Argument for --vm must be 'stack' or 'register'." << std::endl;
+                    return 1;
+                }
+                REGISTER_VM = (vmArg == "register");
+            }
+            else if (arg == "--jit" && (i + 1 < argc)) {
+                std::string jitArg = argv[i + 1];
+                std::transform(jitArg.begin(), jitArg.end(), jitArg.begin(), ::tolower);
+                if (jitArg.rfind("threshold=", 0) == 0) {
+                    JIT_THRESHOLD = std::atoi(jitArg.c_str() + 10);
+                    if (JIT_THRESHOLD <= 0) {
+                        std::cerr << "Error: --jit threshold must be a positive integer." << std::endl;
+                        return 1;
+                    }
+                    JIT_ENABLED = true;
+                }
+                else if (jitArg == "on" || jitArg == "off")
+                    JIT_ENABLED = (jitArg == "on");
+                else {
+                    std::cerr << "Error: Argument for --jit must be 'off', 'on' or 'threshold=N'." << std::endl;
+                    return 1;
+                }
+#ifndef XOJO_JIT
+                if (JIT_ENABLED) {
+                    std::cerr << "Warning: the JIT needs x86-64; running interpreted." << std::endl;
+                    JIT_ENABLED = false;
+                }
+#endif
+            }
+            else if (arg == "--O" && (i + 1 < argc)) {
+                OPT_LEVEL = std::atoi(argv[i + 1]);
+                if (OPT_LEVEL < 0) {
+                    std::cerr << "Error: Argument for --O must be 0 or higher." << std::endl;
+                    return 1;
+                }
+            }
+            else if (arg == "--aot" && (i + 1 < argc)) {
+                AOT_OUTPUT = argv[i + 1];
+            }
+            else if (arg == "--xsb" && (i + 1 < argc)) {
+                XSB_OUTPUT = argv[i + 1];
+            }
         }
         debugLog(std::string("DEBUG_MODE: ") + (DEBUG_MODE ? "ON" : "OFF"));
 
+    #ifndef XOJO_AOT
+        // A program image embedded by xcompile, or given with --s, replaces
+        // the source. Its symbols must be interned before anything else.
+        ProgramImage image;
+        bool fromImage = mapProgramImage(argv[0], true, image) || mapProgramImage(filename, false, image);
+        if (fromImage)
+            XsbReader(image).internSymbols();
+    #endif
+
     ////////////////////////Drop-in//////////////////////////////////
 
         // Register built-in AddressOf and AddHandler functions.
@@ -3407,11 +9030,11 @@ std::string retrieveData(const std::string& exePath) {
                 runtimeError("sortwith expects exactly 2 arguments.");
         
             // Ensure both arguments are arrays.
-            if (!holds<std::shared_ptr<ObjArray>>(args[0]) || !holds<std::shared_ptr<ObjArray>>(args[1]))
+            if (!holds<Ref<ObjArray>>(args[0]) || !holds<Ref<ObjArray>>(args[1]))
                 runtimeError("sortwith expects both arguments to be arrays.");
         
-            auto arr1 = getVal<std::shared_ptr<ObjArray>>(args[0]);
-            auto arr2 = getVal<std::shared_ptr<ObjArray>>(args[1]);
+            auto arr1 = getVal<Ref<ObjArray>>(args[0]);
+            auto arr2 = getVal<Ref<ObjArray>>(args[1]);
         
             // They must be of equal length.
             if (arr1->elements.size() != arr2->elements.size())
@@ -3492,7 +9115,7 @@ std::string retrieveData(const std::string& exePath) {
                 runtimeError("split expects both arguments to be strings.");
             std::string text = getVal<std::string>(args[0]);
             std::string delimiter = getVal<std::string>(args[1]);
-            auto arr = std::make_shared<ObjArray>();
+            auto arr = makeRef<ObjArray>();
             if (delimiter.empty()) {
                 for (char c : text) {
                     arr->elements.push_back(std::string(1, c));
@@ -3510,7 +9133,7 @@ std::string retrieveData(const std::string& exePath) {
             return Value(arr);
         }));
         vm.environment->define("array", BuiltinFn([](const std::vector<Value>& args) -> Value {
-            auto arr = std::make_shared<ObjArray>();
+            auto arr = makeRef<ObjArray>();
             arr->elements = args;
             return Value(arr);
         }));
@@ -3657,9 +9280,9 @@ std::string retrieveData(const std::string& exePath) {
         vm.environment->define("AddHandler", BuiltinFn(addHandlerBuiltin));
 
         {
-            auto randomClass = std::make_shared<ObjClass>();
+            auto randomClass = makeRef<ObjClass>();
             randomClass->name = "random";
-            randomClass->methods["inrange"] = BuiltinFn([](const std::vector<Value>& args) -> Value {
+            randomClass->methods[intern("inrange")] = BuiltinFn([](const std::vector<Value>& args) -> Value {
                 if (args.size() != 2) runtimeError("Random.InRange expects exactly two arguments.");
                 int minVal = 0, maxVal = 0;
                 if (holds<int>(args[0]))
@@ -3687,62 +9310,89 @@ std::string retrieveData(const std::string& exePath) {
 
     ////////////////////////////////////////////////
 
-        std::string exePath = argv[0]; // path to the current executable
-        std::string retrieved = retrieveData(exePath); // retrieve bytecode if exists
-        std::string source;
+    #ifdef XOJO_AOT
+        // The program was compiled into this executable (--aot).
+        aotLoadProgram(vm);
+        debugLog("Loaded the ahead-of-time compiled program.");
+        if (REGISTER_VM)
+            std::cerr << "Notice: --vm register: a precompiled program runs on the stack VM." << std::endl;
+    #else
+        if (fromImage) {
+            XsbReader(image).load(vm);
+            debugLog("Loaded the program image " + image.path + ".");
+            if (REGISTER_VM)
+                std::cerr << "Notice: --vm register: a program image runs on the stack VM." << std::endl;
+        }
+        else {
+            std::string exePath = argv[0]; // path to the current executable
+            std::string retrieved = retrieveData(exePath); // retrieve bytecode if exists
+            std::string source;
 
-        if (!retrieved.empty()) {
-            //std::cout << "Retrieved Bytecode:\n" << retrieved << "\n";
-            source = preprocessSource(retrieved);
-        } else {
-            std::ifstream file(filename);
-            if (!file.is_open()) {
-                std::cerr << "Notice: Unable to find " << filename << std::endl;
-                return EXIT_FAILURE;
+            if (!retrieved.empty()) {
+                //std::cout << "Retrieved Bytecode:\n" << retrieved << "\n";
+                source = preprocessSource(retrieved);
+            } else {
+                std::ifstream file(filename);
+                if (!file.is_open()) {
+                    std::cerr << "Notice: Unable to find " << filename << std::endl;
+                    return EXIT_FAILURE;
+                }
+                std::stringstream buffer;
+                buffer << file.rdbuf();
+                source = preprocessSource(buffer.str());
             }
-            std::stringstream buffer;
-            buffer << file.rdbuf();
-            source = preprocessSource(buffer.str());
-        }
 
 
-        debugLog("Starting lexing...");
-        Lexer lexer(source);
-        auto tokens = lexer.scanTokens();
-        debugLog("Lexing complete. Tokens count: " + std::to_string(tokens.size()));
+            debugLog("Starting lexing...");
+            Lexer lexer(source);
+            auto tokens = lexer.scanTokens();
+            debugLog("Lexing complete. Tokens count: " + std::to_string(tokens.size()));
 
-        debugLog("Starting parsing...");
-        Parser parser(tokens);
-        std::vector<std::shared_ptr<Stmt>> statements = parser.parse();
-        debugLog("Parsing complete. Statements count: " + std::to_string(statements.size()));
+            debugLog("Starting parsing...");
+            Parser parser(tokens);
+            std::vector<std::shared_ptr<Stmt>> statements = parser.parse();
+            debugLog("Parsing complete. Statements count: " + std::to_string(statements.size()));
+            if (OPT_LEVEL > 0) {
+                statements = Optimizer().optimize(statements);
+                debugLog("Optimization complete. Statements count: " + std::to_string(statements.size()));
+            }
     ///////////////////////////////////////
 
-        // Compile the Xojoscript program.
-        debugLog("Starting compilation...");
-        Compiler compiler(vm);
-        compiler.compile(statements);
-        debugLog("Compilation complete. Main chunk instructions count: " + std::to_string(vm.mainChunk.code.size()));
+            // Compile the Xojoscript program.
+            debugLog("Starting compilation...");
+            std::unordered_map<SymbolId, Value> globalsBeforeCompile;
+            if (!AOT_OUTPUT.empty() || !XSB_OUTPUT.empty())
+                globalsBeforeCompile = vm.globals->values;
+            Compiler compiler(vm);
+            compiler.compile(statements);
+            debugLog("Compilation complete. Main chunk bytecode size: " + std::to_string(vm.mainChunk.bytecode.size()) + " bytes.");
+            if (!XSB_OUTPUT.empty())
+                return writeProgramImage(vm, globalsBeforeCompile, XSB_OUTPUT) ? 0 : 1;
+            if (!AOT_OUTPUT.empty())
+                return writeAotProgram(vm, globalsBeforeCompile, AOT_OUTPUT, filename) ? 0 : 1;
+        }
+    #endif
 
-        if (vm.environment->values.find("main") != vm.environment->values.end() &&
-            (holds<std::shared_ptr<ObjFunction>>(vm.environment->get("main")) ||
-            holds<std::vector<std::shared_ptr<ObjFunction>>>(vm.environment->get("main")))) {
+        if (vm.environment->values.find(SYM_MAIN) != vm.environment->values.end() &&
+            (holds<Ref<ObjFunction>>(vm.environment->get("main")) ||
+            holds<std::vector<Ref<ObjFunction>>>(vm.environment->get("main")))) {
             Value mainVal = vm.environment->get("main");
-            if (holds<std::shared_ptr<ObjFunction>>(mainVal)) {
-                auto mainFunction = getVal<std::shared_ptr<ObjFunction>>(mainVal);
+            if (holds<Ref<ObjFunction>>(mainVal)) {
+                auto mainFunction = getVal<Ref<ObjFunction>>(mainVal);
                 debugLog("Calling main function...");
                 // Run the compiled bytecode
-                runVM(vm, mainFunction->chunk);
+                callScriptFunction(vm, mainFunction, {});
             }
-            else if (holds<std::vector<std::shared_ptr<ObjFunction>>>(mainVal)) {
-                auto overloads = getVal<std::vector<std::shared_ptr<ObjFunction>>>(mainVal);
-                std::shared_ptr<ObjFunction> mainFunction = nullptr;
+            else if (holds<std::vector<Ref<ObjFunction>>>(mainVal)) {
+                auto overloads = getVal<std::vector<Ref<ObjFunction>>>(mainVal);
+                Ref<ObjFunction> mainFunction = nullptr;
                 for (auto f : overloads) {
                     if (f->arity == 0) { mainFunction = f; break; }
                 }
                 if (!mainFunction)
                     runtimeError("No main function with 0 parameters found.");
                 debugLog("Calling main function...");
-                runVM(vm, mainFunction->chunk);
+                callScriptFunction(vm, mainFunction, {});
             }
         }
         else {
@@ -3750,6 +9400,13 @@ std::string retrieveData(const std::string& exePath) {
             runVM(vm, vm.mainChunk);
         }
         debugLog("Program execution finished.");
+        if (STATS_MODE) {
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+            std::cerr << "[STATS] " << vm.instructionCount << " instructions in " << seconds << " s ("
+                      << static_cast<uint64_t>(vm.instructionCount / (seconds > 0 ? seconds : 1)) << " instructions/s)" << std::endl;
+        }
+        if (PROFILE_MODE)
+            reportOpcodePairs(vm);
         return 0;
     }
 
@@ -3815,11 +9472,11 @@ const char* CompileAndRun(const char* code, bool enableDebug) {
             runtimeError("sortwith expects exactly 2 arguments.");
     
         // Ensure both arguments are arrays.
-        if (!holds<std::shared_ptr<ObjArray>>(args[0]) || !holds<std::shared_ptr<ObjArray>>(args[1]))
+        if (!holds<Ref<ObjArray>>(args[0]) || !holds<Ref<ObjArray>>(args[1]))
             runtimeError("sortwith expects both arguments to be arrays.");
     
-        auto arr1 = getVal<std::shared_ptr<ObjArray>>(args[0]);
-        auto arr2 = getVal<std::shared_ptr<ObjArray>>(args[1]);
+        auto arr1 = getVal<Ref<ObjArray>>(args[0]);
+        auto arr2 = getVal<Ref<ObjArray>>(args[1]);
     
         // They must be of equal length.
         if (arr1->elements.size() != arr2->elements.size())
@@ -3900,7 +9557,7 @@ const char* CompileAndRun(const char* code, bool enableDebug) {
             runtimeError("split expects both arguments to be strings.");
         std::string text = getVal<std::string>(args[0]);
         std::string delimiter = getVal<std::string>(args[1]);
-        auto arr = std::make_shared<ObjArray>();
+        auto arr = makeRef<ObjArray>();
         if (delimiter.empty()) {
             for (char c : text) {
                 arr->elements.push_back(std::string(1, c));
@@ -3918,7 +9575,7 @@ const char* CompileAndRun(const char* code, bool enableDebug) {
         return Value(arr);
     }));
     vm.environment->define("array", BuiltinFn([](const std::vector<Value>& args) -> Value {
-        auto arr = std::make_shared<ObjArray>();
+        auto arr = makeRef<ObjArray>();
         arr->elements = args;
         return Value(arr);
     }));
@@ -4065,9 +9722,9 @@ const char* CompileAndRun(const char* code, bool enableDebug) {
     vm.environment->define("AddHandler", BuiltinFn(addHandlerBuiltin));
 
     {
-        auto randomClass = std::make_shared<ObjClass>();
+        auto randomClass = makeRef<ObjClass>();
         randomClass->name = "random";
-        randomClass->methods["inrange"] = BuiltinFn([](const std::vector<Value>& args) -> Value {
+        randomClass->methods[intern("inrange")] = BuiltinFn([](const std::vector<Value>& args) -> Value {
             if (args.size() != 2) runtimeError("Random.InRange expects exactly two arguments.");
             int minVal = 0, maxVal = 0;
             if (holds<int>(args[0]))
@@ -4101,27 +9758,29 @@ const char* CompileAndRun(const char* code, bool enableDebug) {
     auto tokens = lexer.scanTokens();
     Parser parser(tokens);
     std::vector<std::shared_ptr<Stmt>> statements = parser.parse();
+    if (OPT_LEVEL > 0)
+        statements = Optimizer().optimize(statements);
     Compiler compiler(vm);
     compiler.compile(statements);
 
     // --- Run the compiled code ---
     // If a 'main' function exists, run it; otherwise run top-level code.
-    if (vm.environment->values.find("main") != vm.environment->values.end() &&
-       (holds<std::shared_ptr<ObjFunction>>(vm.environment->get("main")) ||
-        holds<std::vector<std::shared_ptr<ObjFunction>>>(vm.environment->get("main")))) {
+    if (vm.environment->values.find(SYM_MAIN) != vm.environment->values.end() &&
+       (holds<Ref<ObjFunction>>(vm.environment->get("main")) ||
+        holds<std::vector<Ref<ObjFunction>>>(vm.environment->get("main")))) {
         Value mainVal = vm.environment->get("main");
-        if (holds<std::shared_ptr<ObjFunction>>(mainVal)) {
-            auto mainFunction = getVal<std::shared_ptr<ObjFunction>>(mainVal);
-            runVM(vm, mainFunction->chunk);
-        } else if (holds<std::vector<std::shared_ptr<ObjFunction>>>(mainVal)) {
-            auto overloads = getVal<std::vector<std::shared_ptr<ObjFunction>>>(mainVal);
-            std::shared_ptr<ObjFunction> mainFunction = nullptr;
+        if (holds<Ref<ObjFunction>>(mainVal)) {
+            auto mainFunction = getVal<Ref<ObjFunction>>(mainVal);
+            callScriptFunction(vm, mainFunction, {});
+        } else if (holds<std::vector<Ref<ObjFunction>>>(mainVal)) {
+            auto overloads = getVal<std::vector<Ref<ObjFunction>>>(mainVal);
+            Ref<ObjFunction> mainFunction = nullptr;
             for (auto f : overloads) {
                 if (f->arity == 0) { mainFunction = f; break; }
             }
             if (!mainFunction)
                 runtimeError("No main function with 0 parameters found.");
-            runVM(vm, mainFunction->chunk);
+            callScriptFunction(vm, mainFunction, {});
         }
     } else {
         runVM(vm, vm.mainChunk);